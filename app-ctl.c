@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <fcntl.h>
 #include <time.h>
 #include <poll.h>
@@ -19,10 +20,13 @@
 #include <signal.h>
 #include <sched.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 
+#include <tmc/isol.h>
+
 
 #define SERVER_SOCKET_NAME "/var/run/isol_server"
 
@@ -266,6 +270,95 @@ static int add_cmd_line(const char *line)
 }
 
 
+/*
+ * Show entries of the trace ring of a CPU, oldest first. Ring may be
+ * left by a process that exited, or written while it is shown.
+ * Returns nonzero if there is no ring for the CPU.
+ */
+static int show_trace(int cpu)
+{
+	const struct tmc_isol_trace_ring *r;
+	struct tmc_isol_trace_entry e;
+	struct stat statbuf;
+	char name[64];
+	uint64_t head, n, pos, nsec;
+	double delta;
+	int fd;
+
+	snprintf(name, sizeof(name), TMC_ISOL_TRACE_NAME, cpu);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return -1;
+	if ((fstat(fd, &statbuf) != 0)
+	    || ((size_t)statbuf.st_size < sizeof(struct tmc_isol_trace_ring))) {
+		close(fd);
+		return -1;
+	}
+	r = (const struct tmc_isol_trace_ring *)
+		mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED)
+		return -1;
+	if ((__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE)
+	     != TMC_ISOL_TRACE_MAGIC)
+	    || (r->entry_size != sizeof(struct tmc_isol_trace_entry))
+	    || ((size_t)statbuf.st_size < sizeof(struct tmc_isol_trace_ring)
+		+ (r->mask + 1) * sizeof(struct tmc_isol_trace_entry))) {
+		fprintf(stderr, "Invalid trace ring \"%s\".\n", name);
+		munmap((void *)r, statbuf.st_size);
+		return -1;
+	}
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	n = (head > r->mask) ? (r->mask + 1) : head;
+	printf("CPU %d pid %d tid %d entries %" PRIu64 " written %" PRIu64
+	       "\n",
+	       r->cpu, r->pid, r->tid, r->mask + 1, head);
+	for (pos = head - n; pos < head; pos++) {
+		/* Entry is skipped if it was overwritten while copied */
+		if (__atomic_load_n(&r->entries[pos & r->mask].seq,
+				    __ATOMIC_ACQUIRE) != pos + 1)
+			continue;
+		memcpy(&e, (const void *)&r->entries[pos & r->mask],
+		       sizeof(e));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->entries[pos & r->mask].seq,
+				    __ATOMIC_RELAXED) != pos + 1)
+			continue;
+		/* Time since creation, may be negative if rates drift */
+		delta = (double)(int64_t)(e.time - r->start_cycles);
+		if (r->cycles_per_sec != 0)
+			nsec = r->start_nsec
+				+ (int64_t)(delta * 1e9 / r->cycles_per_sec);
+		else
+			nsec = 0;
+		printf("%" PRIu64 " %" PRIu64 ".%09" PRIu64 " id=%" PRIu32
+		       " arg0=%" PRIu32 " arg1=%" PRIu64 "\n",
+		       pos, nsec / 1000000000, nsec % 1000000000,
+		       e.id, e.arg0, e.arg1);
+	}
+	munmap((void *)r, statbuf.st_size);
+	return 0;
+}
+
+/*
+ * Show trace rings of CPUs in a mask, or of all CPUs if it is empty.
+ */
+static int show_traces(const cpu_set_t *mask)
+{
+	int cpu, found = 0;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (((CPU_COUNT(mask) == 0) || CPU_ISSET(cpu, mask))
+		    && (show_trace(cpu) == 0))
+			found = 1;
+	if (!found) {
+		fprintf(stderr, "No trace rings found.\n");
+		return 1;
+	}
+	return 0;
+}
+
 /*
  * Print usage information.
  */
@@ -402,14 +495,19 @@ int main(int argc, char **argv, char **env)
 	cpu_set_t mask;
 	struct stat statbuf;
 	char * const *task_argv;
+	const char *cmd_name;
 
-#define NCOMMANDS 14
+#define NCOMMANDS 18
 	const char *commands[NCOMMANDS]= {
 	    "boot", "start",
 	    "halt", "kill", "shut",
 	    "del", "rm", "unplug", "remove",
 	    "add", "plug",
 	    "info", "show",
+	    "breaks",
+	    "watch",
+	    "metrics",
+	    "trace",
 	    "interactive"
 	};
 
@@ -419,6 +517,10 @@ int main(int argc, char **argv, char **env)
 	      APP_CMD_DEL,
 	      APP_CMD_ADD,
 	      APP_CMD_KILL,
+	      APP_CMD_BREAKS,
+	      APP_CMD_WATCH,
+	      APP_CMD_METRICS,
+	      APP_CMD_TRACE,
 	      APP_CMD_INTERACTIVE,
 	      APP_CMD_NONE
 	} cmdtable [NCOMMANDS] = {
@@ -427,6 +529,10 @@ int main(int argc, char **argv, char **env)
 	      APP_CMD_DEL, APP_CMD_DEL, APP_CMD_DEL, APP_CMD_DEL,
 	      APP_CMD_ADD, APP_CMD_ADD,
 	      APP_CMD_INFO, APP_CMD_INFO,
+	      APP_CMD_BREAKS,
+	      APP_CMD_WATCH,
+	      APP_CMD_METRICS,
+	      APP_CMD_TRACE,
 	      APP_CMD_INTERACTIVE
 	}, command;
 
@@ -437,21 +543,26 @@ int main(int argc, char **argv, char **env)
 		return 1;
 	}
 
+	/* Command may be given as an option, "--watch" */
+	cmd_name = argv[1];
+	if ((cmd_name[0] == '-') && (cmd_name[1] == '-'))
+		cmd_name += 2;
+
     /* Match the command as unambiguous abbreviation or extension */
-	l = strlen(argv[1]);
+	l = strlen(cmd_name);
 	for (command = APP_CMD_NONE, i = 0;
 	     command == APP_CMD_NONE && i < NCOMMANDS ;
 	     i++) {
 		l_cmd = strlen(commands[i]);
 		if (l < l_cmd)
 			l_cmd = l;
-		if (!strncmp(argv[1], commands[i], l_cmd))
+		if (!strncmp(cmd_name, commands[i], l_cmd))
 			command = cmdtable[i];
 	}
 	for (;
 	     command != APP_CMD_NONE && i < NCOMMANDS ;
 	     i++) {
-		if (!strncmp(argv[1], commands[i], l))
+		if (!strncmp(cmd_name, commands[i], l))
 			command = APP_CMD_NONE;
 	}
 
@@ -615,6 +726,10 @@ int main(int argc, char **argv, char **env)
 		}
 	}
 
+	/* Trace rings are read directly, the server may be gone */
+	if (command == APP_CMD_TRACE)
+		return show_traces(&mask);
+
 	/* Try to connect to the running server. */
 	fd = isol_client_connect_to_server(SERVER_SOCKET_NAME);
 
@@ -658,6 +773,18 @@ int main(int argc, char **argv, char **env)
 	case APP_CMD_KILL:
 		rv = add_cmd_line("terminate\n");
 		break;
+	case APP_CMD_BREAKS:
+		rv = add_cmd_line("breaks\n");
+		rv |= add_cmd_line("quit\n");
+		break;
+	case APP_CMD_WATCH:
+		/* Events follow until the connection is closed */
+		rv = add_cmd_line("subscribe\n");
+		break;
+	case APP_CMD_METRICS:
+		/* No "quit", so only the metrics are shown */
+		rv = add_cmd_line("metrics\n");
+		break;
 	case APP_CMD_INTERACTIVE:
 		rv = 0;
 		break;
@@ -686,8 +813,12 @@ int main(int argc, char **argv, char **env)
 	} else {
 		switch (verbose) {
 		case 0:
-			if (command == APP_CMD_INFO)
+			if ((command == APP_CMD_INFO)
+			    || (command == APP_CMD_BREAKS)
+			    || (command == APP_CMD_WATCH))
 				output_style = 0;
+			else if (command == APP_CMD_METRICS)
+				output_style = 3;
 			else
 				output_style = 3;
 			break;
@@ -716,6 +847,10 @@ int main(int argc, char **argv, char **env)
 			if (send_list != NULL) {
 				struct cmd_line *tmp_list;
 				fputs(send_list->line, f);
+				/* Banner is not a part of the metrics */
+				if ((command == APP_CMD_METRICS)
+				    && (verbose == 0))
+					output_style = 0;
 				if (send_list->next != NULL)
 					send_list->next->prev = NULL;
 				else
@@ -742,6 +877,9 @@ int main(int argc, char **argv, char **env)
 						fputs(line, f);
 					} else
 						exit_flag = 1;
+				} else if (command == APP_CMD_WATCH) {
+					/* Show each event as it arrives */
+					fflush(stdout);
 				} else
 					exit_flag = 1;
 			}
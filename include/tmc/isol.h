@@ -18,36 +18,179 @@
 #endif
 #endif
 
+/*
+ * Loop period histogram. Define TMC_ISOL_LOOP_HISTOGRAM to 1 before
+ * including this file to record the time between passes of the
+ * thread's loop.
+ */
+#ifndef TMC_ISOL_LOOP_HISTOGRAM
+#define TMC_ISOL_LOOP_HISTOGRAM 0
+#endif
+
+/*
+ * Shared configuration. Define TMC_ISOL_CONFIG to 1 before including
+ * this file to switch to a new configuration generation on every pass
+ * of the thread's loop. Otherwise threads switch when the manager
+ * notifies them.
+ */
+#ifndef TMC_ISOL_CONFIG
+#define TMC_ISOL_CONFIG 0
+#endif
+
 #include <stdint.h>
 #include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
 
 extern __thread volatile unsigned char *memipc_check_newdata_ptr;
 extern __thread volatile unsigned char memipc_check_signal;
 extern __thread int memipc_thread_continue_flag;
 
+/* Number of histogram buckets, bucket n counts gaps of 2^n cycles
+   or longer, shorter than 2^(n+1) */
+#define TMC_ISOL_LOOP_HIST_BUCKETS 64
+
+/*
+ * Loop period histogram of a managed thread, written only by the
+ * thread, read by the manager.
+ */
+struct tmc_isol_loop_hist {
+	uint64_t last; /* time of the last pass in cycles, or 0 */
+	uint64_t max; /* longest gap in cycles */
+	uint64_t count; /* number of recorded gaps */
+	uint64_t slow; /* number of passes that took the slow path */
+	uint64_t buckets[TMC_ISOL_LOOP_HIST_BUCKETS];
+};
+
+extern __thread struct tmc_isol_loop_hist *memipc_loop_hist;
+
+/*
+ * Read the cycle counter, or monotonic time in nanoseconds where no
+ * counter is available.
+ */
+static inline uint64_t tmc_isol_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t v;
+
+	__asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (v));
+	return v;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Generation of shared configuration.
+ */
+struct tmc_isol_config_buf {
+	uint64_t generation; /* starts from 1 */
+	size_t size; /* size of data */
+	void *data;
+};
+
+/* Last published generation, written atomically */
+extern struct tmc_isol_config_buf *memipc_config_published;
+/* Generation used by the thread */
+extern __thread struct tmc_isol_config_buf *memipc_config_current;
+
+void _tmc_isol_config_switch(void);
+
+/*
+ * Switch to the last published configuration generation.
+ */
+static inline void tmc_isol_config_check(void)
+{
+	if (__builtin_expect(__atomic_load_n(&memipc_config_published,
+					     __ATOMIC_ACQUIRE)
+			     != memipc_config_current, 0))
+		_tmc_isol_config_switch();
+}
+
+/*
+ * Configuration data used by the thread, or NULL. The pointer is
+ * valid until the next pass of the thread's loop.
+ */
+static inline const void *tmc_isol_config_data(size_t *size)
+{
+	struct tmc_isol_config_buf *c = memipc_config_current;
+
+	if (c == NULL)
+		return NULL;
+	if (size != NULL)
+		*size = c->size;
+	return c->data;
+}
+
+/*
+ * Record the time since the previous pass.
+ */
+static inline void tmc_isol_loop_sample(void)
+{
+	struct tmc_isol_loop_hist *h = memipc_loop_hist;
+	uint64_t now, delta;
+	unsigned int b;
+
+	if (h == NULL)
+		return;
+	now = tmc_isol_cycles();
+	if (h->last != 0) {
+		delta = now - h->last;
+		b = (delta == 0) ? 0 : (63 - __builtin_clzll(delta));
+		__atomic_store_n(&h->buckets[b], h->buckets[b] + 1,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+		if (delta > h->max)
+			__atomic_store_n(&h->max, delta, __ATOMIC_RELAXED);
+	}
+	h->last = now;
+}
+
+/*
+ * Monitoring modes. In master mode the manager notices a SIGUSR1 from
+ * the kernel and relaunches the thread, in slave mode the thread
+ * itself notices it on the next pass and reports the failure. Mode is
+ * chosen for each thread by tmc_isol_thr_init_mode(), tmc_isol_thr_init()
+ * uses TMC_ISOL_MONITOR_DEFAULT.
+ *
+ * Loop checks are separately specialized for each mode, so each pass
+ * is a single load and test. A thread in slave mode should use
+ * TMC_ISOL_THR_PASS_SLAVE() or tmc_isol_thr_pass_slave(), otherwise
+ * the failure is noticed only when the manager sends a request. The
+ * unsuffixed checks use the default mode.
+ */
+#define TMC_ISOL_MONITOR_MASTER 0
+#define TMC_ISOL_MONITOR_SLAVE 1
+#if ISOLATION_MONITOR_IN_SLAVE
+#define TMC_ISOL_MONITOR_DEFAULT TMC_ISOL_MONITOR_SLAVE
+#else
+#define TMC_ISOL_MONITOR_DEFAULT TMC_ISOL_MONITOR_MASTER
+#endif
+
 int tmc_isol_init(void);
 int tmc_isol_start(void);
-int tmc_isol_thr_init(void);
+int tmc_isol_thr_init_mode(int mode);
 int tmc_isol_thr_enter_v(volatile int *c);
 int tmc_isol_thr_exit(void);
 int _tmc_isol_thr_pass(void);
 
-#if ISOLATION_MONITOR_IN_SLAVE
-#define TMC_ISOL_THR_PASS_MIN_CHECK(x, c1, c2)				\
+#define _TMC_ISOL_THR_PASS_MIN_CHECK_SLAVE(x, c1, c2)			\
   ((((--x) || ((c1 == c2) ? 1 : (c1++, 0)))				\
     && ((memipc_check_signal & 1) == 0))				\
    || ((((*memipc_check_newdata_ptr) | memipc_check_signal) & 1) ?	\
        _tmc_isol_thr_pass() : memipc_thread_continue_flag))
-#else
-#define TMC_ISOL_THR_PASS_MIN_CHECK(x, c1, c2)				\
+#define _TMC_ISOL_THR_PASS_MIN_CHECK_MASTER(x, c1, c2)			\
   ((--x)								\
    || (c1 == c2)							\
    || (c1++, ((*memipc_check_newdata_ptr) & 1) ?			\
        _tmc_isol_thr_pass() : memipc_thread_continue_flag))
-#endif
 
-#if ISOLATION_MONITOR_IN_SLAVE
-#define TMC_ISOL_THR_PASS(c1, c2)					\
+#define _TMC_ISOL_THR_PASS_SLAVE(c1, c2)				\
   (__builtin_expect(							\
 		    (((__builtin_expect((c1 == c2), 1) ? 1 : (c1++, 0))	\
 		      && __builtin_expect(((memipc_check_signal & 1)	\
@@ -56,28 +199,248 @@ int _tmc_isol_thr_pass(void);
 			   memipc_check_signal) & 1) ?			\
 			 _tmc_isol_thr_pass()				\
 			 : memipc_thread_continue_flag)), 1))
-#else
-#define TMC_ISOL_THR_PASS(c1, c2)					\
+#define _TMC_ISOL_THR_PASS_MASTER(c1, c2)				\
   (__builtin_expect(							\
 		    (__builtin_expect((c1 == c2), 1)			\
 		     || (c1++, ((*memipc_check_newdata_ptr) & 1) ?	\
 			 (_tmc_isol_thr_pass()) :			\
 			 memipc_thread_continue_flag)), 1))
+
+#if ISOLATION_MONITOR_IN_SLAVE
+#define _TMC_ISOL_THR_PASS_MIN_CHECK _TMC_ISOL_THR_PASS_MIN_CHECK_SLAVE
+#define _TMC_ISOL_THR_PASS _TMC_ISOL_THR_PASS_SLAVE
+#else
+#define _TMC_ISOL_THR_PASS_MIN_CHECK _TMC_ISOL_THR_PASS_MIN_CHECK_MASTER
+#define _TMC_ISOL_THR_PASS _TMC_ISOL_THR_PASS_MASTER
+#endif
+
+#if TMC_ISOL_LOOP_HISTOGRAM
+#define _TMC_ISOL_LOOP_SAMPLE() tmc_isol_loop_sample()
+#else
+#define _TMC_ISOL_LOOP_SAMPLE() ((void)0)
 #endif
 
+#if TMC_ISOL_CONFIG
+#define _TMC_ISOL_CONFIG_CHECK() tmc_isol_config_check()
+#else
+#define _TMC_ISOL_CONFIG_CHECK() ((void)0)
+#endif
+
+#define TMC_ISOL_THR_PASS_MIN_CHECK(x, c1, c2)				\
+  (_TMC_ISOL_LOOP_SAMPLE(), _TMC_ISOL_CONFIG_CHECK(),			\
+   _TMC_ISOL_THR_PASS_MIN_CHECK(x, c1, c2))
+#define TMC_ISOL_THR_PASS(c1, c2)					\
+  (_TMC_ISOL_LOOP_SAMPLE(), _TMC_ISOL_CONFIG_CHECK(),			\
+   _TMC_ISOL_THR_PASS(c1, c2))
+#define TMC_ISOL_THR_PASS_MIN_CHECK_MASTER(x, c1, c2)			\
+  (_TMC_ISOL_LOOP_SAMPLE(), _TMC_ISOL_CONFIG_CHECK(),			\
+   _TMC_ISOL_THR_PASS_MIN_CHECK_MASTER(x, c1, c2))
+#define TMC_ISOL_THR_PASS_MASTER(c1, c2)				\
+  (_TMC_ISOL_LOOP_SAMPLE(), _TMC_ISOL_CONFIG_CHECK(),			\
+   _TMC_ISOL_THR_PASS_MASTER(c1, c2))
+#define TMC_ISOL_THR_PASS_MIN_CHECK_SLAVE(x, c1, c2)			\
+  (_TMC_ISOL_LOOP_SAMPLE(), _TMC_ISOL_CONFIG_CHECK(),			\
+   _TMC_ISOL_THR_PASS_MIN_CHECK_SLAVE(x, c1, c2))
+#define TMC_ISOL_THR_PASS_SLAVE(c1, c2)					\
+  (_TMC_ISOL_LOOP_SAMPLE(), _TMC_ISOL_CONFIG_CHECK(),			\
+   _TMC_ISOL_THR_PASS_SLAVE(c1, c2))
+
+/*
+ * A macro, so the mode always matches the unsuffixed checks compiled
+ * into the application. The exported function uses the default of the
+ * library.
+ */
+int tmc_isol_thr_init(void);
+#define tmc_isol_thr_init()						\
+  tmc_isol_thr_init_mode(TMC_ISOL_MONITOR_DEFAULT)
+
 static inline int tmc_isol_thr_enter(void) {
 	return tmc_isol_thr_enter_v((volatile int *)NULL);
 }
 
+static inline int tmc_isol_thr_pass_master(void) {
+	_TMC_ISOL_LOOP_SAMPLE();
+	_TMC_ISOL_CONFIG_CHECK();
+	return ((*memipc_check_newdata_ptr) & 1) ?
+		_tmc_isol_thr_pass() : memipc_thread_continue_flag;
+}
+
+static inline int tmc_isol_thr_pass_slave(void) {
+	_TMC_ISOL_LOOP_SAMPLE();
+	_TMC_ISOL_CONFIG_CHECK();
+	return (((*memipc_check_newdata_ptr) | memipc_check_signal) & 1) ?
+		_tmc_isol_thr_pass() : memipc_thread_continue_flag;
+}
+
 static inline int tmc_isol_thr_pass(void) {
-	return (((*memipc_check_newdata_ptr)
 #if ISOLATION_MONITOR_IN_SLAVE
-		 | memipc_check_signal
+	return tmc_isol_thr_pass_slave();
+#else
+	return tmc_isol_thr_pass_master();
 #endif
-		 ) & 1) ?
-		_tmc_isol_thr_pass() : memipc_thread_continue_flag;
 }
 
 int tmc_printf(const char *fmt, ...);
+int tmc_log_register(const char *fmt);
+int tmc_log(const char *fmt, ...);
+
+/*
+ * System call offload.
+ *
+ * Isolated thread submits a system call, and a worker thread on a
+ * non-isolated CPU makes it. The descriptor and all memory it refers
+ * to should remain valid until tmc_isol_syscall_done() returns
+ * nonzero. Submitting writes a request to the thread's area, and
+ * waiting only reads the descriptor, so the isolated thread does not
+ * enter the kernel.
+ */
+struct tmc_isol_syscall {
+	long nr; /* system call number, SYS_* */
+	long args[6];
+	long result; /* return value or negative errno, valid when done */
+	int done; /* set when the result is written */
+	struct tmc_isol_syscall *next; /* used by the library */
+};
+
+int tmc_isol_syscall_submit(struct tmc_isol_syscall *op);
+
+/*
+ * Publishing shared configuration.
+ *
+ * tmc_isol_config_init() allocates two buffers of a given size. A
+ * control thread fills the buffer returned by tmc_isol_config_begin(),
+ * then makes it the next generation with tmc_isol_config_publish().
+ * Threads confirm the switch to the manager, and the buffer of the
+ * previous generation is returned by tmc_isol_config_begin() once all
+ * running threads have switched, until then it returns NULL. Only one
+ * thread should publish.
+ */
+int tmc_isol_config_init(size_t size);
+void *tmc_isol_config_begin(void);
+int tmc_isol_config_publish(size_t size);
+
+static inline int tmc_isol_syscall_done(struct tmc_isol_syscall *op)
+{
+	return __atomic_load_n(&op->done, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Isolation-safe memory.
+ *
+ * Before entering isolation, each thread touches stack_size bytes of
+ * its stack, and creates a locked heap reserve of heap_size bytes.
+ * tmc_isol_alloc() and tmc_isol_free() use only that reserve and make
+ * no system calls, so they can be used while isolated. Memory should
+ * be freed by the thread that allocated it, the reserve is deleted
+ * when the thread exits or calls tmc_isol_thr_exit(). Stack touching
+ * stops short of the end of the thread's stack. Returns -1 on unknown
+ * flags or a heap reserve too small for any block.
+ */
+#define TMC_ISOL_RESERVE_HUGEPAGES (1 << 0)
+
+int tmc_isol_set_reserve(size_t stack_size, size_t heap_size,
+			 unsigned int flags);
+void *tmc_isol_alloc(size_t size);
+void tmc_isol_free(void *ptr);
+
+/*
+ * Direct channels between isolated threads.
+ *
+ * A channel is created before threads start, each of the two threads
+ * then opens it on its own CPU. Sending and receiving make no system
+ * calls.
+ */
+struct memipc_channel;
+
+struct memipc_channel *tmc_isol_chan_create(const char *name,
+					    int writer_cpu, int reader_cpu,
+					    size_t size);
+struct memipc_channel *tmc_isol_chan_open(const char *name);
+int tmc_isol_chan_send(struct memipc_channel *channel,
+		       const void *data, size_t size);
+ssize_t tmc_isol_chan_recv(struct memipc_channel *channel,
+			   void *data, size_t size);
+volatile unsigned char * const *
+tmc_isol_chan_poll_ptr(struct memipc_channel *channel);
+
+/*
+ * Check for data in a channel, using a pointer from
+ * tmc_isol_chan_poll_ptr(). It is a single load, so it can be combined
+ * with the pass check in the thread's loop:
+ *
+ * while (TMC_ISOL_THR_PASS(c1, c2))
+ *	if (TMC_ISOL_CHAN_READY(p))
+ *		tmc_isol_chan_recv(channel, buf, sizeof(buf));
+ */
+#define TMC_ISOL_CHAN_READY(p) (((**(p)) & 1) != 0)
+
+/*
+ * Flight recorder.
+ *
+ * When enabled with tmc_isol_set_trace(), each thread creates a trace
+ * ring in named shared memory, TMC_ISOL_TRACE_NAME with its CPU number,
+ * before entering isolation. tmc_isol_trace() writes an entry without
+ * system calls or locks, the oldest entries are overwritten. The ring
+ * is not removed when the thread or process exits, so it can be read
+ * after a crash, until a thread on the same CPU creates a new one.
+ *
+ * An entry is valid if its seq is its position in the ring plus one.
+ * Writer invalidates seq before writing other fields, so readers skip
+ * entries that were being written.
+ */
+#define TMC_ISOL_TRACE_NAME "/isol_server_trace_CPU%d"
+#define TMC_ISOL_TRACE_MAGIC 0x54524354 /* "TCRT" */
+
+struct tmc_isol_trace_entry {
+	uint64_t seq; /* position + 1, or 0 while written */
+	uint64_t time; /* tmc_isol_cycles() */
+	uint32_t id;
+	uint32_t arg0;
+	uint64_t arg1;
+};
+
+struct tmc_isol_trace_ring {
+	uint32_t magic; /* TMC_ISOL_TRACE_MAGIC */
+	uint32_t entry_size; /* sizeof(struct tmc_isol_trace_entry) */
+	uint64_t mask; /* number of entries - 1 */
+	int32_t cpu;
+	int32_t pid;
+	int32_t tid;
+	uint32_t reserved;
+	uint64_t start_cycles; /* tmc_isol_cycles() at creation */
+	uint64_t start_nsec; /* CLOCK_REALTIME at creation */
+	uint64_t cycles_per_sec; /* measured at creation */
+	uint64_t head /* next position, written only by the thread */
+	__attribute__((aligned(64)));
+	struct tmc_isol_trace_entry entries[]
+	__attribute__((aligned(64)));
+};
+
+extern __thread struct tmc_isol_trace_ring *memipc_trace_ring;
+
+int tmc_isol_set_trace(size_t entries);
+
+/*
+ * Write a trace entry.
+ */
+static inline void tmc_isol_trace(uint32_t id, uint32_t arg0, uint64_t arg1)
+{
+	struct tmc_isol_trace_ring *r = memipc_trace_ring;
+	struct tmc_isol_trace_entry *e;
+	uint64_t h;
+
+	if (r == NULL)
+		return;
+	h = r->head;
+	e = &r->entries[h & r->mask];
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->time = tmc_isol_cycles();
+	e->id = id;
+	e->arg0 = arg0;
+	e->arg1 = arg1;
+	__atomic_store_n(&e->seq, h + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
 
 #endif /* __TMC_ISOL_H__ */
@@ -0,0 +1,578 @@
+/*
+ * Benchmark for memipc areas.
+ *
+ * Measures round-trip latency of MEMIPC_REQ_PING / MEMIPC_REQ_PONG
+ * requests and one-way throughput of requests between threads on
+ * pairs of CPUs, for a range of request sizes. Results are printed as
+ * comma-separated values, one line per measurement.
+ *
+ * Threads do not run isolated, so results include all interruptions
+ * on those CPUs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <tmc/isol.h>
+#include "isol-internals.h"
+
+/* Defaults */
+#define BENCH_DEFAULT_SIZES "8,64,256,1024,4096"
+#define BENCH_DEFAULT_AREA_SIZE (256 * 1024)
+#define BENCH_DEFAULT_LAT_COUNT (100000)
+#define BENCH_DEFAULT_TPUT_COUNT (1000000)
+#define BENCH_WARMUP_COUNT (1000)
+
+/* Limits */
+#define BENCH_MAX_SIZES (64)
+#define BENCH_MAX_PAIRS (256)
+
+enum bench_mode {
+	BENCH_LATENCY,
+	BENCH_THROUGHPUT
+};
+
+/*
+ * Parameters and results of a single measurement, shared by the two
+ * threads.
+ */
+struct bench_run {
+	enum bench_mode mode;
+	int cpu_a; /* sends requests */
+	int cpu_b; /* receives and, for latency, responds */
+	size_t size; /* request size */
+	unsigned long count; /* measured requests */
+	struct memipc_area *a_out, *b_in; /* a to b, two views */
+	struct memipc_area *b_out, *a_in; /* b to a, two views */
+	int start; /* 1 to start, -1 to abort, accessed atomically */
+	int64_t *samples; /* latency, per request */
+	int64_t start_nsec, end_nsec; /* throughput */
+	unsigned long errors;
+};
+
+static int64_t bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Wait for the other thread. If both threads are on the same CPU,
+ * spinning would only consume its time slice.
+ */
+static inline void bench_wait(const struct bench_run *run)
+{
+	if (run->cpu_a == run->cpu_b)
+		sched_yield();
+}
+
+/*
+ * Wait until both threads are created, return nonzero on abort.
+ */
+static int bench_wait_start(struct bench_run *run)
+{
+	int start;
+
+	while ((start = __atomic_load_n(&run->start, __ATOMIC_SEQ_CST)) == 0)
+		sched_yield();
+	return (start < 0) || (__atomic_load_n(&run->errors,
+						__ATOMIC_SEQ_CST) != 0);
+}
+
+/*
+ * Receive one request, return its size or -1 on invalid request.
+ */
+static ssize_t bench_get(const struct bench_run *run,
+			 struct memipc_area *area, unsigned char *buffer,
+			 size_t buffer_size, enum memipc_req_type expected)
+{
+	enum memipc_req_type req_type;
+	ssize_t req_size;
+
+	for (;;) {
+		req_size = buffer_size;
+		if (memipc_get_req(area, &req_type, &req_size, buffer) == 0)
+			break;
+		bench_wait(run);
+	}
+	if (req_type != expected)
+		return -1;
+	return req_size;
+}
+
+static void bench_put(const struct bench_run *run, struct memipc_area *area,
+		      enum memipc_req_type req_type, unsigned char *buffer)
+{
+	while (memipc_add_req(area, req_type, run->size, buffer) != 0)
+		bench_wait(run);
+}
+
+static void *bench_thread_a(void *arg)
+{
+	struct bench_run *run = (struct bench_run *)arg;
+	unsigned char *buffer;
+	unsigned long i, errors = 0;
+	int64_t t;
+
+	buffer = (unsigned char *)malloc(run->size + 1);
+	if (buffer == NULL) {
+		__atomic_add_fetch(&run->errors, 1, __ATOMIC_SEQ_CST);
+		return NULL;
+	}
+	memset(buffer, 0x5a, run->size + 1);
+	if (bench_wait_start(run)) {
+		free(buffer);
+		return NULL;
+	}
+
+	if (run->mode == BENCH_LATENCY) {
+		for (i = 0; i < BENCH_WARMUP_COUNT + run->count; i++) {
+			t = bench_nsec();
+			bench_put(run, run->a_out, MEMIPC_REQ_PING, buffer);
+			if (bench_get(run, run->a_in, buffer, run->size + 1,
+				      MEMIPC_REQ_PONG) != (ssize_t)run->size)
+				errors++;
+			if (i >= BENCH_WARMUP_COUNT)
+				run->samples[i - BENCH_WARMUP_COUNT] =
+					bench_nsec() - t;
+		}
+	} else {
+		run->start_nsec = bench_nsec();
+		for (i = 0; i < run->count; i++)
+			bench_put(run, run->a_out, MEMIPC_REQ_DATA, buffer);
+	}
+	__atomic_add_fetch(&run->errors, errors, __ATOMIC_SEQ_CST);
+	free(buffer);
+	return NULL;
+}
+
+static void *bench_thread_b(void *arg)
+{
+	struct bench_run *run = (struct bench_run *)arg;
+	unsigned char *buffer;
+	unsigned long i, errors = 0;
+
+	buffer = (unsigned char *)malloc(run->size + 1);
+	if (buffer == NULL) {
+		__atomic_add_fetch(&run->errors, 1, __ATOMIC_SEQ_CST);
+		return NULL;
+	}
+	memset(buffer, 0xa5, run->size + 1);
+	if (bench_wait_start(run)) {
+		free(buffer);
+		return NULL;
+	}
+
+	if (run->mode == BENCH_LATENCY) {
+		for (i = 0; i < BENCH_WARMUP_COUNT + run->count; i++) {
+			if (bench_get(run, run->b_in, buffer, run->size + 1,
+				      MEMIPC_REQ_PING) != (ssize_t)run->size)
+				errors++;
+			bench_put(run, run->b_out, MEMIPC_REQ_PONG, buffer);
+		}
+	} else {
+		for (i = 0; i < run->count; i++)
+			if (bench_get(run, run->b_in, buffer, run->size + 1,
+				      MEMIPC_REQ_DATA) != (ssize_t)run->size)
+				errors++;
+		run->end_nsec = bench_nsec();
+	}
+	__atomic_add_fetch(&run->errors, errors, __ATOMIC_SEQ_CST);
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * Create an area for requests from one thread to another, and the
+ * second view of it.
+ */
+static int bench_area_create(size_t size, struct memipc_area **out,
+			     struct memipc_area **in)
+{
+	unsigned char *p;
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return -1;
+	*out = memipc_area_create(size, size, 0, -1, p);
+	if (*out == NULL) {
+		munmap(p, size);
+		return -1;
+	}
+	*in = memipc_area_dup(*out);
+	if (*in == NULL) {
+		memipc_area_delete(*out);
+		return -1;
+	}
+	return 0;
+}
+
+static void bench_area_delete(struct memipc_area *out, struct memipc_area *in)
+{
+	memipc_area_delete_duplicate(in);
+	memipc_area_delete(out);
+}
+
+/*
+ * Get NUMA node of a CPU, or -1 if not known.
+ */
+static int bench_cpu_node(int cpu)
+{
+	char name[64];
+	DIR *dir;
+	struct dirent *entry;
+	int node = -1;
+
+	snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(name);
+	if (dir == NULL)
+		return -1;
+	while ((entry = readdir(dir)) != NULL)
+		if (sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+	return node;
+}
+
+/*
+ * Get NUMA distance between nodes of two CPUs, or -1 if not known.
+ */
+static int bench_cpu_distance(int cpu_a, int cpu_b)
+{
+	char name[64];
+	FILE *f;
+	int node_a, node_b, i, distance = -1, d;
+
+	node_a = bench_cpu_node(cpu_a);
+	node_b = bench_cpu_node(cpu_b);
+	if ((node_a < 0) || (node_b < 0))
+		return -1;
+	snprintf(name, sizeof(name),
+		 "/sys/devices/system/node/node%d/distance", node_a);
+	f = fopen(name, "r");
+	if (f == NULL)
+		return -1;
+	for (i = 0; fscanf(f, "%d", &d) == 1; i++)
+		if (i == node_b) {
+			distance = d;
+			break;
+		}
+	fclose(f);
+	return distance;
+}
+
+static int bench_compare_int64(const void *a, const void *b)
+{
+	int64_t va = *(const int64_t *)a, vb = *(const int64_t *)b;
+
+	return (va > vb) - (va < vb);
+}
+
+/*
+ * Run one measurement and print the result.
+ */
+static int bench_run(enum bench_mode mode, int cpu_a, int cpu_b,
+		     size_t size, unsigned long count, size_t area_size)
+{
+	struct bench_run run;
+	pthread_t thread_a, thread_b;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	double seconds;
+	int rv = -1;
+
+	memset(&run, 0, sizeof(run));
+	run.mode = mode;
+	run.cpu_a = cpu_a;
+	run.cpu_b = cpu_b;
+	run.size = size;
+	run.count = count;
+
+	if (mode == BENCH_LATENCY) {
+		run.samples = (int64_t *)malloc(count * sizeof(int64_t));
+		if (run.samples == NULL)
+			return -1;
+	}
+	if (bench_area_create(area_size, &run.a_out, &run.b_in))
+		goto fail_a;
+	if (bench_area_create(area_size, &run.b_out, &run.a_in))
+		goto fail_b;
+	pthread_attr_init(&attr);
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu_a, &cpuset);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+	if (pthread_create(&thread_a, &attr, bench_thread_a, &run)) {
+		pthread_attr_destroy(&attr);
+		goto fail_threads;
+	}
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu_b, &cpuset);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+	if (pthread_create(&thread_b, &attr, bench_thread_b, &run)) {
+		/* Thread a is waiting for a partner */
+		__atomic_store_n(&run.start, -1, __ATOMIC_SEQ_CST);
+		pthread_join(thread_a, NULL);
+		pthread_attr_destroy(&attr);
+		goto fail_threads;
+	}
+	pthread_attr_destroy(&attr);
+	__atomic_store_n(&run.start, 1, __ATOMIC_SEQ_CST);
+	pthread_join(thread_a, NULL);
+	pthread_join(thread_b, NULL);
+
+	if (run.errors != 0) {
+		fprintf(stderr, "CPUs %d and %d, size %zu: %lu errors\n",
+			cpu_a, cpu_b, size, run.errors);
+		goto fail_threads;
+	}
+
+	if (mode == BENCH_LATENCY) {
+		qsort(run.samples, count, sizeof(int64_t),
+		      bench_compare_int64);
+		printf("latency,%d,%d,%d,%zu,%lu,%" PRId64 ",%" PRId64
+		       ",%" PRId64 ",%" PRId64 ",%" PRId64 ",,\n",
+		       cpu_a, cpu_b, bench_cpu_distance(cpu_a, cpu_b),
+		       size, count,
+		       run.samples[0],
+		       run.samples[count / 2],
+		       run.samples[(count * 99) / 100],
+		       run.samples[(count * 9999) / 10000],
+		       run.samples[count - 1]);
+	} else {
+		seconds = (run.end_nsec - run.start_nsec) / 1e9;
+		if (seconds <= 0)
+			seconds = 1e-9;
+		printf("throughput,%d,%d,%d,%zu,%lu,,,,,,%.0f,%.2f\n",
+		       cpu_a, cpu_b, bench_cpu_distance(cpu_a, cpu_b),
+		       size, count,
+		       count / seconds,
+		       (count * (double)size) / seconds / 1e6);
+	}
+	fflush(stdout);
+	rv = 0;
+
+ fail_threads:
+	bench_area_delete(run.b_out, run.a_in);
+ fail_b:
+	bench_area_delete(run.a_out, run.b_in);
+ fail_a:
+	free(run.samples);
+	return rv;
+}
+
+/*
+ * Parse a comma-separated list of sizes.
+ */
+static int bench_parse_sizes(const char *s, size_t *sizes)
+{
+	int n = 0;
+	char *end;
+	unsigned long v;
+
+	while (*s) {
+		errno = 0;
+		v = strtoul(s, &end, 0);
+		if ((end == s) || (errno != 0) || (n >= BENCH_MAX_SIZES))
+			return -1;
+		sizes[n++] = v;
+		s = end;
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -1;
+	}
+	return n;
+}
+
+/*
+ * Parse a comma-separated list of CPU pairs, <cpu>:<cpu>.
+ */
+static int bench_parse_pairs(const char *s, int (*pairs)[2])
+{
+	int n = 0, l;
+
+	while (*s) {
+		if ((n >= BENCH_MAX_PAIRS)
+		    || (sscanf(s, "%d:%d%n", &pairs[n][0], &pairs[n][1],
+			       &l) != 2)
+		    || (pairs[n][0] < 0) || (pairs[n][0] >= CPU_SETSIZE)
+		    || (pairs[n][1] < 0) || (pairs[n][1] >= CPU_SETSIZE))
+			return -1;
+		n++;
+		s += l;
+		if (*s == ',')
+			s++;
+		else if (*s)
+			return -1;
+	}
+	return n;
+}
+
+/*
+ * Default CPU pairs: the first available CPU with the next one, and
+ * with the nearest CPU on every other NUMA distance.
+ */
+static int bench_default_pairs(int (*pairs)[2])
+{
+	cpu_set_t cpuset;
+	int cpu, first = -1, n = 0, i, distance, seen;
+	int distances[BENCH_MAX_PAIRS];
+
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuset))
+		return -1;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &cpuset))
+			continue;
+		if (first < 0) {
+			first = cpu;
+			continue;
+		}
+		distance = bench_cpu_distance(first, cpu);
+		for (i = 0, seen = 0; i < n; i++)
+			if (distances[i] == distance)
+				seen = 1;
+		if (!seen && (n < BENCH_MAX_PAIRS)) {
+			distances[n] = distance;
+			pairs[n][0] = first;
+			pairs[n][1] = cpu;
+			n++;
+		}
+	}
+	if ((n == 0) && (first >= 0)) {
+		/* Only one CPU, both threads share it */
+		pairs[0][0] = first;
+		pairs[0][1] = first;
+		n = 1;
+	}
+	return n;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-l] [-t] [-s <size>[,<size>...]]\n"
+		"       [-p <cpu>:<cpu>[,<cpu>:<cpu>...]] [-n <count>]\n"
+		"       [-N <count>] [-a <area size>]\n"
+		"  -l  measure round-trip latency only\n"
+		"  -t  measure one-way throughput only\n"
+		"  -s  request sizes, default " BENCH_DEFAULT_SIZES "\n"
+		"  -p  CPU pairs, default is the first CPU with one CPU\n"
+		"      at every NUMA distance\n"
+		"  -n  round trips for latency, default %d\n"
+		"  -N  requests for throughput, default %d\n"
+		"  -a  area size, default %d\n",
+		name, BENCH_DEFAULT_LAT_COUNT, BENCH_DEFAULT_TPUT_COUNT,
+		BENCH_DEFAULT_AREA_SIZE);
+}
+
+int main(int argc, char **argv)
+{
+	size_t sizes[BENCH_MAX_SIZES];
+	int pairs[BENCH_MAX_PAIRS][2];
+	int n_sizes, n_pairs = 0, i, j, opt, rv = 0;
+	int do_latency = 1, do_throughput = 1;
+	unsigned long lat_count = BENCH_DEFAULT_LAT_COUNT,
+		tput_count = BENCH_DEFAULT_TPUT_COUNT;
+	unsigned long long val;
+	size_t area_size = BENCH_DEFAULT_AREA_SIZE;
+
+	n_sizes = bench_parse_sizes(BENCH_DEFAULT_SIZES, sizes);
+
+	while ((opt = getopt(argc, argv, "lts:p:n:N:a:")) != -1) {
+		switch (opt) {
+		case 'l':
+			do_throughput = 0;
+			break;
+		case 't':
+			do_latency = 0;
+			break;
+		case 's':
+			n_sizes = bench_parse_sizes(optarg, sizes);
+			if (n_sizes <= 0) {
+				fprintf(stderr, "Invalid sizes: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			n_pairs = bench_parse_pairs(optarg, pairs);
+			if (n_pairs <= 0) {
+				fprintf(stderr, "Invalid CPU pairs: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'n':
+		case 'N':
+		case 'a':
+			if ((sscanf(optarg, "%llu", &val) != 1) || (val == 0)) {
+				fprintf(stderr, "Invalid value: %s\n", optarg);
+				return 1;
+			}
+			if (opt == 'n')
+				lat_count = val;
+			else if (opt == 'N')
+				tput_count = val;
+			else if (val < AREA_MIN_SIZE) {
+				fprintf(stderr, "Area size %llu is less than "
+					"%d bytes\n", val, AREA_MIN_SIZE);
+				return 1;
+			} else
+				area_size = (val + 7) & ~7ULL;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!do_latency && !do_throughput) {
+		do_latency = 1;
+		do_throughput = 1;
+	}
+
+	if (n_pairs == 0) {
+		n_pairs = bench_default_pairs(pairs);
+		if (n_pairs <= 0) {
+			fprintf(stderr, "No CPUs available\n");
+			return 1;
+		}
+	}
+
+	/* Encoding takes 8 bytes for every 7, plus the header */
+	for (i = 0; i < n_sizes; i++)
+		if (sizes[i] * 8 / 7 + 64 > area_size / 2) {
+			fprintf(stderr, "Size %zu does not fit in the area\n",
+				sizes[i]);
+			return 1;
+		}
+
+	printf("test,cpu_a,cpu_b,numa_distance,size,count,"
+	       "min_ns,p50_ns,p99_ns,p9999_ns,max_ns,"
+	       "reqs_per_sec,mbytes_per_sec\n");
+	for (i = 0; i < n_pairs; i++)
+		for (j = 0; j < n_sizes; j++) {
+			if (do_latency
+			    && bench_run(BENCH_LATENCY, pairs[i][0],
+					 pairs[i][1], sizes[j], lat_count,
+					 area_size))
+				rv = 1;
+			if (do_throughput
+			    && bench_run(BENCH_THROUGHPUT, pairs[i][0],
+					 pairs[i][1], sizes[j], tput_count,
+					 area_size))
+				rv = 1;
+		}
+	return rv;
+}
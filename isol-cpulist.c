@@ -0,0 +1,92 @@
+/*
+ * CPU list parsing.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "isol-cpulist.h"
+
+/*
+ * Compare unsigned integers for qsort().
+ */
+static int uintcmp(const void *v1, const void *v2)
+{
+	return (*((const unsigned int*)v1) >
+		*((const unsigned int*)v2)) * 2 - 1;
+}
+
+/*
+ * Allocate and fill a list of CPUs from a string.
+ */
+int string_to_cpulist(const char *s, unsigned int **retbuf)
+{
+	const char *p;
+	char *nextp;
+	unsigned int *buf = NULL;
+	int cpunum, last_cpu, last_oper, n_cpus, pass, i;
+	for (pass = 0; pass < 2; pass++) {
+		p = s;
+		nextp = NULL;
+		cpunum = 0;
+		last_cpu = -1;
+		last_oper = 0;
+		n_cpus = 0;
+
+		while (*p) {
+			cpunum=strtol(p, (char ** restrict)&nextp, 0);
+			if (nextp != p) {
+				if (cpunum >= 0) {
+					if ((last_oper == 1)
+					    && (last_cpu >= 0)
+					    && (cpunum > last_cpu)) {
+						for (i = last_cpu + 1;
+						     i <= cpunum; i++) {
+							if (pass == 1)
+								buf[n_cpus] =
+								(unsigned int)i;
+							n_cpus++;
+						}
+					} else {
+						if (pass == 1)
+							buf[n_cpus] =
+							(unsigned int)cpunum;
+						n_cpus++;
+					}
+					last_cpu = cpunum;
+					last_oper = 0;
+				}
+			}
+			if (*nextp) {
+				if (*nextp == '-')
+					last_oper = 1;
+				nextp++;
+			}
+			p = nextp;
+		}
+		if (pass == 0) {
+			if (n_cpus == 0)
+				return -1;
+			buf = (unsigned int *)malloc(n_cpus
+						     * sizeof(unsigned int));
+			if (buf == NULL)
+				return -1;
+		}
+	}
+
+	qsort(buf, n_cpus, sizeof(unsigned int), uintcmp);
+
+	for (i = 0; i < n_cpus - 1; i++) {
+		if (buf[i] == buf[i+1]) {
+			if ((n_cpus - i) > 2)
+				memmove(&buf[i + 1],
+					&buf[i + 2],
+					(n_cpus - i - 2)
+					* sizeof(unsigned int));
+			i--;
+			n_cpus--;
+		}
+	}
+	*retbuf = buf;
+	return n_cpus;
+}
@@ -0,0 +1,16 @@
+#ifndef __ISOL_CPULIST_H__
+#define __ISOL_CPULIST_H__
+
+/*
+ * CPU list parsing, shared by the library and tools.
+ */
+
+/*
+  Allocate and fill a sorted list of CPUs without duplicates from a
+  string in the kernel's cpulist format, such as "1-3,8". Returns the
+  number of CPUs, or -1 if the list is empty or can not be allocated.
+  The list should be released with free().
+*/
+int string_to_cpulist(const char *s, unsigned int **retbuf);
+
+#endif
@@ -8,6 +8,8 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <pthread.h>
 
 /* Request types */
@@ -28,12 +30,20 @@ enum memipc_req_type
 	MEMIPC_REQ_PING,
 	MEMIPC_REQ_PONG,
 	MEMIPC_REQ_CMD,
-	MEMIPC_REQ_PRINT
+	MEMIPC_REQ_PRINT,
+	MEMIPC_REQ_LOG,
+	MEMIPC_REQ_DATA,
+	MEMIPC_REQ_OFFLOAD,
+	MEMIPC_REQ_CONFIG,
+	MEMIPC_REQ_CONFIG_ACK
     };
 
 struct memipc_area;
 struct memipc_thread_params;
 
+/* Smallest size of a memory area, sufficient for control requests. */
+#define AREA_MIN_SIZE (256)
+
 /*
  * Create an area descriptor and allocate the area.
  */
@@ -81,6 +91,84 @@ int memipc_add_req(struct memipc_area *area, enum memipc_req_type req_type,
 int memipc_get_req(struct memipc_area *area, enum memipc_req_type *req_type,
 		   ssize_t *req_size, unsigned char *req_data);
 
+/* Maximum number of requests written or read in one batch */
+#define MEMIPC_BATCH_MAX (32)
+
+/* Request for batched writing */
+struct memipc_req_vec
+{
+	enum memipc_req_type req_type;
+	ssize_t req_size;
+	unsigned char *req_data;
+};
+
+/* Handler for requests read in a batch */
+typedef void (*memipc_req_handler_t)(enum memipc_req_type req_type,
+				     ssize_t req_size,
+				     unsigned char *req_data,
+				     void *arg);
+
+/*
+ * Create multiple requests in a given area, with a single barrier.
+ *
+ * Returns the number of requests written, or -1 if none could be
+ * written.
+ */
+int memipc_add_reqs(struct memipc_area *area,
+		    const struct memipc_req_vec *reqs,
+		    unsigned int count);
+
+/*
+ * Get up to max_reqs requests, or max_bytes of request data, from a
+ * given area, and pass each of them to the handler. Request data is
+ * valid only until the handler returns.
+ *
+ * Returns the number of requests handled, or -2 if a request does not
+ * fit in the buffer.
+ */
+int memipc_get_reqs(struct memipc_area *area, unsigned int max_reqs,
+		    size_t max_bytes, unsigned char *buffer,
+		    size_t buffer_size, memipc_req_handler_t handler,
+		    void *arg);
+
+/*
+ * Reserve space for a request written in place, without encoding.
+ *
+ * Returns a pointer to req_size bytes of payload inside the area, or
+ * NULL if there is not enough contiguous space. No other requests can
+ * be added to the area until the reserved one is committed or
+ * cancelled.
+ */
+unsigned char *memipc_reserve_req(struct memipc_area *area, size_t req_size);
+
+/*
+ * Make the reserved request visible to the reader. req_size may be
+ * smaller than the reserved size.
+ */
+int memipc_commit_req(struct memipc_area *area, enum memipc_req_type req_type,
+		      size_t req_size);
+
+/*
+ * Cancel the reserved request.
+ */
+void memipc_cancel_req(struct memipc_area *area);
+
+/*
+ * Get a pointer to the next request in a given area without copying.
+ *
+ * Returns 0 if the request was written in place, *req_data then points
+ * to its payload inside the area until memipc_release_req() is called.
+ * Returns 1 if the next request is encoded and should be received with
+ * memipc_get_req(), -1 if there are no requests.
+ */
+int memipc_peek_req(struct memipc_area *area, enum memipc_req_type *req_type,
+		    ssize_t *req_size, unsigned char **req_data);
+
+/*
+ * Release the request returned by memipc_peek_req().
+ */
+void memipc_release_req(struct memipc_area *area);
+
 /*
  *  Call this function in the main loop of the slave/managed thread.
  */
@@ -103,6 +191,33 @@ void memipc_isolation_announce_exit(void);
  */
 int memipc_isolation_printf(const char *fmt, ...);
 
+/*
+ * vprintf() replacement for isolated mode.
+ */
+int memipc_isolation_vprintf(const char *fmt, va_list va);
+
+/*
+ * printf() replacement for isolated mode with deferred formatting.
+ *
+ * Only argument values are sent, output is formatted by the manager,
+ * so format string must remain valid (a string literal). Strings
+ * passed for %s are copied. Returns 0 if the request was sent, or a
+ * negative number if there is not enough space in buffer.
+ */
+int memipc_isolation_log(const char *fmt, ...);
+
+/*
+ * Same as above, with va_list.
+ */
+int memipc_isolation_vlog(const char *fmt, va_list va);
+
+/*
+ * Register a format string for memipc_isolation_log() in advance, so it
+ * is not parsed on the first use. Returns 0 if output with this format
+ * will be deferred, -1 if it will be formatted immediately.
+ */
+int memipc_isolation_log_register(const char *fmt);
+
 /*
  * Handler for requests in a master/manager thread.
  */
@@ -147,6 +262,22 @@ void memipc_isolation_terminate_all_threads(void);
  */
 int memipc_isolation_run_threads(void);
 
+/*
+ * Manager loop of the manager daemon.
+ *
+ * The daemon manages threads of other processes, that connect to it
+ * from tmc_isol_init() and tmc_isol_thr_init(). Returns after
+ * memipc_isolation_stop_daemon() is called and all threads exit.
+ */
+int memipc_isolation_run_daemon(void);
+
+/*
+ * Terminate all threads and leave the daemon's manager loop.
+ *
+ * This function can be called from a signal handler.
+ */
+void memipc_isolation_stop_daemon(void);
+
 /*
  * Claim a CPU, then start a thread on it.
  *
@@ -160,6 +291,20 @@ int isolation_thread_create(int cpu, const pthread_attr_t *attr,
 			    void *(*init_routine)(void*),
 			    void *(*start_routine)(void*), void *arg);
 
+/*
+ * Claim a CPU, then start a thread on it, with memipc areas of a given
+ * size and MEMIPC_AREA_* flags, monitored in TMC_ISOL_MONITOR_* mode.
+ *
+ * Zero area_size keeps areas that were created at initialization.
+ */
+int isolation_thread_create_with_area(int cpu, const pthread_attr_t *attr,
+				      size_t area_size,
+				      unsigned int area_flags,
+				      int monitor,
+				      void *(*init_routine)(void*),
+				      void *(*start_routine)(void*),
+				      void *arg);
+
 /*
  * Claim a CPU from a started thread.
  *
@@ -171,11 +316,143 @@ int isolation_thread_create(int cpu, const pthread_attr_t *attr,
  */
 int isolation_connect_this_thread(int cpu);
 
+/*
+ * Same as above, with TMC_ISOL_MONITOR_* monitoring mode.
+ */
+int isolation_connect_this_thread_mode(int cpu, int monitor);
+
+/*
+ * The library is built with its own ISOLATION_MONITOR_IN_* setting, so
+ * the unsuffixed calls pick up the default mode of the caller, the one
+ * its unsuffixed pass checks are compiled for. The out-of-line versions
+ * remain for callers that do not see this header.
+ */
+#define isolation_thread_create(cpu, attr, init_routine, start_routine, arg) \
+	isolation_thread_create_with_area(cpu, attr, 0, 0,		\
+					  TMC_ISOL_MONITOR_DEFAULT,	\
+					  init_routine, start_routine, arg)
+#define isolation_connect_this_thread(cpu)				\
+	isolation_connect_this_thread_mode(cpu, TMC_ISOL_MONITOR_DEFAULT)
+
 /*
  * Send request to the manager to run this thread isolated.
  */
 int isolation_request_launch_this_thread(volatile int *c);
 
+/* CPU placement policies for isolation_select_cpu() */
+/* Skip CPUs with a claimed SMT sibling */
+#define ISOL_PLACE_NO_SMT (1 << 0)
+/* Prefer L3 cache domains with the most claimed CPUs */
+#define ISOL_PLACE_L3_PACK (1 << 1)
+/* Prefer L3 cache domains with the fewest claimed CPUs */
+#define ISOL_PLACE_L3_SPREAD (1 << 2)
+
+/*
+ * Select a CPU that is not claimed, on a given NUMA node (negative
+ * for any), according to ISOL_PLACE_* policy. CPU is not claimed, it
+ * should be passed to isolation_thread_create() or
+ * isolation_connect_this_thread(). Returns CPU number or -1.
+ */
+int isolation_select_cpu(int node, unsigned int policy);
+
+/*
+ * Get NUMA node of a network interface or sysfs device path, or -1.
+ */
+int isolation_device_node(const char *device);
+
+/*
+ * Get NUMA node of allocated memory at a given address, or -1.
+ */
+int isolation_memory_node(const void *addr);
+
+/* Flags for memipc areas */
+/* Allocate areas in huge pages */
+#define MEMIPC_AREA_HUGEPAGES (1 << 0)
+
+/*
+ * Set size of memipc areas created by default.
+ *
+ * This function should be called before the isolation environment is
+ * initialized. Individual threads can use other sizes, see
+ * isolation_thread_create_with_area().
+ */
+int memipc_isolation_set_area_size(size_t size, unsigned int flags);
+
+/*
+ * Set launch timing: time to wait for all threads to become ready,
+ * delay before re-launching a thread that had to leave isolation, and
+ * time a launched thread may wait for timers on its CPU to expire, all
+ * in nanoseconds.
+ */
+int memipc_isolation_set_launch_timing(int64_t start_timeout,
+				       int64_t restart_delay,
+				       int64_t timers_wait);
+
+/*
+ * Set the number of manager shards, threads that drain areas of
+ * isolated threads on their CPUs, 0 for one shard per NUMA node. With
+ * the default of 1, the manager loop drains all areas itself.
+ */
+int memipc_isolation_set_manager_shards(int count);
+
+/*
+ * Direct channel between two managed threads.
+ */
+struct memipc_channel;
+
+/*
+ * Create a channel with a given name between threads on two CPUs.
+ *
+ * Should be called during setup, before threads attach to the
+ * channel. Zero size means default area size, flags are MEMIPC_AREA_*
+ * flags.
+ */
+struct memipc_channel *memipc_channel_create(const char *name,
+					     int writer_cpu, int reader_cpu,
+					     size_t size, unsigned int flags);
+
+/*
+ * Find a channel by name.
+ */
+struct memipc_channel *memipc_channel_find(const char *name);
+
+/*
+ * Attach current managed thread to a channel, as the writer or the
+ * reader, depending on its CPU.
+ */
+int memipc_channel_attach(struct memipc_channel *channel);
+
+/*
+ * Get area descriptor of the current thread in a channel, for use with
+ * memipc_*_req() functions.
+ */
+struct memipc_area *memipc_channel_area(struct memipc_channel *channel);
+
+/*
+ * Send data to a channel. Returns 0 on success, -1 if there is not
+ * enough space.
+ */
+int memipc_channel_send(struct memipc_channel *channel,
+			const void *data, size_t size);
+
+/*
+ * Receive data from a channel. Returns the size of data, -1 if there is
+ * no data, -2 if data does not fit in the buffer.
+ */
+ssize_t memipc_channel_recv(struct memipc_channel *channel,
+			    void *data, size_t size);
+
+/*
+ * Get a pointer for TMC_ISOL_CHAN_READY() check.
+ */
+volatile unsigned char * const *
+memipc_channel_poll_ptr(struct memipc_channel *channel);
+
+/*
+ * Delete a channel after threads stopped using it.
+ */
+void memipc_channel_delete(struct memipc_channel *channel);
+
 /*
  * Initialize environment for a given CPU list.
  */
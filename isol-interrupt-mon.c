@@ -6,8 +6,13 @@
 #include <stdio.h>
 #include <getopt.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <string.h>
+
+#include "isol-cpulist.h"
+
 #define FILE_BLOCK_SIZE 4096
 #define FILE_BUF_SIZE 1024
 
@@ -193,90 +198,6 @@ char *load_bin_file(const char *name, size_t *len)
 	return buf;
 }
 
-/*
- * Compare unsigned integers for qsort().
- */
-static int uintcmp(const void *v1, const void *v2)
-{
-	return (*((const unsigned int*)v1)
-		> *((const unsigned int*)v2)) * 2 - 1;
-}
-
-/*
- * Allocate and fill a list of CPUs from a string.
- */
-static int string_to_cpulist(const char *s, unsigned int **retbuf)
-{
-	const char *p;
-	char *nextp;
-	unsigned int *buf = NULL;
-	int cpunum, last_cpu, last_oper, n_cpus, pass, i;
-	for (pass = 0; pass < 2; pass++)	{
-		p = s;
-		nextp = NULL;
-		cpunum = 0;
-		last_cpu = -1;
-		last_oper = 0;
-		n_cpus = 0;
-
-		while (*p) {
-			cpunum=strtol(p, (char ** restrict)&nextp, 0);
-			if (nextp != p) {
-				if (cpunum >= 0) {
-					if ((last_oper == 1)
-					    && (last_cpu >= 0)
-					    && (cpunum > last_cpu)) {
-						for (i = last_cpu + 1;
-						     i <= cpunum; i++) {
-							if (pass == 1)
-								buf[n_cpus] =
-								(unsigned int)i;
-							n_cpus++;
-						}
-					} else {
-						if (pass == 1)
-							buf[n_cpus] =
-							(unsigned int)cpunum;
-						n_cpus++;
-					}
-					last_cpu = cpunum;
-					last_oper = 0;
-				}
-			}
-			if (*nextp) {
-				if (*nextp == '-')
-					last_oper = 1;
-				nextp++;
-			}
-			p = nextp;
-		}
-		if (pass == 0) {
-			if (n_cpus == 0)
-				return -1;
-			buf = (unsigned int *)malloc(n_cpus
-						     * sizeof(unsigned int));
-			if (buf == NULL)
-				return -1;
-		}
-	}
-
-	qsort(buf, n_cpus, sizeof(unsigned int), uintcmp);
-
-	for (i = 0; i < n_cpus - 1; i++) {
-		if (buf[i] == buf[i+1]) {
-			if ((n_cpus - i) > 2)
-				memmove(&buf[i + 1],
-					&buf[i + 2],
-					(n_cpus - i - 2)
-					* sizeof(unsigned int));
-			i--;
-			n_cpus--;
-		}
-	}
-	*retbuf = buf;
-	return n_cpus;
-}
-
 struct int_def {
 	int intr_num;
 	unsigned int cpu_count;
@@ -518,6 +439,349 @@ void print_count_interrupts_diff(int n_new, struct int_def *counts_new,
 }
 
 
+/*
+ * Streaming mode.
+ *
+ * /proc/interrupts is kept open and read with pread() into a buffer
+ * that is reused between samples. Only columns of monitored CPUs are
+ * parsed, column positions and interrupt names are determined once,
+ * and again only when the file layout changes.
+ */
+
+#define STREAM_READ_SIZE 65536
+
+enum stream_format {
+	STREAM_FORMAT_CSV,
+	STREAM_FORMAT_BINARY
+};
+
+/* Binary record types */
+#define STREAM_REC_NAME 1	/* followed by len bytes of the name */
+#define STREAM_REC_DELTA 2	/* count is the delta over an interval */
+
+struct stream_record {
+	uint64_t time_nsec;
+	uint32_t type;
+	uint32_t cpu;
+	uint32_t intr;
+	uint32_t len;
+	uint64_t count;
+};
+
+struct int_stream {
+	int fd;
+	char *buf;
+	size_t buf_size;
+	char *header;		/* copy of the CPU list line */
+	int n_cpus;
+	unsigned int *cpus;	/* monitored CPUs */
+	int *columns;		/* column of each monitored CPU, or -1 */
+	int max_column;
+	int n_intr;
+	int alloc_intr;
+	char **names;
+	unsigned long long *prev;	/* n_intr * n_cpus */
+	unsigned long long *curr;
+	enum stream_format format;
+};
+
+static ssize_t stream_read(struct int_stream *st)
+{
+	size_t len = 0;
+	ssize_t l;
+	char *p;
+
+	for (;;) {
+		if ((st->buf_size - len) < (STREAM_READ_SIZE + 1)) {
+			p = realloc(st->buf, st->buf_size
+				    + STREAM_READ_SIZE * 4);
+			if (p == NULL)
+				return -1;
+			st->buf = p;
+			st->buf_size += STREAM_READ_SIZE * 4;
+		}
+		l = pread(st->fd, st->buf + len, st->buf_size - len - 1, len);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (l == 0)
+			break;
+		len += l;
+	}
+	st->buf[len] = '\0';
+	return len;
+}
+
+/*
+ * Determine columns of monitored CPUs from the CPU list line.
+ */
+static int stream_parse_header(struct int_stream *st, const char *line,
+			       size_t len)
+{
+	const char *p, *end;
+	int column, i;
+	unsigned int cpu;
+	char *h;
+
+	h = realloc(st->header, len + 1);
+	if (h == NULL)
+		return -1;
+	st->header = h;
+	memcpy(st->header, line, len);
+	st->header[len] = '\0';
+
+	for (i = 0; i < st->n_cpus; i++)
+		st->columns[i] = -1;
+	st->max_column = -1;
+	end = line + len;
+	for (column = 0, p = line; p < end; column++) {
+		while ((p < end) && ((unsigned char)*p <= ' '))
+			p++;
+		if ((p + 3 >= end) || memcmp(p, "CPU", 3))
+			break;
+		cpu = strtoul(p + 3, NULL, 10);
+		for (i = 0; i < st->n_cpus; i++)
+			if (st->cpus[i] == cpu) {
+				st->columns[i] = column;
+				if (column > st->max_column)
+					st->max_column = column;
+			}
+		while ((p < end) && ((unsigned char)*p > ' '))
+			p++;
+	}
+	return 0;
+}
+
+static int stream_set_name(struct int_stream *st, int intr,
+			   const char *name, size_t len)
+{
+	char **names;
+	unsigned long long *prev, *curr;
+	int alloc;
+
+	if (intr >= st->alloc_intr) {
+		alloc = st->alloc_intr ? st->alloc_intr * 2 : 64;
+		names = realloc(st->names, alloc * sizeof(char *));
+		if (names == NULL)
+			return -1;
+		memset(names + st->alloc_intr, 0,
+		       (alloc - st->alloc_intr) * sizeof(char *));
+		st->names = names;
+		prev = realloc(st->prev, alloc * st->n_cpus
+			       * sizeof(unsigned long long));
+		if (prev == NULL)
+			return -1;
+		st->prev = prev;
+		curr = realloc(st->curr, alloc * st->n_cpus
+			       * sizeof(unsigned long long));
+		if (curr == NULL)
+			return -1;
+		st->curr = curr;
+		st->alloc_intr = alloc;
+	}
+	free(st->names[intr]);
+	st->names[intr] = malloc(len + 1);
+	if (st->names[intr] == NULL)
+		return -1;
+	memcpy(st->names[intr], name, len);
+	st->names[intr][len] = '\0';
+	return 0;
+}
+
+/*
+ * Parse one sample into st->curr. Returns 1 if the layout changed, so
+ * there is nothing to compare with, 0 if counts are comparable with
+ * the previous sample, -1 on error.
+ */
+static int stream_parse(struct int_stream *st, size_t len)
+{
+	char *line, *endl, *end, *p, *name;
+	size_t name_len;
+	int changed = 0, intr, column, i;
+	unsigned long long v, *counts;
+
+	end = st->buf + len;
+	endl = memchr(st->buf, '\n', len);
+	if (endl == NULL)
+		return -1;
+	if ((st->header == NULL)
+	    || (strlen(st->header) != (size_t)(endl - st->buf))
+	    || memcmp(st->header, st->buf, endl - st->buf)) {
+		if (stream_parse_header(st, st->buf, endl - st->buf))
+			return -1;
+		changed = 1;
+	}
+
+	for (intr = 0, line = endl + 1; line < end; line = endl + 1) {
+		endl = memchr(line, '\n', end - line);
+		if (endl == NULL)
+			endl = end;
+		p = memchr(line, ':', endl - line);
+		if (p == NULL)
+			continue;
+		name = line;
+		while ((name < p) && ((unsigned char)*name <= ' '))
+			name++;
+		name_len = p - name;
+		if ((intr >= st->n_intr)
+		    || (strlen(st->names[intr]) != name_len)
+		    || memcmp(st->names[intr], name, name_len)) {
+			if (stream_set_name(st, intr, name, name_len))
+				return -1;
+			changed = 1;
+		}
+		counts = st->curr + intr * st->n_cpus;
+		memset(counts, 0, st->n_cpus * sizeof(unsigned long long));
+		/* Only parse columns up to the last monitored one */
+		p++;
+		for (column = 0; column <= st->max_column; column++) {
+			while ((p < endl) && (*p == ' '))
+				p++;
+			if ((p >= endl) || (*p < '0') || (*p > '9'))
+				break;
+			for (v = 0; (p < endl) && (*p >= '0') && (*p <= '9');
+			     p++)
+				v = v * 10 + (*p - '0');
+			for (i = 0; i < st->n_cpus; i++)
+				if (st->columns[i] == column)
+					counts[i] = v;
+		}
+		intr++;
+	}
+	if (intr != st->n_intr)
+		changed = 1;
+	st->n_intr = intr;
+	return changed;
+}
+
+static void stream_emit(struct int_stream *st, uint64_t time_nsec,
+			uint32_t type, uint32_t cpu, uint32_t intr,
+			unsigned long long count)
+{
+	struct stream_record rec;
+
+	if (st->format == STREAM_FORMAT_CSV) {
+		if (type == STREAM_REC_DELTA)
+			printf("%llu,%u,%s,%llu\n",
+			       (unsigned long long)time_nsec, cpu,
+			       (intr < (uint32_t)st->n_intr) ?
+			       st->names[intr] : "total", count);
+		return;
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.time_nsec = time_nsec;
+	rec.type = type;
+	rec.cpu = cpu;
+	rec.intr = intr;
+	rec.count = count;
+	if (type == STREAM_REC_NAME)
+		rec.len = strlen(st->names[intr]);
+	fwrite(&rec, sizeof(rec), 1, stdout);
+	if (type == STREAM_REC_NAME)
+		fwrite(st->names[intr], rec.len, 1, stdout);
+}
+
+/*
+ * Sample /proc/interrupts every interval_msec milliseconds and emit
+ * per-interval deltas for monitored CPUs. CSV lines are
+ * <time in ns>,<cpu>,<interrupt>,<count>, only non-zero deltas are
+ * emitted, followed by a "total" line for every CPU. Binary output
+ * consists of struct stream_record, names are sent before deltas
+ * whenever the list of interrupts changes, "total" has interrupt
+ * index equal to the number of interrupts.
+ */
+int stream_interrupts(int n_cpus, unsigned int *cpus, long interval_msec,
+		      unsigned long count, enum stream_format format)
+{
+	struct int_stream st;
+	struct timespec next, now;
+	unsigned long long delta, total, *tmp;
+	uint64_t time_nsec;
+	unsigned long sample;
+	ssize_t len = 0;
+	int rv, i, intr;
+
+	memset(&st, 0, sizeof(st));
+	st.format = format;
+	st.n_cpus = n_cpus;
+	st.cpus = cpus;
+	st.columns = malloc(n_cpus * sizeof(int));
+	if (st.columns == NULL)
+		return -1;
+	st.fd = open("/proc/interrupts", O_RDONLY | O_CLOEXEC);
+	if (st.fd < 0) {
+		perror("Can't open /proc/interrupts");
+		free(st.columns);
+		return -1;
+	}
+	if (format == STREAM_FORMAT_CSV)
+		printf("time_ns,cpu,interrupt,count\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (sample = 0, rv = 1; (count == 0) || (sample <= count);
+	     sample++) {
+		len = stream_read(&st);
+		if (len < 0) {
+			perror("Can't read /proc/interrupts");
+			break;
+		}
+		clock_gettime(CLOCK_REALTIME, &now);
+		time_nsec = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		rv = stream_parse(&st, len);
+		if (rv < 0) {
+			fprintf(stderr, "Invalid /proc/interrupts format\n");
+			break;
+		}
+		if (rv == 0) {
+			for (i = 0; i < n_cpus; i++) {
+				if (st.columns[i] < 0)
+					continue;
+				for (intr = 0, total = 0; intr < st.n_intr;
+				     intr++) {
+					delta = st.curr[intr * n_cpus + i]
+						- st.prev[intr * n_cpus + i];
+					if (delta == 0)
+						continue;
+					total += delta;
+					stream_emit(&st, time_nsec,
+						    STREAM_REC_DELTA,
+						    cpus[i], intr, delta);
+				}
+				stream_emit(&st, time_nsec, STREAM_REC_DELTA,
+					    cpus[i], st.n_intr, total);
+			}
+		} else if (format == STREAM_FORMAT_BINARY) {
+			for (intr = 0; intr < st.n_intr; intr++)
+				stream_emit(&st, time_nsec, STREAM_REC_NAME,
+					    0, intr, 0);
+		}
+		fflush(stdout);
+		tmp = st.prev;
+		st.prev = st.curr;
+		st.curr = tmp;
+
+		/* Fixed interval, regardless of processing time */
+		next.tv_nsec += (interval_msec % 1000) * 1000000;
+		next.tv_sec += interval_msec / 1000 + next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &next, NULL) == EINTR);
+	}
+
+	close(st.fd);
+	for (intr = 0; intr < st.alloc_intr; intr++)
+		free(st.names[intr]);
+	free(st.names);
+	free(st.prev);
+	free(st.curr);
+	free(st.header);
+	free(st.buf);
+	free(st.columns);
+	return (rv < 0 || len < 0) ? -1 : 0;
+}
+
 void usage(void)
 {
 	printf(
@@ -525,18 +789,31 @@ void usage(void)
 	"Usage: isol_interrupt_mon <options>\n"
 	"Options:\n"
 	"--help or -h                       -- this message\n"
-	"--cpus=<cpu list> or -c <cpu list> -- list of CPUs to monitor\n");
+	"--cpus=<cpu list> or -c <cpu list> -- list of CPUs to monitor\n"
+	"--interval=<ms> or -i <ms>         -- sample continuously with a\n"
+	"                                      fixed interval, print deltas\n"
+	"--format=<csv|binary> or -f <fmt>  -- output format for sampling,\n"
+	"                                      default csv\n"
+	"--count=<n> or -n <n>              -- number of intervals, default\n"
+	"                                      unlimited\n");
 }
 
 int main(int argc, char **argv)
 {
 	struct int_def *counts, *counts_new;
-	int i, n, n_new, n_cpus, options_left, opt_index, opt;
+	int i, n, n_new, n_cpus = 0, options_left, opt_index, opt;
 	unsigned int *cpus;
-	char *options_short = "hc:";
+	long interval_msec = 0;
+	unsigned long sample_count = 0;
+	enum stream_format format = STREAM_FORMAT_CSV;
+	char *endptr;
+	char *options_short = "hc:i:f:n:";
 	static struct option options_long[] = {
 		{ "help", no_argument, 0, 'h' },
 		{ "cpus", required_argument, 0, 'c' },
+		{ "interval", required_argument, 0, 'i' },
+		{ "format", required_argument, 0, 'f' },
+		{ "count", required_argument, 0, 'n' },
 		{ NULL, 0, 0, 0 }
 	};
 
@@ -560,6 +837,30 @@ int main(int argc, char **argv)
 				fprintf(stderr, "No CPUs defined\n");
 			}
 			break;
+		case 'i':
+			interval_msec = strtol(optarg, &endptr, 0);
+			if ((endptr == optarg) || (interval_msec <= 0)) {
+				fprintf(stderr, "Invalid interval\n");
+				return 1;
+			}
+			break;
+		case 'f':
+			if (!strcmp(optarg, "csv"))
+				format = STREAM_FORMAT_CSV;
+			else if (!strcmp(optarg, "binary"))
+				format = STREAM_FORMAT_BINARY;
+			else {
+				fprintf(stderr, "Invalid format\n");
+				return 1;
+			}
+			break;
+		case 'n':
+			sample_count = strtoul(optarg, &endptr, 0);
+			if (endptr == optarg) {
+				fprintf(stderr, "Invalid count\n");
+				return 1;
+			}
+			break;
 		case -1:
 			options_left = 0;
 			break;
@@ -587,6 +888,15 @@ int main(int argc, char **argv)
 	for (i = 0; i < n_cpus; i++)
 		cpus[i] = i;
 	}
+
+	if (interval_msec > 0) {
+		free_count_interrupts(counts);
+		i = stream_interrupts(n_cpus, cpus, interval_msec,
+				      sample_count, format);
+		free(cpus);
+		return (i == 0) ? 0 : 1;
+	}
+
 	printf("CPUs: ");
 	for (i = 0; i < n_cpus; i++)
 		printf("CPU%d%s", cpus[i], i < (n_cpus - 1)?", ":"\n");
@@ -0,0 +1,81 @@
+/*
+ * Task isolation manager daemon.
+ *
+ * Manages isolated threads of many applications. Applications find it
+ * through the manager socket in tmc_isol_init(), their threads then
+ * connect to it in tmc_isol_thr_init(), and use areas created by the
+ * daemon in named shared memory. Timers and threads are scanned once
+ * for all applications.
+ *
+ * Requests printed by threads of applications are written to the
+ * daemon's output.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <tmc/isol.h>
+#include "isol-internals.h"
+
+static void manager_stop(int sig)
+{
+	(void)sig;
+	memipc_isolation_stop_daemon();
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-a <area size>]\n"
+		"  -a  size of each memipc area, bytes\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa;
+	unsigned long long val;
+	size_t area_size = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:")) != -1) {
+		switch (opt) {
+		case 'a':
+			if ((sscanf(optarg, "%llu", &val) != 1) || (val == 0)) {
+				fprintf(stderr, "Invalid size: %s\n", optarg);
+				return 1;
+			}
+			area_size = val;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if ((area_size != 0) && memipc_isolation_set_area_size(area_size, 0)) {
+		fprintf(stderr, "Invalid area size\n");
+		return 1;
+	}
+
+	if (tmc_isol_init()) {
+		fprintf(stderr, "Isolation initialization failed\n");
+		return 1;
+	}
+
+	/* Poll is interrupted, so the manager loop sees the request */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = manager_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	if (memipc_isolation_run_daemon()) {
+		fprintf(stderr, "Manager is already running\n");
+		return 1;
+	}
+	return 0;
+}
@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/uio.h>
@@ -18,33 +19,62 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <poll.h>
+#include <sys/epoll.h>
 
 #include "isol-server.h"
 
+/* Initial number of client slots, the table grows when necessary */
+#define NCLIENTS_INIT		16
+
 /* Maximum number of clients */
-#define NCLIENTS		50
+#ifndef NCLIENTS_MAX
+#define NCLIENTS_MAX		4096
+#endif
+
+/* Maximum number of events handled in one pass */
+#define NEVENTS			64
 
 /* Buffer size */
 #define INIT_BUF_SIZE		4096
 
-/* Index of the socket fd */
+/* Allocation size of pooled output chunks, including the header */
+#define TX_CHUNK_ALLOC		256
+
+/* Maximum number of free chunks kept in the pool of each thread */
+#define TX_CHUNK_POOL_MAX	64
+
+/* Maximum number of chunks written in one system call */
+#define TX_IOV_MAX		64
+
+/* Event ID of the socket fd */
 #define SOCKFD_INDEX		0
 
-/* Total number of fixed fds */
-#define FIXED_FD_INDEXES	1
+/* Event ID of the doorbell fd */
+#define DOORBELL_INDEX		1
+
+/* Total number of fixed fds, clients' event IDs follow them */
+#define FIXED_FD_INDEXES	2
 
 #define CLIENT_FLAG_INVALID	1
 #define CLIENT_FLAG_CLOSE	2
+#define CLIENT_FLAG_SUBSCRIBED	4
 
-static struct pollfd fds[NCLIENTS + FIXED_FD_INDEXES];
-static int nfds = 0, pending_data_flag = 0;
+static int epoll_fd = -1, sock_fd = -1;
+static int doorbell_fd = -1;
+/* Clients with buffered output, and clients waiting to be closed */
+static int pending_data_count = 0, closing_count = 0;
+/* Clients receiving events */
+static int subscribers_count = 0;
+/* Nonzero if new connections are not accepted */
+static int accept_paused = 0;
 
 static int (*client_line_handler)(int client_index, const char *line) = NULL;
 static int (*client_connect_handler)(int client_index) = NULL;
 static int (*client_disconnect_handler)(int client_index) = NULL;
 
 struct client_desc {
+	int fd;
+	uint32_t events; /* events registered in epoll */
 	char *input_buffer;
 	size_t input_buffer_len;
 	size_t input_buffer_alloc;
@@ -53,10 +83,17 @@ struct client_desc {
 	off_t output_buffer_pos_rd;
 	size_t output_buffer_alloc;
 	int flags;
+	unsigned int events_lost; /* events that did not fit the buffer */
 	void *task;
 };
 
-static struct client_desc *isol_server_clients[NCLIENTS];
+/* Client slots, client index remains the same while it is connected */
+static struct client_desc **isol_server_clients = NULL;
+static int clients_alloc = 0, clients_count = 0;
+
+/* Free output chunks of this thread */
+static __thread struct tx_text_chunk *tx_chunk_pool = NULL;
+static __thread int tx_chunk_pool_count = 0;
 
 #ifndef HAVE_RENAMEAT2
 static inline int renameat2(int olddirfd, const char *oldpath,
@@ -98,7 +135,7 @@ void set_client_disconnect_handler(int (*handler)(int client_index))
 */
 int is_pending_data_present(void)
 {
-	return pending_data_flag;
+	return pending_data_count != 0;
 }
 
 static int get_client_flags(int client_index)
@@ -111,8 +148,15 @@ static int get_client_flags(int client_index)
 
 static void set_client_flags(int client_index, int value)
 {
-	if (isol_server_clients[client_index] != NULL)
-		isol_server_clients[client_index]->flags |= value;
+	struct client_desc *isol_server_client;
+
+	isol_server_client = isol_server_clients[client_index];
+	if (isol_server_client == NULL)
+		return;
+	if ((value & CLIENT_FLAG_CLOSE)
+	    && !(isol_server_client->flags & CLIENT_FLAG_CLOSE))
+		closing_count++;
+	isol_server_client->flags |= value;
 }
 
 #if 0
@@ -130,51 +174,146 @@ void close_client_connection(int client_index)
 	set_client_flags(client_index, CLIENT_FLAG_CLOSE);
 }
 
-static int create_client_desc(int client_index)
+/*
+  Wait, or stop waiting, until the client's socket is writable.
+*/
+static void set_client_pollout(int client_index, int enable)
+{
+	struct client_desc *isol_server_client;
+	struct epoll_event ev;
+	uint32_t events;
+
+	isol_server_client = isol_server_clients[client_index];
+	events = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+	if (isol_server_client->events == events)
+		return;
+	ev.events = events;
+	ev.data.u32 = client_index + FIXED_FD_INDEXES;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, isol_server_client->fd,
+		      &ev) != 0)
+		return;
+	isol_server_client->events = events;
+	if (enable)
+		pending_data_count++;
+	else
+		pending_data_count--;
+}
+
+/*
+  Stop or resume accepting new connections.
+*/
+static void set_accept_paused(int paused)
+{
+	struct epoll_event ev;
+
+	if (accept_paused == paused)
+		return;
+	ev.events = paused ? 0 : EPOLLIN;
+	ev.data.u32 = SOCKFD_INDEX;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock_fd, &ev) == 0)
+		accept_paused = paused;
+}
+
+/*
+  Allocate a client slot for a connected socket. Returns client index
+  or -1.
+*/
+static int create_client_desc(int fd)
 {
-	isol_server_clients[client_index] =
+	struct client_desc **new_clients, *isol_server_client;
+	struct epoll_event ev;
+	int client_index, new_alloc;
+
+	for (client_index = 0; (client_index < clients_alloc)
+		     && (isol_server_clients[client_index] != NULL);
+	     client_index++);
+
+	if (client_index == clients_alloc) {
+		/* All slots are used, grow the table */
+		new_alloc = clients_alloc ? (clients_alloc * 2) : NCLIENTS_INIT;
+		if (new_alloc > NCLIENTS_MAX)
+			new_alloc = NCLIENTS_MAX;
+		if (new_alloc <= clients_alloc)
+			return -1;
+		new_clients = (struct client_desc **)
+			realloc(isol_server_clients,
+				new_alloc * sizeof(struct client_desc *));
+		if (new_clients == NULL)
+			return -1;
+		memset(&new_clients[clients_alloc], 0,
+		       (new_alloc - clients_alloc)
+		       * sizeof(struct client_desc *));
+		isol_server_clients = new_clients;
+		clients_alloc = new_alloc;
+	}
+
+	isol_server_client =
 		(struct client_desc*) malloc(sizeof(struct client_desc));
-	if (isol_server_clients[client_index] == NULL)
+	if (isol_server_client == NULL)
 		return -1;
-	memset(isol_server_clients[client_index], 0,
-	       sizeof(struct client_desc));
-
-	isol_server_clients[client_index]->input_buffer
-		= (char *)malloc(INIT_BUF_SIZE);
-	if (isol_server_clients[client_index]->input_buffer == NULL) {
-		free(isol_server_clients[client_index]);
-		isol_server_clients[client_index] = NULL;
+	memset(isol_server_client, 0, sizeof(struct client_desc));
+
+	isol_server_client->input_buffer = (char *)malloc(INIT_BUF_SIZE);
+	if (isol_server_client->input_buffer == NULL) {
+		free(isol_server_client);
 		return -1;
 	}
 
-	isol_server_clients[client_index]->output_buffer
-		= (char *)malloc(INIT_BUF_SIZE);
-	if (isol_server_clients[client_index]->output_buffer == NULL) {
-		free(isol_server_clients[client_index]->input_buffer);
-		free(isol_server_clients[client_index]);
-		isol_server_clients[client_index] = NULL;
+	isol_server_client->output_buffer = (char *)malloc(INIT_BUF_SIZE);
+	if (isol_server_client->output_buffer == NULL) {
+		free(isol_server_client->input_buffer);
+		free(isol_server_client);
 		return -1;
 	}
 
-	isol_server_clients[client_index]->input_buffer_alloc = INIT_BUF_SIZE;
-	isol_server_clients[client_index]->output_buffer_alloc = INIT_BUF_SIZE;
-	return 0;
+	isol_server_client->input_buffer_alloc = INIT_BUF_SIZE;
+	isol_server_client->output_buffer_alloc = INIT_BUF_SIZE;
+	isol_server_client->fd = fd;
+	isol_server_client->events = EPOLLIN;
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = client_index + FIXED_FD_INDEXES;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		free(isol_server_client->output_buffer);
+		free(isol_server_client->input_buffer);
+		free(isol_server_client);
+		return -1;
+	}
+
+	isol_server_clients[client_index] = isol_server_client;
+	clients_count++;
+	return client_index;
 }
 
+/*
+  Delete client descriptor and close its socket.
+*/
 static void delete_client_desc(int client_index)
 {
-	int i;
+	struct client_desc *isol_server_client;
 
-	if (isol_server_clients[client_index] == NULL)
+	isol_server_client = isol_server_clients[client_index];
+	if (isol_server_client == NULL)
 		return;
-	if (isol_server_clients[client_index]->output_buffer != NULL)
-		free(isol_server_clients[client_index]->output_buffer);
-	if (isol_server_clients[client_index]->input_buffer != NULL)
-		free(isol_server_clients[client_index]->input_buffer);
-	free(isol_server_clients[client_index]);
-
-	for (i = client_index; i < (nfds - FIXED_FD_INDEXES - 1); i++)
-		isol_server_clients[i] = isol_server_clients[i + 1];
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, isol_server_client->fd, NULL);
+	close(isol_server_client->fd);
+	if (isol_server_client->events & EPOLLOUT)
+		pending_data_count--;
+	if (isol_server_client->flags & CLIENT_FLAG_CLOSE)
+		closing_count--;
+	if (isol_server_client->flags & CLIENT_FLAG_SUBSCRIBED)
+		subscribers_count--;
+	if (isol_server_client->output_buffer != NULL)
+		free(isol_server_client->output_buffer);
+	if (isol_server_client->input_buffer != NULL)
+		free(isol_server_client->input_buffer);
+	free(isol_server_client);
+	isol_server_clients[client_index] = NULL;
+	clients_count--;
+
+	/* There is a free slot now */
+	if (accept_paused)
+		set_accept_paused(0);
 }
 
 
@@ -194,8 +333,9 @@ int get_client_index(void *task)
 	if (task == NULL)
 		return -1;
 
-	for (i = 0; i < (nfds - FIXED_FD_INDEXES - 1); i++) {
-		if (isol_server_clients[i]->task == task)
+	for (i = 0; i < clients_alloc; i++) {
+		if ((isol_server_clients[i] != NULL)
+		    && (isol_server_clients[i]->task == task))
 			return i;
 	}
 	return -1;
@@ -506,15 +646,111 @@ static ssize_t send_client_pending_data(int client_index, int fd)
 }
 
 /*
-  Send data to the client. As much as possible will be sent
-  immediately, the rest is buffered. This function may produce short
-  write if there is no sufficient space in the buffer.
+  Place data into the output buffer of the client. Returns the size of
+  data that fits in the buffer.
 */
-ssize_t send_data_nonblock(int client_index, const char *data, size_t size)
+static size_t buffer_client_data(struct client_desc *isol_server_client,
+				 const char *data, size_t size)
+{
+	ssize_t avail_1, avail_2;
+	size_t buffered;
+
+	buffered = 0;
+	if (isol_server_client->output_buffer_pos_rd
+	    > isol_server_client->output_buffer_pos_wr) {
+		/*
+		  One contiguous free area in the ring buffer,
+		  mark it as available except for one reserved
+		  byte before the read offset.
+		*/
+		avail_1 = isol_server_client->output_buffer_pos_rd
+			- isol_server_client->output_buffer_pos_wr - 1;
+		avail_2 = 0;
+	} else {
+		/* Two free areas in the ring buffer. */
+		avail_1 = isol_server_client->output_buffer_alloc
+			- isol_server_client->output_buffer_pos_wr;
+		avail_2 = isol_server_client->output_buffer_pos_rd;
+		/*
+		  If read offset is at the start of the buffer,
+		  reserve the last byte in the first free area,
+		  otherwise reserve it before the read offset.
+		*/
+		if (avail_2 > 0)
+			avail_2--;
+		else
+			avail_1--;
+	}
+	if (size < (size_t)avail_1) {
+		/*
+		  Data does not completely fill the first
+		  available area.
+		*/
+		memcpy(&(isol_server_client->
+			 output_buffer[isol_server_client->
+				       output_buffer_pos_wr]),
+		       data, size);
+		/* Update write offset. */
+		isol_server_client->output_buffer_pos_wr += size;
+		buffered += size;
+	} else {
+		/*
+		  Data completely fills the first available area,
+		  and may spill into the second one.
+		*/
+		memcpy(&(isol_server_client->
+			 output_buffer[isol_server_client->
+				       output_buffer_pos_wr]),
+		       data, avail_1);
+		/*
+		  Update the source pointer and size to reflect
+		  buffered data.
+		*/
+		data += avail_1;
+		size -= avail_1;
+		/* Update write offset. */
+		isol_server_client->output_buffer_pos_wr += avail_1;
+		buffered += avail_1;
+
+		/*
+		  Wrap around write offset if it reached the end
+		  of the buffer.
+		*/
+		if (isol_server_client->output_buffer_pos_wr ==
+		    (ssize_t)isol_server_client->output_buffer_alloc)
+			isol_server_client->output_buffer_pos_wr = 0;
+
+		if ((size > 0) && (avail_2 > 0)) {
+			/*
+			  Some data is left, and there is a second
+			  available area. Copy remaining data, or
+			  whatever fits into it.
+			*/
+			if (size > (size_t)avail_2)
+				size = avail_2;
+			memcpy(&(isol_server_client->output_buffer[0]),
+			       data, size);
+			/* Update write offset. */
+			isol_server_client->output_buffer_pos_wr = size;
+			buffered += size;
+		}
+	}
+	return buffered;
+}
+
+/*
+  Send data from multiple buffers to the client. As much as possible
+  will be sent immediately in one system call, the rest is buffered.
+  This function may produce short write if there is no sufficient
+  space in the buffer.
+*/
+static ssize_t send_iov_nonblock(int client_index, const struct iovec *iov,
+				 int iovcnt)
 {
 	struct client_desc *isol_server_client;
-	ssize_t sent, rv, avail_1, avail_2;
-	int fd;
+	ssize_t sent, rv;
+	size_t skip, buffered;
+	int i;
 
 	/* Get the client descriptor. */
 	isol_server_client = isol_server_clients[client_index];
@@ -524,11 +760,11 @@ ssize_t send_data_nonblock(int client_index, const char *data, size_t size)
 		return 0;
 	}
 
-	fd = fds[client_index + FIXED_FD_INDEXES].fd;
-
 	/* Try to send pending data. */
 	if (size_client_pending_data(client_index) > 0) {
-		if ((rv = send_client_pending_data(client_index, fd)) < 0) {
+		if ((rv = send_client_pending_data(client_index,
+						   isol_server_client->fd))
+		    < 0) {
 			if ((errno != EINTR)
 			    && (errno != EAGAIN)
 			    && (errno != EWOULDBLOCK))
@@ -538,10 +774,10 @@ ssize_t send_data_nonblock(int client_index, const char *data, size_t size)
 
 	/* If there is no pending data left, try to send everything directly. */
 	if (size_client_pending_data(client_index) == 0) {
-		/* Nothing is pending, clear POLLOUT event. */
-		fds[client_index + FIXED_FD_INDEXES].events &= ~POLLOUT;
+		/* Nothing is pending, stop waiting for the socket. */
+		set_client_pollout(client_index, 0);
 
-		sent = write(fd, data, size);
+		sent = writev(isol_server_client->fd, iov, iovcnt);
 
 		/*
 		  Return on permanent errors.
@@ -557,127 +793,124 @@ ssize_t send_data_nonblock(int client_index, const char *data, size_t size)
 			else
 				sent = 0;
 		}
-		/* Update the source pointer and size to reflect sent data. */
-		size -= sent;
-		data += sent;
 	} else
 		sent = 0;
 
 	/* If something remained to be sent, place it into the buffer. */
-	if (size > 0) {
-		if (isol_server_client->output_buffer_pos_rd
-		    > isol_server_client->output_buffer_pos_wr) {
-			/*
-			  One contiguous free area in the ring buffer,
-			  mark it as available except for one reserved
-			  byte before the read offset.
-			*/
-			avail_1 = isol_server_client->output_buffer_pos_rd
-				- isol_server_client->output_buffer_pos_wr - 1;
-			avail_2 = 0;
-		} else {
-			/* Two free areas in the ring buffer. */
-			avail_1 = isol_server_client->output_buffer_alloc
-				- isol_server_client->output_buffer_pos_wr;
-			avail_2 = isol_server_client->output_buffer_pos_rd;
-			/*
-			  If read offset is at the start of the buffer,
-			  reserve the last byte in the first free area,
-			  otherwise reserve it before the read offset.
-			*/
-			if (avail_2 > 0)
-				avail_2--;
-			else
-				avail_1--;
+	buffered = 0;
+	for (i = 0, skip = sent; i < iovcnt; i++) {
+		if (skip >= iov[i].iov_len) {
+			/* Already sent */
+			skip -= iov[i].iov_len;
+			continue;
 		}
-		if (size < (size_t)avail_1) {
-			/*
-			  Data does not completely fill the first
-			  available area.
-			*/
-			memcpy(&(isol_server_client->
-				 output_buffer[isol_server_client->
-					       output_buffer_pos_wr]),
-			       data, size);
-			/* Update write offset, record data as "sent". */
-			isol_server_client->
-				output_buffer_pos_wr += size;
-			sent += size;
-			/*
-			  No need to update source pointer and size, this
-			  is the last write/buffering operation.
-			*/
-		} else {
-			/*
-			  Data completely fills the first available area,
-			  and may spill into the second one.
-			*/
-			memcpy(&(isol_server_client->
-				 output_buffer[isol_server_client->
-					       output_buffer_pos_wr]),
-			       data, avail_1);
-			/*
-			  Update the source pointer and size to reflect
-			  buffered data.
-			*/
-			data += avail_1;
-			size -= avail_1;
-			/* Update write offset, record data as "sent". */
-			isol_server_client->
-				output_buffer_pos_wr += avail_1;
-			sent += avail_1;
+		rv = buffer_client_data(isol_server_client,
+					(const char *)iov[i].iov_base + skip,
+					iov[i].iov_len - skip);
+		buffered += rv;
+		if ((size_t)rv < iov[i].iov_len - skip)
+			break;
+		skip = 0;
+	}
 
-			/*
-			  Wrap around write offset if it reached the end
-			  of the buffer.
-			*/
-			if (isol_server_client->output_buffer_pos_wr ==
-			    (ssize_t)isol_server_client->output_buffer_alloc)
-				isol_server_client->output_buffer_pos_wr = 0;
-
-			if ((size > 0) && (avail_2 > 0)) {
-				/*
-				  Some data is left, and there is a second
-				  available area.
-				*/
-				if (size < (size_t)avail_2) {
-					/* Copy remaining data. */
-					memcpy(&(isol_server_client->
-						 output_buffer[0]), data, size);
-					/*
-					  Update write offset, record
-					  data as "sent".
-					*/
-					isol_server_client->
-						output_buffer_pos_wr = size;
-					sent += size;
-				} else {
-					/*
-					  Copy whatever fits into the
-					  remaining available area.
-					*/
-					memcpy(&(isol_server_client->
-						 output_buffer[0]), data,
-					       avail_2);
-					/*
-					  Update write offset, record
-					  data as "sent".
-					*/
-					isol_server_client->
-						output_buffer_pos_wr = avail_2;
-					sent += avail_2;
-				}
-				/*
-				  No need to update source pointer and size,
-				  this is the last write/buffering operation.
-				*/
-			}
+	/* Data buffered, wait until it can be sent. */
+	if (buffered > 0)
+		set_client_pollout(client_index, 1);
+
+	return sent + buffered;
+}
+
+/*
+  Send data to the client. As much as possible will be sent
+  immediately, the rest is buffered. This function may produce short
+  write if there is no sufficient space in the buffer.
+*/
+ssize_t send_data_nonblock(int client_index, const char *data, size_t size)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = size;
+	return send_iov_nonblock(client_index, &iov, 1);
+}
+
+/*
+  Get an output chunk from the pool of this thread, or allocate a new
+  one.
+*/
+static struct tx_text_chunk *tx_chunk_get(void)
+{
+	struct tx_text_chunk *chunk;
+
+	chunk = tx_chunk_pool;
+	if (chunk != NULL) {
+		tx_chunk_pool = chunk->next;
+		tx_chunk_pool_count--;
+	} else {
+		chunk = (struct tx_text_chunk *)malloc(TX_CHUNK_ALLOC);
+		if (chunk == NULL)
+			return NULL;
+		chunk->buffer = ((unsigned char*)chunk)
+			+ sizeof(struct tx_text_chunk);
+		chunk->alloc = TX_CHUNK_ALLOC - sizeof(struct tx_text_chunk);
+	}
+	chunk->size = 0;
+	chunk->next = NULL;
+	return chunk;
+}
+
+/*
+  Return all chunks of the text to the pool of this thread.
+*/
+static void tx_release(struct tx_text *tx)
+{
+	struct tx_text_chunk *chunk, *next;
+
+	for (chunk = tx->first; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		if (tx_chunk_pool_count < TX_CHUNK_POOL_MAX) {
+			chunk->next = tx_chunk_pool;
+			tx_chunk_pool = chunk;
+			tx_chunk_pool_count++;
+		} else
+			free(chunk);
+	}
+	tx->first = NULL;
+	tx->last = NULL;
+}
+
+/*
+  Fill iovec with chunks, starting from a given offset in the first
+  chunk. Returns the number of iovec elements.
+*/
+static int tx_fill_iov(struct tx_text_chunk *chunk, size_t offset,
+		       struct iovec *iov)
+{
+	int n;
+
+	for (n = 0; (chunk != NULL) && (n < TX_IOV_MAX);
+	     chunk = chunk->next, offset = 0) {
+		if (chunk->size > offset) {
+			iov[n].iov_base = chunk->buffer + offset;
+			iov[n].iov_len = chunk->size - offset;
+			n++;
 		}
-		/* Data buffered, set POLLOUT event to be processed. */
-		fds[client_index + FIXED_FD_INDEXES].events |= POLLOUT;
 	}
+	return n;
+}
 
-	return sent;
+/*
+  Skip sent data in the chain of chunks.
+*/
+static void tx_advance(struct tx_text_chunk **chunk, size_t *offset,
+		       size_t size)
+{
+	while ((*chunk != NULL) && ((*offset + size) >= (*chunk)->size)) {
+		size -= (*chunk)->size - *offset;
+		*chunk = (*chunk)->next;
+		*offset = 0;
+	}
+	*offset += size;
 }
 
 void tx_init(struct tx_text *tx)
@@ -688,26 +921,30 @@ void tx_init(struct tx_text *tx)
 
 int tx_add_text(struct tx_text *tx, char *text)
 {
-	size_t l;
+	size_t l, n;
 	struct tx_text_chunk *chunk;
 
 	l = strlen(text);
-	chunk = (struct tx_text_chunk *)malloc(sizeof(struct tx_text_chunk)
-					       + l + 1);
-	if (chunk == NULL)
-		return -1;
-
-	chunk->buffer = ((unsigned char*)chunk) + sizeof(struct tx_text_chunk);
-	memcpy(chunk->buffer, text, l);
-	chunk->buffer[l] = '\0';
-	chunk->size = l;
-	chunk->next = NULL;
-	if (tx->last == NULL) {
-		tx->first = chunk;
-		tx->last = chunk;
-	} else {
-		tx->last->next = chunk;
-		tx->last = chunk;
+	while (l > 0) {
+		/* Append to the last chunk while there is space in it */
+		chunk = tx->last;
+		if ((chunk == NULL) || (chunk->size == chunk->alloc)) {
+			chunk = tx_chunk_get();
+			if (chunk == NULL)
+				return -1;
+			if (tx->last == NULL)
+				tx->first = chunk;
+			else
+				tx->last->next = chunk;
+			tx->last = chunk;
+		}
+		n = chunk->alloc - chunk->size;
+		if (n > l)
+			n = l;
+		memcpy(chunk->buffer + chunk->size, text, n);
+		chunk->size += n;
+		text += n;
+		l -= n;
 	}
 	return 0;
 }
@@ -721,98 +958,71 @@ int tx_add_text_num(struct tx_text *tx, long v)
 
 int send_tx_persist(int client_index, struct tx_text *tx)
 {
-	struct tx_text_chunk *chunk, *last_chunk;
-	unsigned char *data;
+	struct tx_text_chunk *chunk;
+	struct iovec iov[TX_IOV_MAX];
+	size_t offset;
 	ssize_t sent;
-	int rv;
+	int rv, n;
 
 	rv = 0;
-	for (chunk = tx->first; chunk != NULL;
-	     chunk = chunk ? chunk->next : NULL) {
-		data = chunk->buffer;
-		while ((chunk != NULL)
-		       && (data < (chunk->buffer + chunk->size))) {
-			sent = send_data_nonblock(client_index, (char *)data,
-						  (chunk->buffer + chunk->size)
-						  - data);
-			/*
-			  Return on permanent errors.
-			  Transient errors at this point do not affect the
-			  outcome, so just report that nothing was sent and
-			  continue.
-			*/
-			if (sent < 0) {
-				if ((errno != EINTR)
-				    && (errno != EAGAIN)
-				    && (errno != EWOULDBLOCK)) {
-					chunk = NULL;
-					rv = 1;
-				}
-				sent = 0;
+	chunk = tx->first;
+	offset = 0;
+	while ((n = tx_fill_iov(chunk, offset, iov)) > 0) {
+		sent = send_iov_nonblock(client_index, iov, n);
+		/*
+		  Return on permanent errors.
+		  Transient errors at this point do not affect the
+		  outcome, so just report that nothing was sent and
+		  continue.
+		*/
+		if (sent < 0) {
+			if ((errno != EINTR)
+			    && (errno != EAGAIN)
+			    && (errno != EWOULDBLOCK)) {
+				rv = 1;
+				break;
 			}
-			data += sent;
+			sent = 0;
 		}
+		tx_advance(&chunk, &offset, sent);
 	}
 
-	for (last_chunk = NULL, chunk = tx->first;
-	     chunk != NULL; chunk = chunk->next) {
-		if (last_chunk != NULL)
-			free(last_chunk);
-		last_chunk = chunk;
-	}
-	if (last_chunk != NULL)
-		free(last_chunk);
-
-	tx->first = NULL;
-	tx->last = NULL;
+	tx_release(tx);
 	return rv;
 }
 
 int send_tx_fd_persist(int fd, struct tx_text *tx)
 {
-	struct tx_text_chunk *chunk, *last_chunk;
-	unsigned char *data;
+	struct tx_text_chunk *chunk;
+	struct iovec iov[TX_IOV_MAX];
+	size_t offset;
 	ssize_t sent;
-	int rv;
+	int rv, n;
 
 	rv = 0;
-	for (chunk = tx->first; chunk != NULL;
-	     chunk = chunk ? chunk->next : NULL) {
-		data = chunk->buffer;
-		while ((chunk != NULL)
-		       && (data < (chunk->buffer + chunk->size))) {
-			sent = write(fd, (char *)data,
-				     (chunk->buffer + chunk->size) - data);
-			/*
-			  Return on permanent errors.
-			  Transient errors at this point do not affect the
-			  outcome, so just report that nothing was sent and
-			  continue.
-			*/
-			if (sent < 0) {
-				if ((errno != EINTR)
-				    && (errno != EAGAIN)
-				    && (errno != EWOULDBLOCK)) {
-					chunk = NULL;
-					rv = 1;
-				}
-				sent = 0;
+	chunk = tx->first;
+	offset = 0;
+	while ((n = tx_fill_iov(chunk, offset, iov)) > 0) {
+		sent = writev(fd, iov, n);
+		/*
+		  Return on permanent errors.
+		  Transient errors at this point do not affect the
+		  outcome, so just report that nothing was sent and
+		  continue.
+		*/
+		if (sent < 0) {
+			if ((errno != EINTR)
+			    && (errno != EAGAIN)
+			    && (errno != EWOULDBLOCK)) {
+				rv = 1;
+				break;
 			}
-			data += sent;
+			sent = 0;
 		}
+		tx_advance(&chunk, &offset, sent);
 	}
 
-	for (last_chunk = NULL, chunk = tx->first;
-	     chunk != NULL; chunk = chunk->next) {
-		if (last_chunk != NULL)
-			free(last_chunk);
-		last_chunk = chunk;
-	}
-	if (last_chunk != NULL)
-		free(last_chunk);
-
-	tx->first = NULL;
-	tx->last = NULL;
+	tx_release(tx);
 	return rv;
 }
 
@@ -853,6 +1063,73 @@ ssize_t send_data_persist(int client_index, const char *data, size_t size)
 	return sent_total;
 }
 
+/*
+  Send events to this client.
+*/
+void set_client_subscribed(int client_index)
+{
+	struct client_desc *isol_server_client;
+
+	isol_server_client = isol_server_clients[client_index];
+	if ((isol_server_client == NULL)
+	    || (isol_server_client->flags & CLIENT_FLAG_SUBSCRIBED))
+		return;
+	isol_server_client->flags |= CLIENT_FLAG_SUBSCRIBED;
+	subscribers_count++;
+}
+
+/*
+  Return nonzero if there are clients receiving events.
+*/
+int is_subscriber_present(void)
+{
+	return subscribers_count != 0;
+}
+
+/*
+  Send an event line to all subscribed clients. Lines are never split,
+  if a line does not fit in the output buffer of a slow client, it is
+  dropped, and the client is told how many lines were lost before the
+  next line that fits.
+*/
+void send_event_subscribers(const char *data, size_t size)
+{
+	struct client_desc *isol_server_client;
+	char lost[64];
+	size_t lost_size, avail;
+	int i;
+
+	if (subscribers_count == 0)
+		return;
+	for (i = 0; i < clients_alloc; i++) {
+		isol_server_client = isol_server_clients[i];
+		if ((isol_server_client == NULL)
+		    || ((isol_server_client->flags
+			 & (CLIENT_FLAG_SUBSCRIBED | CLIENT_FLAG_CLOSE))
+			!= CLIENT_FLAG_SUBSCRIBED))
+			continue;
+		/* One byte of the ring buffer is always reserved */
+		avail = isol_server_client->output_buffer_alloc - 1
+			- size_client_pending_data(i);
+		lost_size = 0;
+		if (isol_server_client->events_lost != 0)
+			lost_size = snprintf(lost, sizeof(lost),
+					     "250 %u events lost\n",
+					     isol_server_client->events_lost);
+		if (lost_size + size > avail) {
+			isol_server_client->events_lost++;
+			continue;
+		}
+		if (lost_size != 0) {
+			if (send_data_nonblock(i, lost, lost_size)
+			    != (ssize_t)lost_size)
+				continue;
+			isol_server_client->events_lost = 0;
+		}
+		send_data_nonblock(i, data, size);
+	}
+}
+
 /*
   Create AF_UNIX socket.
 */
@@ -860,9 +1137,10 @@ int isol_server_socket_create(const char *name)
 {
 	char *tmpname;
 	struct sockaddr_un server_socket_addr;
-	int sockfd, flags, l;
+	struct epoll_event ev;
+	int sockfd, l;
 
-	if (nfds != 0) {
+	if (epoll_fd >= 0) {
 		fprintf(stderr, "File descriptors already initialized\n");
 		return 0;
 	}
@@ -875,7 +1153,7 @@ int isol_server_socket_create(const char *name)
 	strcpy(tmpname, name);
 	snprintf(tmpname + l, 22, ".%llu", (unsigned long long)getpid());
 
-	sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if (sockfd < 0) {
 		free(tmpname);
 		return -1;
@@ -904,17 +1182,28 @@ int isol_server_socket_create(const char *name)
 	}
 	free(tmpname);
 
-	flags = fcntl(sockfd, F_GETFL, 0);
-	fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
-
-	memset(&fds, 0, sizeof(fds));
-	/*
-	  This should initialize all fixed file descriptors, in this case
-	  we have only one.
-	*/
-	fds[SOCKFD_INDEX].fd = sockfd;
-	fds[SOCKFD_INDEX].events = POLLIN;
-	nfds = FIXED_FD_INDEXES;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		close(sockfd);
+		unlink(name);
+		return -1;
+	}
+	/* Register all fixed file descriptors */
+	ev.events = EPOLLIN;
+	ev.data.u32 = SOCKFD_INDEX;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev) != 0) {
+		close(epoll_fd);
+		epoll_fd = -1;
+		close(sockfd);
+		unlink(name);
+		return -1;
+	}
+	sock_fd = sockfd;
+	if (doorbell_fd >= 0) {
+		ev.events = EPOLLIN;
+		ev.data.u32 = DOORBELL_INDEX;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, doorbell_fd, &ev);
+	}
 
 	return 0;
 }
@@ -944,88 +1233,102 @@ int isol_client_connect_to_server(const char *name)
 }
 
 
+/*
+  Set eventfd that wakes up the application loop, or -1.
+*/
+void isol_server_set_doorbell(int fd)
+{
+	struct epoll_event ev;
+
+	if (epoll_fd >= 0) {
+		if (doorbell_fd >= 0)
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, doorbell_fd, NULL);
+		if (fd >= 0) {
+			ev.events = EPOLLIN;
+			ev.data.u32 = DOORBELL_INDEX;
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		}
+	}
+	doorbell_fd = fd;
+}
+
+/*
+  Accept new connections.
+*/
+static void accept_clients(void)
+{
+	int newsock, client_index;
+
+	for (;;) {
+		/*
+		  Don't accept new connections if maximum number of
+		  clients is reached.
+		*/
+		if (clients_count >= NCLIENTS_MAX) {
+			set_accept_paused(1);
+			return;
+		}
+		newsock = accept4(sock_fd, NULL, NULL,
+				  SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newsock < 0)
+			return;
+		client_index = create_client_desc(newsock);
+		if (client_index < 0) {
+			/*
+			  Application can't add new client, disconnect
+			  immediately.
+			*/
+			close(newsock);
+		} else {
+			if (client_connect_handler != NULL)
+				client_connect_handler(client_index);
+		}
+	}
+}
+
 /*
   One pass of the application loop.
 */
 int isol_server_poll_pass(int timeout)
 {
-	int rv, i, fd_ind, flags, newsock, fd_closing;
-	static struct sockaddr_un client_socket_addr;
-	socklen_t addrlen;
+	struct epoll_event events[NEVENTS];
+	int rv, i, e, fd_closing;
 	ssize_t l;
 
-	if (nfds <= 0) {
+	if (epoll_fd < 0) {
 		fprintf(stderr, "Server is running but server socket "
 			"does not exist yet\n");
 		errno = EINVAL;
 		return -1;
 	}
-	if ((rv = poll(fds, nfds, timeout)) <= 0)
+	rv = epoll_wait(epoll_fd, events, NEVENTS, timeout);
+	if (rv < 0)
 		return rv;
 
-	pending_data_flag = 0;
-
-	/* Fixed fd positions. */
-	if (fds[SOCKFD_INDEX].revents & POLLIN) {
-		/* New connection. */
-		newsock = accept(fds[SOCKFD_INDEX].fd,
-				 (struct sockaddr *) &client_socket_addr,
-				 &addrlen);
-		if (newsock >=0) {
-			flags = fcntl(newsock, F_GETFL, 0);
-			fcntl(newsock, F_SETFL, flags | O_NONBLOCK);
-			
-			if ((nfds - FIXED_FD_INDEXES) < NCLIENTS) {
-				/* Add new client. */
-				fds[nfds].fd = newsock;
-				fds[nfds].events = POLLIN;
-				fds[nfds].revents = 0;
-				nfds++;
-				if (create_client_desc(nfds - 1
-						       - FIXED_FD_INDEXES)
-				    < 0) {
-					/*
-					  Application can't add new
-					  client, disconnect immediately.
-					*/
-					close(newsock);
-					nfds --;
-
-				} else {
-					if (client_connect_handler != NULL)
-						client_connect_handler(
-							nfds - 1
-							- FIXED_FD_INDEXES);
-				}
-			} else {
-				/*
-				  Can't add new client, disconnect
-				  immediately.
-				*/
-				close(newsock);
-			}
+	for (e = 0; e < rv; e++) {
+		/* Fixed fds. */
+		if (events[e].data.u32 == DOORBELL_INDEX) {
+			/* Reset the doorbell, the caller will check its
+			   requests. */
+			uint64_t count;
+			read(doorbell_fd, &count, sizeof(count));
+			continue;
+		}
+		if (events[e].data.u32 == SOCKFD_INDEX) {
+			/* New connection. */
+			accept_clients();
+			continue;
 		}
-		
-		/*
-		  Don't accept new connections if maximum number of
-		  clients is reached.
-		*/
-		if ((nfds - FIXED_FD_INDEXES) < NCLIENTS)
-			fds[SOCKFD_INDEX].events = POLLIN;
-		else
-			fds[SOCKFD_INDEX].events = 0;
-	}
 
-	/* All clients */
-	for (i = 0; i < (nfds - FIXED_FD_INDEXES); i++) {
+		/* Clients */
+		i = events[e].data.u32 - FIXED_FD_INDEXES;
+		if ((i >= clients_alloc) || (isol_server_clients[i] == NULL))
+			continue;
 		fd_closing = 0;
 
-		fd_ind = i + FIXED_FD_INDEXES;
-
-
-		if (fds[fd_ind].revents & POLLIN) {
+		if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
 			/* Data arrived */
-			l = read_client_data(i, fds[fd_ind].fd);
+			l = read_client_data(i, isol_server_clients[i]->fd);
 			if (l == 0) {
 				/* Client disconnected, closing socket. */
 				clear_client_pending_data(i);
@@ -1035,44 +1338,34 @@ int isol_server_poll_pass(int timeout)
 			}
 		}
 
-		if (fd_closing == 0) {
-			if (fds[fd_ind].revents & POLLOUT) {
-				/* Pending data, send it, process errors. */
-				if (size_client_pending_data(i) > 0) {
-					if ((send_client_pending_data(i,
-							 fds[fd_ind].fd) < 0)
-					    &&(errno != EINTR)
-					    && (errno != EAGAIN)
-					    && (errno != EWOULDBLOCK)) {
-						/* Error, closing socket. */
-						clear_client_pending_data(i);
-						set_client_flags(i,
+		if ((fd_closing == 0) && (events[e].events & EPOLLOUT)) {
+			/* Pending data, send it, process errors. */
+			if (size_client_pending_data(i) > 0) {
+				if ((send_client_pending_data(i,
+					isol_server_clients[i]->fd) < 0)
+				    && (errno != EINTR)
+				    && (errno != EAGAIN)
+				    && (errno != EWOULDBLOCK)) {
+					/* Error, closing socket. */
+					clear_client_pending_data(i);
+					set_client_flags(i,
 							 CLIENT_FLAG_CLOSE);
-					}
 				}
-				if (size_client_pending_data(i) == 0)
-					fds[fd_ind].events &= ~POLLOUT;
-				else
-					pending_data_flag = 1;
-			} else {
-				if (fds[fd_ind].events & POLLOUT)
-					pending_data_flag = 1;
 			}
+			if (size_client_pending_data(i) == 0)
+				set_client_pollout(i, 0);
 		}
+	}
 
-		if ((get_client_flags(i) & CLIENT_FLAG_CLOSE)
+	/* Clients that should be closed */
+	for (i = 0; (closing_count > 0) && (i < clients_alloc); i++) {
+		if ((isol_server_clients[i] != NULL)
+		    && (get_client_flags(i) & CLIENT_FLAG_CLOSE)
 		    && (size_client_pending_data(i) == 0)) {
 			/* This socket should be closed. */
 			if (client_disconnect_handler != NULL)
 				client_disconnect_handler(i);
 			delete_client_desc(i);
-			close(fds[fd_ind].fd);
-			if ((nfds - fd_ind) > 1)
-				memmove(&fds[fd_ind], &fds[fd_ind + 1],
-					(nfds - fd_ind - 1)
-					* sizeof(struct pollfd));
-			i--;
-			nfds--;
 		}
 	}
 	return 0;
@@ -13,6 +13,7 @@
 struct tx_text_chunk {
     unsigned char *buffer;
     size_t size;
+    size_t alloc; /* space in the buffer */
     struct tx_text_chunk *next;
 
 };
@@ -92,6 +93,22 @@ int tx_add_text_num(struct tx_text *tx, long v);
 int send_tx_persist(int client_index, struct tx_text *tx);
 int send_tx_fd_persist(int fd, struct tx_text *tx);
 
+/*
+  Send events to this client, until it disconnects.
+*/
+void set_client_subscribed(int client_index);
+
+/*
+  Return nonzero if there are clients receiving events.
+*/
+int is_subscriber_present(void);
+
+/*
+  Send an event line to all subscribed clients, without blocking. A
+  line that does not fit in a client's buffer is dropped, and counted.
+*/
+void send_event_subscribers(const char *data, size_t size);
+
 void *get_client_task(int client_index);
 void set_client_task(int client_index, void *task);
 int get_client_index(void *task);
@@ -111,6 +128,11 @@ int isol_server_socket_create(const char *name);
 */
 
 int isol_client_connect_to_server(const char *name);
+/*
+  Set eventfd that wakes up the application loop, or -1.
+*/
+void isol_server_set_doorbell(int fd);
+
 /*
   One pass of the application loop.
 */
@@ -1,5 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sched.h>
 #include <pthread.h>
 #include <unistd.h>
 
@@ -106,14 +111,373 @@ static void *default_thread_handler_2(void *arg_data)
 }
 #endif
 
+/*
+ * Jitter benchmark.
+ *
+ * Each thread timestamps every pass of its loop for a given time, and
+ * records gaps between passes that are longer than a threshold. The
+ * threads run pinned to the CPUs without isolation first, then
+ * isolated, and both results are reported for each CPU. Optional
+ * workload processes a packet of a given size on every pass.
+ */
+#define JITTER_DEFAULT_DURATION (10)
+#define JITTER_DEFAULT_THRESHOLD (1000)
+/* Gaps kept for each thread, later gaps are only counted */
+#define JITTER_MAX_GAPS (4096)
+
+struct jitter_gap {
+	uint64_t time; /* cycles since the start of the loop */
+	uint64_t length; /* cycles */
+};
+
+struct jitter_result {
+	int cpu;
+	int isolated;
+	uint64_t passes;
+	uint64_t min_gap, max_gap; /* cycles */
+	uint64_t gaps_count; /* gaps above the threshold */
+	uint64_t gaps_total; /* cycles in gaps above the threshold */
+	uint64_t run_cycles;
+	struct jitter_gap *gaps;
+	uint64_t *packet; /* workload, jitter_workload bytes */
+	uint64_t checksum; /* keeps the workload from being optimized out */
+};
+
+static unsigned long jitter_duration = JITTER_DEFAULT_DURATION;
+static unsigned long jitter_threshold = JITTER_DEFAULT_THRESHOLD;
+static size_t jitter_workload = 0;
+static int jitter_verbose = 0;
+static double jitter_cycles_per_nsec = 1.0;
+
+/*
+ * Process a synthetic packet: check the header, calculate checksum of
+ * the payload, and rewrite the header.
+ */
+static inline void jitter_packet(struct jitter_result *r)
+{
+	uint64_t *p = r->packet, sum = 0;
+	size_t i, words = jitter_workload / sizeof(uint64_t);
+
+	if ((words < 2) || (p[0] == 0))
+		return;
+	for (i = 1; i < words; i++)
+		sum += p[i];
+	p[0] = (sum << 1) | 1;
+	r->checksum += sum;
+}
+
+/*
+ * Record the gap since the previous pass.
+ */
+static inline void jitter_sample(struct jitter_result *r, uint64_t start,
+				 uint64_t *last, uint64_t threshold)
+{
+	uint64_t now, gap;
+
+	now = tmc_isol_cycles();
+	gap = now - *last;
+	*last = now;
+	r->passes++;
+	if (gap < r->min_gap)
+		r->min_gap = gap;
+	if (gap > r->max_gap)
+		r->max_gap = gap;
+	if (__builtin_expect(gap > threshold, 0)) {
+		if (r->gaps_count < JITTER_MAX_GAPS) {
+			r->gaps[r->gaps_count].time = now - start;
+			r->gaps[r->gaps_count].length = gap;
+		}
+		r->gaps_count++;
+		r->gaps_total += gap;
+	}
+}
+
+static void jitter_start(struct jitter_result *r, uint64_t *start,
+			 uint64_t *end, uint64_t *threshold)
+{
+	*threshold = jitter_threshold * jitter_cycles_per_nsec;
+	*start = tmc_isol_cycles();
+	*end = *start + (uint64_t)(jitter_duration * 1e9
+				   * jitter_cycles_per_nsec);
+	r->min_gap = UINT64_MAX;
+}
+
+static void *jitter_pinned_thread(void *arg)
+{
+	struct jitter_result *r = (struct jitter_result *)arg;
+	uint64_t start, end, last, threshold;
+
+	jitter_start(r, &start, &end, &threshold);
+	for (last = start; last < end; ) {
+		jitter_sample(r, start, &last, threshold);
+		jitter_packet(r);
+	}
+	r->run_cycles = last - start;
+	return NULL;
+}
+
+static void *jitter_isolated_thread(void *arg)
+{
+	struct jitter_result *r = (struct jitter_result *)arg;
+	uint64_t start, end, last, threshold;
+	int c1 = 0;
+	volatile int c2 = 0;
+
+	if (tmc_isol_thr_init())
+		return NULL;
+	if (tmc_isol_thr_enter_v(&c2))
+		return NULL;
+
+	jitter_start(r, &start, &end, &threshold);
+	for (last = start; (last < end) && TMC_ISOL_THR_PASS(c1, c2); ) {
+		jitter_sample(r, start, &last, threshold);
+		jitter_packet(r);
+	}
+	r->run_cycles = last - start;
+	tmc_isol_thr_exit();
+	return NULL;
+}
+
+/*
+ * Measure the rate of the cycle counter.
+ */
+static void jitter_calibrate(void)
+{
+	struct timespec ts0, ts1, delay;
+	uint64_t c0, c1;
+	int64_t nsec;
+
+	delay.tv_sec = 0;
+	delay.tv_nsec = 100000000;
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	c0 = tmc_isol_cycles();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	c1 = tmc_isol_cycles();
+	nsec = (ts1.tv_sec - ts0.tv_sec) * 1000000000LL
+		+ (ts1.tv_nsec - ts0.tv_nsec);
+	if ((nsec > 0) && (c1 > c0))
+		jitter_cycles_per_nsec = (double)(c1 - c0) / nsec;
+}
+
+/*
+ * Find CPUs of isolated threads. They are claimed to find the next
+ * one, then released.
+ */
+static int jitter_find_cpus(int *cpus, int count)
+{
+	struct memipc_thread_params **claimed;
+	int i, n;
+
+	claimed = calloc(count, sizeof(struct memipc_thread_params *));
+	if (claimed == NULL)
+		return 0;
+	for (n = 0; n < count; n++) {
+		cpus[n] = isolation_select_cpu(-1, 0);
+		if (cpus[n] < 0)
+			break;
+		claimed[n] = isolation_claim_cpu(cpus[n]);
+		if (claimed[n] == NULL)
+			break;
+	}
+	for (i = 0; i < n; i++)
+		isolation_release_cpu(claimed[i]);
+	free(claimed);
+	return n;
+}
+
+/*
+ * Allocate and touch result buffers, so isolated threads don't fault.
+ */
+static int jitter_result_init(struct jitter_result *r, int cpu,
+			      int isolated)
+{
+	size_t i, words;
+
+	memset(r, 0, sizeof(struct jitter_result));
+	r->cpu = cpu;
+	r->isolated = isolated;
+	r->gaps = calloc(JITTER_MAX_GAPS, sizeof(struct jitter_gap));
+	if (r->gaps == NULL)
+		return -1;
+	if (jitter_workload >= 2 * sizeof(uint64_t)) {
+		r->packet = malloc(jitter_workload);
+		if (r->packet == NULL)
+			return -1;
+		words = jitter_workload / sizeof(uint64_t);
+		r->packet[0] = 1;
+		for (i = 1; i < words; i++)
+			r->packet[i] = i * 0x9e3779b97f4a7c15ULL;
+	}
+	return 0;
+}
+
+static int jitter_compare_gap(const void *a, const void *b)
+{
+	uint64_t la = ((const struct jitter_gap *)a)->length,
+		lb = ((const struct jitter_gap *)b)->length;
+
+	return (la > lb) - (la < lb);
+}
+
+static void jitter_report_line(const struct jitter_result *r)
+{
+	double c = jitter_cycles_per_nsec, run_nsec;
+	uint64_t stored, median = 0;
+	struct jitter_gap *sorted;
+
+	run_nsec = r->run_cycles / c;
+	if (r->passes == 0) {
+		printf("%4d %-9s did not run\n", r->cpu,
+		       r->isolated ? "isolated" : "pinned");
+		return;
+	}
+	stored = (r->gaps_count < JITTER_MAX_GAPS) ?
+		r->gaps_count : JITTER_MAX_GAPS;
+	/* Median of kept gaps */
+	if (stored != 0) {
+		sorted = malloc(stored * sizeof(struct jitter_gap));
+		if (sorted != NULL) {
+			memcpy(sorted, r->gaps,
+			       stored * sizeof(struct jitter_gap));
+			qsort(sorted, stored, sizeof(struct jitter_gap),
+			      jitter_compare_gap);
+			median = sorted[stored / 2].length;
+			free(sorted);
+		}
+	}
+	printf("%4d %-9s %12" PRIu64 " %8.0f %10.0f %8" PRIu64
+	       " %9.1f %10.0f %10.0f %12.1f %8.4f\n",
+	       r->cpu, r->isolated ? "isolated" : "pinned", r->passes,
+	       r->min_gap / c, r->max_gap / c, r->gaps_count,
+	       (run_nsec > 0) ? r->gaps_count * 1e9 / run_nsec : 0.0,
+	       r->gaps_count ? r->gaps_total / c / r->gaps_count : 0.0,
+	       median / c, r->gaps_total / c / 1000.0,
+	       (run_nsec > 0) ? r->gaps_total / c * 100.0 / run_nsec : 0.0);
+}
+
+static void jitter_report_gaps(const struct jitter_result *r)
+{
+	uint64_t i;
+	double c = jitter_cycles_per_nsec;
+
+	for (i = 0; (i < r->gaps_count) && (i < JITTER_MAX_GAPS); i++)
+		printf("  CPU %d %s gap at %.3f ms: %.0f ns\n", r->cpu,
+		       r->isolated ? "isolated" : "pinned",
+		       r->gaps[i].time / c / 1e6, r->gaps[i].length / c);
+	if (r->gaps_count > JITTER_MAX_GAPS)
+		printf("  CPU %d %s: %" PRIu64 " more gaps\n", r->cpu,
+		       r->isolated ? "isolated" : "pinned",
+		       r->gaps_count - JITTER_MAX_GAPS);
+}
+
+/*
+ * Run the benchmark on all CPUs available for isolation, pinned
+ * threads first, then isolated threads.
+ */
+static int jitter_benchmark(int threads_count)
+{
+	struct jitter_result *results;
+	pthread_t *thread_ids;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	int *cpus, count = 0, i, mode, rv = 1;
+
+	cpus = calloc(threads_count, sizeof(int));
+	results = calloc(2 * threads_count, sizeof(struct jitter_result));
+	thread_ids = calloc(threads_count, sizeof(pthread_t));
+	if ((cpus == NULL) || (results == NULL) || (thread_ids == NULL)) {
+		fprintf(stderr, "Insufficient memory\n");
+		goto done;
+	}
+	count = jitter_find_cpus(cpus, threads_count);
+	if (count == 0) {
+		fprintf(stderr, "No CPUs available for isolation\n");
+		goto done;
+	}
+	for (i = 0; i < 2 * count; i++)
+		if (jitter_result_init(&results[i], cpus[i / 2], i & 1)) {
+			fprintf(stderr, "Insufficient memory\n");
+			goto done;
+		}
+	jitter_calibrate();
+	printf("Jitter benchmark: %d CPUs, %lu s, threshold %lu ns, "
+	       "workload %lu bytes, %.3f cycles/ns\n", count,
+	       jitter_duration, jitter_threshold,
+	       (unsigned long)jitter_workload, jitter_cycles_per_nsec);
+
+	for (mode = 0; mode < 2; mode++) {
+		for (i = 0; i < count; i++) {
+			pthread_attr_init(&attr);
+			CPU_ZERO(&cpuset);
+			CPU_SET(cpus[i], &cpuset);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+						    &cpuset);
+			if (pthread_create(&thread_ids[i], &attr,
+					   mode ? jitter_isolated_thread
+					   : jitter_pinned_thread,
+					   &results[i * 2 + mode])) {
+				fprintf(stderr,
+					"Thread on CPU %d failed to start\n",
+					cpus[i]);
+				thread_ids[i] = 0;
+			}
+			pthread_attr_destroy(&attr);
+		}
+		if (mode)
+			/* Manager runs until isolated threads exit */
+			tmc_isol_start();
+		for (i = 0; i < count; i++)
+			if (thread_ids[i] != 0)
+				pthread_join(thread_ids[i], NULL);
+	}
+
+	printf("%4s %-9s %12s %8s %10s %8s %9s %10s %10s %12s %8s\n",
+	       "CPU", "mode", "passes", "min_ns", "max_ns", "gaps", "gaps/s",
+	       "mean_ns", "median_ns", "lost_us", "lost_%");
+	for (i = 0; i < 2 * count; i++)
+		jitter_report_line(&results[i]);
+	if (jitter_verbose)
+		for (i = 0; i < 2 * count; i++)
+			jitter_report_gaps(&results[i]);
+	rv = 0;
+
+done:
+	/* Results are cleared by calloc(), unused buffers are NULL */
+	if (results != NULL)
+		for (i = 0; i < 2 * count; i++) {
+			free(results[i].gaps);
+			free(results[i].packet);
+		}
+	free(thread_ids);
+	free(results);
+	free(cpus);
+	return rv;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [-c <count>]\n"
+		"       %s -j [-d <seconds>] [-t <ns>] [-w <bytes>] [-v]\n"
+		"  -c  number of passes before threads exit\n"
+		"  -j  jitter benchmark, pinned and isolated threads\n"
+		"  -d  duration of each run, seconds, default %d\n"
+		"  -t  threshold of recorded gaps, ns, default %d\n"
+		"  -w  size of a packet processed on every pass, bytes\n"
+		"  -v  show all recorded gaps\n",
+		name, name, JITTER_DEFAULT_DURATION,
+		JITTER_DEFAULT_THRESHOLD);
+}
+
 int main(int argc, char **argv)
 {
 	int threads_count;
 	int i;
-	int opt;
+	int opt, jitter = 0;
 	unsigned long long val;
 
-	while ((opt = getopt(argc, argv, "c:")) != -1) {
+	while ((opt = getopt(argc, argv, "c:jd:t:w:v")) != -1) {
 		switch (opt) {
 		case 'c':
 			if (sscanf(optarg, "%llu", &val) == 1) {
@@ -124,10 +488,29 @@ int main(int argc, char **argv)
 				return 1;
 			}
 			break;
+		case 'j':
+			jitter = 1;
+			break;
+		case 'd':
+		case 't':
+		case 'w':
+			if ((sscanf(optarg, "%llu", &val) != 1)
+			    || ((opt == 'd') && (val == 0))) {
+				fprintf(stderr, "Invalid value: %s\n", optarg);
+				return 1;
+			}
+			if (opt == 'd')
+				jitter_duration = val;
+			else if (opt == 't')
+				jitter_threshold = val;
+			else
+				jitter_workload = val;
+			break;
+		case 'v':
+			jitter_verbose = 1;
+			break;
 		default:
-			fprintf(stderr,
-				"Usage: %s [-c <count>]\n",
-				argv[0]);
+			usage(argv[0]);
 			return 1;
 		}
 	}
@@ -140,6 +523,9 @@ int main(int argc, char **argv)
 	/* This is just used to count the available CPUs */
 	threads_count = memipc_isolation_get_max_isolated_threads_count();
 
+	if (jitter)
+		return jitter_benchmark(threads_count);
+
 	for (i = 0; i < threads_count; i++) {
 #if CREATE_THREADS_MANAGED
 		if (isolation_thread_create(-1,
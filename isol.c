@@ -56,17 +56,27 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <alloca.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <dirent.h>
 #include <sched.h>
+#include <mntent.h>
 #include <pthread.h>
 #include <signal.h>
 #include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#if defined(__x86_64__) && defined(__BMI2__)
+#include <immintrin.h>
+#endif
 
 /* Internal functions */
 #include "isol-internals.h"
@@ -74,6 +84,9 @@
 /* Server */
 #include "isol-server.h"
 
+/* CPU lists */
+#include "isol-cpulist.h"
+
 /* TMC for ODP */
 #include <tmc/isol.h>
 
@@ -104,9 +117,11 @@
 #define DEBUG_ISOL_VERBOSE 0
 #endif
 
-/* Compile-time options for monitoring implementation. */
-
-/* Two monitoring methods are supported */
+/*
+  Compile-time options for monitoring implementation. Two monitoring
+  methods are supported, this selects the default for threads that do
+  not choose one in tmc_isol_thr_init_mode().
+*/
 #if (!defined(ISOLATION_MONITOR_IN_MASTER)	\
      && !defined(ISOLATION_MONITOR_IN_SLAVE))
 #define ISOLATION_MONITOR_IN_MASTER 1
@@ -123,6 +138,15 @@
 #endif
 #endif
 
+/*
+  Allocate memipc areas and stacks of managed threads on the NUMA node
+  of the thread's CPU. System calls are used directly, so no NUMA
+  library is necessary.
+*/
+#ifndef USE_NUMA_PLACEMENT
+#define USE_NUMA_PLACEMENT 1
+#endif
+
 /* Use CPU subsets to support multiple applications. */
 #ifndef USE_CPU_SUBSETS
 #define USE_CPU_SUBSETS 1
@@ -140,6 +164,115 @@
 #define CPU_SUBSETS_FILE "/etc/cpu_subsets"
 #endif
 
+/*
+  Keep parsed CPU topology and CPU subsets in named shared memory,
+  shared by all applications. Topology of a CPU is read from sysfs once
+  after boot, CPU subsets file is parsed again only when it changes.
+  Otherwise each process keeps its own copy.
+*/
+#ifndef USE_CPU_CACHE
+#define USE_CPU_CACHE 1
+#endif
+
+/* Compile-time options for memipc encoding. */
+
+/*
+  Encode and decode each block as a single 64-bit word. Requires a
+  little-endian target where aligned 64-bit loads and stores are
+  single-copy atomic.
+*/
+#ifndef MEMIPC_ENCODE_WORD
+#if (defined(__x86_64__) || defined(__aarch64__)) \
+	&& (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define MEMIPC_ENCODE_WORD 1
+#else
+#define MEMIPC_ENCODE_WORD 0
+#endif
+#endif
+
+/*
+  Use PDEP/PEXT instructions for word encoding. Enabled when the
+  compiler targets BMI2 (-mbmi2, -march=haswell or later). Some CPUs
+  implement those instructions in microcode, so shifts are used
+  otherwise.
+*/
+#ifndef MEMIPC_ENCODE_BMI2
+#if MEMIPC_ENCODE_WORD && defined(__x86_64__) && defined(__BMI2__)
+#define MEMIPC_ENCODE_BMI2 1
+#else
+#define MEMIPC_ENCODE_BMI2 0
+#endif
+#endif
+
+/*
+  Encode and decode multiple blocks of long requests at once, using
+  compiler vector extensions (SSE2/AVX2 on x86, NEON on ARM64).
+*/
+#ifndef MEMIPC_ENCODE_VECTOR
+#define MEMIPC_ENCODE_VECTOR MEMIPC_ENCODE_WORD
+#endif
+
+/* Compile-time options for the manager. */
+
+/*
+  Maximum number of requests, and bytes of request data, received
+  from each thread in one pass of the manager loop.
+*/
+#ifndef MANAGER_DRAIN_MAX_REQS
+#define MANAGER_DRAIN_MAX_REQS 16
+#endif
+
+#ifndef MANAGER_DRAIN_MAX_BYTES
+#define MANAGER_DRAIN_MAX_BYTES (64 * 1024)
+#endif
+
+/*
+  Doorbell mode. Manager spins for MANAGER_SPIN_NSEC after the last
+  request, then blocks in poll() on an eventfd that threads signal
+  when the manager has found all areas empty. Isolated threads do not
+  signal it, a system call would break isolation, so while I/O is
+  expected manager wakes up at least every MANAGER_DOORBELL_TIMEOUT
+  milliseconds.
+*/
+#ifndef MANAGER_DOORBELL
+#define MANAGER_DOORBELL 0
+#endif
+
+#ifndef MANAGER_SPIN_NSEC
+#define MANAGER_SPIN_NSEC (50000)
+#endif
+
+#ifndef MANAGER_DOORBELL_TIMEOUT
+#define MANAGER_DOORBELL_TIMEOUT (1)
+#endif
+
+/*
+  Manager visits threads that marked the activity bitmap after writing
+  requests, and all threads every MANAGER_FULL_SCAN_PASSES passes, so
+  threads that could not map the bitmap are still served.
+*/
+#ifndef MANAGER_FULL_SCAN_PASSES
+#define MANAGER_FULL_SCAN_PASSES (64)
+#endif
+
+/*
+  Manager shards, see memipc_isolation_set_manager_shards(). A shard
+  that found all areas of its threads empty for MANAGER_SPIN_NSEC
+  sleeps for MANAGER_SHARD_SLEEP_NSEC between passes.
+*/
+#ifndef MANAGER_SHARD_SLEEP_NSEC
+#define MANAGER_SHARD_SLEEP_NSEC (1000000)
+#endif
+
+/*
+  Number of worker threads that make system calls offloaded by
+  isolated threads. Workers run on non-isolated CPUs, and are started
+  when the first request arrives.
+*/
+#ifndef OFFLOAD_WORKERS
+#define OFFLOAD_WORKERS (2)
+#endif
+
 /*
   The following is specific to the patched kernel, and may be
   incompatible with other kernel versions. If the build environment
@@ -170,9 +303,103 @@
 #define SEVEN (7)
 #define EIGHT (8)
 
-/* Memory area. */
+/* Default size of a memory area. */
 #define AREA_SIZE (4096)
 
+/* Size of huge pages used for areas with MEMIPC_AREA_HUGEPAGES flag. */
+#define AREA_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Cache line size. Area descriptors are aligned to it, so reader's and
+ * writer's descriptors do not share a cache line.
+ */
+#define MEMIPC_CACHE_LINE_SIZE (64)
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT 0
+#endif
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE (1 << 0)
+#endif
+#ifndef MPOL_F_ADDR
+#define MPOL_F_ADDR (1 << 1)
+#endif
+
+/* Node masks passed to memory policy system calls */
+#define NUMA_NODEMASK_WORDS (16)
+#define NUMA_NODEMASK_BITS (NUMA_NODEMASK_WORDS * 8 * sizeof(unsigned long))
+
+#if USE_NUMA_PLACEMENT
+/*
+ * Fill a node mask with a single node.
+ */
+static int memipc_numa_nodemask(unsigned long *nodemask, int node)
+{
+	const unsigned int word_bits = 8 * sizeof(unsigned long);
+
+	/* Kernel ignores the last bit of the mask */
+	if ((node < 0) || ((unsigned int)node >= NUMA_NODEMASK_BITS - 1))
+		return -1;
+	memset(nodemask, 0, NUMA_NODEMASK_WORDS * sizeof(unsigned long));
+	nodemask[node / word_bits] = 1UL << (node % word_bits);
+	return 0;
+}
+
+/*
+ * Prefer memory of a given node for pages of a mapping that are not
+ * allocated yet.
+ */
+static void memipc_numa_bind(const volatile void *addr, size_t size,
+			     int node)
+{
+	unsigned long nodemask[NUMA_NODEMASK_WORDS];
+
+	if (memipc_numa_nodemask(nodemask, node))
+		return;
+	syscall(SYS_mbind, addr, size, MPOL_PREFERRED, nodemask,
+		NUMA_NODEMASK_BITS, 0);
+}
+
+/*
+ * Prefer memory of a given node for the calling thread and threads it
+ * creates. Previous policy is saved in mode and nodemask.
+ */
+static int memipc_numa_prefer_node(int node, int *mode,
+				   unsigned long *nodemask)
+{
+	unsigned long new_nodemask[NUMA_NODEMASK_WORDS];
+
+	if (memipc_numa_nodemask(new_nodemask, node))
+		return -1;
+	if (syscall(SYS_get_mempolicy, mode, nodemask, NUMA_NODEMASK_BITS,
+		    NULL, 0))
+		return -1;
+	if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, new_nodemask,
+		    NUMA_NODEMASK_BITS))
+		return -1;
+	return 0;
+}
+
+/*
+ * Restore policy saved by memipc_numa_prefer_node().
+ */
+static void memipc_numa_restore_policy(int mode,
+				       const unsigned long *nodemask)
+{
+	syscall(SYS_set_mempolicy, mode, nodemask, NUMA_NODEMASK_BITS);
+}
+#endif
+
 /*
  * Per-process or per-thread ID.
  * For now, use pthread_t, however it may be changed to pid_t for external
@@ -183,15 +410,32 @@ static __thread int memipc_thread_launch_confirmed = 0;
 __thread int memipc_thread_continue_flag = 1;
 __thread int memipc_thread_ok_leave_flag = 0;
 static unsigned char newdata_one = 1;
-__thread volatile unsigned char *memipc_check_newdata_ptr = &newdata_one;
-__thread volatile unsigned char memipc_check_signal = 0;
+/*
+ * Checked on every pass of the thread's loop. Each is in its own cache
+ * line, written only by the thread and its signal handler.
+ */
+__thread volatile unsigned char *memipc_check_newdata_ptr
+__attribute__((aligned(MEMIPC_CACHE_LINE_SIZE))) = &newdata_one;
+__thread volatile unsigned char memipc_check_signal
+__attribute__((aligned(MEMIPC_CACHE_LINE_SIZE))) = 0;
+__thread struct tmc_isol_loop_hist *memipc_loop_hist = NULL;
+struct tmc_isol_config_buf *memipc_config_published = NULL;
+__thread struct tmc_isol_config_buf *memipc_config_current = NULL;
+/* Configuration switch waits for space for its acknowledgement */
+static __thread int memipc_config_pending = 0;
 
 struct memipc_thread_params;
 
 static __thread struct memipc_thread_params *memipc_thread_self = NULL;
 static __thread int memipc_thread_fd = -1;
 
-/* Memory area descriptor. */
+/*
+ * Memory area descriptor.
+ *
+ * Writer uses wptr, rptr and inbuffer to track free space. Reader only
+ * uses rptr, valid bits in the header block at rptr indicate that the
+ * whole request is written.
+ */
 struct memipc_area
 {
 	unsigned char volatile *area;
@@ -201,8 +445,82 @@ struct memipc_area
 	size_t inbuffer;
 	pthread_t writer;
 	pthread_t reader;
+	/* Writer: header block of a reserved in-place request, or NULL */
+	unsigned char volatile *resv_ptr;
+	/* Writer: payload size of the reserved in-place request */
+	size_t resv_size;
+	/* Reader: blocks in the in-place request returned by peek */
+	size_t peek_blocks;
+	/* Writer: reader's doorbell flag, or NULL */
+	int *doorbell;
+	/* Writer: word and bit of the activity bitmap, or NULL */
+	unsigned long *activity;
+	unsigned long activity_bit;
+	/* Writer: counters of the writer's CPU, or NULL */
+	struct memipc_thread_counters *counters;
+};
+
+/*
+ * Activity bitmap.
+ *
+ * Writer of the manager's input area of a thread sets the bit of the
+ * thread's CPU after each request, and the manager only visits threads
+ * with bits set. Bitmap is in named shared memory, so threads of other
+ * processes mark it too.
+ *
+ * The same memory holds counters written by threads, one cache line
+ * for each CPU, and loop period histograms, so the manager sees those
+ * of threads in other processes.
+ *
+ * Name is qualified with the CPU subset as the server socket is, and
+ * only the manager that created the socket creates the bitmap.
+ */
+#define MEMIPC_ACTIVITY_NAME "/isol_server_activity"
+#define MEMIPC_ACTIVITY_BITS (8 * sizeof(unsigned long))
+#define MEMIPC_ACTIVITY_WORDS (CPU_SETSIZE / MEMIPC_ACTIVITY_BITS)
+
+/* Counters of a thread, written only by the thread */
+struct memipc_thread_counters {
+	uint64_t ring_full; /* requests that did not fit in the area */
+	uint64_t ring_drops; /* output dropped because the area was full */
+} __attribute__((aligned(MEMIPC_CACHE_LINE_SIZE)));
+
+struct memipc_activity {
+	unsigned long rings[MEMIPC_ACTIVITY_WORDS];
+	struct memipc_thread_counters counters[CPU_SETSIZE];
+	struct tmc_isol_loop_hist loop_hists[CPU_SETSIZE]
+	__attribute__((aligned(MEMIPC_CACHE_LINE_SIZE)));
 };
 
+static struct memipc_activity *_global_memipc_activity = NULL;
+static char *_global_memipc_activity_name = NULL;
+
+/*
+ * Mark the area in the activity bitmap after a request was written.
+ *
+ * The word is shared by many CPUs, so it is only read while the bit is
+ * still set from an earlier request. If the manager clears the bit
+ * before this request is visible, it is found in the next full scan,
+ * or with the next marked request.
+ */
+static inline void memipc_activity_mark(struct memipc_area *area)
+{
+	if ((area->activity != NULL)
+	    && ((__atomic_load_n(area->activity, __ATOMIC_RELAXED)
+		 & area->activity_bit) == 0))
+		__atomic_fetch_or(area->activity, area->activity_bit,
+				  __ATOMIC_RELEASE);
+}
+
+/*
+ * Increment a counter of the writer. Only the writer updates it, so
+ * there is no atomic read-modify-write.
+ */
+static inline void memipc_counter_inc(uint64_t *counter)
+{
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
 /*
  * Request header.
  * Does not exist in memory but assumed in message layout.
@@ -213,6 +531,24 @@ struct memipc_req_header
 	uint32_t size;
 } __attribute__((packed));
 
+/*
+ * Requests written in place.
+ *
+ * Such request consists of a regular encoded header block with
+ * MEMIPC_REQ_SIZE_INPLACE flag set in the size field, followed by
+ * unencoded payload padded to EIGHT bytes. The size field contains
+ * the payload size, without the header. Payload is written before the
+ * header, so only the header block carries valid bits. Reader clears
+ * the payload before clearing the header, so writer never finds
+ * cleared header in front of payload that is still being released.
+ *
+ * Payload is always contiguous. If it does not fit before the end of
+ * the area, writer places a padding request (in-place request with
+ * MEMIPC_REQ_NONE type) that covers the rest of the area, and the
+ * request itself is written at the start of the area.
+ */
+#define MEMIPC_REQ_SIZE_INPLACE (0x80000000U)
+
 
 char *memipc_area_name(int cpu)
 {
@@ -224,6 +560,161 @@ char *memipc_area_name(int cpu)
 	return s;
 }
 
+/*
+ * Get the path of a named area on a hugetlbfs mount with pages of
+ * AREA_HUGEPAGE_SIZE. Name starts with a slash, as for shm_open().
+ *
+ * Returns 0 on success, -1 if there is no such mount.
+ */
+static int memipc_hugetlbfs_path(const char *name, char *path, size_t len)
+{
+	struct mntent *m, mbuf;
+	char buf[1024], *opt;
+	FILE *f;
+	int rv = -1;
+
+	f = setmntent("/proc/mounts", "r");
+	if (f == NULL)
+		return -1;
+	while ((m = getmntent_r(f, &mbuf, buf, sizeof(buf))) != NULL) {
+		if (strcmp(m->mnt_type, "hugetlbfs") != 0)
+			continue;
+		/* Mounts without the option use the default size, 2M */
+		opt = hasmntopt(m, "pagesize");
+		if ((opt != NULL)
+		    && ((strncmp(opt, "pagesize=2M", 11) != 0)
+			|| ((opt[11] != ',') && (opt[11] != '\0'))))
+			continue;
+		if ((size_t)snprintf(path, len, "%s%s", m->mnt_dir, name)
+		    < len) {
+			rv = 0;
+			break;
+		}
+	}
+	endmntent(f);
+	return rv;
+}
+
+/*
+ * Open a named area, in shared memory or in huge pages.
+ */
+static int memipc_area_open(const char *name)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	fd = shm_open(name, O_RDWR, 0);
+	if ((fd < 0) && (memipc_hugetlbfs_path(name, path, sizeof(path)) == 0))
+		fd = open(path, O_RDWR | O_CLOEXEC);
+	return fd;
+}
+
+/*
+ * Remove a named area, in shared memory and in huge pages.
+ */
+static void memipc_area_unlink(const char *name)
+{
+	char path[PATH_MAX];
+
+	shm_unlink(name);
+	if (memipc_hugetlbfs_path(name, path, sizeof(path)) == 0)
+		unlink(path);
+}
+
+/*
+ * Set the name of the activity bitmap for a CPU subset, or the default
+ * name if subset_id is NULL.
+ */
+static int memipc_activity_set_name(const char *subset_id)
+{
+	size_t len;
+	char *name;
+
+	len = sizeof(MEMIPC_ACTIVITY_NAME)
+		+ ((subset_id != NULL) ? (strlen(subset_id) + 1) : 0);
+	name = (char *)malloc(len);
+	if (name == NULL)
+		return -1;
+	if (subset_id != NULL)
+		snprintf(name, len, "%s.%s", MEMIPC_ACTIVITY_NAME, subset_id);
+	else
+		strcpy(name, MEMIPC_ACTIVITY_NAME);
+	free(_global_memipc_activity_name);
+	_global_memipc_activity_name = name;
+	return 0;
+}
+
+/*
+ * Map the activity bitmap, create it if create is nonzero.
+ */
+static struct memipc_activity *memipc_activity_map(int create)
+{
+	struct memipc_activity *activity;
+	int fd;
+
+	if (_global_memipc_activity_name == NULL)
+		return NULL;
+	if (create) {
+		shm_unlink(_global_memipc_activity_name);
+		fd = shm_open(_global_memipc_activity_name,
+			      O_RDWR | O_CREAT | O_TRUNC, 0600);
+	} else
+		fd = shm_open(_global_memipc_activity_name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	if (create && (ftruncate(fd, sizeof(struct memipc_activity)) < 0)) {
+		close(fd);
+		return NULL;
+	}
+	activity = (struct memipc_activity *)
+		mmap(NULL, sizeof(struct memipc_activity),
+		     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (activity == MAP_FAILED)
+		return NULL;
+	return activity;
+}
+
+/*
+ * Make the writer of an area mark the bit of a CPU in the activity
+ * bitmap, and update counters of that CPU.
+ */
+static void memipc_activity_attach(struct memipc_area *area, int cpu)
+{
+	if ((area == NULL) || (_global_memipc_activity == NULL)
+	    || (cpu < 0) || (cpu >= CPU_SETSIZE))
+		return;
+	area->activity =
+		&_global_memipc_activity->rings[cpu / MEMIPC_ACTIVITY_BITS];
+	area->activity_bit = 1UL << (cpu % MEMIPC_ACTIVITY_BITS);
+	area->counters = &_global_memipc_activity->counters[cpu];
+}
+
+/*
+ * Set the bit of a CPU in a bitmap.
+ */
+static inline void memipc_activity_set(unsigned long *bitmap, int cpu)
+{
+	__atomic_fetch_or(&bitmap[cpu / MEMIPC_ACTIVITY_BITS],
+			  1UL << (cpu % MEMIPC_ACTIVITY_BITS), __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Take bits of CPUs in a mask from a bitmap, and add them to bits.
+ */
+static void memipc_activity_take(unsigned long *bits,
+				 unsigned long *bitmap,
+				 const unsigned long *mask)
+{
+	unsigned int w;
+
+	for (w = 0; w < MEMIPC_ACTIVITY_WORDS; w++)
+		if (mask[w] != 0)
+			bits[w] |= __atomic_fetch_and(&bitmap[w], ~mask[w],
+						      __ATOMIC_SEQ_CST)
+				& mask[w];
+}
+
 /*
  * Create an area descriptor and allocate the area.
  */
@@ -234,8 +725,8 @@ struct memipc_area *memipc_area_create(size_t size, size_t map_size,
 	unsigned char *p;
 	struct memipc_area *area;
 
-	area = malloc(sizeof(struct memipc_area));
-	if (area == NULL)
+	if (posix_memalign((void **)&area, MEMIPC_CACHE_LINE_SIZE,
+			   sizeof(struct memipc_area)))
 		return NULL;
 
 	if (ptr == NULL) {
@@ -255,6 +746,13 @@ struct memipc_area *memipc_area_create(size_t size, size_t map_size,
 	area->inbuffer = 0;
 	area->writer = 0;
 	area->reader = 0;
+	area->resv_ptr = NULL;
+	area->resv_size = 0;
+	area->peek_blocks = 0;
+	area->doorbell = NULL;
+	area->activity = NULL;
+	area->activity_bit = 0;
+	area->counters = NULL;
 
 	return area;
 }
@@ -275,8 +773,8 @@ struct memipc_area *memipc_area_dup(struct memipc_area *src)
 	struct memipc_area *dst;
 	if (src == NULL)
 		return NULL;
-	dst = malloc(sizeof(struct memipc_area));
-	if (dst == NULL)
+	if (posix_memalign((void **)&dst, MEMIPC_CACHE_LINE_SIZE,
+			   sizeof(struct memipc_area)))
 		return NULL;
 	memcpy(dst, src, sizeof(struct memipc_area));
 	return dst;
@@ -313,6 +811,108 @@ void memipc_area_delete_duplicate(struct memipc_area *area)
 	free(area);
 }
 
+#if MEMIPC_ENCODE_WORD
+/*
+ * Word encoding.
+ *
+ * SEVEN source bytes, taken as a little-endian 56-bit value, are
+ * spread into seven-bit groups occupying bits 1-7 of each encoded
+ * byte, and bit 0 of each byte is set. This produces exactly the same
+ * layout as the byte-wise encoder, so both can be mixed.
+ */
+#define MEMIPC_WORD_VALID (0x0101010101010101ULL)
+#define MEMIPC_WORD_DATA (0xfefefefefefefefeULL)
+
+#define MEMIPC_WORD_ALIGNED(p) ((((uintptr_t)(p)) & (EIGHT - 1)) == 0)
+
+static inline uint64_t memipc_encode_word(uint64_t s)
+{
+#if MEMIPC_ENCODE_BMI2
+	return _pdep_u64(s, MEMIPC_WORD_DATA) | MEMIPC_WORD_VALID;
+#else
+	s = (s & 0x000000000fffffffULL) | ((s & 0x00fffffff0000000ULL) << 4);
+	s = (s & 0x00003fff00003fffULL) | ((s & 0x0fffc0000fffc000ULL) << 2);
+	s = (s & 0x007f007f007f007fULL) | ((s & 0x3f803f803f803f80ULL) << 1);
+	return (s << 1) | MEMIPC_WORD_VALID;
+#endif
+}
+
+static inline uint64_t memipc_decode_word(uint64_t d)
+{
+#if MEMIPC_ENCODE_BMI2
+	return _pext_u64(d, MEMIPC_WORD_DATA);
+#else
+	d = (d >> 1) & 0x7f7f7f7f7f7f7f7fULL;
+	d = (d & 0x007f007f007f007fULL) | ((d & 0x7f007f007f007f00ULL) >> 1);
+	d = (d & 0x00003fff00003fffULL) | ((d & 0x3fff00003fff0000ULL) >> 2);
+	d = (d & 0x000000000fffffffULL) | ((d & 0x0fffffff00000000ULL) >> 4);
+	return d;
+#endif
+}
+
+static inline uint64_t memipc_load_word(unsigned char volatile *p)
+{
+	return __atomic_load_n((uint64_t volatile *)p, __ATOMIC_RELAXED);
+}
+
+static inline void memipc_store_word(unsigned char volatile *p, uint64_t v)
+{
+	__atomic_store_n((uint64_t volatile *)p, v, __ATOMIC_RELAXED);
+}
+
+#if MEMIPC_ENCODE_VECTOR
+/*
+ * Vector encoding, blocks are processed in groups, one per vector
+ * lane. This is the same transformation as memipc_encode_word() and
+ * memipc_decode_word() without PDEP/PEXT.
+ */
+#define MEMIPC_VECTOR_BLOCKS (4)
+typedef uint64_t memipc_vector_t
+__attribute__((vector_size(MEMIPC_VECTOR_BLOCKS * EIGHT)));
+
+static inline void memipc_encode_vector(unsigned char volatile *dst,
+					const unsigned char *src)
+{
+	memipc_vector_t s;
+	uint64_t w;
+	unsigned i;
+
+	for (i = 0; i < MEMIPC_VECTOR_BLOCKS; i++) {
+		w = 0;
+		memcpy(&w, src + i * SEVEN, SEVEN);
+		s[i] = w;
+	}
+	s = (s & 0x000000000fffffffULL) | ((s & 0x00fffffff0000000ULL) << 4);
+	s = (s & 0x00003fff00003fffULL) | ((s & 0x0fffc0000fffc000ULL) << 2);
+	s = (s & 0x007f007f007f007fULL) | ((s & 0x3f803f803f803f80ULL) << 1);
+	s = (s << 1) | MEMIPC_WORD_VALID;
+	/*
+	  Visibility of those blocks is ordered by the barrier before
+	  the header block is written, so a plain store is sufficient.
+	*/
+	memcpy((unsigned char *)dst, &s, sizeof(s));
+}
+
+static inline void memipc_decode_vector(unsigned char *dst,
+					unsigned char volatile *src)
+{
+	memipc_vector_t d;
+	uint64_t w;
+	unsigned i;
+
+	memcpy(&d, (unsigned char *)src, sizeof(d));
+	d = (d >> 1) & 0x7f7f7f7f7f7f7f7fULL;
+	d = (d & 0x007f007f007f007fULL) | ((d & 0x7f007f007f007f00ULL) >> 1);
+	d = (d & 0x00003fff00003fffULL) | ((d & 0x3fff00003fff0000ULL) >> 2);
+	d = (d & 0x000000000fffffffULL) | ((d & 0x0fffffff00000000ULL) >> 4);
+	for (i = 0; i < MEMIPC_VECTOR_BLOCKS; i++) {
+		w = d[i];
+		memcpy(dst + i * SEVEN, &w, SEVEN);
+	}
+}
+#endif
+#endif
+
 /*
  * Write SEVEN bytes encoded as EIGHT bytes.
  *
@@ -325,6 +925,23 @@ static int write_encode_bytes(unsigned char volatile *dst,
 	unsigned char src0, src1, src2, src3, src4, src5, src6,
 		dst0, dst1, dst2, dst3, dst4, dst5, dst6, dst7;
 
+#if MEMIPC_ENCODE_WORD
+	if (MEMIPC_WORD_ALIGNED(dst)) {
+		uint64_t s = 0;
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if ((memipc_load_word(dst) & MEMIPC_WORD_VALID) != 0)
+			return -1;
+		if (size > SEVEN)
+			size = SEVEN;
+		if (size > 0)
+			memcpy(&s, src, size);
+		memipc_store_word(dst, memipc_encode_word(s));
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		return 0;
+	}
+#endif
+
 	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 	/*
 	  Do not write if all data in the block is not read yet,
@@ -424,6 +1041,24 @@ static int write_encode_bytes_with_header(unsigned char volatile *dst,
 	unsigned char src0, src1, src2, src3, src4, src5, src6,
 		dst0, dst1, dst2, dst3, dst4, dst5, dst6, dst7;
 
+#if MEMIPC_ENCODE_WORD
+	if (MEMIPC_WORD_ALIGNED(dst)) {
+		uint64_t s;
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if ((memipc_load_word(dst) & MEMIPC_WORD_VALID) != 0)
+			return -1;
+		s = (uint64_t)(unsigned char)t | ((uint64_t)msize << 8);
+		if (size >= 2)
+			s |= (uint64_t)src[1] << 48;
+		if (size >= 1)
+			s |= (uint64_t)src[0] << 40;
+		memipc_store_word(dst, memipc_encode_word(s));
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		return 0;
+	}
+#endif
+
 	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 	/*
 	  Do not write if all data in the block is not read yet,
@@ -496,10 +1131,28 @@ static int read_decode_bytes(unsigned char *dst,
 {
 	unsigned char src0, src1, src2, src3, src4, src5, src6, src7;
 
-	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+#if MEMIPC_ENCODE_WORD
+	if (MEMIPC_WORD_ALIGNED(src)) {
+		uint64_t d;
 
-	/* Read all values */
-	src0 = src[0];
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		d = memipc_load_word(src);
+		if ((d & MEMIPC_WORD_VALID) != MEMIPC_WORD_VALID)
+			return -1;
+		d = memipc_decode_word(d);
+		if (size > SEVEN)
+			size = SEVEN;
+		if (size > 0)
+			memcpy(dst, &d, size);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		return 0;
+	}
+#endif
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* Read all values */
+	src0 = src[0];
 	src1 = src[1];
 	src2 = src[2];
 	src3 = src[3];
@@ -559,6 +1212,26 @@ static int read_decode_bytes_with_header(unsigned char *dst,
 {
 	unsigned char src0, src1, src2, src3, src4, src5, src6, src7;
 
+#if MEMIPC_ENCODE_WORD
+	if (MEMIPC_WORD_ALIGNED(src)) {
+		uint64_t d;
+
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		d = memipc_load_word(src);
+		if ((d & MEMIPC_WORD_VALID) != MEMIPC_WORD_VALID)
+			return -1;
+		d = memipc_decode_word(d);
+		if (size >= 2)
+			dst[1] = (unsigned char)(d >> 48);
+		if (size >= 1)
+			dst[0] = (unsigned char)(d >> 40);
+		*msize = (uint32_t)(d >> 8);
+		*type = (char)(d & 0xff);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		return 0;
+	}
+#endif
+
 	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
 	/* Read all values */
@@ -601,30 +1274,146 @@ static int read_decode_bytes_with_header(unsigned char *dst,
 }
 
 /*
- * Create a request in a given area.
+ * Check if blocks_count blocks are released by the reader.
  */
-int memipc_add_req(struct memipc_area *area, enum memipc_req_type req_type,
-		   ssize_t req_size, unsigned char *req_data)
+static int memipc_blocks_clear(unsigned char volatile *p,
+			       size_t blocks_count)
 {
-	size_t total_req_size, blocks_count, remainder,
-		blocks_available, blocks_available_1, blocks_available_2,
-		blocks_write, srcsize;
-	unsigned i;
-	unsigned char volatile *localptr, *endptr, *next_wptr;
-	unsigned char *srcptr;
-	unsigned inbuffer;
+	unsigned char volatile *endptr;
+	unsigned char acc = 0;
 
-	/* Are we supposed to write here? */
-	if (area->writer != memipc_my_pid) {
-		fprintf(stderr, "Process %lu attempted to write a request "
-			"to memipc area writable by a process %lu\n",
-			(unsigned long)memipc_my_pid,
-			(unsigned long)area->writer);
-		return -1;
+	endptr = p + blocks_count * EIGHT;
+#if MEMIPC_ENCODE_WORD
+	if (MEMIPC_WORD_ALIGNED(p)) {
+		uint64_t wacc = 0;
+
+		for (; p < endptr; p += EIGHT)
+			wacc |= memipc_load_word(p);
+		return (wacc & MEMIPC_WORD_VALID) == 0;
+	}
+#endif
+	for (; p < endptr; p++)
+		acc |= *p;
+	return (acc & 1) == 0;
+}
+
+/*
+ * Write size bytes encoded as a sequence of blocks.
+ *
+ * Destination blocks must be checked with memipc_blocks_clear()
+ * first. There is no barrier after the last block, the caller orders
+ * those writes before the header block.
+ */
+static int write_encode_blocks(unsigned char volatile *dst,
+			       const unsigned char *src,
+			       size_t size)
+{
+	size_t srcsize;
+
+#if MEMIPC_ENCODE_WORD
+	if (MEMIPC_WORD_ALIGNED(dst)) {
+		uint64_t s;
+#if MEMIPC_ENCODE_VECTOR
+		while (size >= MEMIPC_VECTOR_BLOCKS * SEVEN) {
+			memipc_encode_vector(dst, src);
+			dst += MEMIPC_VECTOR_BLOCKS * EIGHT;
+			src += MEMIPC_VECTOR_BLOCKS * SEVEN;
+			size -= MEMIPC_VECTOR_BLOCKS * SEVEN;
+		}
+#endif
+		while (size > 0) {
+			srcsize = (size > SEVEN) ? SEVEN : size;
+			s = 0;
+			memcpy(&s, src, srcsize);
+			memipc_store_word(dst, memipc_encode_word(s));
+			dst += EIGHT;
+			src += srcsize;
+			size -= srcsize;
+		}
+		return 0;
+	}
+#endif
+	while (size > 0) {
+		srcsize = (size > SEVEN) ? SEVEN : size;
+		if (write_encode_bytes(dst, src, srcsize))
+			return -1;
+		dst += EIGHT;
+		src += srcsize;
+		size -= srcsize;
 	}
+	return 0;
+}
+
+/*
+ * Read size bytes encoded as a sequence of blocks.
+ *
+ * The caller has already read the header block of the request with a
+ * barrier, so all blocks written before it are visible.
+ */
+static int read_decode_blocks(unsigned char *dst,
+			      unsigned char volatile *src,
+			      size_t size)
+{
+	size_t dstsize;
+
+#if MEMIPC_ENCODE_WORD
+	if (MEMIPC_WORD_ALIGNED(src)) {
+		uint64_t d;
+#if MEMIPC_ENCODE_VECTOR
+		while (size >= MEMIPC_VECTOR_BLOCKS * SEVEN) {
+			memipc_decode_vector(dst, src);
+			dst += MEMIPC_VECTOR_BLOCKS * SEVEN;
+			src += MEMIPC_VECTOR_BLOCKS * EIGHT;
+			size -= MEMIPC_VECTOR_BLOCKS * SEVEN;
+		}
+#endif
+		while (size > 0) {
+			dstsize = (size > SEVEN) ? SEVEN : size;
+			d = memipc_decode_word(memipc_load_word(src));
+			memcpy(dst, &d, dstsize);
+			dst += dstsize;
+			src += EIGHT;
+			size -= dstsize;
+		}
+		return 0;
+	}
+#endif
+	while (size > 0) {
+		dstsize = (size > SEVEN) ? SEVEN : size;
+		if (read_decode_bytes(dst, src, dstsize))
+			return -1;
+		dst += dstsize;
+		src += EIGHT;
+		size -= dstsize;
+	}
+	return 0;
+}
+
+/*
+ * Update writer's view of the area, skip over the data already
+ * released by the reader.
+ */
+static void memipc_writer_update(struct memipc_area *area)
+{
+	unsigned char volatile *localptr, *endptr;
+	size_t inbuffer;
+
 	localptr = area->rptr;
 	endptr = area->area + area->size;
 	inbuffer = area->inbuffer;
+#if MEMIPC_ENCODE_WORD
+	/* Skip whole blocks released by the reader */
+	if (MEMIPC_WORD_ALIGNED(localptr)) {
+		while ((inbuffer >= EIGHT)
+		       && ((memipc_load_word(localptr)
+			    & MEMIPC_WORD_VALID) == 0)) {
+			localptr += EIGHT;
+			if (localptr >= endptr)
+				localptr = area->area;
+			inbuffer -= EIGHT;
+		}
+	}
+#endif
 	while ((((*localptr) & 1) == 0) && (inbuffer > 0)) {
 		localptr ++;
 		if (localptr >= endptr)
@@ -633,10 +1422,29 @@ int memipc_add_req(struct memipc_area *area, enum memipc_req_type req_type,
 	}
 	area->rptr = localptr;
 	area->inbuffer = inbuffer;
+}
+
+/*
+ * Write all blocks of a request except the header block, and advance
+ * the write pointer.
+ *
+ * Returns position of the header block, or NULL if there is not
+ * enough space. The header block should be written after a barrier.
+ */
+static unsigned char volatile *memipc_place_req(struct memipc_area *area,
+						 ssize_t req_size,
+						 unsigned char *req_data)
+{
+	size_t total_req_size, blocks_count, remainder,
+		blocks_available, blocks_available_1, blocks_available_2,
+		blocks_write, first_size, wrapped_offset;
+	unsigned char volatile *endptr, *next_wptr, *header;
+
+	endptr = area->area + area->size;
 
 	/* Check if the area is full */
 	if (area->inbuffer == area->size)
-		return -1;
+		return NULL;
 
 	/*
 	  Determine the amount of data to be written. We use SEVEN-byte
@@ -660,83 +1468,204 @@ int memipc_add_req(struct memipc_area *area, enum memipc_req_type req_type,
 
 	/* Check if there is enough space to write the request */
 	if (blocks_count > blocks_available)
-		return -1;
+		return NULL;
+
+	/* Payload bytes that share the first block with the header */
+	first_size = SEVEN - sizeof(struct memipc_req_header);
+	if ((size_t)req_size < first_size)
+		first_size = req_size;
 
-	/* If there is a wrap around, start from writing wrapped data */
 	if (blocks_count > blocks_available_1) {
+		/* Wrap around, the rest of the request is at the area start */
+		blocks_write = blocks_available_1;
 		next_wptr = area->area
 			+ (blocks_count - blocks_available_1) * EIGHT;
-		for (i = blocks_count - blocks_available_1; i > 0; i --) {
-			srcptr = req_data + blocks_available_1 * SEVEN
-				+ i * SEVEN - sizeof(struct memipc_req_header);
-			if ((srcptr - req_data) >= SEVEN) {
-				srcsize = req_size
-					- (srcptr - SEVEN - req_data);
-				if (srcsize > SEVEN)
-					srcsize = SEVEN;
-				if (write_encode_bytes(area->area
-						       + ((i - 1) * EIGHT),
-						       srcptr - SEVEN, srcsize))
-					return -1;
-			} else {
-				if (srcptr - req_data > req_size)
-					srcptr = req_data + req_size;
-				srcsize = srcptr - req_data;
-				if (write_encode_bytes_with_header(
-				area->area + ((i - 1) * EIGHT),
-				req_data, srcsize,
-				req_type,
-				req_size + sizeof(struct memipc_req_header)))
-					return -1;
-			}
-		}
-		blocks_write = blocks_available_1;
+		wrapped_offset = first_size + (blocks_write - 1) * SEVEN;
 	} else {
 		/* No wrap around */
 		blocks_write = blocks_count;
 		next_wptr = area->wptr + (blocks_write) * EIGHT;
 		if (next_wptr >= endptr)
 			next_wptr = area->area;
+		wrapped_offset = req_size;
 	}
 
-	/* Write data that was not wrapped around */
-	for (i = blocks_write; i > 0 ; i --) {
-		srcptr = req_data
-			+ i * SEVEN - sizeof(struct memipc_req_header);
-		if ((srcptr - req_data) >= SEVEN) {
-			srcsize = req_size - (srcptr - SEVEN - req_data);
-			if (srcsize > SEVEN)
-				srcsize = SEVEN;
-			if (write_encode_bytes(area->wptr + ((i - 1) * EIGHT),
-					       srcptr - SEVEN, srcsize))
-				return -1;
-		} else {
-			if (srcptr - req_data > req_size)
-				srcptr = req_data + req_size;
-			srcsize = srcptr - req_data;
-			if (write_encode_bytes_with_header(
-			area->wptr + ((i - 1) * EIGHT),
-			req_data, srcsize,
-			req_type,
-			req_size + sizeof(struct memipc_req_header)))
-				return -1;
-		}
+	/*
+	  Do not write anything if some data is not read yet, or if read
+	  markers were not yet propagated to this core.
+	*/
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!memipc_blocks_clear(area->wptr, blocks_write)
+	    || !memipc_blocks_clear(area->area, blocks_count - blocks_write))
+		return NULL;
 
-	}
+	/* Write wrapped around data, then data that was not wrapped around */
+	if (write_encode_blocks(area->area, req_data + wrapped_offset,
+				req_size - wrapped_offset)
+	    || write_encode_blocks(area->wptr + EIGHT, req_data + first_size,
+				   wrapped_offset - first_size))
+		return NULL;
+
+	header = area->wptr;
 	area->inbuffer += blocks_count * EIGHT;
 	area->wptr = next_wptr;
+	return header;
+}
+
+/*
+ * Write the header block of a request placed with memipc_place_req().
+ *
+ * The block is already checked, so this can not fail, and there are
+ * no barriers around aligned word writes.
+ */
+static void memipc_write_header(unsigned char volatile *header,
+				enum memipc_req_type req_type,
+				ssize_t req_size,
+				unsigned char *req_data)
+{
+	unsigned int first_size;
+
+	first_size = SEVEN - sizeof(struct memipc_req_header);
+	if ((size_t)req_size < first_size)
+		first_size = req_size;
+#if MEMIPC_ENCODE_WORD
+	if (MEMIPC_WORD_ALIGNED(header)) {
+		uint64_t s;
+
+		s = (uint64_t)(unsigned char)req_type
+			| ((uint64_t)(req_size
+				      + sizeof(struct memipc_req_header)) << 8);
+		if (first_size >= 2)
+			s |= (uint64_t)req_data[1] << 48;
+		if (first_size >= 1)
+			s |= (uint64_t)req_data[0] << 40;
+		memipc_store_word(header, memipc_encode_word(s));
+		return;
+	}
+#endif
+	write_encode_bytes_with_header(header, req_data, first_size, req_type,
+				       req_size
+				       + sizeof(struct memipc_req_header));
+}
+
+static void memipc_doorbell_ring(struct memipc_area *area,
+				 enum memipc_req_type req_type);
+
+/*
+ * Create a request in a given area.
+ */
+int memipc_add_req(struct memipc_area *area, enum memipc_req_type req_type,
+		   ssize_t req_size, unsigned char *req_data)
+{
+	unsigned char volatile *header;
+
+	/* Are we supposed to write here? */
+	if (area->writer != memipc_my_pid) {
+		fprintf(stderr, "Process %lu attempted to write a request "
+			"to memipc area writable by a process %lu\n",
+			(unsigned long)memipc_my_pid,
+			(unsigned long)area->writer);
+		return -1;
+	}
+
+	/* Space after the reserved in-place request is not available */
+	if (area->resv_ptr != NULL)
+		return -1;
+
+	memipc_writer_update(area);
+
+	header = memipc_place_req(area, req_size, req_data);
+	if (header == NULL) {
+		if (area->counters != NULL)
+			memipc_counter_inc(&area->counters->ring_full);
+		return -1;
+	}
+
+	/*
+	  Header block is written last, after all other blocks are
+	  visible, so the reader only has to check it.
+	*/
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	memipc_write_header(header, req_type, req_size, req_data);
 	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	memipc_activity_mark(area);
+	memipc_doorbell_ring(area, req_type);
 	return 0;
 }
 
+/*
+ * Create multiple requests in a given area.
+ *
+ * Requests are written in order, up to MEMIPC_BATCH_MAX requests
+ * or until the area is full. Header blocks of all requests are written
+ * after a single barrier.
+ *
+ * Returns the number of requests written, or -1 if none could be
+ * written.
+ */
+int memipc_add_reqs(struct memipc_area *area,
+		    const struct memipc_req_vec *reqs,
+		    unsigned int count)
+{
+	unsigned char volatile *headers[MEMIPC_BATCH_MAX];
+	unsigned int i, n;
+
+	/* Are we supposed to write here? */
+	if (area->writer != memipc_my_pid) {
+		fprintf(stderr, "Process %lu attempted to write a request "
+			"to memipc area writable by a process %lu\n",
+			(unsigned long)memipc_my_pid,
+			(unsigned long)area->writer);
+		return -1;
+	}
+
+	/* Space after the reserved in-place request is not available */
+	if (area->resv_ptr != NULL)
+		return -1;
+
+	if (count == 0)
+		return 0;
+	if (count > MEMIPC_BATCH_MAX)
+		count = MEMIPC_BATCH_MAX;
+
+	memipc_writer_update(area);
+
+	for (n = 0; n < count; n++) {
+		headers[n] = memipc_place_req(area, reqs[n].req_size,
+					      reqs[n].req_data);
+		if (headers[n] == NULL)
+			break;
+	}
+	if ((n < count) && (area->counters != NULL))
+		memipc_counter_inc(&area->counters->ring_full);
+	if (n == 0)
+		return -1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < n; i++)
+		memipc_write_header(headers[i], reqs[i].req_type,
+				    reqs[i].req_size, reqs[i].req_data);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	memipc_activity_mark(area);
+	memipc_doorbell_ring(area, reqs[n - 1].req_type);
+	return n;
+}
+
 /*
  * Clear memory.
  *
  * memset() can not be used here because it may write multiple times
- * to the same location.
+ * to the same location. Aligned words are written with a single store
+ * each.
  */
 static inline void memipc_clearmem(volatile unsigned char *p, size_t size)
 {
+#if MEMIPC_ENCODE_WORD
+	if (MEMIPC_WORD_ALIGNED(p)) {
+		for (; size >= EIGHT; size -= EIGHT, p += EIGHT)
+			memipc_store_word(p, 0);
+	}
+#endif
 	while (size-- > 0) *p++ = 0;
 }
 
@@ -749,54 +1678,130 @@ static inline struct memipc_area *get_s_memipc_mosi(struct
 						    memipc_thread_params
 						    *arg);
 /*
- * Get request from a given area.
+ * Request taken from an area, but not released yet.
  */
-int memipc_get_req(struct memipc_area *area, enum memipc_req_type *req_type,
-		   ssize_t *req_size, unsigned char *req_data)
+struct memipc_taken_req
 {
-	size_t total_req_size, blocks_count, remainder,
-		blocks_count_1, blocks_count_2, dstsize;
-	unsigned i;
-	unsigned char volatile *localptr, *endptr, *curr_rptr;
-	unsigned char *dstptr;
-	unsigned inbuffer;
+	/* Header block */
+	unsigned char volatile *header;
+	/* Payload of a request written in place, or NULL */
+	unsigned char volatile *payload;
+	/* Size of the payload blocks */
+	size_t payload_size;
+};
 
-	/* Are we supposed to read here? */
-	if (area->reader != memipc_my_pid) {
-		fprintf(stderr, "Process %lu attempted to read a request from "
-			"memipc area readable by a process %lu\n",
-			(unsigned long)memipc_my_pid,
-			(unsigned long)area->reader);
-		return -1;
-	}
+/*
+ * Release payload of a request written in place.
+ *
+ * The header block remains valid, so the writer does not advance over
+ * nonzero payload bytes even if they become visible later.
+ */
+static inline void memipc_release_payload(struct memipc_taken_req *taken)
+{
+	if (taken->payload != NULL)
+		memipc_clearmem(taken->payload, taken->payload_size);
+	taken->payload = NULL;
+}
 
-	localptr = area->wptr;
-	endptr = area->area + area->size;
+/*
+ * Release header blocks of taken requests.
+ */
+static void memipc_release_headers(struct memipc_area *area,
+				   struct memipc_taken_req *taken,
+				   unsigned int count)
+{
+	unsigned int i;
 
-	/* Determine the amount of data in the buffer */
-	inbuffer = area->inbuffer;
-	while ((((*localptr) & 1) == 1) && (inbuffer < area->size)) {
-		localptr ++;
-		if (localptr >= endptr)
-			localptr = area->area;
-		inbuffer ++;
-	}
-	area->wptr = localptr;
-	area->inbuffer = inbuffer;
+	if (count == 0)
+		return;
+	/* All other blocks must be released before headers */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < count; i++)
+		memipc_clearmem(taken[i].header, EIGHT);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-	/* Check if the area has no complete blocks */
-	if (area->inbuffer < EIGHT)
-		return -1;
+	/* If we are reading from the thread input area, update the pointer */
+	if ((memipc_thread_self != NULL)
+	    && (area == get_s_memipc_mosi(memipc_thread_self)))
+		memipc_check_newdata_ptr = area->rptr;
+}
 
-	/* Read the first header */
+/*
+ * Take the request at the read pointer, and advance the read pointer.
+ *
+ * Encoded requests are decoded into req_data, *req_size is the size of
+ * req_data on input. Requests written in place are copied if
+ * inplace_data is NULL, otherwise *inplace_data is set to the payload
+ * in the area, and payload should be released with
+ * memipc_release_payload() when it is no longer used.
+ *
+ * All other blocks except the header block are released. The header
+ * block should be released with memipc_release_headers().
+ *
+ * Returns 0 if a request was taken, 1 if padding was skipped, -1 if
+ * there is no request, -2 if req_data is too small.
+ */
+static int memipc_take_req(struct memipc_area *area,
+			   enum memipc_req_type *req_type,
+			   ssize_t *req_size, unsigned char *req_data,
+			   unsigned char **inplace_data,
+			   struct memipc_taken_req *taken)
+{
+	size_t total_req_size, blocks_count, remainder,
+		blocks_count_1, blocks_count_2, first_size, dstsize;
+	unsigned char volatile *endptr, *curr_rptr;
+	unsigned char first_data[SEVEN - sizeof(struct memipc_req_header)];
 	uint32_t l_req_size;
 	char l_req_type;
-	if (read_decode_bytes_with_header(req_data, area->rptr,
-					  SEVEN
-					  - sizeof(struct memipc_req_header),
+
+	endptr = area->area + area->size;
+
+	/*
+	  Read the first header. Writer writes the header block last,
+	  so if it is valid, the rest of the request is also available.
+	*/
+	if (read_decode_bytes_with_header(first_data, area->rptr,
+					  sizeof(first_data),
 					  &l_req_type, &l_req_size))
 		return -1;
 
+	taken->header = area->rptr;
+	taken->payload = NULL;
+	taken->payload_size = 0;
+
+	if (l_req_size & MEMIPC_REQ_SIZE_INPLACE) {
+		/* Request written in place */
+		l_req_size &= ~MEMIPC_REQ_SIZE_INPLACE;
+		if ((l_req_type != MEMIPC_REQ_NONE) && (inplace_data == NULL)
+		    && (l_req_size > *req_size))
+			return -2;
+
+		blocks_count = 1 + (l_req_size + EIGHT - 1) / EIGHT;
+		taken->payload = area->rptr + EIGHT;
+		taken->payload_size = (blocks_count - 1) * EIGHT;
+		if (l_req_type == MEMIPC_REQ_NONE) {
+			/* Padding */
+			memipc_release_payload(taken);
+		} else {
+			*req_type = l_req_type;
+			*req_size = l_req_size;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+			if (inplace_data != NULL) {
+				*inplace_data = (unsigned char *)taken->payload;
+			} else {
+				memcpy(req_data, (unsigned char *)taken->payload,
+				       l_req_size);
+				memipc_release_payload(taken);
+			}
+#pragma GCC diagnostic pop
+		}
+		area->rptr += blocks_count * EIGHT;
+		if (area->rptr >= endptr)
+			area->rptr = area->area;
+		return (l_req_type == MEMIPC_REQ_NONE) ? 1 : 0;
+	}
+
 	total_req_size = l_req_size;
 
 	/* Check if there is sufficient amount of space in the destination */
@@ -804,90 +1809,676 @@ int memipc_get_req(struct memipc_area *area, enum memipc_req_type *req_type,
 		return -2;
 
 	*req_size = total_req_size - sizeof(struct memipc_req_header);
-
 	*req_type = l_req_type;
+	if (inplace_data != NULL)
+		*inplace_data = NULL;
 
-	if (total_req_size <= SEVEN) {
-		/* Just one block, already written */
+	first_size = sizeof(first_data);
+	if ((size_t)*req_size < first_size)
+		first_size = *req_size;
+	memcpy(req_data, first_data, first_size);
 
-		/* Mark data as read */
-		memipc_clearmem(area->rptr, EIGHT);
-		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (total_req_size <= SEVEN) {
+		/* Just one block, already copied */
 		area->rptr += EIGHT;
 		if (area->rptr >= endptr)
 			area->rptr = area->area;
-		area->inbuffer -= EIGHT;
-		/* Finished */
-	} else {
-		/* Multiple blocks */
-		blocks_count = total_req_size / SEVEN;
-		remainder = total_req_size - blocks_count * SEVEN;
-		if (remainder)
-			blocks_count++;
-
-		/* Check if there is sufficient amount of data in the buffer */
-		if (area->inbuffer < (blocks_count * EIGHT))
-			return -1;
-
-		blocks_count_1 = (endptr - area->rptr) / EIGHT;
-		if (blocks_count <= blocks_count_1) {
-			blocks_count_1 = blocks_count;
-			blocks_count_2 = 0;
-		} else {
-			blocks_count_2 = blocks_count - blocks_count_1;
-		}
+		return 0;
+	}
 
-		/* First block already copied */
+	/* Multiple blocks */
+	blocks_count = total_req_size / SEVEN;
+	remainder = total_req_size - blocks_count * SEVEN;
+	if (remainder)
+		blocks_count++;
 
-		dstptr = req_data + SEVEN - sizeof(struct memipc_req_header);
+	blocks_count_1 = (endptr - area->rptr) / EIGHT;
+	if (blocks_count <= blocks_count_1) {
+		blocks_count_1 = blocks_count;
+		blocks_count_2 = 0;
+	} else {
+		blocks_count_2 = blocks_count - blocks_count_1;
+	}
 
-		/* Read remaining data that was not wrapped around, if any */
-		curr_rptr = area->rptr;
-		for (i = 1; i < blocks_count_1; i++) {
-			dstsize = total_req_size - i * SEVEN;
-			if (dstsize > SEVEN)
-				dstsize = SEVEN;
-			if (read_decode_bytes(dstptr, curr_rptr + i * EIGHT,
-					      dstsize))
-				return -1;
-			dstptr += dstsize;
+	dstsize = (blocks_count_1 - 1) * SEVEN;
+	if (dstsize > (size_t)*req_size - first_size)
+		dstsize = *req_size - first_size;
 
-		}
-		curr_rptr += blocks_count_1 * EIGHT;
+	/* Read remaining data that was not wrapped around, if any */
+	if (read_decode_blocks(req_data + first_size, area->rptr + EIGHT,
+			       dstsize))
+		return -1;
 
-		/* If there is a wrap around, read wrapped around data */
-		if (curr_rptr >= endptr) {
+	/* If there is a wrap around, read wrapped around data */
+	if (blocks_count_2 > 0) {
+		if (read_decode_blocks(req_data + first_size + dstsize,
+				       area->area,
+				       *req_size - first_size - dstsize))
+			return -1;
+		memipc_clearmem(area->area, blocks_count_2 * EIGHT);
+		curr_rptr = area->area + blocks_count_2 * EIGHT;
+	} else {
+		curr_rptr = area->rptr + blocks_count_1 * EIGHT;
+		if (curr_rptr >= endptr)
 			curr_rptr = area->area;
-			if (blocks_count_2 > 0) {
-				for (i = 0; i < blocks_count_2; i++) {
-					dstsize = total_req_size
-						- (blocks_count_1 + i) * SEVEN;
-					if (dstsize > SEVEN)
-						dstsize = SEVEN;
-					if (read_decode_bytes(dstptr,
-							curr_rptr + i * EIGHT,
-							dstsize))
-						return -1;
-					dstptr += dstsize;
-				}
-				curr_rptr += blocks_count_2 * EIGHT;
-				memipc_clearmem(area->area,
-						blocks_count_2 * EIGHT);
-			}
-		}
-		memipc_clearmem(area->rptr, blocks_count_1 * EIGHT);
+	}
+	memipc_clearmem(area->rptr + EIGHT, (blocks_count_1 - 1) * EIGHT);
+	area->rptr = curr_rptr;
+	return 0;
+}
+
+/*
+ * Get request from a given area.
+ */
+int memipc_get_req(struct memipc_area *area, enum memipc_req_type *req_type,
+		   ssize_t *req_size, unsigned char *req_data)
+{
+	/* Padding can be followed by one request */
+	struct memipc_taken_req taken[2];
+	unsigned int n;
+	int rv;
+
+	/* Are we supposed to read here? */
+	if (area->reader != memipc_my_pid) {
+		fprintf(stderr, "Process %lu attempted to read a request from "
+			"memipc area readable by a process %lu\n",
+			(unsigned long)memipc_my_pid,
+			(unsigned long)area->reader);
+		return -1;
+	}
+
+	n = 0;
+	do {
+		rv = memipc_take_req(area, req_type, req_size, req_data,
+				     NULL, &taken[n]);
+		if (rv >= 0)
+			n++;
+	} while ((rv == 1) && (n < 2));
+	memipc_release_headers(area, taken, n);
+	return (rv == 1) ? -1 : rv;
+}
+
+/*
+ * Get multiple requests from a given area, and pass each of them to
+ * the handler.
+ *
+ * Up to max_reqs requests (at most MEMIPC_BATCH_MAX) are handled, or
+ * until max_bytes of request data are handled, if max_bytes is not
+ * zero. Encoded requests are decoded into the buffer, requests written
+ * in place are passed to the handler without copying. Request data is
+ * valid only until the handler returns. Areas are released after all
+ * requests are handled, with a single barrier.
+ *
+ * Returns the number of requests handled, or -2 if a request does not
+ * fit in the buffer.
+ */
+int memipc_get_reqs(struct memipc_area *area, unsigned int max_reqs,
+		    size_t max_bytes, unsigned char *buffer,
+		    size_t buffer_size, memipc_req_handler_t handler,
+		    void *arg)
+{
+	/* Every request can be preceded by padding */
+	struct memipc_taken_req taken[MEMIPC_BATCH_MAX * 2];
+	enum memipc_req_type req_type;
+	ssize_t req_size;
+	unsigned char *inplace_data;
+	unsigned int n, handled;
+	size_t bytes;
+	int rv = -1;
+
+	/* Are we supposed to read here? */
+	if (area->reader != memipc_my_pid) {
+		fprintf(stderr, "Process %lu attempted to read a request from "
+			"memipc area readable by a process %lu\n",
+			(unsigned long)memipc_my_pid,
+			(unsigned long)area->reader);
+		return -1;
+	}
+
+	if (max_reqs > MEMIPC_BATCH_MAX)
+		max_reqs = MEMIPC_BATCH_MAX;
+
+	n = 0;
+	handled = 0;
+	bytes = 0;
+	while ((handled < max_reqs)
+	       && ((max_bytes == 0) || (bytes < max_bytes))) {
+		/*
+		  If the area was full, the read pointer may return to the
+		  header of the first request in this batch, that is not
+		  released yet.
+		*/
+		if ((n > 0) && (area->rptr == taken[0].header))
+			break;
+		req_size = buffer_size;
+		rv = memipc_take_req(area, &req_type, &req_size, buffer,
+				     &inplace_data, &taken[n]);
+		if (rv < 0)
+			break;
+		n++;
+		if (rv == 1)
+			continue;
+		handler(req_type, req_size,
+			(inplace_data != NULL) ? inplace_data : buffer, arg);
+		memipc_release_payload(&taken[n - 1]);
+		handled++;
+		bytes += req_size;
+	}
+	memipc_release_headers(area, taken, n);
+	if ((handled == 0) && (rv == -2))
+		return -2;
+	return handled;
+}
+
+/*
+ * Reserve space for a request written in place.
+ *
+ * Returns a pointer to req_size bytes of payload in the area, or NULL
+ * if there is not enough contiguous space. Payload should be written
+ * there, then the request is made visible to the reader with
+ * memipc_commit_req(). No other requests can be added to the area
+ * until the reserved one is committed or cancelled.
+ */
+unsigned char *memipc_reserve_req(struct memipc_area *area, size_t req_size)
+{
+	size_t blocks_count, blocks_available_1, blocks_available_2;
+	unsigned char volatile *endptr;
+
+	/* Are we supposed to write here? */
+	if (area->writer != memipc_my_pid) {
+		fprintf(stderr, "Process %lu attempted to write a request "
+			"to memipc area writable by a process %lu\n",
+			(unsigned long)memipc_my_pid,
+			(unsigned long)area->writer);
+		return NULL;
+	}
+
+	if ((area->resv_ptr != NULL) || (req_size >= MEMIPC_REQ_SIZE_INPLACE))
+		return NULL;
+
+	endptr = area->area + area->size;
+	memipc_writer_update(area);
+
+	/* Check if the area is full */
+	if (area->inbuffer == area->size)
+		return NULL;
+
+	/* Header block, then payload rounded up to blocks */
+	blocks_count = 1 + (req_size + EIGHT - 1) / EIGHT;
+
+	if (area->wptr < area->rptr) {
+		blocks_available_1 = (area->rptr - area->wptr) / EIGHT;
+		blocks_available_2 = 0;
+	} else {
+		blocks_available_1 = (endptr - area->wptr) / EIGHT;
+		blocks_available_2 = (area->rptr - area->area) / EIGHT;
+	}
+
+	if (blocks_count > blocks_available_1) {
+		/*
+		  Payload can't be placed before the read pointer or the
+		  end of the area. If it fits at the start of the area,
+		  pad the rest of the area.
+		*/
+		if ((blocks_count > blocks_available_2)
+		    || (area->wptr < area->rptr))
+			return NULL;
+		if (write_encode_bytes_with_header(area->wptr, NULL, 0,
+						   MEMIPC_REQ_NONE,
+						   ((blocks_available_1 - 1)
+						    * EIGHT)
+						   | MEMIPC_REQ_SIZE_INPLACE))
+			return NULL;
+		area->inbuffer += blocks_available_1 * EIGHT;
+		area->wptr = area->area;
+	}
+
+	area->resv_ptr = area->wptr;
+	area->resv_size = req_size;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+	return (unsigned char *)(area->resv_ptr + EIGHT);
+#pragma GCC diagnostic pop
+}
+
+/*
+ * Make the reserved request visible to the reader.
+ *
+ * req_size may be smaller than the size passed to memipc_reserve_req().
+ */
+int memipc_commit_req(struct memipc_area *area, enum memipc_req_type req_type,
+		      size_t req_size)
+{
+	size_t blocks_count;
+	unsigned char volatile *endptr, *next_wptr;
+
+	if ((area->resv_ptr == NULL) || (req_size > area->resv_size))
+		return -1;
+
+	endptr = area->area + area->size;
+	blocks_count = 1 + (req_size + EIGHT - 1) / EIGHT;
+
+	/* Payload must be visible before the header */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (write_encode_bytes_with_header(area->resv_ptr, NULL, 0,
+					   req_type,
+					   req_size
+					   | MEMIPC_REQ_SIZE_INPLACE))
+		return -1;
+
+	next_wptr = area->resv_ptr + blocks_count * EIGHT;
+	if (next_wptr >= endptr)
+		next_wptr = area->area;
+	area->inbuffer += blocks_count * EIGHT;
+	area->wptr = next_wptr;
+	area->resv_ptr = NULL;
+	area->resv_size = 0;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	memipc_activity_mark(area);
+	memipc_doorbell_ring(area, req_type);
+	return 0;
+}
+
+/*
+ * Cancel the reserved request.
+ */
+void memipc_cancel_req(struct memipc_area *area)
+{
+	area->resv_ptr = NULL;
+	area->resv_size = 0;
+}
+
+/*
+ * Release blocks of an in-place request at the read pointer.
+ */
+static void memipc_release_blocks(struct memipc_area *area,
+				  size_t blocks_count)
+{
+	unsigned char volatile *endptr;
+
+	endptr = area->area + area->size;
+
+	/* Payload is cleared first, header last */
+	if (blocks_count > 1) {
+		memipc_clearmem(area->rptr + EIGHT,
+				(blocks_count - 1) * EIGHT);
 		__atomic_thread_fence(__ATOMIC_SEQ_CST);
-		area->rptr = curr_rptr;
-		area->inbuffer -= blocks_count * EIGHT;
-		/* Finished */
 	}
+	memipc_clearmem(area->rptr, EIGHT);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	area->rptr += blocks_count * EIGHT;
+	if (area->rptr >= endptr)
+		area->rptr = area->area;
+
 	/* If we are reading from the thread input area, update the pointer */
 	if ((memipc_thread_self != NULL)
 	    && (area == get_s_memipc_mosi(memipc_thread_self)))
 		memipc_check_newdata_ptr = area->rptr;
+}
+
+/*
+ * Get a pointer to the next request in a given area without copying.
+ *
+ * Returns 0 and sets *req_data to the payload in the area if the request
+ * was written in place, it stays valid until memipc_release_req() is
+ * called. Returns 1 if the next request is encoded and should be received
+ * with memipc_get_req(), -1 if there are no requests.
+ */
+int memipc_peek_req(struct memipc_area *area, enum memipc_req_type *req_type,
+		    ssize_t *req_size, unsigned char **req_data)
+{
+	unsigned char dummy[2];
+	uint32_t l_req_size;
+	char l_req_type;
+	size_t blocks_count;
+
+	/* Are we supposed to read here? */
+	if (area->reader != memipc_my_pid) {
+		fprintf(stderr, "Process %lu attempted to read a request from "
+			"memipc area readable by a process %lu\n",
+			(unsigned long)memipc_my_pid,
+			(unsigned long)area->reader);
+		return -1;
+	}
+
+	for (;;) {
+		if (read_decode_bytes_with_header(dummy, area->rptr, 0,
+						  &l_req_type, &l_req_size))
+			return -1;
+
+		if ((l_req_size & MEMIPC_REQ_SIZE_INPLACE) == 0)
+			return 1;
+
+		l_req_size &= ~MEMIPC_REQ_SIZE_INPLACE;
+		blocks_count = 1 + (l_req_size + EIGHT - 1) / EIGHT;
+
+		if (l_req_type != MEMIPC_REQ_NONE)
+			break;
+
+		/* Padding, skip to the start of the area */
+		memipc_release_blocks(area, blocks_count);
+	}
+
+	area->peek_blocks = blocks_count;
+	*req_type = l_req_type;
+	*req_size = l_req_size;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+	*req_data = (unsigned char *)(area->rptr + EIGHT);
+#pragma GCC diagnostic pop
 	return 0;
 }
 
+/*
+ * Release the request returned by memipc_peek_req().
+ */
+void memipc_release_req(struct memipc_area *area)
+{
+	if (area->peek_blocks == 0)
+		return;
+	memipc_release_blocks(area, area->peek_blocks);
+	area->peek_blocks = 0;
+}
+
+/*
+ * Pre-entry phase and isolation-safe allocator.
+ *
+ * Before entering isolation, the thread touches its stack and TLS
+ * variables, and creates a locked heap reserve. Pages are allocated
+ * then, so there are no page faults and no allocator system calls
+ * while the thread runs isolated. tmc_isol_alloc() serves blocks from
+ * the reserve, freed blocks are kept in per-size lists and reused.
+ */
+#ifndef ISOL_STACK_RESERVE
+#define ISOL_STACK_RESERVE (256 * 1024)
+#endif
+
+#ifndef ISOL_HEAP_RESERVE
+#define ISOL_HEAP_RESERVE (1024 * 1024)
+#endif
+
+/* Part of the stack left untouched below the reserve */
+#ifndef ISOL_STACK_MARGIN
+#define ISOL_STACK_MARGIN (16 * 1024)
+#endif
+
+/* Block sizes are powers of two, from 16 bytes to 2^(ARENA_CLASSES-1) */
+#define ARENA_MIN_CLASS (4)
+#define ARENA_CLASSES (40)
+/* Block header, keeps payload aligned to 16 bytes */
+#define ARENA_HEADER_SIZE (16)
+
+struct memipc_arena {
+	unsigned char *base; /* reserve, or NULL */
+	size_t size; /* size of the reserve */
+	size_t used; /* bytes given to blocks, never decreases */
+	int created; /* nonzero if creation was attempted */
+	void *free_blocks[ARENA_CLASSES]; /* freed blocks by class */
+};
+
+static size_t _global_isolated_stack_reserve = ISOL_STACK_RESERVE;
+static size_t _global_isolated_heap_reserve = ISOL_HEAP_RESERVE;
+static unsigned int _global_isolated_heap_flags = 0;
+static __thread struct memipc_arena memipc_arena;
+
+/*
+ * Create the heap reserve of the calling thread.
+ *
+ * Memory is locked and allocated on the node of the CPU the thread
+ * runs on.
+ */
+static void memipc_arena_create(void)
+{
+	struct memipc_arena *arena = &memipc_arena;
+	size_t size;
+	void *p = MAP_FAILED;
+
+	if (arena->created)
+		return;
+	arena->created = 1;
+	size = _global_isolated_heap_reserve;
+	if (size == 0)
+		return;
+
+	if (_global_isolated_heap_flags & TMC_ISOL_RESERVE_HUGEPAGES) {
+		size = (size + AREA_HUGEPAGE_SIZE - 1)
+			& ~(size_t)(AREA_HUGEPAGE_SIZE - 1);
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return;
+#ifdef MADV_HUGEPAGE
+		if (_global_isolated_heap_flags & TMC_ISOL_RESERVE_HUGEPAGES)
+			madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+	/* Locking allocates all pages */
+	if (mlock(p, size)) {
+		munmap(p, size);
+		return;
+	}
+	arena->base = (unsigned char *)p;
+	arena->size = size;
+	arena->used = 0;
+	memset(arena->free_blocks, 0, sizeof(arena->free_blocks));
+}
+
+/*
+ * Delete the heap reserve of the calling thread.
+ */
+static void memipc_arena_delete(void)
+{
+	struct memipc_arena *arena = &memipc_arena;
+
+	if (arena->base != NULL)
+		munmap(arena->base, arena->size);
+	memset(arena, 0, sizeof(struct memipc_arena));
+}
+
+/*
+ * Allocate a block from the heap reserve of the calling thread.
+ */
+static inline void *memipc_arena_alloc(size_t size)
+{
+	struct memipc_arena *arena = &memipc_arena;
+	unsigned char *block;
+	unsigned int c;
+	size_t need;
+
+	if (!arena->created)
+		memipc_arena_create();
+	if (size <= ((size_t)1 << ARENA_MIN_CLASS))
+		c = ARENA_MIN_CLASS;
+	else
+		c = 64 - __builtin_clzll((unsigned long long)(size - 1));
+	if (c >= ARENA_CLASSES)
+		return NULL;
+
+	block = arena->free_blocks[c];
+	if (block != NULL) {
+		arena->free_blocks[c] = *(void **)block;
+		return block;
+	}
+
+	need = ARENA_HEADER_SIZE + ((size_t)1 << c);
+	if ((arena->base == NULL) || (need > arena->size - arena->used))
+		return NULL;
+	block = arena->base + arena->used + ARENA_HEADER_SIZE;
+	arena->used += need;
+	*(unsigned int *)(block - ARENA_HEADER_SIZE) = c;
+	return block;
+}
+
+/*
+ * Return a block to the heap reserve of the calling thread.
+ */
+static inline void memipc_arena_free(void *ptr)
+{
+	struct memipc_arena *arena = &memipc_arena;
+	unsigned char *block = (unsigned char *)ptr;
+	unsigned int c;
+
+	/* Blocks of other threads are ignored */
+	if ((block == NULL) || (block < arena->base + ARENA_HEADER_SIZE)
+	    || (block >= arena->base + arena->used))
+		return;
+	c = *(unsigned int *)(block - ARENA_HEADER_SIZE);
+	*(void **)block = arena->free_blocks[c];
+	arena->free_blocks[c] = block;
+}
+
+/*
+ * Flight recorder of the calling thread, see tmc_isol_trace().
+ */
+#ifndef ISOL_TRACE_ENTRIES
+#define ISOL_TRACE_ENTRIES (0)
+#endif
+
+static size_t _global_isolated_trace_entries = ISOL_TRACE_ENTRIES;
+__thread struct tmc_isol_trace_ring *memipc_trace_ring = NULL;
+static __thread size_t memipc_trace_ring_size = 0;
+
+/*
+ * Create the trace ring of the calling thread on its CPU, or keep the
+ * existing one.
+ */
+static void memipc_trace_create(int cpu)
+{
+	struct tmc_isol_trace_ring *r;
+	struct timespec ts, delay;
+	uint64_t c0, n0, n1;
+	char name[64];
+	size_t size;
+	int fd;
+
+	if ((memipc_trace_ring != NULL) || (_global_isolated_trace_entries == 0))
+		return;
+	size = sizeof(struct tmc_isol_trace_ring)
+		+ _global_isolated_trace_entries
+		* sizeof(struct tmc_isol_trace_entry);
+	snprintf(name, sizeof(name), TMC_ISOL_TRACE_NAME, cpu);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return;
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return;
+	}
+	r = (struct tmc_isol_trace_ring *)mmap(NULL, size,
+					       PROT_READ | PROT_WRITE,
+					       MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED)
+		return;
+
+	/* Counter rate, so readers can convert time of entries */
+	delay.tv_sec = 0;
+	delay.tv_nsec = 1000000;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	n0 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	c0 = tmc_isol_cycles();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	n1 = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->cycles_per_sec = (n1 > n0) ?
+		(uint64_t)((double)(tmc_isol_cycles() - c0) * 1e9
+			   / (n1 - n0)) : 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->start_cycles = tmc_isol_cycles();
+	r->start_nsec = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->entry_size = sizeof(struct tmc_isol_trace_entry);
+	r->mask = _global_isolated_trace_entries - 1;
+	r->cpu = cpu;
+	r->pid = getpid();
+	r->tid = syscall(SYS_gettid);
+	r->head = 0;
+	/* Readers check the magic last */
+	__atomic_store_n(&r->magic, TMC_ISOL_TRACE_MAGIC, __ATOMIC_RELEASE);
+	memipc_trace_ring = r;
+	memipc_trace_ring_size = size;
+}
+
+/*
+ * Unmap the trace ring of the calling thread. It remains in shared
+ * memory.
+ */
+static void memipc_trace_delete(void)
+{
+	if (memipc_trace_ring == NULL)
+		return;
+	munmap(memipc_trace_ring, memipc_trace_ring_size);
+	memipc_trace_ring = NULL;
+	memipc_trace_ring_size = 0;
+}
+
+/*
+ * Touch stack pages below the current frame, no more than the stack of
+ * the thread has left.
+ */
+static void __attribute__((noinline)) memipc_prefault_stack(size_t size)
+{
+	volatile unsigned char *p;
+	pthread_attr_t attr;
+	void *stack_addr;
+	size_t stack_size, left, i;
+
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		if (pthread_attr_getstack(&attr, &stack_addr,
+					  &stack_size) == 0) {
+			left = (unsigned char *)&attr
+				- (unsigned char *)stack_addr;
+			if (left < ISOL_STACK_MARGIN)
+				size = 0;
+			else if (size > left - ISOL_STACK_MARGIN)
+				size = left - ISOL_STACK_MARGIN;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	if (size == 0)
+		return;
+
+	p = (volatile unsigned char *)alloca(size);
+	for (i = 0; i < size; i += 4096)
+		p[i] = 0;
+	p[size - 1] = 0;
+}
+
+/*
+ * Write a byte back to its place, so the page is allocated.
+ */
+static inline void memipc_touch(void *ptr)
+{
+	volatile unsigned char *p = (volatile unsigned char *)ptr;
+
+	*p = *p;
+}
+
+/*
+ * Pre-entry phase, called by the thread on its CPU before entering
+ * isolation.
+ */
+static void memipc_isolation_prefault(void)
+{
+	/* TLS of a dynamically loaded library is allocated on first use */
+	memipc_touch(&memipc_thread_launch_confirmed);
+	memipc_touch(&memipc_thread_continue_flag);
+	memipc_touch(&memipc_thread_ok_leave_flag);
+	memipc_touch((void *)&memipc_check_newdata_ptr);
+	memipc_touch((void *)&memipc_check_signal);
+	memipc_touch(&memipc_loop_hist);
+	memipc_touch(&memipc_arena);
+	memipc_touch(&memipc_trace_ring);
+
+	if (_global_isolated_stack_reserve != 0)
+		memipc_prefault_stack(_global_isolated_stack_reserve);
+	memipc_arena_create();
+}
+
 /*
  * Enter isolation mode.
  *
@@ -900,14 +2491,17 @@ static int start_isolation(int cpu)
 	/* Exit from isolation, if still in isolation mode */
 	prctl(PR_SET_TASK_ISOLATION, 0, 0, 0, 0);
 
-	if (mlockall(MCL_CURRENT))
-		return -1;
-
 	CPU_ZERO(&set);
 	CPU_SET(cpu, &set);
 	if (sched_setaffinity(0, sizeof(cpu_set_t), &set))
 		return -1;
 
+	/* Pages are allocated on this CPU's node, then locked */
+	memipc_isolation_prefault();
+	memipc_trace_create(cpu);
+	if (mlockall(MCL_CURRENT))
+		return -1;
+
 	return prctl(PR_SET_TASK_ISOLATION,
 		     PR_TASK_ISOLATION_ENABLE
 		     | PR_TASK_ISOLATION_USERSIG
@@ -919,6 +2513,9 @@ static cpu_set_t _global_nonisol_cpuset, _global_isol_cpuset,
 	_global_running_cpuset;
 #if USE_CPU_SUBSETS
 static char *server_socket_name = NULL;
+/* Subset from the CPU subsets file, checked again on every claim */
+static char *_global_cpu_subset_id = NULL;
+static int memipc_cpu_subset_lookup(const char *id, cpu_set_t *cpus);
 #endif
 
 /*
@@ -1167,27 +2764,37 @@ enum isol_timer_type {
     ISOL_TIMER_CPUTICKDEV
 };
 
-#if DEBUG_ISOL_VERBOSE
 static const char *isol_timer_type_name[] = {
 	"HR timer",
 	"CPU timer",
 	"Tick",
 	"Tick (CPU)"
 };
+
+#if DEBUG_ISOL_NAMES
+/* Timer names are truncated to those lengths */
+#define TIMER_ADDR_LEN (24)
+#define TIMER_HANDLER_LEN (64)
 #endif
 
+/* Initial number of timers in a per-CPU pool */
+#define TIMER_POOL_INIT_SIZE (16)
+
 /*
   Timer list for debugging purposes.
+
+  Timers are kept in a per-CPU pool that is reused on every scan, and
+  only grows. Time until the CPU is quiet is tracked separately, in
+  lasttimer of the thread.
  */
 struct isol_linux_timer {
 #if DEBUG_ISOL_NAMES
-	char *addr;
-	char *handler;
+	char addr[TIMER_ADDR_LEN];
+	char handler[TIMER_HANDLER_LEN];
 #endif
 	enum isol_timer_type timer_type;
 	int64_t last_updated;
 	int64_t expires;
-	struct isol_linux_timer *next;
 };
 
 /*
@@ -1376,15 +2983,142 @@ static void memipc_remove_timers_from_all_desc(void);
 static void show_all_timers_by_desc(FILE *f, cpu_set_t *cpuset);
 #endif
 
-static int64_t remaining_nsec_before_expiration(int64_t now);
+static int64_t remaining_nsec_before_expiration(
+				const struct memipc_thread_params *thread,
+				int64_t now);
+
+/* Source of timers information */
+#define TIMER_LIST_FILE "/proc/timer_list"
+
+/* Size of a single read from the timers list */
+#define TIMER_LIST_READ_SIZE (64 * 1024)
+
+/*
+ * Read a whole file from /proc with pread() from the start, into a
+ * buffer that grows as necessary.
+ *
+ * Returns the size of data, the buffer is terminated with a zero byte.
+ */
+static ssize_t proc_pread_all(int fd, char **buffer, size_t *buffer_size,
+			      size_t read_size)
+{
+	char *new_buffer;
+	size_t len = 0;
+	ssize_t l;
+
+	for (;;) {
+		if ((*buffer_size - len) < (read_size + 1)) {
+			new_buffer = realloc(*buffer, *buffer_size
+					     + read_size * 4);
+			if (new_buffer == NULL)
+				return -1;
+			*buffer = new_buffer;
+			*buffer_size += read_size * 4;
+		}
+		/* Sequential reads from the start regenerate the file */
+		l = pread(fd, *buffer + len, *buffer_size - len - 1, len);
+		if (l < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (l == 0)
+			break;
+		len += l;
+	}
+	(*buffer)[len] = 0;
+	return len;
+}
+
+/*
+ * Read the whole timers list into a buffer.
+ *
+ * File and buffer are kept between scans, buffer only grows. Returns
+ * the size of data, the buffer is terminated with a zero byte.
+ */
+static ssize_t timer_list_read(char **data)
+{
+	static int fd = -1;
+	static char *buffer = NULL;
+	static size_t buffer_size = 0;
+	ssize_t l;
+
+	if (fd < 0) {
+		fd = open(TIMER_LIST_FILE, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+	}
+
+	l = proc_pread_all(fd, &buffer, &buffer_size, TIMER_LIST_READ_SIZE);
+	if (l < 0) {
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+	*data = buffer;
+	return l;
+}
+
+/*
+ * Find the next section of the timers list, either another CPU or
+ * tick devices.
+ */
+static char *timer_list_next_section(char *p, char *end)
+{
+	while (p < end) {
+		if ((((end - p) >= 4) && !memcmp(p, "cpu:", 4))
+		    || (((end - p) >= 12) && !memcmp(p, "Tick Device:", 12)))
+			return p;
+		p = memchr(p, '\n', end - p);
+		if (p == NULL)
+			return end;
+		p++;
+	}
+	return end;
+}
+
+/*
+ * Durations of scans, written only by the manager.
+ */
+struct memipc_scan_stats {
+	uint64_t count;
+	int64_t nsec; /* total */
+	int64_t max_nsec;
+};
+
+static struct memipc_scan_stats _global_timer_scan_stats;
+static struct memipc_scan_stats _global_proc_scan_stats;
+
+static int64_t memipc_scan_start(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void memipc_scan_done(struct memipc_scan_stats *stats, int64_t start)
+{
+	int64_t nsec;
+
+	nsec = memipc_scan_start() - start;
+	stats->count++;
+	stats->nsec += nsec;
+	if (nsec > stats->max_nsec)
+		stats->max_nsec = nsec;
+}
 
 /*
  * Process all timers visible in /proc/timer_list , determine timers
  * still running on CPUs that are intended for isolation.  cpuset is
  * set to all CPUs intended for isolation, that have timers running on
  * them.
+ *
+ * Timers of CPUs outside of filter, if it is not NULL, are skipped
+ * together with their sections of the list.
  */
-static int process_all_timers(cpu_set_t *cpuset, int64_t *now)
+static int process_all_timers(cpu_set_t *cpuset, const cpu_set_t *filter,
+			      int64_t *now)
 {
 	static const char *token_timers_list[] = {
 	    "now",
@@ -1414,9 +3148,9 @@ static int process_all_timers(cpu_set_t *cpuset, int64_t *now)
 	    28
 	};
 
-	char stringbuf[1024];
+	char *data, *data_end, *line, *next;
+	ssize_t data_size;
 	const char *p, *e;
-	FILE *f;
 	int i, retval = 0;
 	enum {
 	      T_PARS_START,
@@ -1443,10 +3177,12 @@ static int process_all_timers(cpu_set_t *cpuset, int64_t *now)
 	      T_TOKEN_BCAST_ONESHOT_MASK,
 	      T_TOKEN_NONE
 	} token = T_TOKEN_NONE;
+	int64_t scan_start = memipc_scan_start();
 
-	f = fopen("/proc/timer_list", "rt");
-	if (f == NULL)
+	data_size = timer_list_read(&data);
+	if (data_size < 0)
 		return -1;
+	data_end = data + data_size;
 	parser_state = T_PARS_START;
 	int64_t now_at = KTIME_MAX, expires_next = KTIME_MAX,
 		hrtimer_softexp = KTIME_MAX, hrtimer_exp = KTIME_MAX,
@@ -1468,8 +3204,14 @@ static int process_all_timers(cpu_set_t *cpuset, int64_t *now)
 
 	memipc_remove_timers_from_all_desc();
 
-	while (fgets(stringbuf, sizeof(stringbuf), f) != NULL) {
-		p = stringbuf;
+	for (next = data; next < data_end; ) {
+		line = next;
+		next = memchr(line, '\n', data_end - line);
+		if (next != NULL)
+			*next++ = 0;
+		else
+			next = data_end;
+		p = line;
 		skip_whitespace(&p);
 		e = find_endtoken(p);
 		if (e != p) {
@@ -1564,6 +3306,20 @@ static int process_all_timers(cpu_set_t *cpuset, int64_t *now)
 					    == 1) {
 						parser_state = T_PARS_CPU;
 						expires_next = KTIME_MAX;
+						if ((filter != NULL)
+						    && ((curr_cpu < 0)
+							|| (curr_cpu
+							    >= CPU_SETSIZE)
+							|| !CPU_ISSET(curr_cpu,
+								      filter))) {
+							/* Skip this CPU */
+							next =
+							timer_list_next_section(
+								next,
+								data_end);
+							parser_state =
+								T_PARS_CPU_LIST;
+						}
 					}
 					break;
 				case T_TOKEN_ACTIVE:
@@ -1782,7 +3538,6 @@ static int process_all_timers(cpu_set_t *cpuset, int64_t *now)
 			}
 		}
 	}
-	fclose(f);
 #if DEBUG_ISOL_NAMES
 	if (hrtimer_func) {
 		free(hrtimer_func);
@@ -1797,6 +3552,7 @@ static int process_all_timers(cpu_set_t *cpuset, int64_t *now)
 		*now = now_at;
 		cpu_remove_expired_timers(now_at);
 	}
+	memipc_scan_done(&_global_timer_scan_stats, scan_start);
 	return retval;
 }
 
@@ -1808,41 +3564,92 @@ static int process_all_timers(cpu_set_t *cpuset, int64_t *now)
 
 /* struct memipc_thread_params; */
 
+/*
+ * Affinity of a thread.
+ *
+ * It is large, so it is kept apart from fields that are accessed on
+ * every scan.
+ */
+struct foreign_thread_cpus {
+	cpu_set_t cpus_allowed;
+	cpu_set_t prev_cpus_allowed;
+};
+
 struct foreign_thread_desc {
 	pid_t pid;
 	pid_t tid;
+	int cpu;
+	int vol_context_switches;
+	int nonvol_context_switches;
+	int prev_cpu;
+	int prev_vol_context_switches;
+	int prev_nonvol_context_switches;
+	int update_flag;
+	/* Kept-open /proc files of a watched thread, or -1 */
+	int status_fd;
+	int stat_fd;
 	pthread_t thread;
 
 	/* non-NULL only for managed threads */
 	struct memipc_thread_params *isolated_thread;
 
+	/* Affinity, entries of the table point to proctable_cpus */
+	struct foreign_thread_cpus *cpus;
+
 #if DEBUG_ISOL_NAMES
 	char *name;
 #endif
-	cpu_set_t cpus_allowed;
-	int cpu;
-	int vol_context_switches;
-	int nonvol_context_switches;
-	cpu_set_t prev_cpus_allowed;
-	int prev_cpu;
-	int prev_vol_context_switches;
-	int prev_nonvol_context_switches;
-	int update_flag;
 };
 
 /*
  * List of all threads visible on the system. This list is allocated
- * on first scan and gets re-allocated if it has to grow. It never
- * shrinks or freed.
+ * on first scan and gets re-allocated, doubling its size, if it has to
+ * grow. It never shrinks or freed. Affinity of each entry is in
+ * proctable_cpus at the same index.
  */
 static struct foreign_thread_desc *proctable = NULL;
+static struct foreign_thread_cpus *proctable_cpus = NULL;
 static int proctable_size = 0, proctable_alloc = 0;
 
 /*
- * Block sizes for dynamic allocation.
+ * Index of the list by thread ID, with open addressing. Slots
+ * contain entry index + 1, or 0 if empty. Size is a power of two, at
+ * least twice the allocated size of the list, so there are always
+ * free slots.
+ */
+static int *proctable_index = NULL;
+static unsigned int proctable_index_size = 0;
+
+/*
+ * Initial size for dynamic allocation.
  */
-#define PROCTABLE_INIT_ALLOC_SIZE (10)
-#define PROCTABLE_INC_ALLOC_SIZE (4)
+#define PROCTABLE_INIT_ALLOC_SIZE (64)
+
+/*
+ * Incremental scan.
+ *
+ * Threads that can run on CPUs intended for isolation, and managed
+ * threads, are "watched" -- they are re-read on every scan, and their
+ * /proc files are kept open. Other threads are only checked for
+ * existence, and re-read on every PROCTABLE_FULL_SCAN_PASSES-th scan.
+ */
+#ifndef PROCTABLE_INCREMENTAL
+#define PROCTABLE_INCREMENTAL 1
+#endif
+
+#ifndef PROCTABLE_FULL_SCAN_PASSES
+#define PROCTABLE_FULL_SCAN_PASSES (16)
+#endif
+
+/* Maximum number of watched threads with kept-open files */
+#ifndef PROCTABLE_MAX_OPEN_THREADS
+#define PROCTABLE_MAX_OPEN_THREADS (128)
+#endif
+
+/* Size of a single read from /proc/<pid>/task/<tid> files */
+#define PROC_READ_SIZE (4096)
+
+static int proctable_open_threads = 0;
 
 static int memipc_attach_thread_to_desc(struct foreign_thread_desc *desc);
 static void memipc_detach_thread_from_desc(struct foreign_thread_desc *desc);
@@ -1854,7 +3661,12 @@ static void memipc_update_foreign_thread(struct foreign_thread_desc *desc);
 static int proctable_init_thread(struct foreign_thread_desc *dst,
 				 struct foreign_thread_desc *src)
 {
+	struct foreign_thread_cpus *cpus;
+
+	/* Affinity of the entry is already assigned */
+	cpus = dst->cpus;
 	memset(dst, 0, sizeof(struct foreign_thread_desc));
+	dst->cpus = cpus;
 #if DEBUG_ISOL_NAMES
 	if (src->name != NULL)
 		dst->name = strdup(src->name);
@@ -1864,98 +3676,216 @@ static int proctable_init_thread(struct foreign_thread_desc *dst,
 	dst->pid = src->pid;
 	dst->tid = src->tid;
 	dst->thread = src->thread;
-	dst->cpus_allowed = src->cpus_allowed;
+	dst->cpus->cpus_allowed = src->cpus->cpus_allowed;
+	CPU_ZERO(&dst->cpus->prev_cpus_allowed);
 	dst->cpu = src->cpu;
 	dst->vol_context_switches = src->vol_context_switches;
 	dst->nonvol_context_switches = src->nonvol_context_switches;
+	dst->status_fd = src->status_fd;
+	dst->stat_fd = src->stat_fd;
+
+	memipc_attach_thread_to_desc(dst);
+
+	dst->update_flag = 1;
+
+	return 0;
+}
+
+/*
+ * Update the thread entry.
+ */
+static int proctable_update_thread(struct foreign_thread_desc *dst,
+				   struct foreign_thread_desc *src)
+{
+
+#if DEBUG_ISOL_NAMES
+	if ((src->name != NULL)
+	    && (dst->name != NULL)
+	    && strcmp(src->name, dst->name)) {
+		int sl, dl;
+		sl = strlen(src->name);
+		dl = strlen(dst->name);
+		if (dl < sl) {
+			free(dst->name);
+			dst->name = strdup(src->name);
+		}
+		else
+			memcpy(dst->name, src->name, sl + 1);
+	}
+#endif
+
+	dst->cpus->prev_cpus_allowed = dst->cpus->cpus_allowed;
+	dst->cpus->cpus_allowed = src->cpus->cpus_allowed;
+
+	dst->prev_cpu = dst->cpu;
+	dst->cpu = src->cpu;
+
+	dst->prev_vol_context_switches = dst->vol_context_switches;
+	dst->vol_context_switches = src->vol_context_switches;
+
+	dst->prev_nonvol_context_switches = dst->nonvol_context_switches;
+	dst->nonvol_context_switches = src->nonvol_context_switches;
+
+	memipc_attach_thread_to_desc(dst);
+
+	dst->update_flag = 1;
+	return 0;
+}
+
+static inline unsigned int proctable_hash(pid_t tid)
+{
+	return (uint32_t)tid * 2654435761U;
+}
+
+/*
+ * Add an entry to the index.
+ */
+static void proctable_index_insert(int i)
+{
+	unsigned int mask, slot;
+
+	mask = proctable_index_size - 1;
+	for (slot = proctable_hash(proctable[i].tid) & mask;
+	     proctable_index[slot] != 0; slot = (slot + 1) & mask);
+	proctable_index[slot] = i + 1;
+}
+
+/*
+ * Re-create the index from all entries.
+ */
+static void proctable_index_rebuild(void)
+{
+	int i;
+
+	memset(proctable_index, 0, proctable_index_size * sizeof(int));
+	for (i = 0; i < proctable_size; i++)
+		proctable_index_insert(i);
+}
+
+/*
+ * Find a thread in the table.
+ */
+static struct foreign_thread_desc *proctable_find_thread(pid_t pid,
+							 pid_t tid)
+{
+	unsigned int mask, slot;
+	int i;
+
+	if (proctable_index_size == 0)
+		return NULL;
+
+	mask = proctable_index_size - 1;
+	for (slot = proctable_hash(tid) & mask;
+	     (i = proctable_index[slot]) != 0; slot = (slot + 1) & mask) {
+		if ((proctable[i - 1].tid == tid)
+		    && (proctable[i - 1].pid == pid))
+			return &proctable[i - 1];
+	}
+	return NULL;
+}
+
+/*
+ * Double the size of the table.
+ */
+static int proctable_grow(void)
+{
+	struct foreign_thread_desc *tmptable;
+	struct foreign_thread_cpus *tmpcpus;
+	int *tmpindex;
+	int j, new_alloc;
 
-	memipc_attach_thread_to_desc(dst);
+	new_alloc = (proctable_alloc == 0) ? PROCTABLE_INIT_ALLOC_SIZE
+		: (proctable_alloc * 2);
 
-	dst->update_flag = 1;
+	tmpindex = (int *)malloc(new_alloc * 2 * sizeof(int));
+	if (tmpindex == NULL)
+		return -1;
+
+	tmptable = (struct foreign_thread_desc *)
+		realloc(proctable,
+			sizeof(struct foreign_thread_desc) * new_alloc);
+	if (tmptable == NULL) {
+		free(tmpindex);
+		return -1;
+	}
+	proctable = tmptable;
+	for (j = 0; j < proctable_size; j++) {
+		if (proctable[j].isolated_thread != NULL)
+			memipc_update_foreign_thread(&proctable[j]);
+	}
 
+	tmpcpus = (struct foreign_thread_cpus *)
+		realloc(proctable_cpus,
+			sizeof(struct foreign_thread_cpus) * new_alloc);
+	if (tmpcpus == NULL) {
+		free(tmpindex);
+		return -1;
+	}
+	proctable_cpus = tmpcpus;
+	for (j = 0; j < proctable_size; j++)
+		proctable[j].cpus = &proctable_cpus[j];
+
+	free(proctable_index);
+	proctable_index = tmpindex;
+	proctable_index_size = new_alloc * 2;
+	proctable_alloc = new_alloc;
+	proctable_index_rebuild();
 	return 0;
 }
 
 /*
- * Update the thread entry.
+ * Add a new thread to the table or update existing one.
+ *
+ * Returns the entry, or NULL if the table can not grow.
  */
-static int proctable_update_thread(struct foreign_thread_desc *dst,
-				   struct foreign_thread_desc *src)
+static struct foreign_thread_desc *proctable_add_thread(struct
+							foreign_thread_desc
+							*src)
 {
+	struct foreign_thread_desc *desc;
 
-#if DEBUG_ISOL_NAMES
-	if ((src->name != NULL)
-	    && (dst->name != NULL)
-	    && strcmp(src->name, dst->name)) {
-		int sl, dl;
-		sl = strlen(src->name);
-		dl = strlen(dst->name);
-		if (dl < sl) {
-			free(dst->name);
-			dst->name = strdup(src->name);
-		}
-		else
-			memcpy(dst->name, src->name, sl + 1);
+	desc = proctable_find_thread(src->pid, src->tid);
+	if (desc != NULL) {
+		proctable_update_thread(desc, src);
+		return desc;
 	}
-#endif
-
-	dst->prev_cpus_allowed = dst->cpus_allowed;
-	dst->cpus_allowed = src->cpus_allowed;
-
-	dst->prev_cpu = dst->cpu;
-	dst->cpu = src->cpu;
-
-	dst->prev_vol_context_switches = dst->vol_context_switches;
-	dst->vol_context_switches = src->vol_context_switches;
-
-	dst->prev_nonvol_context_switches = dst->nonvol_context_switches;
-	dst->nonvol_context_switches = src->nonvol_context_switches;
+	if ((proctable_size >= proctable_alloc) && proctable_grow())
+		return NULL;
 
-	memipc_attach_thread_to_desc(dst);
+	desc = &proctable[proctable_size];
+	desc->cpus = &proctable_cpus[proctable_size];
+	proctable_init_thread(desc, src);
+	proctable_index_insert(proctable_size);
+	proctable_size++;
+	return desc;
+}
 
-	dst->update_flag = 1;
-	return 0;
+/*
+ * Close kept-open files of a thread.
+ */
+static void proctable_close_files(struct foreign_thread_desc *desc)
+{
+	if (desc->status_fd < 0)
+		return;
+	close(desc->status_fd);
+	close(desc->stat_fd);
+	desc->status_fd = -1;
+	desc->stat_fd = -1;
+	proctable_open_threads--;
 }
 
 /*
- * Add a new thread to the table or update existing one.
+ * Check if thread should be re-read on every scan.
  */
-static int proctable_add_thread(struct foreign_thread_desc *src)
+static int proctable_thread_watched(struct foreign_thread_desc *desc)
 {
-	int i, j;
-	for (i = 0; i < proctable_size ; i++) {
-		if ((proctable[i].pid == src->pid)
-		    && (proctable[i].tid == src->tid))
-			return proctable_update_thread(&proctable[i], src);
-	}
-	if (proctable_size >= proctable_alloc) {
-		if (proctable_alloc == 0) {
-			proctable = (struct foreign_thread_desc *)
-				malloc(sizeof(struct foreign_thread_desc)
-				       * PROCTABLE_INIT_ALLOC_SIZE);
-			if (proctable == NULL)
-				return -1;
-			proctable_size = 0;
-			proctable_alloc = PROCTABLE_INIT_ALLOC_SIZE;
-		} else {
-			struct foreign_thread_desc *tmptable;
-			tmptable = (struct foreign_thread_desc *)
-				realloc(proctable,
-					sizeof(struct foreign_thread_desc)
-					* (proctable_alloc +
-					   PROCTABLE_INC_ALLOC_SIZE));
-			if (tmptable == NULL)
-				return -1;
-			proctable = tmptable;
-			for (j = 0; j < proctable_size; j++) {
-				if (proctable[j].isolated_thread != NULL)
-					memipc_update_foreign_thread(
-							&proctable[j]);
-			}
-			proctable_alloc += PROCTABLE_INC_ALLOC_SIZE;
-		}
-	}
-	return proctable_init_thread(&proctable[proctable_size++], src);
+	cpu_set_t overlap_cpuset;
+
+	if (desc->isolated_thread != NULL)
+		return 1;
+	CPU_AND(&overlap_cpuset, &desc->cpus->cpus_allowed,
+		&_global_isol_cpuset);
+	return CPU_COUNT(&overlap_cpuset) != 0;
 }
 
 /*
@@ -1971,6 +3901,9 @@ static void cleanup_threads(void)
 			if (src != dst) {
 				memcpy(dst, src,
 				       sizeof(struct foreign_thread_desc));
+				dst->cpus = &proctable_cpus[dst - proctable];
+				memcpy(dst->cpus, src->cpus,
+				       sizeof(struct foreign_thread_cpus));
 				if (dst->isolated_thread != NULL)
 					memipc_update_foreign_thread(dst);
 			}
@@ -1979,6 +3912,7 @@ static void cleanup_threads(void)
 		} else {
 			if (src->isolated_thread != NULL)
 				memipc_detach_thread_from_desc(src);
+			proctable_close_files(src);
 #if DEBUG_ISOL_NAMES
 			if (src->name != NULL)
 				free(src->name);
@@ -1986,7 +3920,10 @@ static void cleanup_threads(void)
 		}
 		src++;
 	}
-	proctable_size = dst - proctable;
+	if (proctable_size != (dst - proctable)) {
+		proctable_size = dst - proctable;
+		proctable_index_rebuild();
+	}
 }
 
 #if DEBUG_ISOL_VERBOSE
@@ -2100,7 +4037,7 @@ static int update_proc_status(struct foreign_thread_desc *desc,
 #endif
 			break;
 		case S_TOKEN_CPUS_ALLOWED:
-			get_cpuset(p, &desc->cpus_allowed);
+			get_cpuset(p, &desc->cpus->cpus_allowed);
 			break;
 		case S_TOKEN_VOL_CTXT_SW:
 			sscanf(p, "%d", &desc->vol_context_switches);
@@ -2146,86 +4083,167 @@ static int get_proc_stat(struct foreign_thread_desc *desc,
 	return 0;
 }
 
+/*
+ * Read status and stat files of a thread.
+ *
+ * Returns -1 if files can not be read, the thread no longer exists.
+ */
+static int read_proc_thread(struct foreign_thread_desc *desc,
+			    int status_fd, int stat_fd, int cmd)
+{
+	static char *buffer = NULL;
+	static size_t buffer_size = 0;
+	char *p, *e, *end;
+	ssize_t l;
+
+	l = proc_pread_all(status_fd, &buffer, &buffer_size, PROC_READ_SIZE);
+	if (l <= 0)
+		return -1;
+	for (p = buffer, end = buffer + l; p < end; p = e + 1) {
+		update_proc_status(desc, p, desc->pid, desc->tid, cmd);
+		e = memchr(p, '\n', end - p);
+		if (e == NULL)
+			break;
+	}
+
+	l = proc_pread_all(stat_fd, &buffer, &buffer_size, PROC_READ_SIZE);
+	if (l <= 0)
+		return -1;
+	get_proc_stat(desc, buffer, desc->pid, desc->tid, cmd);
+	return 0;
+}
+
+/*
+ * Process a single thread found in /proc/<pid>/task directory.
+ */
+static void process_thread(int taskfd, const char *tid_name,
+			   unsigned int pid, unsigned int tid,
+			   int full_scan, int cmd)
+{
+	struct foreign_thread_desc currproc, *desc;
+	struct foreign_thread_cpus currcpus;
+	char name[512];
+	int status_fd, stat_fd;
+
+	desc = proctable_find_thread(pid, tid);
+	if ((desc != NULL) && !full_scan && (desc->status_fd < 0)
+	    && !proctable_thread_watched(desc)) {
+		/* Only check that the thread still exists */
+		if (desc->isolated_thread == NULL)
+			memipc_attach_thread_to_desc(desc);
+		desc->update_flag = 1;
+		return;
+	}
+
+	memset(&currproc, 0, sizeof(struct foreign_thread_desc));
+	currproc.pid = pid;
+	currproc.tid = tid;
+	currproc.status_fd = -1;
+	currproc.stat_fd = -1;
+	CPU_ZERO(&currcpus.cpus_allowed);
+	CPU_ZERO(&currcpus.prev_cpus_allowed);
+	currproc.cpus = &currcpus;
+
+	if ((desc != NULL) && (desc->status_fd >= 0)) {
+		if (read_proc_thread(&currproc, desc->status_fd,
+				     desc->stat_fd, cmd) == 0) {
+			desc = proctable_add_thread(&currproc);
+			/* Stop watching if the thread was moved away */
+			if ((desc != NULL) && !proctable_thread_watched(desc))
+				proctable_close_files(desc);
+			goto done;
+		}
+		/* Thread ID was reused */
+		proctable_close_files(desc);
+	}
+
+	snprintf(name, sizeof(name), "%s/status", tid_name);
+	status_fd = openat(taskfd, name, O_RDONLY | O_CLOEXEC);
+	snprintf(name, sizeof(name), "%s/stat", tid_name);
+	stat_fd = openat(taskfd, name, O_RDONLY | O_CLOEXEC);
+	if ((status_fd >= 0) && (stat_fd >= 0)
+	    && (read_proc_thread(&currproc, status_fd, stat_fd, cmd) == 0)) {
+		desc = proctable_add_thread(&currproc);
+#if PROCTABLE_INCREMENTAL
+		if ((desc != NULL) && (desc->status_fd < 0)
+		    && (proctable_open_threads < PROCTABLE_MAX_OPEN_THREADS)
+		    && proctable_thread_watched(desc)) {
+			desc->status_fd = status_fd;
+			desc->stat_fd = stat_fd;
+			proctable_open_threads++;
+			goto done;
+		}
+#endif
+	}
+	if (status_fd >= 0)
+		close(status_fd);
+	if (stat_fd >= 0)
+		close(stat_fd);
+ done:
+#if DEBUG_ISOL_NAMES
+	if (currproc.name != NULL)
+		free(currproc.name);
+#endif
+	return;
+}
+
 /*
  * Scan /proc and process all processes and their threads.
+ *
+ * /proc directory is kept open between scans, and files are opened
+ * relative to it.
  */
 static int process_all_threads(cpu_set_t *cpuset, int cmd)
 {
-	struct foreign_thread_desc currproc;
-
-	char stringbuf[1024];
+	static DIR *processes = NULL;
+	static unsigned int scan_counter = 0;
+	char name[512];
 	struct dirent *procdirent, *taskdirent;
-	DIR *processes, *tasks;
-	FILE *sfile;
+	DIR *tasks;
 	unsigned int pid, tid;
+	int taskfd, full_scan;
+	int64_t scan_start = memipc_scan_start();
 
-	processes = opendir("/proc");
-	if (processes == NULL)
-		return -1;
+	if (processes == NULL) {
+		processes = opendir("/proc");
+		if (processes == NULL)
+			return -1;
+	} else
+		rewinddir(processes);
+
+#if PROCTABLE_INCREMENTAL
+	full_scan = ((scan_counter++ % PROCTABLE_FULL_SCAN_PASSES) == 0);
+#else
+	full_scan = 1;
+#endif
 
 	while ((procdirent = readdir(processes))) {
 		if (is_all_decimal(procdirent->d_name)
 		    && (sscanf(procdirent->d_name,
 			       "%u", &pid) == 1)) {
-			snprintf(stringbuf, sizeof(stringbuf),
-				 "/proc/%s/task",
+			snprintf(name, sizeof(name), "%s/task",
 				 procdirent->d_name);
-			if ((tasks = opendir(stringbuf)) != NULL) {
-				while ((taskdirent = readdir(tasks))) {
-					if (is_all_decimal(taskdirent->d_name)
-					    && (sscanf(taskdirent->d_name,
-						       "%u", &tid) == 1)) {
-						memset(&currproc, 0,
-						 sizeof(struct
-						 foreign_thread_desc));
-						currproc.pid = pid;
-						currproc.tid = tid;
-						snprintf(stringbuf,
-						 sizeof(stringbuf),
-						 "/proc/%s/task/%s/status",
-							 procdirent->d_name,
-							 taskdirent->d_name);
-						sfile = fopen(stringbuf, "rt");
-						if (sfile != NULL) {
-							while (fgets(stringbuf,
-							sizeof(stringbuf),
-							     sfile) != NULL)
-							update_proc_status(
-								&currproc,
-								stringbuf,
-								pid, tid,
-								cmd);
-							fclose(sfile);
-						}
-						snprintf(stringbuf,
-							sizeof(stringbuf),
-							"/proc/%s/task/%s/stat",
-							procdirent->d_name,
-							taskdirent->d_name);
-						sfile = fopen(stringbuf, "rt");
-						if (sfile != NULL) {
-							if (fgets(stringbuf,
-							  sizeof(stringbuf),
-							  sfile) != NULL)
-							get_proc_stat(
-								&currproc,
-								stringbuf,
-								pid, tid,
-								cmd);
-							fclose(sfile);
-						}
-						proctable_add_thread(&currproc);
-#if DEBUG_ISOL_NAMES
-						if (currproc.name != NULL)
-							free(currproc.name);
-#endif
-					}
-				}
-				closedir(tasks);
+			taskfd = openat(dirfd(processes), name,
+					O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (taskfd < 0)
+				continue;
+			tasks = fdopendir(taskfd);
+			if (tasks == NULL) {
+				close(taskfd);
+				continue;
+			}
+			while ((taskdirent = readdir(tasks))) {
+				if (is_all_decimal(taskdirent->d_name)
+				    && (sscanf(taskdirent->d_name,
+					       "%u", &tid) == 1))
+					process_thread(taskfd,
+						       taskdirent->d_name,
+						       pid, tid, full_scan,
+						       cmd);
 			}
+			closedir(tasks);
 		}
 	}
-	closedir(processes);
 	cleanup_threads();
 	if (cmd & ISOL_PROC_LIST_CMD_PUSH_AWAY) {
 		int i;
@@ -2246,9 +4264,9 @@ static int process_all_threads(cpu_set_t *cpuset, int cmd)
 			      Only change scheduling of processes and threads
 			      that are not bound to a single CPU.
 			    */
-			    (CPU_COUNT(&proctable[i].cpus_allowed) > 1)) {
+			    (CPU_COUNT(&proctable_cpus[i].cpus_allowed) > 1)) {
 				CPU_AND(&overlap_cpuset,
-					&proctable[i].cpus_allowed,
+					&proctable_cpus[i].cpus_allowed,
 					&_global_isol_cpuset);
 				if (CPU_COUNT(&overlap_cpuset) != 0) {
 					/*
@@ -2256,7 +4274,7 @@ static int process_all_threads(cpu_set_t *cpuset, int cmd)
 					  CPUS used for isolation.
 					*/
 					CPU_XOR(&schedule_cpuset,
-						&proctable[i].cpus_allowed,
+						&proctable_cpus[i].cpus_allowed,
 						&overlap_cpuset);
 					/* Now they are all cleared */
 
@@ -2290,6 +4308,7 @@ static int process_all_threads(cpu_set_t *cpuset, int cmd)
 		}
 	}
 #endif
+	memipc_scan_done(&_global_proc_scan_stats, scan_start);
 	return 0;
 }
 
@@ -2308,7 +4327,6 @@ enum memipc_thread_state {
 	MEMIPC_STATE_LOST_ISOLATION
 };
 
-#if DEBUG_ISOL_VERBOSE
 static const char *memipc_thread_state_names[] = {
 	"Off",
 	"Started",
@@ -2320,12 +4338,127 @@ static const char *memipc_thread_state_names[] = {
 	"Exiting isolation",
 	"Lost isolation"
 };
+
+#define MEMIPC_THREAD_STATES (MEMIPC_STATE_LOST_ISOLATION + 1)
+
+/* Names of states in metrics */
+static const char *memipc_thread_state_labels[MEMIPC_THREAD_STATES] = {
+	"off",
+	"started",
+	"ready",
+	"launching",
+	"launched",
+	"running",
+	"tmp_exiting_isolation",
+	"exiting_isolation",
+	"lost_isolation"
+};
+
+#define MEMIPC_REQ_TYPES (MEMIPC_REQ_CONFIG_ACK + 1)
+
+/* Names of request types in metrics */
+static const char *memipc_req_type_labels[MEMIPC_REQ_TYPES] = {
+	"none",
+	"init",
+	"start_ready",
+	"start_launch",
+	"start_launch_done",
+	"start_launch_failure",
+	"start_confirmed",
+	"terminate",
+	"exit_isolation",
+	"exiting",
+	"leave_isolation",
+	"ok_leave_isolation",
+	"ping",
+	"pong",
+	"cmd",
+	"print",
+	"log",
+	"data",
+	"offload",
+	"config",
+	"config_ack"
+};
+
+/* Number of isolation break events kept for each thread */
+#ifndef ISOL_BREAK_EVENTS
+#define ISOL_BREAK_EVENTS (16)
+#endif
+
+/* Number of timers and threads kept in each event */
+#define ISOL_BREAK_SUSPECTS (4)
+
+/* Length of thread names kept in events */
+#define ISOL_BREAK_NAME_LEN (32)
+
+/*
+ * How isolation break was detected.
+ */
+enum isol_break_source {
+	ISOL_BREAK_MONITOR, /* manager saw the isolation flag cleared */
+	ISOL_BREAK_LAUNCH_FAILURE, /* thread reported launch failure */
+	ISOL_BREAK_CLIENT /* client process reported isolation failure */
+};
+
+static const char *isol_break_source_name[] = {
+	"monitor",
+	"launch failure",
+	"client"
+};
+
+/*
+ * Timer that was running on the CPU when isolation was broken.
+ */
+struct isol_break_timer {
+	enum isol_timer_type timer_type;
+	int64_t remaining; /* nanoseconds before expiration */
+#if DEBUG_ISOL_NAMES
+	char handler[TIMER_HANDLER_LEN];
+#endif
+};
+
+/*
+ * Another thread that was on the CPU when isolation was broken.
+ */
+struct isol_break_thread {
+	pid_t pid;
+	pid_t tid;
+	int nonvol_context_switches;
+#if DEBUG_ISOL_NAMES
+	char name[ISOL_BREAK_NAME_LEN];
 #endif
+};
+
+/*
+ * Isolation break event.
+ */
+struct isol_break_event {
+	struct timespec time; /* when break was detected, CLOCK_REALTIME */
+	enum isol_break_source source;
+	/* SIGUSR1 received since the previous event, and the last one */
+	unsigned int signals;
+	int signal_code;
+	pid_t signal_pid;
+	struct timespec signal_time;
+	/* Timers on the CPU in the last scan, the first one expires first */
+	int timers_count;
+	struct isol_break_timer timers[ISOL_BREAK_SUSPECTS];
+	/* Threads that were last seen on the CPU */
+	int threads_count;
+	struct isol_break_thread threads[ISOL_BREAK_SUSPECTS];
+};
 
 /*
  *  Managed thread descriptor.
+ *
+ * Fields are grouped by the side that writes them, each group starts
+ * a new cache line, and descriptors in the array occupy whole lines.
+ * Manager's writes never invalidate lines that the isolated thread
+ * reads, except for the line with fields written by both.
  */
 struct memipc_thread_params {
+	/* Set up before the thread runs, read by both sides */
 	int index; /* Index in array, used for referencing */
 	int cpu; /* CPU where thread can run isolated. This is set once
 		    at the moment of system initialization */
@@ -2335,23 +4468,18 @@ struct memipc_thread_params {
 	long tid; /* Thread ID as seen by kernel (this is not very
 		     portable, and implementation is specific
 		     to a particular implementation) */
-	/* Atomically accessed counters and flags */
-	int claim_counter; /* accessed atomically */
-	char isolated; /* isolation state, accessed atomically, values:
-			  0 - failure, 1 - not isolated, 2 - isolated or calling
-			  isolation entry procedure.
-			  Value does not reflect actual isolation while the
-			  memipc_thread_state is
-			  MEMIPC_STATE_TMP_EXITING_ISOLATION */
 
-	/* Manager's state machine */
-	enum memipc_thread_state state; /* accessed only by manager */
-	char exit_request;              /* accessed only by manager */
-	struct timespec isol_exit_time; /* accessed only by manager */
+	/* CPU topology, read at initialization */
+	int node; /* NUMA node of the CPU, or -1 */
+	int l3_domain; /* lowest CPU sharing L3 cache, or -1 */
+	cpu_set_t siblings; /* SMT siblings, including the CPU itself */
 
 	/* Memory-mapped IPC */
 	char *memipc_name;
 	int memipc_fd;
+	size_t area_size; /* size of each area */
+	unsigned int area_flags; /* MEMIPC_AREA_* flags used for areas */
+	unsigned char *read_buffer; /* slave input buffer, area_size bytes */
 	/* Master output, slave input, master view */
 	struct memipc_area *m_memipc_mosi;
 	/* Master input, slave output, master view */
@@ -2363,28 +4491,316 @@ struct memipc_thread_params {
 	/* Pointer to local memipc_check_signal */
 	volatile unsigned char *memipc_check_signal_ptr;
 	volatile int *counter_ptr;
+	/* TMC_ISOL_MONITOR_*, set when the thread is connected */
+	unsigned char monitor;
+
+	/* Functions and data pointers for managed startup */
+	void *(*init_routine) (void *); /* used only for managed startup */
+	void *(*start_routine) (void *); /* used only for managed startup */
+	void *userdata; /* used only for managed startup */
+
+	/* Written by both sides */
+	int claim_counter /* accessed atomically */
+	__attribute__((aligned(MEMIPC_CACHE_LINE_SIZE)));
+	char isolated; /* isolation state, accessed atomically, values:
+			  0 - failure, 1 - not isolated, 2 - isolated or calling
+			  isolation entry procedure.
+			  Value does not reflect actual isolation while the
+			  memipc_thread_state is
+			  MEMIPC_STATE_TMP_EXITING_ISOLATION */
+
+	/* Last SIGUSR1, written by the signal handler */
+	unsigned int break_signals; /* accessed atomically */
+	int break_si_code;
+	pid_t break_si_pid;
+	struct timespec break_signal_time;
+
+	/* Manager's state machine, accessed only by manager */
+	enum memipc_thread_state state
+	__attribute__((aligned(MEMIPC_CACHE_LINE_SIZE)));
+	char exit_request;
+	struct timespec isol_exit_time;
+	int64_t launch_done_time; /* entered MEMIPC_STATE_LAUNCHED,
+				     nanoseconds */
+
+	/* Manager's references to processes and timers */
+	struct foreign_thread_desc *foreign_desc; /* "Foreign thread"
+						     descriptor,
+						     if present */
+	struct isol_linux_timer *timers; /* Timers pool */
+	int timers_count; /* Number of timers in the pool */
+	int timers_alloc; /* Allocated size of the pool */
+	int64_t lasttimer; /* Last timer expiration in nanoseconds,
+			      or KTIME_MAX */
+	int64_t updatetimer; /* Last time timers were updated, in nanoseconds,
+				or KTIME_MAX */
+
+	/* Isolation breaks, accessed only by manager */
+	unsigned int break_signals_seen; /* signals already in events */
+	unsigned int break_count; /* number of breaks since startup */
+	struct isol_break_event *break_events; /* ring of ISOL_BREAK_EVENTS,
+						  allocated on first break */
+
+	/* Shared configuration, written only by manager */
+	uint64_t config_notified; /* generation the thread was notified of */
+	uint64_t config_generation; /* generation the thread switched to,
+				       accessed atomically */
+
+	/* Last state and drops reported to subscribers, manager only */
+	enum memipc_thread_state event_state;
+	uint64_t event_ring_drops;
+
+	/* Metrics, manager only */
+	uint64_t req_counts[MEMIPC_REQ_TYPES]; /* updated atomically, shards
+						  count their requests */
+	uint64_t relaunches;
+	int64_t state_nsec[MEMIPC_THREAD_STATES]; /* time in each state */
+	enum memipc_thread_state metrics_state; /* state at last sample */
+	int64_t metrics_time; /* time of last sample, nanoseconds, or 0 */
+
+	/* Held by a manager shard while it drains the areas, and by the
+	   manager while it replaces them, accessed atomically */
+	int drain_lock;
+};
+
+static inline void memipc_drain_lock(struct memipc_thread_params *thread)
+{
+	while (__atomic_exchange_n(&thread->drain_lock, 1, __ATOMIC_ACQUIRE))
+		while (__atomic_load_n(&thread->drain_lock, __ATOMIC_RELAXED))
+			;
+}
+
+static inline void memipc_drain_unlock(struct memipc_thread_params *thread)
+{
+	__atomic_store_n(&thread->drain_lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Counters written by the thread on a CPU, or NULL.
+ */
+static inline struct memipc_thread_counters *
+memipc_thread_counters(struct memipc_thread_params *thread)
+{
+	if ((_global_memipc_activity == NULL)
+	    || (thread->cpu < 0) || (thread->cpu >= CPU_SETSIZE))
+		return NULL;
+	return &_global_memipc_activity->counters[thread->cpu];
+}
+
+/*
+ * Loop period histogram of the thread on a CPU, or NULL.
+ */
+static inline struct tmc_isol_loop_hist *
+memipc_thread_loop_hist(struct memipc_thread_params *thread)
+{
+	if ((_global_memipc_activity == NULL)
+	    || (thread->cpu < 0) || (thread->cpu >= CPU_SETSIZE))
+		return NULL;
+	return &_global_memipc_activity->loop_hists[thread->cpu];
+}
+
+/*
+ * Start recording loop period histogram for the current thread.
+ *
+ * Thread runs without a histogram if the activity bitmap is not mapped.
+ */
+static void memipc_loop_hist_attach(struct memipc_thread_params *thread)
+{
+	struct tmc_isol_loop_hist *h;
+
+	h = memipc_thread_loop_hist(thread);
+	if (h != NULL)
+		memset(h, 0, sizeof(struct tmc_isol_loop_hist));
+	memipc_loop_hist = h;
+}
+
+static inline struct memipc_area *get_s_memipc_mosi(struct
+						    memipc_thread_params
+						    *arg)
+{
+	return arg->s_memipc_mosi;
+}
+
+#if MANAGER_DOORBELL
+/* Manager's doorbell */
+static int _global_memipc_doorbell_fd = -1;
+/* Nonzero while the manager is blocked or about to block */
+static int _global_memipc_doorbell_armed = 0;
+#endif
+
+/* Where the manager of this process runs */
+enum memipc_manager_mode {
+	MEMIPC_MANAGER_LOCAL, /* in tmc_isol_start() of this process */
+	MEMIPC_MANAGER_REMOTE, /* in the manager daemon */
+	MEMIPC_MANAGER_DAEMON, /* this process is the manager daemon */
+	MEMIPC_MANAGER_DAEMON_STOPPING, /* daemon should terminate threads */
+	MEMIPC_MANAGER_DAEMON_STOPPED /* daemon exits when threads exit */
+};
+/* Accessed atomically, changed from signal handlers */
+static int _global_memipc_manager_mode = MEMIPC_MANAGER_LOCAL;
+/* Remote mode: CPUs managed by the daemon */
+static int _global_memipc_remote_cpus = 0;
+/* Remote mode: connected threads, connection attempts in progress, and
+   all connection attempts, accessed atomically */
+static int _global_memipc_remote_threads = 0;
+static int _global_memipc_remote_pending = 0;
+static int _global_memipc_remote_attempts = 0;
+
+static inline int memipc_manager_mode(void)
+{
+	return __atomic_load_n(&_global_memipc_manager_mode, __ATOMIC_RELAXED);
+}
+
+/*
+ * Check if threads of this process are managed by the daemon.
+ */
+static inline int memipc_manager_is_remote(void)
+{
+	return memipc_manager_mode() == MEMIPC_MANAGER_REMOTE;
+}
+
+/*
+ * Delete descriptor of a thread managed by another process.
+ */
+static void memipc_remote_thread_delete(struct memipc_thread_params *thread)
+{
+	if (thread->s_memipc_mosi != NULL)
+		memipc_area_delete(thread->s_memipc_mosi);
+	if (thread->s_memipc_miso != NULL)
+		memipc_area_delete(thread->s_memipc_miso);
+	if (thread->read_buffer != NULL)
+		free(thread->read_buffer);
+	if (thread->memipc_fd >= 0)
+		close(thread->memipc_fd);
+	free(thread->memipc_name);
+	free(thread);
+}
+
+/*
+ * Map the activity bitmap of the manager for threads of this process,
+ * if it was not mapped yet, and make the writer of an area mark it.
+ * Without the bitmap, manager finds requests in its full scans.
+ */
+static void memipc_remote_activity_attach(struct memipc_area *area, int cpu)
+{
+	struct memipc_activity *activity, *expected = NULL;
+
+	if (area == NULL)
+		return;
+	if (__atomic_load_n(&_global_memipc_activity, __ATOMIC_ACQUIRE)
+	    == NULL) {
+		activity = memipc_activity_map(0);
+		if ((activity != NULL)
+		    && !__atomic_compare_exchange_n(&_global_memipc_activity,
+						    &expected, activity, 0,
+						    __ATOMIC_ACQ_REL,
+						    __ATOMIC_ACQUIRE))
+			/* Another thread mapped it first */
+			munmap(activity, sizeof(struct memipc_activity));
+	}
+	memipc_activity_attach(area, cpu);
+}
+
+/*
+ * Create descriptor of a thread managed by another process, and map
+ * memipc areas created by the manager in named shared memory.
+ *
+ * Manager's descriptor is not accessible, so this one only has the
+ * thread's views of the areas.
+ */
+static struct memipc_thread_params *memipc_remote_thread_create(int cpu,
+							const char *name,
+							size_t size)
+{
+	struct memipc_thread_params *thread;
+
+	if (posix_memalign((void **)&thread, MEMIPC_CACHE_LINE_SIZE,
+			   sizeof(struct memipc_thread_params)))
+		return NULL;
+	memset(thread, 0, sizeof(struct memipc_thread_params));
+	thread->index = -1;
+	thread->cpu = cpu;
+	thread->node = -1;
+	thread->l3_domain = -1;
+	thread->area_size = size;
+	thread->memipc_name = strdup(name);
+	thread->memipc_fd = memipc_area_open(name);
+	if (thread->memipc_fd >= 0)
+		thread->s_memipc_mosi = memipc_area_create(size, size * 2, 0,
+							   thread->memipc_fd,
+							   NULL);
+	if (thread->s_memipc_mosi != NULL)
+		thread->s_memipc_miso =
+			memipc_area_create(size, 0, size, thread->memipc_fd,
+				(unsigned char *)thread->s_memipc_mosi->area);
+	memipc_remote_activity_attach(thread->s_memipc_miso, cpu);
+	thread->read_buffer = malloc(size);
+	if ((thread->memipc_name == NULL)
+	    || (thread->s_memipc_miso == NULL)
+	    || (thread->read_buffer == NULL)) {
+		memipc_remote_thread_delete(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+/*
+ * Close connection of the current thread to the manager.
+ */
+static void memipc_thread_disconnect(void)
+{
+	struct memipc_thread_params *thread;
+
+	if (memipc_thread_fd < 0)
+		return;
+	close(memipc_thread_fd);
+	memipc_thread_fd = -1;
+	thread = memipc_thread_self;
+	if ((thread != NULL) && (thread->index < 0)) {
+		/* Areas are no longer used by the manager */
+		memipc_thread_self = NULL;
+		memipc_check_newdata_ptr = &newdata_one;
+		memipc_loop_hist = NULL;
+		memipc_remote_thread_delete(thread);
+		__atomic_sub_fetch(&_global_memipc_remote_threads, 1,
+				   __ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * Signal the reader after a request was written, if it is waiting.
+ *
+ * Writer's barrier after the header and reader's barrier after
+ * arming the doorbell guarantee that either the reader sees the
+ * request before blocking, or the writer sees the armed doorbell.
+ */
+static void memipc_doorbell_ring(struct memipc_area *area,
+				 enum memipc_req_type req_type)
+{
+#if MANAGER_DOORBELL
+	uint64_t one = 1;
+	char isolated;
 
-	/* Functions and data pointers for managed startup */
-	void *(*init_routine) (void *); /* used only for managed startup */
-	void *(*start_routine) (void *); /* used only for managed startup */
-	void *userdata; /* used only for managed startup */
+	if ((area->doorbell == NULL)
+	    || (__atomic_load_n(area->doorbell, __ATOMIC_SEQ_CST) == 0))
+		return;
 
-	/* Manager's references to processes and timers */
-	struct foreign_thread_desc *foreign_desc; /* "Foreign thread"
-						     descriptor,
-						     if present */
-	struct isol_linux_timer *timers; /* Timers list */
-	int64_t lasttimer; /* Last timer expiration in nanoseconds,
-			      or KTIME_MAX */
-	int64_t updatetimer; /* Last time timers were updated, in nanoseconds,
-				or KTIME_MAX */
-};
+	/*
+	  Isolated thread can only make a system call when it is leaving
+	  isolation anyway.
+	*/
+	if ((memipc_thread_self != NULL)
+	    && (req_type != MEMIPC_REQ_LEAVE_ISOLATION)
+	    && (req_type != MEMIPC_REQ_EXITING)) {
+		__atomic_load(&memipc_thread_self->isolated, &isolated,
+			      __ATOMIC_SEQ_CST);
+		if (isolated == 2)
+			return;
+	}
 
-static inline struct memipc_area *get_s_memipc_mosi(struct
-						    memipc_thread_params
-						    *arg)
-{
-	return arg->s_memipc_mosi;
+	if (__atomic_exchange_n(area->doorbell, 0, __ATOMIC_SEQ_CST))
+		write(_global_memipc_doorbell_fd, &one, sizeof(one));
+#endif
 }
 
 /*
@@ -2470,8 +4886,13 @@ static void memipc_slave_handle_request(int read_req_type,
 		/* Some command handling may be added here later. */
 		break;
 	case MEMIPC_REQ_PRINT:
+	case MEMIPC_REQ_LOG:
 		/* Do nothing, we are the thread. */
 		break;
+	case MEMIPC_REQ_CONFIG:
+		/* New configuration generation is published */
+		_tmc_isol_config_switch();
+		break;
 	default:
 		/* Invalid request */
 		break;
@@ -2479,23 +4900,27 @@ static void memipc_slave_handle_request(int read_req_type,
 }
 
 /*
- *  Call this function in the main loop of the slave/managed thread.
+ * Process the thread's input, and check its state.
  */
-int memipc_thread_pass(struct memipc_thread_params *params)
+static int memipc_thread_pass_reqs(struct memipc_thread_params *params)
 {
-	unsigned char memipc_read_buffer[AREA_SIZE];
+	unsigned char *memipc_read_buffer = params->read_buffer;
 	enum memipc_req_type read_req_type;
 	ssize_t read_req_size;
-#if ISOLATION_MONITOR_IN_SLAVE
 	char isolated_state, one = 1;
 	int rv, rcode_value = -1;
 	struct tx_text tx;
 	struct rx_buffer rx;
 
 	rx.input_buffer = NULL;
-	__atomic_load(&params->isolated,
-		      &isolated_state,
-		      __ATOMIC_SEQ_CST);
+	if (memipc_config_pending)
+		_tmc_isol_config_switch();
+	if (params->monitor == TMC_ISOL_MONITOR_SLAVE)
+		__atomic_load(&params->isolated,
+			      &isolated_state,
+			      __ATOMIC_SEQ_CST);
+	else
+		isolated_state = 1;
 	if (isolated_state == 0 && memipc_thread_launch_confirmed != 0) {
 		memipc_thread_launch_confirmed = 0;
 #ifdef DEBUG_LOG_ISOL_CHANGES
@@ -2526,8 +4951,7 @@ int memipc_thread_pass(struct memipc_thread_params *params)
 					      MEMIPC_REQ_START_LAUNCH_FAILURE,
 					      0, NULL));
 	}
-#endif
-	read_req_size = sizeof(memipc_read_buffer);
+	read_req_size = params->area_size;
 	read_req_type = MEMIPC_REQ_NONE;
 	if (memipc_get_req(params->s_memipc_mosi,
 			   &read_req_type,
@@ -2540,26 +4964,40 @@ int memipc_thread_pass(struct memipc_thread_params *params)
 	return memipc_thread_continue_flag;
 }
 
+/*
+ *  Call this function in the main loop of the slave/managed thread.
+ */
+int memipc_thread_pass(struct memipc_thread_params *params)
+{
+	int rv;
+
+	rv = memipc_thread_pass_reqs(params);
+	/*
+	  Requests processed in this pass moved the check pointer back to
+	  the input area, keep the slow path while an ACK is not queued.
+	*/
+	if (memipc_config_pending)
+		memipc_check_newdata_ptr = &newdata_one;
+	return rv;
+}
+
 /*
  *  Same as above, except for the current thread.
  */
 int memipc_thread_pass_default(void)
 {
+	char isolated_state = 1;
+
 	if (memipc_thread_self == NULL)
 		return 0;
-#if ISOLATION_MONITOR_IN_SLAVE
-	char isolated_state;
-
-	__atomic_load(&memipc_thread_self->isolated,
-		      &isolated_state,
-		      __ATOMIC_SEQ_CST);
+	if (memipc_thread_self->monitor == TMC_ISOL_MONITOR_SLAVE)
+		__atomic_load(&memipc_thread_self->isolated,
+			      &isolated_state,
+			      __ATOMIC_SEQ_CST);
 	if ((isolated_state == 0) || memipc_check_newdata())
-#else
-		if (memipc_check_newdata())
-#endif
-			return memipc_thread_pass(memipc_thread_self);
-		else
-			return memipc_thread_continue_flag;
+		return memipc_thread_pass(memipc_thread_self);
+	else
+		return memipc_thread_continue_flag;
 }
 
 /*
@@ -2573,6 +5011,7 @@ static void *memipc_thread_startup(void *arg_data)
 
 	memipc_my_pid = params->thread_id;
 	memipc_thread_self = params;
+	memipc_loop_hist_attach(params);
 	params->s_memipc_mosi->reader = memipc_my_pid;
 	params->s_memipc_miso->writer = memipc_my_pid;
 	params->memipc_check_signal_ptr = &memipc_check_signal;
@@ -2581,15 +5020,15 @@ static void *memipc_thread_startup(void *arg_data)
 	unsigned char message[]="Thread started\n";
 	memipc_thread_launch_confirmed = 0;
 	memipc_thread_continue_flag = 1;
-#if ISOLATION_MONITOR_IN_SLAVE
-	char one = 1;
+	char zero = 0, one = 1;
+	if (params->monitor == TMC_ISOL_MONITOR_SLAVE) {
 #ifdef DEBUG_LOG_ISOL_CHANGES
-	write(1, "\nTHR_STA, isolated = 1\n", 23);
-#endif
-	__atomic_store(&params->isolated,
-		       &one,
-		       __ATOMIC_SEQ_CST);
+		write(1, "\nTHR_STA, isolated = 1\n", 23);
 #endif
+		__atomic_store(&params->isolated,
+			       &one,
+			       __ATOMIC_SEQ_CST);
+	}
 	/* Print startup message */
 	while (memipc_add_req(params->s_memipc_miso, MEMIPC_REQ_PRINT,
 			      strlen((char*)message), message));
@@ -2620,21 +5059,19 @@ static void *memipc_thread_startup(void *arg_data)
 
 	/* Exiting */
 	prctl(PR_SET_TASK_ISOLATION, 0, 0, 0, 0);
-#if ISOLATION_MONITOR_IN_SLAVE
-	char zero = 0;
+	if (params->monitor == TMC_ISOL_MONITOR_SLAVE) {
 #ifdef DEBUG_LOG_ISOL_CHANGES
-	write(1, "\nTHR_STA, isolated = 0\n", 23);
-#endif
-	__atomic_store(&params->isolated,
-		       &zero,
-		       __ATOMIC_SEQ_CST);
+		write(1, "\nTHR_STA, isolated = 0\n", 23);
 #endif
+		__atomic_store(&params->isolated,
+			       &zero,
+			       __ATOMIC_SEQ_CST);
+	}
 	while (memipc_add_req(params->s_memipc_miso, MEMIPC_REQ_EXITING,
 			      0, NULL));
-	if (memipc_thread_fd >= 0) {
-		close(memipc_thread_fd);
-		memipc_thread_fd = -1;
-	}
+	memipc_arena_delete();
+	memipc_trace_delete();
+	memipc_thread_disconnect();
 	return retval;
 }
 
@@ -2682,38 +5119,571 @@ void memipc_isolation_announce_exit(void)
 }
 
 /*
- * printf() replacement for isolated mode. Will return a negative number if
+ * Count output dropped because the area of the current thread is full.
+ */
+static int memipc_ring_drop(void)
+{
+	struct memipc_thread_counters *counters;
+
+	counters = memipc_thread_self->s_memipc_miso->counters;
+	if (counters != NULL)
+		memipc_counter_inc(&counters->ring_drops);
+	return -EAGAIN;
+}
+
+/*
+ * vprintf() replacement for isolated mode. Will return a negative number if
  * there is not enough space in buffer, retry if necessary.
  */
-int memipc_isolation_printf(const char *fmt, ...)
+int memipc_isolation_vprintf(const char *fmt, va_list va)
 {
-	unsigned char buffer[2048];
-	va_list va;
+	unsigned char buffer[2048], *dst;
+	va_list va_long;
 	int l;
 
-	va_start(va, fmt);
+	va_copy(va_long, va);
 	l = vsnprintf((char *)buffer, sizeof(buffer), fmt, va);
-	va_end(va);
 
-	if (memipc_thread_self == NULL)
+	if (l < 0) {
+		va_end(va_long);
+		return l;
+	}
+
+	if (memipc_thread_self == NULL) {
+		va_end(va_long);
+		if ((size_t)l >= sizeof(buffer))
+			l = sizeof(buffer) - 1;
 		return write(1, buffer, l);
-	else
+	}
+
+	if ((size_t)l < sizeof(buffer)) {
+		va_end(va_long);
 		if (memipc_add_req(memipc_thread_self->s_memipc_miso,
 				   MEMIPC_REQ_PRINT,
 				   l, buffer))
-			return -EAGAIN;
+			return memipc_ring_drop();
+		return l;
+	}
+
+	/* Long output is formatted directly in the area */
+	dst = memipc_reserve_req(memipc_thread_self->s_memipc_miso, l + 1);
+	if (dst == NULL) {
+		va_end(va_long);
+		return memipc_ring_drop();
+	}
+	vsnprintf((char *)dst, l + 1, fmt, va_long);
+	va_end(va_long);
+	if (memipc_commit_req(memipc_thread_self->s_memipc_miso,
+			      MEMIPC_REQ_PRINT, l)) {
+		memipc_cancel_req(memipc_thread_self->s_memipc_miso);
+		return memipc_ring_drop();
+	}
 	return l;
 }
 
+/*
+ * printf() replacement for isolated mode. Will return a negative number if
+ * there is not enough space in buffer, retry if necessary.
+ */
+int memipc_isolation_printf(const char *fmt, ...)
+{
+	va_list va;
+	int l;
+
+	va_start(va, fmt);
+	l = memipc_isolation_vprintf(fmt, va);
+	va_end(va);
+	return l;
+}
+
+/*
+ * Deferred formatting.
+ *
+ * memipc_isolation_log() does not format its output. Every format string
+ * is registered once, on first use or by memipc_isolation_log_register(),
+ * and the types of its arguments are determined at that time. Isolated
+ * thread only fetches arguments by those types, and sends a
+ * MEMIPC_REQ_LOG request, written in place:
+ *
+ * struct memipc_log_header
+ * unsigned char types[nargs] - argument types from the registry
+ * uint64_t args[nwords]      - argument values, long double takes two
+ * char strings[strsize]      - NUL-terminated strings for %s, in order
+ *
+ * Manager finds the format string by its id, and formats the output when
+ * it handles the request, so format string must remain valid (a string
+ * literal). Formats that can not be handled this way are formatted
+ * immediately as with memipc_isolation_printf().
+ */
+
+/* Maximum number of arguments or argument words in a deferred request */
+#define MEMIPC_LOG_MAX_ARGS (16)
+
+/* Maximum number of strings in a deferred log request */
+#define MEMIPC_LOG_MAX_STRINGS (8)
+
+/* Maximum length of a single conversion specification */
+#define MEMIPC_LOG_MAX_CONV (32)
+
+/* Size of the format registry, a power of two */
+#define MEMIPC_LOG_MAX_FORMATS (256)
+
+struct memipc_log_header
+{
+	uint32_t id;
+	uint32_t nargs;
+	uint32_t nwords;
+	uint32_t strsize;
+};
+
+/* Argument types */
+enum memipc_log_arg
+{
+	MEMIPC_LOG_ARG_NONE,	/* %% */
+	MEMIPC_LOG_ARG_INT,
+	MEMIPC_LOG_ARG_LONG,
+	MEMIPC_LOG_ARG_LLONG,
+	MEMIPC_LOG_ARG_SIZE,
+	MEMIPC_LOG_ARG_PTRDIFF,
+	MEMIPC_LOG_ARG_INTMAX,
+	MEMIPC_LOG_ARG_DOUBLE,
+	MEMIPC_LOG_ARG_LDOUBLE,
+	MEMIPC_LOG_ARG_STRING,
+	MEMIPC_LOG_ARG_POINTER,
+	MEMIPC_LOG_ARG_IGNORE,	/* %n, pointer is not used */
+	MEMIPC_LOG_ARG_STAR	/* '*' width or precision */
+};
+
+/* Conversion specification */
+struct memipc_log_conv
+{
+	const char *start;	/* '%' */
+	const char *end;	/* after conversion character */
+	unsigned int stars;	/* '*' width and precision arguments */
+	int precision_star;	/* precision is the last '*' argument */
+	int precision;		/* numeric precision, or -1 */
+	enum memipc_log_arg arg;
+};
+
+/*
+ * Find the next conversion specification in a format string.
+ *
+ * Returns 1 if found, 0 at the end of the format string, -1 if the
+ * specification is not supported for deferred formatting.
+ */
+static int memipc_log_parse(const char *p, struct memipc_log_conv *conv)
+{
+	int length = 0; /* 'h' -1, 'hh' -2, 'l' 1, 'll' 2, 'L' 3,
+			   'z' 4, 't' 5, 'j' 6 */
+
+	p = strchr(p, '%');
+	if (p == NULL)
+		return 0;
+	conv->start = p++;
+	conv->stars = 0;
+	conv->precision_star = 0;
+	conv->precision = -1;
+	conv->arg = MEMIPC_LOG_ARG_NONE;
+
+	if (*p == '%') {
+		conv->end = p + 1;
+		return 1;
+	}
+
+	/* Flags */
+	while ((*p != '\0') && (strchr("-+ #0'", *p) != NULL))
+		p++;
+
+	/* Width */
+	if (*p == '*') {
+		conv->stars++;
+		p++;
+	} else
+		while ((*p >= '0') && (*p <= '9'))
+			p++;
+	/* Positional arguments are not supported */
+	if (*p == '$')
+		return -1;
+
+	/* Precision */
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			conv->stars++;
+			conv->precision_star = 1;
+			p++;
+		} else {
+			conv->precision = 0;
+			while ((*p >= '0') && (*p <= '9'))
+				conv->precision = conv->precision * 10
+					+ (*p++ - '0');
+		}
+	}
+
+	/* Length modifier */
+	switch (*p) {
+	case 'h':
+		length = (p[1] == 'h') ? -2 : -1;
+		p += -length;
+		break;
+	case 'l':
+		length = (p[1] == 'l') ? 2 : 1;
+		p += length;
+		break;
+	case 'q':
+		length = 2;
+		p++;
+		break;
+	case 'L':
+		length = 3;
+		p++;
+		break;
+	case 'z':
+	case 'Z':
+		length = 4;
+		p++;
+		break;
+	case 't':
+		length = 5;
+		p++;
+		break;
+	case 'j':
+		length = 6;
+		p++;
+		break;
+	default:
+		break;
+	}
+
+	/* Conversion */
+	switch (*p) {
+	case 'd':
+	case 'i':
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		switch (length) {
+		case 1:
+			conv->arg = MEMIPC_LOG_ARG_LONG;
+			break;
+		case 2:
+		case 3:
+			conv->arg = MEMIPC_LOG_ARG_LLONG;
+			break;
+		case 4:
+			conv->arg = MEMIPC_LOG_ARG_SIZE;
+			break;
+		case 5:
+			conv->arg = MEMIPC_LOG_ARG_PTRDIFF;
+			break;
+		case 6:
+			conv->arg = MEMIPC_LOG_ARG_INTMAX;
+			break;
+		default:
+			conv->arg = MEMIPC_LOG_ARG_INT;
+			break;
+		}
+		break;
+	case 'c':
+		if (length != 0)
+			return -1;
+		conv->arg = MEMIPC_LOG_ARG_INT;
+		break;
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		conv->arg = (length == 3) ? MEMIPC_LOG_ARG_LDOUBLE
+			: MEMIPC_LOG_ARG_DOUBLE;
+		break;
+	case 's':
+		if (length != 0)
+			return -1;
+		conv->arg = MEMIPC_LOG_ARG_STRING;
+		break;
+	case 'p':
+		conv->arg = MEMIPC_LOG_ARG_POINTER;
+		break;
+	case 'n':
+		conv->arg = MEMIPC_LOG_ARG_IGNORE;
+		break;
+	default:
+		/* Wide characters, %m, invalid or unknown conversions */
+		return -1;
+	}
+	conv->end = p + 1;
+	if ((conv->end - conv->start) >= MEMIPC_LOG_MAX_CONV)
+		return -1;
+	return 1;
+}
+
+/* Registered format string */
+struct memipc_log_fmt
+{
+	const char *fmt;	/* NULL if the entry is free, set last */
+	int deferred;		/* arguments can be sent unformatted */
+	unsigned int nargs;
+	unsigned int nwords;
+	unsigned char types[MEMIPC_LOG_MAX_ARGS];
+	int precision[MEMIPC_LOG_MAX_ARGS]; /* %s: -1, or -2 for '*' */
+};
+
+static struct memipc_log_fmt _global_memipc_log_fmts[MEMIPC_LOG_MAX_FORMATS];
+static pthread_mutex_t _global_memipc_log_fmts_lock =
+	PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Determine the types of arguments of a format string.
+ */
+static void memipc_log_classify(struct memipc_log_fmt *entry,
+				const char *fmt)
+{
+	struct memipc_log_conv conv;
+	unsigned int nstrings = 0, i;
+	const char *p;
+	int rv;
+
+	entry->deferred = 0;
+	entry->nargs = 0;
+	entry->nwords = 0;
+	for (p = fmt; (rv = memipc_log_parse(p, &conv)) > 0; p = conv.end) {
+		if (conv.arg == MEMIPC_LOG_ARG_NONE)
+			continue;
+		if ((entry->nwords + conv.stars + 2 > MEMIPC_LOG_MAX_ARGS)
+		    || ((conv.arg == MEMIPC_LOG_ARG_STRING)
+			&& (nstrings++ >= MEMIPC_LOG_MAX_STRINGS)))
+			return;
+		for (i = 0; i < conv.stars; i++) {
+			entry->types[entry->nargs] = MEMIPC_LOG_ARG_STAR;
+			entry->precision[entry->nargs++] = -1;
+			entry->nwords++;
+		}
+		entry->types[entry->nargs] = conv.arg;
+		entry->precision[entry->nargs++] =
+			conv.precision_star ? -2 : conv.precision;
+		if (conv.arg == MEMIPC_LOG_ARG_LDOUBLE)
+			entry->nwords += 2;
+		else if (conv.arg != MEMIPC_LOG_ARG_STRING)
+			entry->nwords++;
+	}
+	entry->deferred = (rv == 0);
+}
+
+/*
+ * Find a format string in the registry, register it if not found.
+ *
+ * Lookup does not take the lock, entries are never removed, and the
+ * format pointer is published after the rest of the entry.
+ *
+ * Returns the entry, or NULL if the registry is full.
+ */
+static struct memipc_log_fmt *memipc_log_lookup(const char *fmt)
+{
+	struct memipc_log_fmt *entry;
+	unsigned int h, i;
+	const char *f;
+
+	h = ((uintptr_t)fmt >> 3) * 2654435761U;
+	for (i = 0; i < MEMIPC_LOG_MAX_FORMATS; i++) {
+		entry = &_global_memipc_log_fmts[(h + i)
+						 & (MEMIPC_LOG_MAX_FORMATS - 1)];
+		f = __atomic_load_n(&entry->fmt, __ATOMIC_ACQUIRE);
+		if (f == fmt)
+			return entry;
+		if (f != NULL)
+			continue;
+
+		pthread_mutex_lock(&_global_memipc_log_fmts_lock);
+		f = __atomic_load_n(&entry->fmt, __ATOMIC_RELAXED);
+		if (f == NULL) {
+			memipc_log_classify(entry, fmt);
+			__atomic_store_n(&entry->fmt, fmt, __ATOMIC_RELEASE);
+			f = fmt;
+		}
+		pthread_mutex_unlock(&_global_memipc_log_fmts_lock);
+		if (f == fmt)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Register a format string for deferred formatting, so it will not be
+ * parsed when first used by an isolated thread.
+ *
+ * Returns 0 if the format can be deferred, -1 otherwise.
+ */
+int memipc_isolation_log_register(const char *fmt)
+{
+	struct memipc_log_fmt *entry;
+
+	entry = memipc_log_lookup(fmt);
+	if ((entry == NULL) || !entry->deferred)
+		return -1;
+	return 0;
+}
+
+/*
+ * printf() replacement for isolated mode with deferred formatting.
+ *
+ * Returns 0 if the request was sent, otherwise same as
+ * memipc_isolation_vprintf().
+ */
+int memipc_isolation_vlog(const char *fmt, va_list va)
+{
+	uint64_t args[MEMIPC_LOG_MAX_ARGS];
+	const char *strings[MEMIPC_LOG_MAX_STRINGS];
+	size_t string_lengths[MEMIPC_LOG_MAX_STRINGS];
+	struct memipc_log_header header;
+	struct memipc_log_fmt *entry;
+	unsigned int nwords = 0, nstrings = 0, i;
+	size_t strsize = 0, size;
+	unsigned char *dst;
+	const char *str;
+	double d;
+	long double ld;
+	int star = 0;
+
+	/* Format string must be readable by the manager */
+	if ((memipc_thread_self == NULL) || memipc_manager_is_remote())
+		return memipc_isolation_vprintf(fmt, va);
+
+	entry = memipc_log_lookup(fmt);
+	if ((entry == NULL) || !entry->deferred)
+		return memipc_isolation_vprintf(fmt, va);
+
+	for (i = 0; i < entry->nargs; i++) {
+		switch (entry->types[i]) {
+		case MEMIPC_LOG_ARG_STAR:
+			star = va_arg(va, int);
+			args[nwords++] = (uint64_t)(int64_t)star;
+			break;
+		case MEMIPC_LOG_ARG_INT:
+			args[nwords++] = (uint64_t)(int64_t)va_arg(va, int);
+			break;
+		case MEMIPC_LOG_ARG_LONG:
+			args[nwords++] = (uint64_t)va_arg(va, long);
+			break;
+		case MEMIPC_LOG_ARG_LLONG:
+			args[nwords++] = (uint64_t)va_arg(va, long long);
+			break;
+		case MEMIPC_LOG_ARG_SIZE:
+			args[nwords++] = (uint64_t)va_arg(va, size_t);
+			break;
+		case MEMIPC_LOG_ARG_PTRDIFF:
+			args[nwords++] = (uint64_t)va_arg(va, ptrdiff_t);
+			break;
+		case MEMIPC_LOG_ARG_INTMAX:
+			args[nwords++] = (uint64_t)va_arg(va, intmax_t);
+			break;
+		case MEMIPC_LOG_ARG_DOUBLE:
+			d = va_arg(va, double);
+			memcpy(&args[nwords++], &d, sizeof(d));
+			break;
+		case MEMIPC_LOG_ARG_LDOUBLE:
+			ld = va_arg(va, long double);
+			args[nwords + 1] = 0;
+			memcpy(&args[nwords], &ld,
+			       (sizeof(ld) < 2 * sizeof(uint64_t)) ?
+			       sizeof(ld) : 2 * sizeof(uint64_t));
+			nwords += 2;
+			break;
+		case MEMIPC_LOG_ARG_STRING:
+			str = va_arg(va, const char *);
+			if (str == NULL)
+				str = "(null)";
+			strings[nstrings] = str;
+			if ((entry->precision[i] == -2) && (star >= 0))
+				string_lengths[nstrings] = strnlen(str, star);
+			else if (entry->precision[i] >= 0)
+				string_lengths[nstrings] =
+					strnlen(str, entry->precision[i]);
+			else
+				string_lengths[nstrings] = strlen(str);
+			strsize += string_lengths[nstrings] + 1;
+			nstrings++;
+			break;
+		case MEMIPC_LOG_ARG_POINTER:
+		case MEMIPC_LOG_ARG_IGNORE:
+			args[nwords++] = (uint64_t)(uintptr_t)va_arg(va, void *);
+			break;
+		default:
+			break;
+		}
+	}
+
+	size = sizeof(header) + entry->nargs
+		+ nwords * sizeof(uint64_t) + strsize;
+	dst = memipc_reserve_req(memipc_thread_self->s_memipc_miso, size);
+	if (dst == NULL)
+		return memipc_ring_drop();
+
+	header.id = entry - _global_memipc_log_fmts;
+	header.nargs = entry->nargs;
+	header.nwords = nwords;
+	header.strsize = strsize;
+	memcpy(dst, &header, sizeof(header));
+	dst += sizeof(header);
+	memcpy(dst, entry->types, entry->nargs);
+	dst += entry->nargs;
+	memcpy(dst, args, nwords * sizeof(uint64_t));
+	dst += nwords * sizeof(uint64_t);
+	for (i = 0; i < nstrings; i++) {
+		memcpy(dst, strings[i], string_lengths[i]);
+		dst[string_lengths[i]] = '\0';
+		dst += string_lengths[i] + 1;
+	}
+
+	if (memipc_commit_req(memipc_thread_self->s_memipc_miso,
+			      MEMIPC_REQ_LOG, size)) {
+		memipc_cancel_req(memipc_thread_self->s_memipc_miso);
+		return memipc_ring_drop();
+	}
+	return 0;
+}
+
+/*
+ * printf() replacement for isolated mode with deferred formatting.
+ * Format string must remain valid until the manager handles it.
+ */
+int memipc_isolation_log(const char *fmt, ...)
+{
+	va_list va;
+	int rv;
+
+	va_start(va, fmt);
+	rv = memipc_isolation_vlog(fmt, va);
+	va_end(va);
+	return rv;
+}
+
 /*
   Various globals.
 */
 static struct memipc_thread_params *_global_isolated_threads = NULL;
 static int _global_isolated_thread_count = 0;
+/* Managed thread descriptors by CPU, for timer and thread scans */
+static struct memipc_thread_params *_global_cpu_threads[CPU_SETSIZE];
+/* CPUs of managed threads, and ones that received SIGUSR1, as bitmaps */
+static unsigned long _global_memipc_threads_mask[MEMIPC_ACTIVITY_WORDS];
+static unsigned long _global_memipc_activity_breaks[MEMIPC_ACTIVITY_WORDS];
+/* Cycle counter and time at initialization, to convert cycles */
+static uint64_t _global_loop_hist_start_cycles = 0;
+static int64_t _global_loop_hist_start_nsec = 0;
 static int _global_isolated_threads_timeout_started = 0;
-static time_t _global_isolated_threads_start_time = 0;
-static time_t _global_isolated_threads_start_timeout = 20;
-static time_t _global_isolated_threads_restart_delay = 3;
+/* Launch timing, all in nanoseconds of CLOCK_MONOTONIC */
+static int64_t _global_isolated_threads_start_time = 0;
+static int64_t _global_isolated_threads_start_timeout = 20000000000LL;
+static int64_t _global_isolated_threads_restart_delay = 3000000000LL;
+static int64_t _global_isolated_threads_timers_wait = 100000000LL;
+static size_t _global_memipc_area_size = AREA_SIZE;
+static unsigned int _global_memipc_area_flags = 0;
+static size_t _global_memipc_max_area_size = AREA_SIZE;
 
 /*
  * Find descriptor of a managed thread with a given ID.
@@ -2737,6 +5707,16 @@ struct memipc_thread_params *isolation_find_thread(pthread_t thread_id)
 	return NULL;
 }
 
+/*
+ * Find managed thread descriptor for a given CPU.
+ */
+static inline struct memipc_thread_params *memipc_cpu_thread(int cpu)
+{
+	if ((cpu < 0) || (cpu >= CPU_SETSIZE))
+		return NULL;
+	return _global_cpu_threads[cpu];
+}
+
 /*
  * Add a timer to the managed thread descriptor.
  */
@@ -2749,50 +5729,35 @@ static int memipc_add_timer_to_desc(int cpu,
 				    int64_t last_updated,
 				    int64_t expires)
 {
-	int i, l
-#if DEBUG_ISOL_NAMES
-		, laddr
-#endif
-		;
-	struct memipc_thread_params *threads;
-	int threads_count;
+	int new_alloc;
+	struct memipc_thread_params *thread;
 	struct isol_linux_timer *t;
 
-	threads = _global_isolated_threads;
-	threads_count = _global_isolated_thread_count;
+	thread = memipc_cpu_thread(cpu);
+	if (thread == NULL)
+		return -1;
 
-	for (i = 0; i < threads_count; i++) {
-		if (threads[i].cpu == cpu) {
-#if DEBUG_ISOL_NAMES
-			laddr = strlen(addr);
-#endif
-			l = sizeof(struct isol_linux_timer)
+	if (thread->timers_count >= thread->timers_alloc) {
+		new_alloc = (thread->timers_alloc == 0) ?
+			TIMER_POOL_INIT_SIZE : thread->timers_alloc * 2;
+		t = (struct isol_linux_timer *)
+			realloc(thread->timers,
+				new_alloc * sizeof(struct isol_linux_timer));
+		if (t == NULL)
+			return -1;
+		thread->timers = t;
+		thread->timers_alloc = new_alloc;
+	}
+
+	t = &thread->timers[thread->timers_count++];
 #if DEBUG_ISOL_NAMES
-				+ laddr + strlen(handler)
-				+ 2
+	snprintf(t->addr, TIMER_ADDR_LEN, "%s", addr);
+	snprintf(t->handler, TIMER_HANDLER_LEN, "%s", handler);
 #endif
-				;
-			t = (struct isol_linux_timer *)malloc(l);
-			if (t == NULL)
-				return -1;
-#if DEBUG_ISOL_NAMES
-			t->addr = ((char*)t)
-				+ sizeof(struct isol_linux_timer);
-			t->handler = ((char*)t)
-				+ sizeof(struct isol_linux_timer)
-				+ laddr + 1;
-			strcpy(t->addr, addr);
-			strcpy(t->handler, handler);
-#endif
-			t->timer_type = timer_type;
-			t->last_updated = last_updated;
-			t->expires = expires;
-			t->next = threads[i].timers;
-			threads[i].timers = t;
-			return 0;
-		}
-	}
-	return -1;
+	t->timer_type = timer_type;
+	t->last_updated = last_updated;
+	t->expires = expires;
+	return 0;
 }
 
 #if 0
@@ -2801,51 +5766,30 @@ static int memipc_add_timer_to_desc(int cpu,
  */
 static void memipc_remove_timers_from_desc(int cpu)
 {
-	int i;
-	struct memipc_thread_params *threads;
-	int threads_count;
-	struct isol_linux_timer *t, *tnext;
-
-	threads = _global_isolated_threads;
-	threads_count = _global_isolated_thread_count;
+	struct memipc_thread_params *thread;
 
-	for (i = 0; i < threads_count; i++) {
-		if (threads[i].cpu == cpu) {
-			t = threads[i].timers;
-			threads[i].timers = NULL;
-			while (t != NULL) {
-				tnext = t->next;
-				free(t);
-				t = tnext;
-			}
-			return;
-		}
-	}
+	thread = memipc_cpu_thread(cpu);
+	if (thread != NULL)
+		thread->timers_count = 0;
 }
 #endif
 
 /*
  * Remove all timers from all managed thread descriptors.
+ *
+ * Pools are kept for the next scan.
  */
 static void memipc_remove_timers_from_all_desc(void)
 {
 	int i;
 	struct memipc_thread_params *threads;
 	int threads_count;
-	struct isol_linux_timer *t, *tnext;
 
 	threads = _global_isolated_threads;
 	threads_count = _global_isolated_thread_count;
 
-	for (i = 0; i < threads_count; i++) {
-		t = threads[i].timers;
-		threads[i].timers = NULL;
-		while (t != NULL) {
-			tnext = t->next;
-			free(t);
-			t = tnext;
-		}
-	}
+	for (i = 0; i < threads_count; i++)
+		threads[i].timers_count = 0;
 }
 
 #if DEBUG_ISOL_VERBOSE
@@ -2854,7 +5798,7 @@ static void memipc_remove_timers_from_all_desc(void)
  */
 static void show_all_timers_by_desc(FILE *f, cpu_set_t *cpuset)
 {
-	int i;
+	int i, j;
 	struct memipc_thread_params *threads;
 	int threads_count;
 	struct isol_linux_timer *t;
@@ -2863,12 +5807,14 @@ static void show_all_timers_by_desc(FILE *f, cpu_set_t *cpuset)
 	threads_count = _global_isolated_thread_count;
 
 	for (i = 0; i < threads_count; i++) {
-		t = threads[i].timers;
-		if ((t != NULL)
+		if ((threads[i].timers_count > 0)
 		    && ((cpuset == NULL)
 			|| CPU_ISSET(threads[i].cpu, cpuset))) {
-			fprintf(f, "Timers for CPU %d:\n", threads[i].cpu);
-			while (t != NULL) {
+			fprintf(f, "Timers for CPU %d, last expires at %lu:\n",
+				threads[i].cpu,
+				(uint64_t) threads[i].lasttimer);
+			for (j = 0; j < threads[i].timers_count; j++) {
+				t = &threads[i].timers[j];
 #if DEBUG_ISOL_NAMES
 				fprintf(f,
 					" Timer %s, at %s, handler %s, "
@@ -2884,7 +5830,6 @@ static void show_all_timers_by_desc(FILE *f, cpu_set_t *cpuset)
 					isol_timer_type_name[t->timer_type],
 					(uint64_t) t->expires);
 #endif
-				t = t->next;
 			}
 		}
 	}
@@ -2942,7 +5887,6 @@ static void memipc_update_foreign_thread(struct foreign_thread_desc *desc)
 		desc->isolated_thread->foreign_desc = desc;
 }
 
-#if DEBUG_ISOL_VERBOSE
 /*
  * Return a name of a thread state.
  */
@@ -2957,7 +5901,95 @@ static const char *memipc_thread_state_name(struct memipc_thread_params *s)
 	else
 		return invalid;
 }
-#endif
+
+/*
+ * Send an event line to clients that use the "subscribe" command.
+ * Nothing is formatted while there are no subscribers.
+ */
+static void memipc_event_push(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static void memipc_event_push(const char *fmt, ...)
+{
+	char line[256];
+	va_list va;
+	int l;
+
+	if (!is_subscriber_present())
+		return;
+	va_start(va, fmt);
+	l = vsnprintf(line, sizeof(line), fmt, va);
+	va_end(va);
+	if ((l > 0) && ((size_t)l < sizeof(line)))
+		send_event_subscribers(line, l);
+}
+
+/*
+ * Count and report a re-launch of a thread that lost isolation.
+ */
+static void memipc_event_relaunch(struct memipc_thread_params *thread)
+{
+	thread->relaunches++;
+	memipc_event_push("250 CPU %d relaunch\n", thread->cpu);
+}
+
+/*
+ * Report state changes and dropped output of threads since the
+ * previous pass of the manager loop.
+ */
+static void memipc_events_scan(void)
+{
+	struct memipc_thread_params *threads;
+	struct memipc_thread_counters *counters;
+	uint64_t drops;
+	int i;
+
+	threads = _global_isolated_threads;
+	for (i = 0; i < _global_isolated_thread_count; i++) {
+		if (threads[i].state != threads[i].event_state) {
+			threads[i].event_state = threads[i].state;
+			memipc_event_push("250 CPU %d state %s\n",
+					  threads[i].cpu,
+					  memipc_thread_state_name(
+							 &threads[i]));
+		}
+		counters = memipc_thread_counters(&threads[i]);
+		if (counters == NULL)
+			continue;
+		drops = __atomic_load_n(&counters->ring_drops,
+					__ATOMIC_RELAXED);
+		if (drops != threads[i].event_ring_drops) {
+			memipc_event_push("250 CPU %d ring full, "
+					  "%" PRIu64 " dropped\n",
+					  threads[i].cpu,
+					  drops - threads[i].event_ring_drops);
+			threads[i].event_ring_drops = drops;
+		}
+	}
+}
+
+/*
+ * Add time since the previous pass of the manager loop to the time
+ * threads spent in their states.
+ */
+static void memipc_metrics_scan(void)
+{
+	struct memipc_thread_params *threads;
+	struct timespec ts;
+	int64_t now;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	threads = _global_isolated_threads;
+	for (i = 0; i < _global_isolated_thread_count; i++) {
+		if (threads[i].metrics_time != 0)
+			threads[i].state_nsec[threads[i].metrics_state] +=
+				now - threads[i].metrics_time;
+		threads[i].metrics_state = threads[i].state;
+		threads[i].metrics_time = now;
+	}
+}
 
 /*
  * The following is a "claim CPU" mechanism used to connect the
@@ -2982,11 +6014,25 @@ struct memipc_thread_params *isolation_claim_cpu(int cpu)
 	int i, one = 1, orig_claim_counter;
 	struct memipc_thread_params *threads;
 	int threads_count;
+#if USE_CPU_SUBSETS
+	cpu_set_t subset_cpus;
+	int subset_check;
+#endif
 
 	threads = _global_isolated_threads;
 	threads_count = _global_isolated_thread_count;
 
+#if USE_CPU_SUBSETS
+	/* CPUs removed from the subset after start are not claimed */
+	subset_check = (_global_cpu_subset_id != NULL)
+		&& (memipc_cpu_subset_lookup(_global_cpu_subset_id,
+					     &subset_cpus) == 0);
+#endif
 	for (i = 0; i < threads_count; i++) {
+#if USE_CPU_SUBSETS
+		if (subset_check && !CPU_ISSET(threads[i].cpu, &subset_cpus))
+			continue;
+#endif
 		if ((cpu < 0) || (threads[i].cpu == cpu)) {
 			orig_claim_counter =
 				__atomic_fetch_add(&threads[i].claim_counter,
@@ -3016,8 +6062,410 @@ void isolation_release_cpu(struct memipc_thread_params *thread)
 			   one, __ATOMIC_SEQ_CST);
 }
 
-static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
-						  int64_t now);
+static int64_t memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
+						     int64_t now);
+
+/*
+ * Format a deferred log request.
+ *
+ * Format string is parsed here, argument types sent with the request
+ * must match it.
+ *
+ * Returns the length of the output, or -1 if the request is invalid.
+ */
+static int memipc_log_format(char *dst, size_t dst_size,
+			     const unsigned char *data, size_t size)
+{
+	struct memipc_log_header header;
+	struct memipc_log_conv conv;
+	struct memipc_log_fmt *entry;
+	char spec[MEMIPC_LOG_MAX_CONV];
+	const unsigned char *types, *words;
+	const char *fmt, *p, *strings, *strings_end;
+	size_t pos = 0, l;
+	unsigned int typei = 0, argi = 0, i;
+	uint64_t w;
+	int star[2], rv, n;
+	double d;
+	long double ld;
+
+	if (dst_size == 0)
+		return -1;
+	if (size < sizeof(header))
+		return -1;
+	memcpy(&header, data, sizeof(header));
+	if ((header.id >= MEMIPC_LOG_MAX_FORMATS)
+	    || (header.nargs > MEMIPC_LOG_MAX_ARGS)
+	    || (header.nwords > MEMIPC_LOG_MAX_ARGS)
+	    || (sizeof(header) + header.nargs
+		+ header.nwords * sizeof(uint64_t)
+		+ header.strsize != size))
+		return -1;
+	entry = &_global_memipc_log_fmts[header.id];
+	fmt = __atomic_load_n(&entry->fmt, __ATOMIC_ACQUIRE);
+	if (fmt == NULL)
+		return -1;
+	types = data + sizeof(header);
+	words = types + header.nargs;
+	strings = (const char *)words + header.nwords * sizeof(uint64_t);
+	strings_end = strings + header.strsize;
+
+#define LOG_TYPE(t)							\
+	((typei < header.nargs) && (types[typei++] == (t)))
+#define LOG_ARG(x)							\
+	(memcpy(&(x), words + argi * sizeof(uint64_t),			\
+		sizeof(uint64_t)), argi++)
+#define LOG_SNPRINTF(v)							\
+	((conv.stars == 0) ?						\
+	 snprintf(dst + pos, dst_size - pos, spec, v) :			\
+	 ((conv.stars == 1) ?						\
+	  snprintf(dst + pos, dst_size - pos, spec, star[0], v) :	\
+	  snprintf(dst + pos, dst_size - pos, spec, star[0], star[1], v)))
+
+	for (p = fmt;
+	     (pos < dst_size - 1) && ((rv = memipc_log_parse(p, &conv)) > 0);
+	     p = conv.end) {
+		/* Text before the conversion */
+		l = conv.start - p;
+		if (l > dst_size - 1 - pos)
+			l = dst_size - 1 - pos;
+		memcpy(dst + pos, p, l);
+		pos += l;
+		if (pos >= dst_size - 1)
+			break;
+
+		/* Argument words used by this conversion */
+		if (conv.arg == MEMIPC_LOG_ARG_LDOUBLE)
+			n = 2;
+		else if ((conv.arg == MEMIPC_LOG_ARG_NONE)
+			 || (conv.arg == MEMIPC_LOG_ARG_STRING))
+			n = 0;
+		else
+			n = 1;
+		if (argi + conv.stars + n > header.nwords)
+			return -1;
+		for (i = 0; i < conv.stars; i++) {
+			if (!LOG_TYPE(MEMIPC_LOG_ARG_STAR))
+				return -1;
+			LOG_ARG(w);
+			star[i] = (int)(int64_t)w;
+		}
+		if ((conv.arg != MEMIPC_LOG_ARG_NONE) && !LOG_TYPE(conv.arg))
+			return -1;
+		memcpy(spec, conv.start, conv.end - conv.start);
+		spec[conv.end - conv.start] = '\0';
+		n = 0;
+		switch (conv.arg) {
+		case MEMIPC_LOG_ARG_NONE:
+			dst[pos] = '%';
+			n = 1;
+			break;
+		case MEMIPC_LOG_ARG_INT:
+			LOG_ARG(w);
+			n = LOG_SNPRINTF((int)(int64_t)w);
+			break;
+		case MEMIPC_LOG_ARG_LONG:
+			LOG_ARG(w);
+			n = LOG_SNPRINTF((long)w);
+			break;
+		case MEMIPC_LOG_ARG_LLONG:
+			LOG_ARG(w);
+			n = LOG_SNPRINTF((long long)w);
+			break;
+		case MEMIPC_LOG_ARG_SIZE:
+			LOG_ARG(w);
+			n = LOG_SNPRINTF((size_t)w);
+			break;
+		case MEMIPC_LOG_ARG_PTRDIFF:
+			LOG_ARG(w);
+			n = LOG_SNPRINTF((ptrdiff_t)w);
+			break;
+		case MEMIPC_LOG_ARG_INTMAX:
+			LOG_ARG(w);
+			n = LOG_SNPRINTF((intmax_t)w);
+			break;
+		case MEMIPC_LOG_ARG_DOUBLE:
+			LOG_ARG(d);
+			n = LOG_SNPRINTF(d);
+			break;
+		case MEMIPC_LOG_ARG_LDOUBLE:
+			memcpy(&ld, words + argi * sizeof(uint64_t),
+			       (sizeof(ld) < 2 * sizeof(uint64_t)) ?
+			       sizeof(ld) : 2 * sizeof(uint64_t));
+			argi += 2;
+			n = LOG_SNPRINTF(ld);
+			break;
+		case MEMIPC_LOG_ARG_STRING:
+			l = strnlen(strings, strings_end - strings);
+			if (strings + l >= strings_end)
+				return -1;
+			n = LOG_SNPRINTF(strings);
+			strings += l + 1;
+			break;
+		case MEMIPC_LOG_ARG_POINTER:
+			LOG_ARG(w);
+			n = LOG_SNPRINTF((void *)(uintptr_t)w);
+			break;
+		case MEMIPC_LOG_ARG_IGNORE:
+			LOG_ARG(w);
+			break;
+		case MEMIPC_LOG_ARG_STAR:
+			return -1;
+		}
+		if (n < 0)
+			return -1;
+		pos += n;
+		if (pos > dst_size - 1)
+			pos = dst_size - 1;
+	}
+#undef LOG_SNPRINTF
+#undef LOG_ARG
+#undef LOG_TYPE
+
+	/* Text after the last conversion */
+	if ((pos < dst_size - 1) && (rv == 0)) {
+		l = strlen(p);
+		if (l > dst_size - 1 - pos)
+			l = dst_size - 1 - pos;
+		memcpy(dst + pos, p, l);
+		pos += l;
+	}
+	dst[pos] = '\0';
+	return pos;
+}
+
+/*
+ * System call offload.
+ *
+ * Manager queues descriptors received in MEMIPC_REQ_OFFLOAD requests,
+ * workers take them from the queue, make system calls and write
+ * results back to the descriptors.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct tmc_isol_syscall *first;
+	struct tmc_isol_syscall *last;
+	int stop;
+	int workers_count;
+	pthread_t workers[OFFLOAD_WORKERS];
+} _global_memipc_offload = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Write the result of an offloaded system call.
+ */
+static void memipc_offload_complete(struct tmc_isol_syscall *op, long result)
+{
+	op->result = result;
+	__atomic_store_n(&op->done, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Offload worker thread.
+ */
+static void *memipc_offload_worker(void *arg)
+{
+	struct tmc_isol_syscall *op;
+	long result;
+
+	(void)arg;
+	pthread_mutex_lock(&_global_memipc_offload.lock);
+	for (;;) {
+		while ((_global_memipc_offload.first == NULL)
+		       && !_global_memipc_offload.stop)
+			pthread_cond_wait(&_global_memipc_offload.cond,
+					  &_global_memipc_offload.lock);
+		op = _global_memipc_offload.first;
+		/* Queue is drained before workers exit */
+		if (op == NULL)
+			break;
+		_global_memipc_offload.first = op->next;
+		if (_global_memipc_offload.first == NULL)
+			_global_memipc_offload.last = NULL;
+		pthread_mutex_unlock(&_global_memipc_offload.lock);
+
+		result = syscall(op->nr, op->args[0], op->args[1],
+				 op->args[2], op->args[3], op->args[4],
+				 op->args[5]);
+		memipc_offload_complete(op, (result == -1) ? -errno : result);
+
+		pthread_mutex_lock(&_global_memipc_offload.lock);
+	}
+	pthread_mutex_unlock(&_global_memipc_offload.lock);
+	return NULL;
+}
+
+/*
+ * Queue an offloaded system call, start workers if necessary.
+ */
+static void memipc_offload_queue(struct tmc_isol_syscall *op)
+{
+	pthread_attr_t attr;
+
+	pthread_mutex_lock(&_global_memipc_offload.lock);
+	if (_global_memipc_offload.workers_count == 0) {
+		pthread_attr_init(&attr);
+		if (CPU_COUNT(&_global_nonisol_cpuset) != 0)
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+						    &_global_nonisol_cpuset);
+		_global_memipc_offload.stop = 0;
+		while ((_global_memipc_offload.workers_count < OFFLOAD_WORKERS)
+		       && (pthread_create(&_global_memipc_offload.workers[
+				_global_memipc_offload.workers_count],
+					  &attr, memipc_offload_worker,
+					  NULL) == 0))
+			_global_memipc_offload.workers_count++;
+		pthread_attr_destroy(&attr);
+	}
+	if (_global_memipc_offload.workers_count == 0) {
+		pthread_mutex_unlock(&_global_memipc_offload.lock);
+		memipc_offload_complete(op, -EAGAIN);
+		return;
+	}
+	op->next = NULL;
+	if (_global_memipc_offload.last != NULL)
+		_global_memipc_offload.last->next = op;
+	else
+		_global_memipc_offload.first = op;
+	_global_memipc_offload.last = op;
+	pthread_cond_signal(&_global_memipc_offload.cond);
+	pthread_mutex_unlock(&_global_memipc_offload.lock);
+}
+
+/*
+ * Stop offload workers after they complete queued system calls.
+ */
+static void memipc_offload_stop(void)
+{
+	int i, workers_count;
+
+	pthread_mutex_lock(&_global_memipc_offload.lock);
+	_global_memipc_offload.stop = 1;
+	workers_count = _global_memipc_offload.workers_count;
+	pthread_cond_broadcast(&_global_memipc_offload.cond);
+	pthread_mutex_unlock(&_global_memipc_offload.lock);
+
+	for (i = 0; i < workers_count; i++)
+		pthread_join(_global_memipc_offload.workers[i], NULL);
+
+	pthread_mutex_lock(&_global_memipc_offload.lock);
+	_global_memipc_offload.workers_count = 0;
+	pthread_mutex_unlock(&_global_memipc_offload.lock);
+}
+
+/* Output of threads is printed by the manager and its shards */
+static pthread_mutex_t _global_memipc_print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Print output of a thread on standard output.
+ */
+static void memipc_master_print(struct memipc_thread_params *thread,
+				const unsigned char *data, size_t size)
+{
+	char buffer[19];
+	static int thread_last_cpu = -1, last_newline = 1;
+
+	pthread_mutex_lock(&_global_memipc_print_lock);
+	if (thread_last_cpu != thread->cpu) {
+		thread_last_cpu = thread->cpu;
+		snprintf(buffer, sizeof(buffer), "\r\nCPU %2d: ",
+			 thread->cpu);
+		write(1, buffer + last_newline * 2,
+		      strlen(buffer) - last_newline * 2);
+	}
+	write(1, data, size);
+	if (size > 0)
+		last_newline = data[size - 1] == '\n';
+	pthread_mutex_unlock(&_global_memipc_print_lock);
+}
+
+/*
+ * Record isolation break of a thread.
+ *
+ * Signal information is taken from the last SIGUSR1 received by the
+ * thread, timers and threads are taken from the last scans of timers
+ * and processes, so nothing is read from /proc here.
+ */
+static void memipc_record_isolation_break(struct memipc_thread_params *thread,
+					  enum isol_break_source source)
+{
+	struct isol_break_event *event;
+	struct isol_break_timer timer;
+	struct isol_linux_timer *t;
+	unsigned int signals;
+	int64_t now;
+	int i, j, n;
+
+	if (thread->break_events == NULL) {
+		thread->break_events = (struct isol_break_event *)
+			calloc(ISOL_BREAK_EVENTS,
+			       sizeof(struct isol_break_event));
+		if (thread->break_events == NULL)
+			return;
+	}
+	event = &thread->break_events[thread->break_count
+				      % ISOL_BREAK_EVENTS];
+	thread->break_count++;
+	memset(event, 0, sizeof(struct isol_break_event));
+	clock_gettime(CLOCK_REALTIME, &event->time);
+	event->source = source;
+
+	signals = __atomic_load_n(&thread->break_signals, __ATOMIC_SEQ_CST);
+	event->signals = signals - thread->break_signals_seen;
+	thread->break_signals_seen = signals;
+	if (event->signals != 0) {
+		event->signal_code = thread->break_si_code;
+		event->signal_pid = thread->break_si_pid;
+		event->signal_time = thread->break_signal_time;
+	}
+
+	/*
+	  Timers are left from the last scan of the manager loop, the
+	  ones that expire first are kept, sorted.
+	*/
+	now = memipc_scan_start();
+	event->timers_count = thread->timers_count;
+	for (i = 0, n = 0; i < thread->timers_count; i++) {
+		t = &thread->timers[i];
+		timer.timer_type = t->timer_type;
+		timer.remaining = t->expires - now;
+#if DEBUG_ISOL_NAMES
+		memcpy(timer.handler, t->handler, TIMER_HANDLER_LEN);
+#endif
+		for (j = n; (j > 0)
+			     && (event->timers[j - 1].remaining
+				 > timer.remaining); j--)
+			if (j < ISOL_BREAK_SUSPECTS)
+				event->timers[j] = event->timers[j - 1];
+		if (j < ISOL_BREAK_SUSPECTS)
+			event->timers[j] = timer;
+		if (n < ISOL_BREAK_SUSPECTS)
+			n++;
+	}
+
+	for (i = 0, n = 0; i < proctable_size; i++) {
+		if ((proctable[i].isolated_thread != NULL)
+		    || ((proctable[i].cpu != thread->cpu)
+			&& (proctable[i].prev_cpu != thread->cpu)))
+			continue;
+		if (n < ISOL_BREAK_SUSPECTS) {
+			event->threads[n].pid = proctable[i].pid;
+			event->threads[n].tid = proctable[i].tid;
+			event->threads[n].nonvol_context_switches =
+				proctable[i].nonvol_context_switches;
+#if DEBUG_ISOL_NAMES
+			snprintf(event->threads[n].name, ISOL_BREAK_NAME_LEN,
+				 "%s", (proctable[i].name != NULL) ?
+				 proctable[i].name : "");
+#endif
+		}
+		n++;
+	}
+	event->threads_count = n;
+}
 
 /*
  * Handler for requests in a master/manager thread.
@@ -3027,13 +6475,15 @@ void memipc_master_handle_request(int read_req_type,
 				  unsigned char *memipc_read_buffer,
 				  struct memipc_thread_params *thread)
 {
-	char buffer[19];
+	char log_buffer[4096];
 	char zero = 0;
-	static int thread_last_cpu = -1, last_newline = 1;
-	int client_index;
+	int client_index, log_size;
 
 	(void)zero;
 
+	if ((read_req_type >= 0) && (read_req_type < MEMIPC_REQ_TYPES))
+		__atomic_add_fetch(&thread->req_counts[read_req_type], 1,
+				   __ATOMIC_RELAXED);
 	switch (read_req_type) {
 	case MEMIPC_REQ_NONE:
 		fprintf(stderr,
@@ -3055,17 +6505,11 @@ void memipc_master_handle_request(int read_req_type,
 		fprintf(stderr,
 			"Thread on CPU %d ready\n", thread->cpu);
 #endif
-		{
-			cpu_set_t timers_cpuset;
-			int64_t now;
-			/*
-			  Get all CPUs with isolation and timers running
-			  on them.
-			*/
-			process_all_timers(&timers_cpuset, &now);
-			memipc_isolation_process_ready_launch(&timers_cpuset,
-							      now);
-		}
+		/*
+		  Launch is started by the manager loop once all requests
+		  are drained, so threads that became ready at the same
+		  time are launched in the same pass.
+		*/
 	    break;
 	case MEMIPC_REQ_START_LAUNCH:
 		/* Do nothing, we are the manager */
@@ -3080,7 +6524,12 @@ void memipc_master_handle_request(int read_req_type,
 				thread->cpu);
 #endif
 		} else {
+			struct timespec ts;
+
 			thread->state = MEMIPC_STATE_LAUNCHED;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			thread->launch_done_time =
+				ts.tv_sec * 1000000000LL + ts.tv_nsec;
 #if DEBUG_ISOL_VERBOSE
 			fprintf(stderr,
 				"Thread launch OK, CPU %d\n", thread->cpu);
@@ -3095,39 +6544,15 @@ void memipc_master_handle_request(int read_req_type,
 			thread->cpu);
 #endif
 	    /* Re-launch */
-#if ISOLATION_MONITOR_IN_MASTER
-		{
-		char isolated_state;
-		__atomic_load(&thread->isolated,
-			      &isolated_state,
-			      __ATOMIC_SEQ_CST);
-		if (isolated_state == 0) {
-			if ((thread->state
-			     != MEMIPC_STATE_TMP_EXITING_ISOLATION)
-			 && (thread->state
-			     != MEMIPC_STATE_EXITING_ISOLATION)) {
-				thread->state = MEMIPC_STATE_LOST_ISOLATION;
-				clock_gettime(CLOCK_MONOTONIC,
-					      &thread->isol_exit_time);
-				if (memipc_add_req(thread->m_memipc_mosi,
-						   MEMIPC_REQ_START_LAUNCH,
-						   0, NULL) == 0) {
-				        if (thread->counter_ptr != NULL)
-						(*(thread->counter_ptr))++;
-					thread->state = MEMIPC_STATE_LAUNCHING;
-#if DEBUG_ISOL_VERBOSE
-					fprintf(stderr,
-					"Re-launching thread on CPU %d\n",
-						thread->cpu);
-#endif
-				}
-			}
-		}
-		}
-#else
+		if ((thread->monitor == TMC_ISOL_MONITOR_MASTER)
+		    && (__atomic_load_n(&thread->isolated, __ATOMIC_SEQ_CST)
+			!= 0))
+			break;
 		if ((thread->state != MEMIPC_STATE_TMP_EXITING_ISOLATION)
 		    && (thread->state != MEMIPC_STATE_EXITING_ISOLATION)) {
 			thread->state = MEMIPC_STATE_LOST_ISOLATION;
+			memipc_record_isolation_break(thread,
+						      ISOL_BREAK_LAUNCH_FAILURE);
 			clock_gettime(CLOCK_MONOTONIC, &thread->isol_exit_time);
 			if (memipc_add_req(thread->m_memipc_mosi,
 					   MEMIPC_REQ_START_LAUNCH,
@@ -3135,6 +6560,7 @@ void memipc_master_handle_request(int read_req_type,
 				if (thread->counter_ptr != NULL)
 					(*(thread->counter_ptr))++;
 				thread->state = MEMIPC_STATE_LAUNCHING;
+				memipc_event_relaunch(thread);
 #if DEBUG_ISOL_VERBOSE
 				fprintf(stderr,
 					"Re-launching thread on CPU %d\n",
@@ -3142,7 +6568,6 @@ void memipc_master_handle_request(int read_req_type,
 #endif
 			}
 		}
-#endif
 		break;
 	case MEMIPC_REQ_START_CONFIRMED:
 		/* Do nothing, we are the manager. */
@@ -3160,6 +6585,9 @@ void memipc_master_handle_request(int read_req_type,
 		thread->state = MEMIPC_STATE_OFF;
 		thread->counter_ptr = NULL;
 		thread->exit_request = 0;
+		thread->config_notified = 0;
+		__atomic_store_n(&thread->config_generation, 0,
+				 __ATOMIC_RELEASE);
 		CPU_CLR(thread->cpu, &_global_running_cpuset);
 		if (thread->foreign_desc != NULL)
 			memipc_detach_thread_from_desc(thread->foreign_desc);
@@ -3167,14 +6595,14 @@ void memipc_master_handle_request(int read_req_type,
 			/* Thread from the same process, join it. */
 			pthread_join(thread->thread_id, NULL);
 		}
-#if ISOLATION_MONITOR_IN_MASTER
+		if (thread->monitor == TMC_ISOL_MONITOR_MASTER) {
 #ifdef DEBUG_LOG_ISOL_CHANGES
-		write(1, "\nREQ_EXI, isolated = 0\n", 23);
-#endif
-		__atomic_store(&thread->isolated,
-			       &zero,
-			       __ATOMIC_SEQ_CST);
+			write(1, "\nREQ_EXI, isolated = 0\n", 23);
 #endif
+			__atomic_store(&thread->isolated,
+				       &zero,
+				       __ATOMIC_SEQ_CST);
+		}
 		thread->start_routine = NULL;
 		thread->userdata = NULL;
 		thread->lasttimer = KTIME_MAX;
@@ -3219,17 +6647,56 @@ void memipc_master_handle_request(int read_req_type,
 		break;
 	case MEMIPC_REQ_PRINT:
 		/* Print the message on standard output */
-		if (thread_last_cpu != thread->cpu) {
-			thread_last_cpu = thread->cpu;
-			snprintf(buffer, sizeof(buffer), "\r\nCPU %2d: ",
-				 thread->cpu);
-			write(1, buffer + last_newline * 2,
-			      strlen(buffer) - last_newline * 2);
+		memipc_master_print(thread, memipc_read_buffer, read_req_size);
+		break;
+	case MEMIPC_REQ_LOG:
+		/* Format strings of other processes are not accessible */
+		if ((thread->pid != 0) && (thread->pid != getpid())) {
+			fprintf(stderr,
+				"Manager received log request from "
+				"another process on CPU %d\n", thread->cpu);
+			break;
+		}
+		/* Format the message, then print it */
+		log_size = memipc_log_format(log_buffer, sizeof(log_buffer),
+					     memipc_read_buffer,
+					     read_req_size);
+		if (log_size >= 0)
+			memipc_master_print(thread,
+					    (unsigned char *)log_buffer,
+					    log_size);
+		else
+			fprintf(stderr,
+				"Manager received invalid log request "
+				"from thread on CPU %d\n", thread->cpu);
+		break;
+	case MEMIPC_REQ_OFFLOAD:
+		/* Descriptors of other processes are not accessible */
+		if (((thread->pid != 0) && (thread->pid != getpid()))
+		    || ((size_t)read_req_size
+			!= sizeof(struct tmc_isol_syscall *))) {
+			fprintf(stderr,
+				"Manager received invalid offload request "
+				"from thread on CPU %d\n", thread->cpu);
+			break;
+		}
+		{
+			struct tmc_isol_syscall *op;
+
+			memcpy(&op, memipc_read_buffer, sizeof(op));
+			memipc_offload_queue(op);
+		}
+		break;
+	case MEMIPC_REQ_CONFIG_ACK:
+		/* Thread no longer uses earlier generations */
+		if ((size_t)read_req_size == sizeof(uint64_t)) {
+			uint64_t generation;
+
+			memcpy(&generation, memipc_read_buffer,
+			       sizeof(generation));
+			__atomic_store_n(&thread->config_generation,
+					 generation, __ATOMIC_RELEASE);
 		}
-		write(1, memipc_read_buffer, read_req_size);
-		if (read_req_size > 0)
-			last_newline = memipc_read_buffer[read_req_size - 1]
-				== '\n';
 		break;
 	default:
 		/* Invalid request */
@@ -3271,9 +6738,14 @@ static int memipc_isolation_io_expected(void)
 /*
  * Launch isolation in threads if and when they should be isolated,
  * confirm entering isolation if there are no timers left.
+ *
+ * Each thread is launched and confirmed on its own, as soon as timers
+ * on its CPU are gone. Returns time in nanoseconds before the next
+ * launch step is due, or KTIME_MAX if nothing is waiting for time to
+ * pass.
  */
-static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
-						  int64_t now)
+static int64_t memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
+						     int64_t now)
 {
 	int i, ready_count, needs_start_count,
 		show_running_threads_flag = 0
@@ -3285,13 +6757,17 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
 	, errflag = 0;
 #endif
 	;
-	cpu_set_t overlap_cpuset;
 	struct memipc_thread_params *threads;
 	int threads_count;
+	struct timespec ts;
+	int64_t mono_now, left, remaining, wake = KTIME_MAX;
 
 	threads = _global_isolated_threads;
 	threads_count = _global_isolated_thread_count;
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mono_now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
 	for (i = 0, ready_count = 0, needs_start_count = 0;
 	     i < threads_count; i++) {
 		if ((threads[i].state == MEMIPC_STATE_READY)
@@ -3322,11 +6798,12 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
 		if (_global_isolated_threads_timeout_started == 0)
 			goto last_actions;
 
-		struct timespec ts;
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-		if ((ts.tv_sec - _global_isolated_threads_start_time)
-		    < _global_isolated_threads_start_timeout)
+		left = _global_isolated_threads_start_time
+			+ _global_isolated_threads_start_timeout - mono_now;
+		if (left > 0) {
+			wake = left;
 			goto last_actions;
+		}
 	}
 
 	/* Should issue the request to launch */
@@ -3336,8 +6813,6 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
 #endif
 		    ;
 	    i < threads_count; i++) {
-		struct timespec ts;
-
 		/*
 		  Send exit requests if there are any pending.
 		  This happens regardless of state.
@@ -3355,28 +6830,33 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
 		/* Process thread state. */
 		switch (threads[i].state) {
 		case MEMIPC_STATE_TMP_EXITING_ISOLATION:
-			clock_gettime(CLOCK_MONOTONIC, &ts);
-			if ((ts.tv_sec - threads[i].isol_exit_time.tv_sec)
-			    > _global_isolated_threads_restart_delay) {
-				if (memipc_add_req(threads[i].m_memipc_mosi,
-						   MEMIPC_REQ_START_LAUNCH,
-						   0, NULL) == 0) {
-					if (threads[i].counter_ptr != NULL)
-						(*(threads[i].counter_ptr))++;
-					threads[i].state =
-						MEMIPC_STATE_LAUNCHING;
+			left = threads[i].isol_exit_time.tv_sec * 1000000000LL
+				+ threads[i].isol_exit_time.tv_nsec
+				+ _global_isolated_threads_restart_delay
+				- mono_now;
+			if (left > 0) {
+				if (left < wake)
+					wake = left;
+				break;
+			}
+			if (memipc_add_req(threads[i].m_memipc_mosi,
+					   MEMIPC_REQ_START_LAUNCH,
+					   0, NULL) == 0) {
+				if (threads[i].counter_ptr != NULL)
+					(*(threads[i].counter_ptr))++;
+				threads[i].state = MEMIPC_STATE_LAUNCHING;
+				memipc_event_relaunch(&threads[i]);
 #if DEBUG_ISOL_VERBOSE
-					fprintf(stderr,
+				fprintf(stderr,
 					"Re-launching thread after leaving"
-						" and waiting, CPU %d\n",
-						threads[i].cpu);
+					" and waiting, CPU %d\n",
+					threads[i].cpu);
 #endif
-				}
+			}
 #if 0
-				else
-					errflag = 1;
+			else
+				errflag = 1;
 #endif
-			}
 			break;
 		case MEMIPC_STATE_READY:
 		case MEMIPC_STATE_LOST_ISOLATION:
@@ -3385,6 +6865,9 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
 					   0, NULL) == 0) {
 				if (threads[i].counter_ptr != NULL)
 					(*(threads[i].counter_ptr))++;
+				if (threads[i].state
+				    == MEMIPC_STATE_LOST_ISOLATION)
+					memipc_event_relaunch(&threads[i]);
 				threads[i].state = MEMIPC_STATE_LAUNCHING;
 			}
 #if 0
@@ -3393,14 +6876,11 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
 #endif
 			break;
 		case MEMIPC_STATE_LAUNCHED:
-			CPU_AND(&overlap_cpuset,
-				timers_cpuset,
-				&_global_running_cpuset);
-			if (CPU_COUNT(&overlap_cpuset) == 0) {
+			if (!CPU_ISSET(threads[i].cpu, timers_cpuset)) {
 				/*
-				  There are no timers left on all CPUs
-				  that run isolated threads, so it's safe
-				  to continue.
+				  There are no timers left on the CPU of
+				  this thread, so it's safe to continue.
+				  Timers on other CPUs do not delay it.
 				*/
 #if DEBUG_ISOL_STARTUP_MESSAGE
 				fprintf(stderr,
@@ -3413,85 +6893,69 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
 						   0, NULL) == 0) {
 					if (threads[i].counter_ptr != NULL)
 						(*(threads[i].counter_ptr))++;
+					memipc_event_push(
+						"250 CPU %d timers quiet\n",
+						threads[i].cpu);
 					threads[i].state = MEMIPC_STATE_RUNNING;
 				}
 #if 0
 				else
 					errflag = 1;
 #endif
+				break;
+			}
+			/*
+			  Timers are running on isolated thread. If the last
+			  of them expires soon enough, wait for it, otherwise
+			  request exit from isolation.
+			*/
+			remaining = remaining_nsec_before_expiration(&threads[i],
+								     now);
+			if ((remaining != KTIME_MAX)
+			    && ((mono_now - threads[i].launch_done_time
+				 + remaining)
+				<= _global_isolated_threads_timers_wait)) {
+#if DEBUG_ISOL_VERBOSE
+				fprintf(stderr, "CPUs with timers: ");
+				print_cpuset(stderr, timers_cpuset);
+				fprintf(stderr,
+					", %ld ns left, thread on "
+					"CPU %d should wait\n",
+					(long)remaining, threads[i].cpu);
+				show_running_timers_flag = 1;
+#endif
+				if (remaining < 0)
+					remaining = 0;
+				if (remaining < wake)
+					wake = remaining;
 			} else {
-				if (CPU_ISSET(threads[i].cpu, timers_cpuset)) {
-					/*
-					  Timers are running on isolated thread
-					*/
 #if DEBUG_ISOL_VERBOSE
-					fprintf(stderr,
+				fprintf(stderr,
 					"Timers are present on CPU %d, "
 					"requesting exit from isolation\n",
 					threads[i].cpu);
+				show_running_timers_flag = 1;
 #endif
-					if (memipc_add_req(
-						threads[i].m_memipc_mosi,
-						MEMIPC_REQ_EXIT_ISOLATION,
-						0, NULL) == 0) {
-						if (threads[i].counter_ptr
-						    != NULL)
+				if (memipc_add_req(threads[i].m_memipc_mosi,
+						   MEMIPC_REQ_EXIT_ISOLATION,
+						   0, NULL) == 0) {
+					if (threads[i].counter_ptr != NULL)
 						(*(threads[i].counter_ptr))++;
-						threads[i].state
-					= MEMIPC_STATE_TMP_EXITING_ISOLATION;
-						clock_gettime(CLOCK_MONOTONIC,
+					threads[i].state =
+					MEMIPC_STATE_TMP_EXITING_ISOLATION;
+					clock_gettime(CLOCK_MONOTONIC,
 						&threads[i].isol_exit_time);
-					}
-#if DEBUG_ISOL_VERBOSE
-					show_running_timers_flag = 1;
-#endif
-				} else {
-					/*
-					  Some timers are still running, check
-					  if they are relevant for threads that
-					  are running right now.
-					*/
-					int64_t remaining;
-					remaining =
-					remaining_nsec_before_expiration(now);
-#if DEBUG_ISOL_VERBOSE
-					fprintf(stderr, "CPUs with timers: ");
-					print_cpuset(stderr, timers_cpuset);
-#endif
-					if (remaining != KTIME_MAX) {
-						/*
-						  Some are still in progress,
-						  keep waiting.
-						*/
-#if DEBUG_ISOL_VERBOSE
-						fprintf(stderr,
-						", %ld ns left, thread on "
-							"CPU %d should wait\n",
-							remaining,
-							threads[i].cpu);
-						show_running_timers_flag = 1;
-#endif
-					} else {
-						/*
-						  Everything relevant seemingly
-						  expired, however timers are
-						  still present in the list, so
-						  keep waiting.
-						*/
-#if DEBUG_ISOL_VERBOSE
-						fprintf(stderr,
-					", thread on CPU %d should wait\n",
-							threads[i].cpu);
-						show_running_timers_flag = 1;
-#endif
-					}
+					left =
+					_global_isolated_threads_restart_delay;
+					if (left < wake)
+						wake = left;
 				}
-				/*
-				  Show currently running threads
-				  once all our threads are processed.
-				*/
-				show_running_threads_flag = 1;
 			}
+			/*
+			  Show currently running threads
+			  once all our threads are processed.
+			*/
+			show_running_threads_flag = 1;
 			break;
 		default:
 			break;
@@ -3519,9 +6983,7 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
 #endif
 				    ISOL_PROC_LIST_CMD_PUSH_AWAY);
 	} else {
-		struct timespec ts;
 		static time_t last_thread_scan = 0;
-		clock_gettime(CLOCK_MONOTONIC, &ts);
 		if (((last_thread_scan == 0)
 		     || (ts.tv_sec - last_thread_scan) > 3)) {
 			/* Push threads away from CPUs intended
@@ -3534,6 +6996,7 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
 				last_thread_scan = 1;
 		}
 	}
+	return wake;
 }
 
 /*
@@ -3541,6 +7004,8 @@ static void memipc_isolation_process_ready_launch(cpu_set_t *timers_cpuset,
  */
 int memipc_isolation_get_max_isolated_threads_count(void)
 {
+	if (memipc_manager_is_remote())
+		return _global_memipc_remote_cpus;
 	return _global_isolated_thread_count;
 }
 
@@ -3567,110 +7032,694 @@ void memipc_isolation_terminate_all_threads(void)
 		threads[i].exit_request = 1;
 }
 
+/*
+ * Handle a request from a batch received by the manager.
+ */
+static void memipc_master_handle_batched(enum memipc_req_type req_type,
+					 ssize_t req_size,
+					 unsigned char *req_data,
+					 void *arg)
+{
+	memipc_master_handle_request(req_type, req_size, req_data,
+				     (struct memipc_thread_params *)arg);
+}
+
+/*
+ * Manager shards.
+ *
+ * Each shard is a thread that drains areas of threads on its CPUs.
+ * Output, logs, offloaded system calls and configuration
+ * acknowledgements are handled by the shard. Other requests change
+ * the state of the manager, so they are queued, and handled in the
+ * manager loop in the order they were received.
+ */
+struct memipc_deferred_req {
+	struct memipc_deferred_req *next;
+	struct memipc_thread_params *thread;
+	enum memipc_req_type req_type;
+	ssize_t req_size;
+	unsigned char req_data[];
+};
+
+struct memipc_shard {
+	pthread_t thread_id;
+	int node; /* NUMA node of threads, or -1 */
+	unsigned long cpus[MEMIPC_ACTIVITY_WORDS];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct memipc_deferred_req *first;
+	struct memipc_deferred_req *last;
+	int stop; /* accessed atomically */
+	int count;
+	struct memipc_shard *shards;
+} _global_memipc_shards = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+/* Requested number of shards, 0 for one per NUMA node */
+static int _global_memipc_shards_requested = 1;
+
+/*
+ * Set the number of manager shards, 0 for one shard per NUMA node of
+ * isolated CPUs. With one shard, manager loop drains all areas.
+ *
+ * This function should be called before the manager loop starts.
+ */
+int memipc_isolation_set_manager_shards(int count)
+{
+	if ((count < 0) || (_global_memipc_shards.count != 0))
+		return -1;
+	_global_memipc_shards_requested = count;
+	return 0;
+}
+
+/*
+ * Wake up the manager loop if it is waiting for the doorbell.
+ */
+static void memipc_manager_wake(void)
+{
+#if MANAGER_DOORBELL
+	uint64_t one = 1;
+
+	if ((_global_memipc_doorbell_fd >= 0)
+	    && __atomic_exchange_n(&_global_memipc_doorbell_armed, 0,
+				   __ATOMIC_SEQ_CST))
+		write(_global_memipc_doorbell_fd, &one, sizeof(one));
+#endif
+}
+
+/*
+ * Handle a request in a shard, or queue it for the manager loop.
+ */
+static void memipc_shard_handle_batched(enum memipc_req_type req_type,
+					ssize_t req_size,
+					unsigned char *req_data,
+					void *arg)
+{
+	struct memipc_thread_params *thread;
+	struct memipc_deferred_req *req;
+
+	thread = (struct memipc_thread_params *)arg;
+	switch (req_type) {
+	case MEMIPC_REQ_PRINT:
+	case MEMIPC_REQ_LOG:
+	case MEMIPC_REQ_OFFLOAD:
+	case MEMIPC_REQ_CONFIG_ACK:
+		memipc_master_handle_request(req_type, req_size, req_data,
+					     thread);
+		return;
+	default:
+		break;
+	}
+
+	req = (struct memipc_deferred_req *)
+		malloc(sizeof(struct memipc_deferred_req) + req_size);
+	if (req == NULL) {
+		fprintf(stderr, "Manager shard can't queue request type %d "
+			"from thread on CPU %d\n", req_type, thread->cpu);
+		return;
+	}
+	req->next = NULL;
+	req->thread = thread;
+	req->req_type = req_type;
+	req->req_size = req_size;
+	memcpy(req->req_data, req_data, req_size);
+
+	pthread_mutex_lock(&_global_memipc_shards.lock);
+	if (_global_memipc_shards.last != NULL)
+		_global_memipc_shards.last->next = req;
+	else
+		_global_memipc_shards.first = req;
+	_global_memipc_shards.last = req;
+	pthread_mutex_unlock(&_global_memipc_shards.lock);
+	memipc_manager_wake();
+}
+
+/*
+ * Handle requests queued by shards.
+ *
+ * Returns the number of requests handled.
+ */
+static int memipc_shards_handle_deferred(void)
+{
+	struct memipc_deferred_req *req, *next;
+	int count = 0;
+
+	if (_global_memipc_shards.count == 0)
+		return 0;
+	pthread_mutex_lock(&_global_memipc_shards.lock);
+	req = _global_memipc_shards.first;
+	_global_memipc_shards.first = NULL;
+	_global_memipc_shards.last = NULL;
+	pthread_mutex_unlock(&_global_memipc_shards.lock);
+
+	for (; req != NULL; req = next, count++) {
+		next = req->next;
+		memipc_master_handle_request(req->req_type, req->req_size,
+					     req->req_data, req->thread);
+		free(req);
+	}
+	return count;
+}
+
+/*
+ * Drain areas of threads of a shard.
+ *
+ * Returns the number of requests handled.
+ */
+static int memipc_shard_pass(struct memipc_shard *shard, unsigned int pass,
+			     unsigned char **buffer, size_t *buffer_size)
+{
+	struct memipc_thread_params *thread;
+	unsigned long visit[MEMIPC_ACTIVITY_WORDS], bits;
+	unsigned char *new_buffer;
+	unsigned int w;
+	int claim_counter, rv, handled = 0;
+
+	if ((_global_memipc_activity == NULL)
+	    || ((pass % MANAGER_FULL_SCAN_PASSES) == 0))
+		memcpy(visit, shard->cpus, sizeof(visit));
+	else
+		memset(visit, 0, sizeof(visit));
+	if (_global_memipc_activity != NULL)
+		memipc_activity_take(visit, _global_memipc_activity->rings,
+				     shard->cpus);
+
+	for (w = 0; w < MEMIPC_ACTIVITY_WORDS; w++)
+		for (bits = visit[w]; bits != 0; bits &= bits - 1) {
+			thread = _global_cpu_threads[w * MEMIPC_ACTIVITY_BITS
+						     + __builtin_ctzl(bits)];
+			__atomic_load(&thread->claim_counter, &claim_counter,
+				      __ATOMIC_SEQ_CST);
+			if (claim_counter == 0)
+				continue;
+			memipc_drain_lock(thread);
+			if (*buffer_size < thread->area_size) {
+				new_buffer = realloc(*buffer,
+						     thread->area_size);
+				if (new_buffer == NULL) {
+					memipc_drain_unlock(thread);
+					continue;
+				}
+				*buffer = new_buffer;
+				*buffer_size = thread->area_size;
+			}
+			rv = memipc_get_reqs(thread->m_memipc_miso,
+					     MANAGER_DRAIN_MAX_REQS,
+					     MANAGER_DRAIN_MAX_BYTES,
+					     *buffer, *buffer_size,
+					     memipc_shard_handle_batched,
+					     thread);
+			if ((_global_memipc_activity != NULL)
+			    && (*thread->m_memipc_miso->rptr & 1))
+				memipc_activity_set(
+					_global_memipc_activity->rings,
+					thread->cpu);
+			memipc_drain_unlock(thread);
+			if (rv > 0)
+				handled += rv;
+		}
+	return handled;
+}
+
+/*
+ * Shard thread.
+ */
+static void *memipc_shard_run(void *arg)
+{
+	struct memipc_shard *shard = (struct memipc_shard *)arg;
+	struct timespec ts, sleep_ts;
+	unsigned char *buffer = NULL;
+	size_t buffer_size = 0;
+	unsigned int pass = 0;
+	int64_t now, idle_start = 0;
+
+	sleep_ts.tv_sec = MANAGER_SHARD_SLEEP_NSEC / 1000000000LL;
+	sleep_ts.tv_nsec = MANAGER_SHARD_SLEEP_NSEC % 1000000000LL;
+	while (!__atomic_load_n(&_global_memipc_shards.stop,
+				__ATOMIC_ACQUIRE)) {
+		if (memipc_shard_pass(shard, pass++, &buffer, &buffer_size)) {
+			idle_start = 0;
+			continue;
+		}
+		/* Spin after the last request, then sleep between passes */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		if (idle_start == 0)
+			idle_start = now;
+		else if ((now - idle_start) >= MANAGER_SPIN_NSEC)
+			nanosleep(&sleep_ts, NULL);
+	}
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * Find the shard of a thread.
+ */
+static struct memipc_shard *memipc_shard_find(struct memipc_shard *shards,
+					      int count,
+					      struct memipc_thread_params
+					      *thread, int index)
+{
+	int i, node;
+
+	if (_global_memipc_shards_requested != 0)
+		/* Consecutive CPUs */
+		return &shards[index * count / _global_isolated_thread_count];
+
+	node = (thread->node < 0) ? 0 : thread->node;
+	for (i = 0; i < count; i++)
+		if (shards[i].node == node)
+			return &shards[i];
+	return NULL;
+}
+
+/*
+ * Start manager shards, if requested.
+ *
+ * Returns the number of shards started, 0 if the manager loop should
+ * drain areas itself.
+ */
+static int memipc_shards_start(void)
+{
+	struct memipc_thread_params *threads;
+	struct memipc_shard *shards, *shard;
+	pthread_attr_t attr;
+	int i, count, threads_count, started;
+#if USE_NUMA_PLACEMENT
+	unsigned long policy_nodemask[NUMA_NODEMASK_WORDS];
+	int policy_mode, policy_set;
+#endif
+
+	threads = _global_isolated_threads;
+	threads_count = _global_isolated_thread_count;
+	count = _global_memipc_shards_requested;
+	if (count > threads_count)
+		count = threads_count;
+	if (count == 0)
+		count = threads_count;
+	if (count < 1)
+		return 0;
+
+	shards = (struct memipc_shard *)
+		calloc(count, sizeof(struct memipc_shard));
+	if (shards == NULL)
+		return 0;
+	if (_global_memipc_shards_requested == 0) {
+		/* One shard per node, count becomes the number of nodes */
+		for (i = 0; i < count; i++)
+			shards[i].node = -1;
+		count = 0;
+		for (i = 0; i < threads_count; i++)
+			if (memipc_shard_find(shards, count, &threads[i], i)
+			    == NULL)
+				shards[count++].node = (threads[i].node < 0) ?
+					0 : threads[i].node;
+	} else
+		for (i = 0; i < count; i++)
+			shards[i].node = -1;
+	if (count < 2) {
+		/* Manager loop is enough */
+		free(shards);
+		return 0;
+	}
+	for (i = 0; i < threads_count; i++) {
+		shard = memipc_shard_find(shards, count, &threads[i], i);
+		if ((shard != NULL) && (threads[i].cpu < CPU_SETSIZE))
+			shard->cpus[threads[i].cpu / MEMIPC_ACTIVITY_BITS] |=
+				1UL << (threads[i].cpu % MEMIPC_ACTIVITY_BITS);
+	}
+
+	pthread_attr_init(&attr);
+	if (CPU_COUNT(&_global_nonisol_cpuset) != 0)
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+					    &_global_nonisol_cpuset);
+	__atomic_store_n(&_global_memipc_shards.stop, 0, __ATOMIC_RELEASE);
+	_global_memipc_shards.shards = shards;
+	/* Areas are drained by shards from now on */
+	_global_memipc_shards.count = count;
+	for (started = 0; started < count; started++) {
+#if USE_NUMA_PLACEMENT
+		/* Stack of the shard is on the node of its threads */
+		policy_set = (shards[started].node >= 0)
+			&& (memipc_numa_prefer_node(shards[started].node,
+						    &policy_mode,
+						    policy_nodemask) == 0);
+#endif
+		i = pthread_create(&shards[started].thread_id, &attr,
+				   memipc_shard_run, &shards[started]);
+#if USE_NUMA_PLACEMENT
+		if (policy_set)
+			memipc_numa_restore_policy(policy_mode,
+						   policy_nodemask);
+#endif
+		if (i != 0)
+			break;
+	}
+	pthread_attr_destroy(&attr);
+	if (started < count) {
+		fprintf(stderr, "Can't start manager shards\n");
+		__atomic_store_n(&_global_memipc_shards.stop, 1,
+				 __ATOMIC_RELEASE);
+		for (i = 0; i < started; i++)
+			pthread_join(shards[i].thread_id, NULL);
+		_global_memipc_shards.count = 0;
+		_global_memipc_shards.shards = NULL;
+		free(shards);
+		return 0;
+	}
+	return count;
+}
+
+/*
+ * Stop manager shards, and handle requests they queued.
+ */
+static void memipc_shards_stop(void)
+{
+	int i;
+
+	if (_global_memipc_shards.count == 0)
+		return;
+	__atomic_store_n(&_global_memipc_shards.stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < _global_memipc_shards.count; i++)
+		pthread_join(_global_memipc_shards.shards[i].thread_id, NULL);
+	memipc_shards_handle_deferred();
+	_global_memipc_shards.count = 0;
+	free(_global_memipc_shards.shards);
+	_global_memipc_shards.shards = NULL;
+}
+
+#if MANAGER_DOORBELL
+/*
+ * Check if any thread has a request for the manager.
+ */
+static int memipc_isolation_reqs_pending(void)
+{
+	struct memipc_thread_params *threads;
+	int i, threads_count, claim_counter;
+
+	threads = _global_isolated_threads;
+	threads_count = _global_isolated_thread_count;
+
+	if (_global_memipc_shards.count != 0) {
+		/* Areas are drained by shards */
+		pthread_mutex_lock(&_global_memipc_shards.lock);
+		i = (_global_memipc_shards.first != NULL);
+		pthread_mutex_unlock(&_global_memipc_shards.lock);
+		return i;
+	}
+	for (i = 0; i < threads_count; i++) {
+		__atomic_load(&threads[i].claim_counter, &claim_counter,
+			      __ATOMIC_SEQ_CST);
+		if (claim_counter && (*threads[i].m_memipc_miso->rptr & 1))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Get poll timeout for the next pass of the manager loop.
+ *
+ * Manager polls with zero timeout while it handles requests, and for
+ * MANAGER_SPIN_NSEC after the last one. Then it arms the doorbell and
+ * blocks for idle_timeout, or for MANAGER_DOORBELL_TIMEOUT if I/O is
+ * expected.
+ */
+static int memipc_manager_backoff(int handled, int idle_timeout)
+{
+	static int64_t idle_start = 0;
+	struct timespec ts;
+	int64_t now;
+	int one = 1, zero = 0;
+
+	if (_global_memipc_doorbell_fd < 0)
+		return idle_timeout;
+
+	if (handled > 0) {
+		idle_start = 0;
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	if (idle_start == 0) {
+		idle_start = now;
+		return 0;
+	}
+	if ((now - idle_start) < MANAGER_SPIN_NSEC)
+		return 0;
+
+	/* Requests written before this are seen below */
+	__atomic_store(&_global_memipc_doorbell_armed, &one, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (memipc_isolation_reqs_pending()) {
+		__atomic_store(&_global_memipc_doorbell_armed, &zero,
+			       __ATOMIC_SEQ_CST);
+		idle_start = 0;
+		return 0;
+	}
+	return (idle_timeout == 0) ? MANAGER_DOORBELL_TIMEOUT : idle_timeout;
+}
+#endif
+
+/*
+ * Notify running threads of a new shared configuration generation.
+ */
+static void memipc_config_notify(void)
+{
+	struct tmc_isol_config_buf *c;
+	struct memipc_thread_params *threads;
+	int i;
+
+	c = __atomic_load_n(&memipc_config_published, __ATOMIC_ACQUIRE);
+	if (c == NULL)
+		return;
+	threads = _global_isolated_threads;
+	for (i = 0; i < _global_isolated_thread_count; i++) {
+		if ((threads[i].state == MEMIPC_STATE_OFF)
+		    || (threads[i].config_notified == c->generation))
+			continue;
+		/* Area is full, try again in the next pass */
+		if (memipc_add_req(threads[i].m_memipc_mosi,
+				   MEMIPC_REQ_CONFIG, 0, NULL) != 0)
+			continue;
+		if (threads[i].counter_ptr != NULL)
+			(*(threads[i].counter_ptr))++;
+		threads[i].config_notified = c->generation;
+	}
+}
+
+/*
+ * Limit poll timeout in milliseconds, so manager wakes up when the
+ * next launch step is due.
+ */
+static int memipc_launch_poll_timeout(int timeout, int64_t wake)
+{
+	int64_t wake_msec;
+
+	if (wake == KTIME_MAX)
+		return timeout;
+	wake_msec = (wake + 999999) / 1000000;
+	if ((timeout < 0) || (wake_msec < timeout))
+		return (int)wake_msec;
+	return timeout;
+}
+
+/*
+ * Visit a thread in the manager loop: check if it lost isolation, and
+ * drain a batch of its requests unless shards drain them.
+ *
+ * Returns the number of requests handled.
+ */
+static int memipc_manager_visit(struct memipc_thread_params *thread,
+				unsigned char *memipc_read_buffer,
+				size_t memipc_read_buffer_size)
+{
+	int claim_counter, rv;
+
+	__atomic_load(&thread->claim_counter, &claim_counter,
+		      __ATOMIC_SEQ_CST);
+	if (claim_counter == 0)
+		return 0;
+	/* Areas may be replaced by memipc_thread_areas_resize() */
+	memipc_drain_lock(thread);
+	if ((thread->monitor == TMC_ISOL_MONITOR_MASTER)
+	    && (thread->state != MEMIPC_STATE_OFF)) {
+		char isolated_state, zero = 0, one = 1;
+		__atomic_load(&thread->isolated, &isolated_state,
+			      __ATOMIC_SEQ_CST);
+		if (isolated_state == 0) {
+#ifdef DEBUG_LOG_ISOL_CHANGES
+			write(1, "\nMONITOR, isolated = 1\n", 23);
+#endif
+			__atomic_store(&thread->isolated, &one,
+				       __ATOMIC_SEQ_CST);
+			/* Should react to the launch failure */
+#if DEBUG_ISOL_VERBOSE
+			fprintf(stderr,
+				"Manager: Isolation failure on CPU %d\n",
+				thread->cpu);
+#endif
+			memipc_record_isolation_break(thread,
+						      ISOL_BREAK_MONITOR);
+			/* Re-launch */
+			if (memipc_add_req(thread->m_memipc_mosi,
+					   MEMIPC_REQ_START_LAUNCH,
+					   0, NULL) != 0) {
+#ifdef DEBUG_LOG_ISOL_CHANGES
+				write(1, "\nMONITOR, isolated = 0\n", 23);
+#endif
+				__atomic_store(&thread->isolated, &zero,
+					       __ATOMIC_SEQ_CST);
+			} else {
+				if (thread->counter_ptr != NULL)
+					(*(thread->counter_ptr))++;
+				thread->state = MEMIPC_STATE_LAUNCHING;
+				memipc_event_relaunch(thread);
+#if DEBUG_ISOL_VERBOSE
+				fprintf(stderr,
+					"Re-launching thread on CPU %d\n",
+					thread->cpu);
+#endif
+			}
+		}
+	}
+	if (_global_memipc_shards.count != 0) {
+		memipc_drain_unlock(thread);
+		return 0;
+	}
+	/* Drain a batch of requests, or wait for a larger buffer */
+	if (memipc_read_buffer_size >= thread->area_size)
+		rv = memipc_get_reqs(thread->m_memipc_miso,
+				     MANAGER_DRAIN_MAX_REQS,
+				     MANAGER_DRAIN_MAX_BYTES,
+				     memipc_read_buffer,
+				     memipc_read_buffer_size,
+				     memipc_master_handle_batched,
+				     thread);
+	else
+		rv = 0;
+	/* Requests are left after the batch, visit it in the next pass */
+	if ((_global_memipc_activity != NULL)
+	    && (*thread->m_memipc_miso->rptr & 1))
+		memipc_activity_set(_global_memipc_activity->rings,
+				    thread->cpu);
+	memipc_drain_unlock(thread);
+	return (rv > 0) ? rv : 0;
+}
+
 /*
  * Manager loop.
  */
 int memipc_isolation_run_threads(void)
 {
-	struct memipc_thread_params *threads;
+	struct memipc_thread_params *threads, *thread;
+	unsigned long visit[MEMIPC_ACTIVITY_WORDS], bits;
+	unsigned int w, manager_pass = 0;
 	int threads_count;
 	int i, counter_threads_not_running, threads_were_running;
-	int poll_timeout = 0;
+	int poll_timeout = 0, idle_timeout = 0;
+	int64_t launch_wake = KTIME_MAX;
+#if MANAGER_DOORBELL
+	int handled, zero = 0;
+#endif
 
-	unsigned char memipc_read_buffer[AREA_SIZE];
-	enum memipc_req_type read_req_type;
-	ssize_t read_req_size;
+	unsigned char *memipc_read_buffer;
+	size_t memipc_read_buffer_size, max_area_size;
 
 	threads = _global_isolated_threads;
 	threads_count = _global_isolated_thread_count;
 
+	/* Buffer for requests from threads, sized for the largest area */
+	memipc_read_buffer_size = __atomic_load_n(&_global_memipc_max_area_size,
+						  __ATOMIC_SEQ_CST);
+	memipc_read_buffer = malloc(memipc_read_buffer_size);
+	if (memipc_read_buffer == NULL)
+		return -1;
+	memipc_shards_start();
+
 	threads_were_running = 0;
 	counter_threads_not_running = 0;
-	while ((counter_threads_not_running != threads_count)
-	       || (threads_were_running == 0)
+	/* Daemon keeps running while there are no threads */
+	while ((memipc_manager_mode() == MEMIPC_MANAGER_DAEMON)
+	       || (counter_threads_not_running != threads_count)
+	       || ((threads_were_running == 0)
+		   && (memipc_manager_mode() == MEMIPC_MANAGER_LOCAL))
 	       || is_pending_data_present()) {
+		if (memipc_manager_mode() == MEMIPC_MANAGER_DAEMON_STOPPING) {
+			__atomic_store_n(&_global_memipc_manager_mode,
+					 MEMIPC_MANAGER_DAEMON_STOPPED,
+					 __ATOMIC_SEQ_CST);
+			memipc_isolation_terminate_all_threads();
+		}
 		isol_server_poll_pass(poll_timeout);
+#if MANAGER_DOORBELL
+		__atomic_store(&_global_memipc_doorbell_armed, &zero,
+			       __ATOMIC_SEQ_CST);
+		handled = 0;
+#endif
+		max_area_size = __atomic_load_n(&_global_memipc_max_area_size,
+						__ATOMIC_SEQ_CST);
+		if (memipc_read_buffer_size < max_area_size) {
+			unsigned char *new_buffer;
+
+			/* Area was re-created with a larger size */
+			new_buffer = realloc(memipc_read_buffer,
+					     max_area_size);
+			if (new_buffer != NULL) {
+				memipc_read_buffer = new_buffer;
+				memipc_read_buffer_size = max_area_size;
+			}
+		}
+		/*
+		  Visit threads that wrote requests or received SIGUSR1,
+		  and all threads in full scans. With shards, areas are
+		  drained by them, so only SIGUSR1 is checked here.
+		*/
+		if ((_global_memipc_activity == NULL)
+		    || ((manager_pass++ % MANAGER_FULL_SCAN_PASSES) == 0))
+			memcpy(visit, _global_memipc_threads_mask,
+			       sizeof(visit));
+		else
+			memset(visit, 0, sizeof(visit));
+		if ((_global_memipc_activity != NULL)
+		    && (_global_memipc_shards.count == 0))
+			memipc_activity_take(visit,
+					     _global_memipc_activity->rings,
+					     _global_memipc_threads_mask);
+		memipc_activity_take(visit, _global_memipc_activity_breaks,
+				     _global_memipc_threads_mask);
+		for (w = 0; w < MEMIPC_ACTIVITY_WORDS; w++)
+			for (bits = visit[w]; bits != 0; bits &= bits - 1) {
+				thread = _global_cpu_threads[w
+						* MEMIPC_ACTIVITY_BITS
+						+ __builtin_ctzl(bits)];
+#if MANAGER_DOORBELL
+				handled +=
+#endif
+				memipc_manager_visit(thread,
+						     memipc_read_buffer,
+						     memipc_read_buffer_size);
+			}
+#if MANAGER_DOORBELL
+		handled +=
+#endif
+		memipc_shards_handle_deferred();
+
+		/*
+		  Check if threads are running, this will be used to
+		  determine if this loop should finish.
+		*/
 		counter_threads_not_running = 0;
 		for (i = 0; i < threads_count; i++) {
-			int claim_counter;
-			__atomic_load(&threads[i].claim_counter,
-				      &claim_counter,
-				      __ATOMIC_SEQ_CST);
-			if (claim_counter) {
-#if ISOLATION_MONITOR_IN_MASTER
-				if (threads[i].state != MEMIPC_STATE_OFF) {
-					char isolated_state, zero = 0, one = 1;
-					__atomic_load(&threads[i].isolated,
-						      &isolated_state,
-						      __ATOMIC_SEQ_CST);
-					if (isolated_state == 0) {
-#ifdef DEBUG_LOG_ISOL_CHANGES
-						write(1,
-						"\nMONITOR, isolated = 1\n",
-						      23);
-#endif
-						__atomic_store(
-						       &threads[i].isolated,
-						       &one,
-						       __ATOMIC_SEQ_CST);
-						/* Should react to the launch
-						   failure */
-#if DEBUG_ISOL_VERBOSE
-						fprintf(stderr,
-				"Manager: Isolation failure on CPU %d\n",
-							threads[i].cpu);
-#endif
-						/* Re-launch */
-						if (memipc_add_req(
-						threads[i].m_memipc_mosi,
-						MEMIPC_REQ_START_LAUNCH,
-						0, NULL) != 0) {
-#ifdef DEBUG_LOG_ISOL_CHANGES
-							write(1,
-						"\nMONITOR, isolated = 0\n",
-							      23);
-#endif
-							__atomic_store(
-							&threads[i].isolated,
-							&zero,
-							__ATOMIC_SEQ_CST);
-						} else {
-							if (threads[i].
-							    counter_ptr != NULL)
-							(*(threads[i].
-							   counter_ptr))++;
-							threads[i].state
-						= MEMIPC_STATE_LAUNCHING;
-#if DEBUG_ISOL_VERBOSE
-							fprintf(stderr,
-					    "Re-launching thread on CPU %d\n",
-								threads[i].cpu);
-#endif
-						}
-					}
-				}
-#endif
-				read_req_size = sizeof(memipc_read_buffer);
-				read_req_type = MEMIPC_REQ_NONE;
-				if (memipc_get_req(threads[i].m_memipc_miso,
-						   &read_req_type,
-						   &read_req_size,
-						   memipc_read_buffer) == 0) {
-				memipc_master_handle_request(read_req_type,
-							     read_req_size,
-							     memipc_read_buffer,
-							     &threads[i]);
-				}
-			}
-			/*
-			  Check if the current thread is running, this will be
-			  used it to determine if this loop should finish.
-			*/
 			if (threads[i].state == MEMIPC_STATE_OFF)
 				counter_threads_not_running++;
 			else
 				threads_were_running = 1;
 		}
+		memipc_config_notify();
 		if (_global_isolated_threads_timeout_started) {
 			cpu_set_t timers_cpuset;
 			int64_t now;
@@ -3678,18 +7727,68 @@ int memipc_isolation_run_threads(void)
 			  Get all CPUs with isolation and timers running
 			  on them.
 			*/
-			process_all_timers(&timers_cpuset, &now);
-			memipc_isolation_process_ready_launch(&timers_cpuset,
-							      now);
+			/* Time is left as is if the list does not have it */
+			now = memipc_scan_start();
+			if (process_all_timers(&timers_cpuset,
+					       &_global_isol_cpuset,
+					       &now) != 0)
+				/* No timers are known without the list */
+				CPU_ZERO(&timers_cpuset);
+			launch_wake =
+				memipc_isolation_process_ready_launch(
+							&timers_cpuset, now);
 			if (memipc_isolation_io_expected() == 0)
-				poll_timeout = ISOL_SERVER_IDLE_POLL_TIMEOUT;
+				idle_timeout = ISOL_SERVER_IDLE_POLL_TIMEOUT;
 			else
-				poll_timeout = 0;
+				idle_timeout = 0;
 		}
+		memipc_events_scan();
+		memipc_metrics_scan();
+#if MANAGER_DOORBELL
+		poll_timeout = memipc_manager_backoff(handled, idle_timeout);
+#else
+		poll_timeout = idle_timeout;
+#endif
+		poll_timeout = memipc_launch_poll_timeout(poll_timeout,
+							  launch_wake);
 	}
+	memipc_shards_stop();
+	memipc_offload_stop();
+	free(memipc_read_buffer);
 	return 0;
 }
 
+/*
+ * Manager loop of the manager daemon.
+ *
+ * Threads of other processes connect through the socket, and use
+ * areas in named shared memory. Unlike memipc_isolation_run_threads(),
+ * this function does not return when all threads exit, but only after
+ * memipc_isolation_stop_daemon() is called.
+ */
+int memipc_isolation_run_daemon(void)
+{
+	if (_global_isolated_threads == NULL)
+		return -1;
+	__atomic_store_n(&_global_memipc_manager_mode, MEMIPC_MANAGER_DAEMON,
+			 __ATOMIC_SEQ_CST);
+	return memipc_isolation_run_threads();
+}
+
+/*
+ * Terminate all threads, then exit the daemon's manager loop.
+ *
+ * This function can be called from a signal handler.
+ */
+void memipc_isolation_stop_daemon(void)
+{
+	int mode = MEMIPC_MANAGER_DAEMON;
+
+	__atomic_compare_exchange_n(&_global_memipc_manager_mode, &mode,
+				    MEMIPC_MANAGER_DAEMON_STOPPING, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
 /*
  * Linux-specific thread ID conversion.
  *
@@ -3718,9 +7817,514 @@ static unsigned int isolation_get_tid(pthread_t thread)
 		pid_t pid;
 	};
 
-	const struct mockup_pthread *p;
-	p = (const struct mockup_pthread *) thread;
-	return (unsigned long) p->tid;
+	const struct mockup_pthread *p;
+	p = (const struct mockup_pthread *) thread;
+	return (unsigned long) p->tid;
+}
+
+/*
+ * Delete memipc areas of a thread.
+ */
+static void memipc_thread_areas_delete(struct memipc_thread_params *thread)
+{
+	if (thread->m_memipc_mosi != NULL)
+		memipc_area_delete(thread->m_memipc_mosi);
+	if (thread->m_memipc_miso != NULL)
+		memipc_area_delete(thread->m_memipc_miso);
+	if (thread->s_memipc_mosi != NULL)
+		memipc_area_delete_duplicate(thread->s_memipc_mosi);
+	if (thread->s_memipc_miso != NULL)
+		memipc_area_delete_duplicate(thread->s_memipc_miso);
+	thread->m_memipc_mosi = NULL;
+	thread->m_memipc_miso = NULL;
+	thread->s_memipc_mosi = NULL;
+	thread->s_memipc_miso = NULL;
+	if (thread->read_buffer != NULL)
+		free(thread->read_buffer);
+	thread->read_buffer = NULL;
+	if (thread->memipc_fd >= 0)
+		close(thread->memipc_fd);
+	thread->memipc_fd = -1;
+}
+
+/*
+ * Allocate shared memory for count areas of a given size, and create
+ * the descriptor of the first area.
+ *
+ * With MEMIPC_AREA_HUGEPAGES flag, areas are rounded up to whole huge
+ * pages and allocated as a file of the same name on a hugetlbfs mount,
+ * so other processes can open it with memipc_area_open(). If huge pages
+ * are not available, regular shared memory is used, and transparent
+ * huge pages are requested for it. Size is updated to the size of each
+ * area.
+ */
+static struct memipc_area *memipc_area_alloc(const char *name,
+					     size_t *size,
+					     unsigned int count,
+					     unsigned int flags,
+					     int node,
+					     int *fd)
+{
+	size_t hsize, asize;
+	struct memipc_area *area = NULL;
+	char path[PATH_MAX];
+
+	/* Area consists of whole blocks */
+	asize = *size;
+	if (asize < AREA_MIN_SIZE)
+		asize = AREA_MIN_SIZE;
+	asize = (asize + EIGHT - 1) & ~(size_t)(EIGHT - 1);
+
+	*fd = -1;
+	memipc_area_unlink(name);
+	if ((flags & MEMIPC_AREA_HUGEPAGES)
+	    && (memipc_hugetlbfs_path(name, path, sizeof(path)) == 0)) {
+		hsize = (asize + AREA_HUGEPAGE_SIZE - 1)
+			& ~(size_t)(AREA_HUGEPAGE_SIZE - 1);
+		*fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (*fd >= 0) {
+			/* Huge pages are reserved when mapped */
+			if (ftruncate(*fd, hsize * count) == 0)
+				area = memipc_area_create(hsize, hsize * count,
+							  0, *fd, NULL);
+			if (area == NULL) {
+				close(*fd);
+				*fd = -1;
+				unlink(path);
+			} else
+				asize = hsize;
+		}
+	}
+
+	if (*fd < 0) {
+		*fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (*fd < 0)
+			return NULL;
+		if (ftruncate(*fd, asize * count) < 0) {
+			close(*fd);
+			*fd = -1;
+			return NULL;
+		}
+		area = memipc_area_create(asize, asize * count, 0, *fd, NULL);
+#ifdef MADV_HUGEPAGE
+		/* Transparent huge pages, if enabled for shared memory */
+		if ((area != NULL) && (flags & MEMIPC_AREA_HUGEPAGES))
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+			madvise((void *)area->area, asize * count,
+				MADV_HUGEPAGE);
+#pragma GCC diagnostic pop
+#endif
+		if (area == NULL) {
+			close(*fd);
+			*fd = -1;
+		}
+	}
+#if USE_NUMA_PLACEMENT
+	/* Nothing was written to the area yet */
+	if (area != NULL)
+		memipc_numa_bind(area->area, asize * count, node);
+#endif
+
+	*size = asize;
+	return area;
+}
+
+/*
+ * Create memipc areas of a thread, each of a given size.
+ *
+ * See memipc_area_alloc() for MEMIPC_AREA_HUGEPAGES flag.
+ */
+static int memipc_thread_areas_create(struct memipc_thread_params *thread,
+				      size_t size, unsigned int flags)
+{
+	size_t max_size;
+
+	thread->memipc_fd = -1;
+	thread->m_memipc_mosi = NULL;
+	thread->m_memipc_miso = NULL;
+	thread->s_memipc_mosi = NULL;
+	thread->s_memipc_miso = NULL;
+	thread->read_buffer = NULL;
+
+	if (thread->memipc_name == NULL)
+		return -1;
+
+	thread->m_memipc_mosi = memipc_area_alloc(thread->memipc_name, &size,
+						  2, flags, thread->node,
+						  &thread->memipc_fd);
+	if (thread->m_memipc_mosi == NULL)
+		return -1;
+
+	thread->m_memipc_miso =
+		memipc_area_create(size, 0, size, thread->memipc_fd,
+				   (unsigned char*)thread->m_memipc_mosi->area);
+	thread->s_memipc_mosi = memipc_area_dup(thread->m_memipc_mosi);
+	if (thread->m_memipc_miso != NULL)
+		thread->s_memipc_miso = memipc_area_dup(thread->m_memipc_miso);
+	thread->read_buffer = malloc(size);
+
+	if ((thread->m_memipc_miso == NULL)
+	    || (thread->s_memipc_mosi == NULL)
+	    || (thread->s_memipc_miso == NULL)
+	    || (thread->read_buffer == NULL)) {
+		memipc_thread_areas_delete(thread);
+		return -1;
+	}
+
+#if MANAGER_DOORBELL
+	thread->s_memipc_miso->doorbell = &_global_memipc_doorbell_armed;
+#endif
+	memipc_activity_attach(thread->s_memipc_miso, thread->cpu);
+	thread->area_size = size;
+	thread->area_flags = flags;
+	/* Manager loop grows its buffer when it sees a larger size */
+	max_size = __atomic_load_n(&_global_memipc_max_area_size,
+				   __ATOMIC_SEQ_CST);
+	while ((size > max_size)
+	       && !__atomic_compare_exchange_n(&_global_memipc_max_area_size,
+					       &max_size, size, 0,
+					       __ATOMIC_SEQ_CST,
+					       __ATOMIC_SEQ_CST))
+		;
+	return 0;
+}
+
+/*
+ * Set size of memipc areas created by default.
+ *
+ * This function should be called before the isolation environment is
+ * initialized. Individual threads can use other sizes, see
+ * isolation_thread_create_with_area().
+ */
+int memipc_isolation_set_area_size(size_t size, unsigned int flags)
+{
+	if (_global_isolated_threads != NULL)
+		return -1;
+	if (size < AREA_MIN_SIZE)
+		size = AREA_MIN_SIZE;
+	if (size >= MEMIPC_REQ_SIZE_INPLACE)
+		return -1;
+	_global_memipc_area_size = size;
+	_global_memipc_area_flags = flags;
+	return 0;
+}
+
+/*
+ * Set launch timing, in nanoseconds.
+ *
+ * start_timeout is the time manager waits for all threads to become
+ * ready before launching the ones that are, restart_delay is the time
+ * before a thread that left isolation because of timers on its CPU is
+ * launched again, timers_wait is the time a launched thread may wait
+ * for timers on its CPU to expire before it is sent out of isolation.
+ */
+int memipc_isolation_set_launch_timing(int64_t start_timeout,
+				       int64_t restart_delay,
+				       int64_t timers_wait)
+{
+	if ((start_timeout < 0) || (restart_delay < 0) || (timers_wait < 0))
+		return -1;
+	_global_isolated_threads_start_timeout = start_timeout;
+	_global_isolated_threads_restart_delay = restart_delay;
+	_global_isolated_threads_timers_wait = timers_wait;
+	return 0;
+}
+
+/*
+ * Replace memipc areas of a thread with areas of a different size.
+ *
+ * Manager and shards only use the areas with drain_lock held. Old
+ * areas remain in place if new ones can not be created.
+ */
+static int memipc_thread_areas_resize(struct memipc_thread_params *thread,
+				      size_t size, unsigned int flags)
+{
+	struct memipc_thread_params new_areas;
+
+	new_areas.memipc_name = thread->memipc_name;
+	new_areas.cpu = thread->cpu;
+	new_areas.node = thread->node;
+	if (memipc_thread_areas_create(&new_areas, size, flags))
+		return -1;
+	/* Manager or a shard may be draining old areas */
+	memipc_drain_lock(thread);
+	memipc_thread_areas_delete(thread);
+	thread->memipc_fd = new_areas.memipc_fd;
+	thread->area_size = new_areas.area_size;
+	thread->area_flags = new_areas.area_flags;
+	thread->read_buffer = new_areas.read_buffer;
+	thread->m_memipc_mosi = new_areas.m_memipc_mosi;
+	thread->m_memipc_miso = new_areas.m_memipc_miso;
+	thread->s_memipc_mosi = new_areas.s_memipc_mosi;
+	thread->s_memipc_miso = new_areas.s_memipc_miso;
+	memipc_drain_unlock(thread);
+	return 0;
+}
+
+/*
+ * Direct channels between managed threads.
+ *
+ * Channel is a single memipc area shared by two threads on different
+ * CPUs, one of them writes requests, another reads them, manager is not
+ * involved. Channels are created during setup, then each of the two
+ * threads attaches to the channel with its own area descriptor.
+ * Sending and receiving only access the area and the thread's own
+ * descriptor, so no system calls or locks are used.
+ */
+struct memipc_channel {
+	struct memipc_channel *next; /* list of channels */
+	char *name; /* channel name */
+	char *shm_name; /* name of shared memory object */
+	int fd;
+	int writer_cpu; /* CPU of the writing thread */
+	int reader_cpu; /* CPU of the reading thread */
+	struct memipc_area *w_area; /* writer view */
+	struct memipc_area *r_area; /* reader view */
+};
+
+/* List of channels, new channels are added atomically */
+static struct memipc_channel *_global_memipc_channels = NULL;
+
+/*
+ * Check if CPU is available for managed threads.
+ */
+static int memipc_cpu_is_managed(int cpu)
+{
+	int i;
+
+	for (i = 0; i < _global_isolated_thread_count; i++)
+		if (_global_isolated_threads[i].cpu == cpu)
+			return 1;
+	return 0;
+}
+
+/*
+ * Create a channel with a given name between threads on two CPUs.
+ *
+ * Size and MEMIPC_AREA_* flags apply to the channel's area, as in
+ * isolation_thread_create_with_area(). Returns channel descriptor or
+ * NULL.
+ */
+struct memipc_channel *memipc_channel_create(const char *name,
+					     int writer_cpu, int reader_cpu,
+					     size_t size, unsigned int flags)
+{
+	struct memipc_channel *channel;
+	struct memipc_thread_params *reader;
+	size_t l;
+
+	if ((name == NULL) || (writer_cpu == reader_cpu)
+	    || (size >= MEMIPC_REQ_SIZE_INPLACE))
+		return NULL;
+
+	if (!memipc_cpu_is_managed(writer_cpu)
+	    || !memipc_cpu_is_managed(reader_cpu)) {
+		fprintf(stderr, "Channel %s: CPUs %d and %d must be "
+			"available for isolation\n", name,
+			writer_cpu, reader_cpu);
+		return NULL;
+	}
+
+	if (memipc_channel_find(name) != NULL) {
+		fprintf(stderr, "Channel %s already exists\n", name);
+		return NULL;
+	}
+
+	channel = (struct memipc_channel *)
+		malloc(sizeof(struct memipc_channel));
+	if (channel == NULL)
+		return NULL;
+
+	l = strlen(name);
+	channel->name = strdup(name);
+	channel->shm_name = malloc(l + 12);
+	if ((channel->name == NULL) || (channel->shm_name == NULL)) {
+		free(channel->name);
+		free(channel->shm_name);
+		free(channel);
+		return NULL;
+	}
+	snprintf(channel->shm_name, l + 12, "/isol_chan_%s", name);
+
+	if (size == 0)
+		size = _global_memipc_area_size;
+	/* Reader polls the area, so it is placed on the reader's node */
+	reader = memipc_cpu_thread(reader_cpu);
+	channel->w_area = memipc_area_alloc(channel->shm_name, &size, 1,
+					    flags,
+					    (reader != NULL) ? reader->node : -1,
+					    &channel->fd);
+	channel->r_area = memipc_area_dup(channel->w_area);
+	if (channel->r_area == NULL) {
+		if (channel->w_area != NULL) {
+			memipc_area_delete(channel->w_area);
+			close(channel->fd);
+		}
+		memipc_area_unlink(channel->shm_name);
+		free(channel->name);
+		free(channel->shm_name);
+		free(channel);
+		return NULL;
+	}
+	/* Only this process maps the area */
+	memipc_area_unlink(channel->shm_name);
+
+	channel->writer_cpu = writer_cpu;
+	channel->reader_cpu = reader_cpu;
+
+	channel->next = __atomic_load_n(&_global_memipc_channels,
+					__ATOMIC_SEQ_CST);
+	while (!__atomic_compare_exchange_n(&_global_memipc_channels,
+					    &channel->next, channel, 0,
+					    __ATOMIC_SEQ_CST,
+					    __ATOMIC_SEQ_CST));
+	return channel;
+}
+
+/*
+ * Find a channel by name.
+ */
+struct memipc_channel *memipc_channel_find(const char *name)
+{
+	struct memipc_channel *channel;
+
+	for (channel = __atomic_load_n(&_global_memipc_channels,
+				       __ATOMIC_SEQ_CST);
+	     channel != NULL; channel = channel->next)
+		if (!strcmp(channel->name, name))
+			return channel;
+	return NULL;
+}
+
+/*
+ * Attach current managed thread to a channel.
+ *
+ * Thread on the writer's CPU becomes the writer, thread on the
+ * reader's CPU becomes the reader.
+ */
+int memipc_channel_attach(struct memipc_channel *channel)
+{
+	if ((channel == NULL) || (memipc_thread_self == NULL))
+		return -1;
+
+	if (memipc_thread_self->cpu == channel->writer_cpu) {
+		channel->w_area->writer = memipc_my_pid;
+		return 0;
+	}
+	if (memipc_thread_self->cpu == channel->reader_cpu) {
+		channel->r_area->reader = memipc_my_pid;
+		return 0;
+	}
+	fprintf(stderr, "Thread on CPU %d can not be attached to channel "
+		"%s between CPUs %d and %d\n", memipc_thread_self->cpu,
+		channel->name, channel->writer_cpu, channel->reader_cpu);
+	return -1;
+}
+
+/*
+ * Get area descriptor of the current thread in a channel.
+ *
+ * Requests can be written to the writer's descriptor with
+ * memipc_add_req(), memipc_add_reqs() or memipc_reserve_req(), and read
+ * from the reader's descriptor with memipc_get_req(),
+ * memipc_get_reqs() or memipc_peek_req().
+ */
+struct memipc_area *memipc_channel_area(struct memipc_channel *channel)
+{
+	if (channel == NULL)
+		return NULL;
+	if (channel->w_area->writer == memipc_my_pid)
+		return channel->w_area;
+	if (channel->r_area->reader == memipc_my_pid)
+		return channel->r_area;
+	return NULL;
+}
+
+/*
+ * Send data to a channel.
+ *
+ * Data is copied into the area without encoding. Returns 0 on success,
+ * -1 if there is not enough space in the area.
+ */
+int memipc_channel_send(struct memipc_channel *channel,
+			const void *data, size_t size)
+{
+	unsigned char *p;
+
+	if (channel->w_area->writer != memipc_my_pid)
+		return -1;
+	p = memipc_reserve_req(channel->w_area, size);
+	if (p == NULL)
+		return -1;
+	memcpy(p, data, size);
+	return memipc_commit_req(channel->w_area, MEMIPC_REQ_DATA, size);
+}
+
+/*
+ * Receive data from a channel.
+ *
+ * Returns the size of received data, -1 if there is no data, -2 if
+ * data does not fit in the buffer.
+ */
+ssize_t memipc_channel_recv(struct memipc_channel *channel,
+			    void *data, size_t size)
+{
+	enum memipc_req_type req_type;
+	ssize_t req_size;
+	int rv;
+
+	if (channel->r_area->reader != memipc_my_pid)
+		return -1;
+	req_size = size;
+	rv = memipc_get_req(channel->r_area, &req_type, &req_size,
+			    (unsigned char *)data);
+	if (rv < 0)
+		return rv;
+	return req_size;
+}
+
+/*
+ * Get a pointer to the read pointer of the reader's descriptor.
+ *
+ * Valid bit of the block it points to is set when there is a request,
+ * see TMC_ISOL_CHAN_READY().
+ */
+volatile unsigned char * const *
+memipc_channel_poll_ptr(struct memipc_channel *channel)
+{
+	if (channel == NULL)
+		return NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+	return (volatile unsigned char * const *)&channel->r_area->rptr;
+#pragma GCC diagnostic pop
+}
+
+/*
+ * Delete a channel.
+ *
+ * Threads should not use the channel at this point. Channels should
+ * not be created at the same time.
+ */
+void memipc_channel_delete(struct memipc_channel *channel)
+{
+	struct memipc_channel **p;
+
+	if (channel == NULL)
+		return;
+
+	for (p = &_global_memipc_channels; *p != NULL; p = &(*p)->next)
+		if (*p == channel) {
+			*p = channel->next;
+			break;
+		}
+	memipc_area_delete(channel->w_area);
+	memipc_area_delete_duplicate(channel->r_area);
+	close(channel->fd);
+	free(channel->name);
+	free(channel->shm_name);
+	free(channel);
 }
 
 /*
@@ -3732,54 +8336,101 @@ static unsigned int isolation_get_tid(pthread_t thread)
  * managed environment from the very beginning. Alternatively thread
  * can be started independently, then claim a CPU.
  */
-int isolation_thread_create(int cpu, const pthread_attr_t *attr,
-			    void *(*init_routine)(void*),
-			    void *(*start_routine)(void*), void *arg)
+int (isolation_thread_create)(int cpu, const pthread_attr_t *attr,
+			      void *(*init_routine)(void*),
+			      void *(*start_routine)(void*), void *arg)
+{
+	return isolation_thread_create_with_area(cpu, attr, 0, 0,
+						 TMC_ISOL_MONITOR_DEFAULT,
+						 init_routine, start_routine,
+						 arg);
+}
+
+/*
+ * Claim a CPU, then start a thread on it, with memipc areas of a given
+ * size and MEMIPC_AREA_* flags, monitored in TMC_ISOL_MONITOR_* mode.
+ *
+ * Zero area_size keeps areas that were created at initialization.
+ */
+int isolation_thread_create_with_area(int cpu, const pthread_attr_t *attr,
+				      size_t area_size,
+				      unsigned int area_flags,
+				      int monitor,
+				      void *(*init_routine)(void*),
+				      void *(*start_routine)(void*),
+				      void *arg)
 {
 	struct memipc_thread_params *thread;
 	int retval;
-#if ISOLATION_MONITOR_IN_MASTER
 	char zero = 0, one = 1;
+#if USE_NUMA_PLACEMENT
+	unsigned long policy_nodemask[NUMA_NODEMASK_WORDS];
+	int policy_mode, policy_set;
 #endif
 
+	if ((monitor != TMC_ISOL_MONITOR_MASTER)
+	    && (monitor != TMC_ISOL_MONITOR_SLAVE))
+		return -EINVAL;
+
 	thread = isolation_claim_cpu(cpu);
 	if (thread == NULL)
 		return -EINVAL;
+	if ((area_size != 0)
+	    && ((area_size != thread->area_size)
+		|| (area_flags != thread->area_flags))
+	    && memipc_thread_areas_resize(thread, area_size, area_flags)) {
+		isolation_release_cpu(thread);
+		return -ENOMEM;
+	}
 	thread->init_routine = init_routine;
 	thread->start_routine = start_routine;
 	thread->userdata = arg;
-#if ISOLATION_MONITOR_IN_MASTER
-	/*
-	  thread->isolated value 1 means that initialization is in progress,
-	  and thread may be not in isolated state.
-	*/
+	thread->monitor = monitor;
+	if (thread->monitor == TMC_ISOL_MONITOR_MASTER) {
+		/*
+		  thread->isolated value 1 means that initialization is in
+		  progress, and thread may be not in isolated state.
+		*/
 #ifdef DEBUG_LOG_ISOL_CHANGES
-	write(1, "\nTHR_CRE, isolated = 1\n", 23);
+		write(1, "\nTHR_CRE, isolated = 1\n", 23);
 #endif
-	__atomic_store(&thread->isolated,
-		       &one,
-		       __ATOMIC_SEQ_CST);
+		__atomic_store(&thread->isolated,
+			       &one,
+			       __ATOMIC_SEQ_CST);
+	}
+#if USE_NUMA_PLACEMENT
+	/*
+	  Stack and thread descriptor are allocated and first written
+	  by this thread, so it temporarily prefers the node of the new
+	  thread's CPU. New thread inherits the policy.
+	*/
+	policy_set = (memipc_numa_prefer_node(thread->node, &policy_mode,
+					      policy_nodemask) == 0);
 #endif
 	retval = pthread_create(&thread->thread_id, attr, memipc_thread_startup,
 				thread);
+#if USE_NUMA_PLACEMENT
+	if (policy_set)
+		memipc_numa_restore_policy(policy_mode, policy_nodemask);
+#endif
 	if (retval < 0) {
 		thread->thread_id = 0;
 		thread->pid = 0;
 		thread->tid = 0;
 		thread->lasttimer = KTIME_MAX;
 		thread->updatetimer = KTIME_MAX;
-#if ISOLATION_MONITOR_IN_MASTER
-		/*
-		  thread->isolated value 0 means that thread does not exist or
-		  lost its isolated state.
-		*/
+		if (thread->monitor == TMC_ISOL_MONITOR_MASTER) {
+			/*
+			  thread->isolated value 0 means that thread does not
+			  exist or lost its isolated state.
+			*/
 #ifdef DEBUG_LOG_ISOL_CHANGES
-		write(1, "\nTHR_CRE, isolated = 0\n", 23);
-#endif
-		__atomic_store(&thread->isolated,
-			       &zero,
-			       __ATOMIC_SEQ_CST);
+			write(1, "\nTHR_CRE, isolated = 0\n", 23);
 #endif
+			__atomic_store(&thread->isolated,
+				       &zero,
+				       __ATOMIC_SEQ_CST);
+		}
 		isolation_release_cpu(thread);
 	} else {
 		/*
@@ -3796,7 +8447,8 @@ int isolation_thread_create(int cpu, const pthread_attr_t *attr,
 		thread->state = MEMIPC_STATE_STARTED;
 		struct timespec ts;
 		clock_gettime(CLOCK_MONOTONIC, &ts);
-		_global_isolated_threads_start_time = ts.tv_sec;
+		_global_isolated_threads_start_time =
+			ts.tv_sec * 1000000000LL + ts.tv_nsec;
 		_global_isolated_threads_timeout_started = 1;
 	}
 	return retval;
@@ -3811,12 +8463,25 @@ int isolation_thread_create(int cpu, const pthread_attr_t *attr,
  * is attached to the managed environment. This can not be done in a thread
  * that is already managed.
  */
-int isolation_connect_this_thread(int cpu)
+int (isolation_connect_this_thread)(int cpu)
+{
+	return isolation_connect_this_thread_mode(cpu,
+						  TMC_ISOL_MONITOR_DEFAULT);
+}
+
+/*
+ * Same as above, with TMC_ISOL_MONITOR_* monitoring mode.
+ */
+int isolation_connect_this_thread_mode(int cpu, int monitor)
 {
 	struct memipc_thread_params *thread;
 	pthread_t thread_id;
 	char one = 1;
 
+	if ((monitor != TMC_ISOL_MONITOR_MASTER)
+	    && (monitor != TMC_ISOL_MONITOR_SLAVE))
+		return -EINVAL;
+
 	thread_id = pthread_self();
 	if (memipc_thread_self != NULL)
 		return -EEXIST;
@@ -3829,6 +8494,7 @@ int isolation_connect_this_thread(int cpu)
 	memipc_my_pid = thread_id;
 	memipc_thread_self = thread;
 	thread->thread_id = thread_id;
+	memipc_loop_hist_attach(thread);
 
 	/* Those values are filled by the thread itself before sending
 	   requests */
@@ -3840,6 +8506,7 @@ int isolation_connect_this_thread(int cpu)
 	thread->s_memipc_miso->writer = memipc_my_pid;
 	thread->memipc_check_signal_ptr = &memipc_check_signal;
 	thread->counter_ptr = NULL;
+	thread->monitor = monitor;
 	memipc_check_signal = 0;
 	/*
 	  thread->isolated value 1 means that initialization is in progress,
@@ -3859,7 +8526,7 @@ int isolation_connect_this_thread(int cpu)
 	return 0;
 }
 
-int isolation_connect_this_thread_remote(int cpu)
+static int memipc_connect_remote(int cpu, int monitor)
 {
 	struct memipc_thread_params *thread;
 	pthread_t thread_id;
@@ -3878,7 +8545,9 @@ int isolation_connect_this_thread_remote(int cpu)
 	enum {
 	      MANAGER_NEWTASK_KV_MODE,
 	      MANAGER_NEWTASK_KV_INDEX,
-	      MANAGER_NEWTASK_KV_CPU
+	      MANAGER_NEWTASK_KV_CPU,
+	      MANAGER_NEWTASK_KV_AREA,
+	      MANAGER_NEWTASK_KV_AREA_SIZE
 	};
 	enum {
 	      MANAGER_MODE_THREAD,
@@ -3889,6 +8558,8 @@ int isolation_connect_this_thread_remote(int cpu)
 		{"MODE", KV_TYPE_ENUM, kv_type_modes, 0, .val.val_int = 0},
 		{"INDEX", KV_TYPE_INT, NULL, 0, .val.val_int = 0},
 		{"CPU", KV_TYPE_INT, NULL, 0, .val.val_ptr = NULL},
+		{"AREA", KV_TYPE_STRING, NULL, 0, .val.val_ptr = NULL},
+		{"AREA_SIZE", KV_TYPE_INT, NULL, 0, .val.val_int = 0},
 		{NULL}
 	};
 
@@ -3908,7 +8579,8 @@ int isolation_connect_this_thread_remote(int cpu)
 		return -ENOENT;
 	}
 	my_thread_pid = (unsigned long) getpid();
-	my_thread_tid = isolation_get_tid(thread_id);
+	/* This is the current thread, kernel reports its ID */
+	my_thread_tid = syscall(SYS_gettid);
 	rcode_value = read_rx_data(&rx, memipc_thread_fd, NULL);
 	if (rcode_value != 220) {
 		close(memipc_thread_fd);
@@ -3922,6 +8594,8 @@ int isolation_connect_this_thread_remote(int cpu)
 	    || tx_add_text_num(&tx, my_thread_pid)
 	    || tx_add_text(&tx, "/")
 	    || tx_add_text_num(&tx, my_thread_tid)
+	    || tx_add_text(&tx, ",")
+	    || tx_add_text_num(&tx, monitor)
 	    || tx_add_text(&tx, "\n")
 	    || send_tx_fd_persist(memipc_thread_fd, &tx)) {
 		close(memipc_thread_fd);
@@ -3936,6 +8610,7 @@ int isolation_connect_this_thread_remote(int cpu)
 	    || !kv[MANAGER_NEWTASK_KV_CPU].set) {
 		close(memipc_thread_fd);
 		memipc_thread_fd = -1;
+		clear_kv_rx(&kv[MANAGER_NEWTASK_KV_AREA]);
 		free_rx_buffer(&rx);
 		return -EINVAL;
 	}
@@ -3952,12 +8627,38 @@ int isolation_connect_this_thread_remote(int cpu)
 	} else {
 		/* Process mode */
 		thread = NULL;
-		for (i = 0; i < threads_count; i++)
-			if (threads[i].cpu ==
-			    kv[MANAGER_NEWTASK_KV_CPU].val.val_int) {
-				thread = &threads[i];
-				i = threads_count;
+		if (kv[MANAGER_NEWTASK_KV_AREA].set
+		    && kv[MANAGER_NEWTASK_KV_AREA_SIZE].set) {
+			/* Areas in shared memory, created by the manager */
+			thread = memipc_remote_thread_create(
+				kv[MANAGER_NEWTASK_KV_CPU].val.val_int,
+				(const char *)
+				kv[MANAGER_NEWTASK_KV_AREA].val.val_ptr,
+				kv[MANAGER_NEWTASK_KV_AREA_SIZE].val.val_int);
+			if (thread == NULL) {
+				close(memipc_thread_fd);
+				memipc_thread_fd = -1;
+				clear_kv_rx(&kv[MANAGER_NEWTASK_KV_AREA]);
+				free_rx_buffer(&rx);
+				return -ENOMEM;
 			}
+			__atomic_add_fetch(&_global_memipc_remote_threads, 1,
+					   __ATOMIC_SEQ_CST);
+		} else {
+			for (i = 0; i < threads_count; i++)
+				if (threads[i].cpu ==
+				    kv[MANAGER_NEWTASK_KV_CPU].val.val_int) {
+					thread = &threads[i];
+					i = threads_count;
+				}
+		}
+		clear_kv_rx(&kv[MANAGER_NEWTASK_KV_AREA]);
+		if ((thread == NULL) && (threads_count == 0)) {
+			close(memipc_thread_fd);
+			memipc_thread_fd = -1;
+			free_rx_buffer(&rx);
+			return -EINVAL;
+		}
 		if (thread == NULL) {
 			/* FIXME -- allocate to support multiple threads
 			   per process */
@@ -3984,6 +8685,7 @@ int isolation_connect_this_thread_remote(int cpu)
 	memipc_my_pid = thread_id;
 	memipc_thread_self = thread;
 	thread->thread_id = thread_id;
+	memipc_loop_hist_attach(thread);
 
 	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
@@ -3991,6 +8693,7 @@ int isolation_connect_this_thread_remote(int cpu)
 	thread->s_memipc_miso->writer = memipc_my_pid;
 	thread->memipc_check_signal_ptr = &memipc_check_signal;
 	thread->counter_ptr = NULL;
+	thread->monitor = monitor;
 	memipc_check_signal = 0;
 
 	/*
@@ -4003,169 +8706,687 @@ int isolation_connect_this_thread_remote(int cpu)
 }
 
 /*
- * Send request to the manager to run this thread isolated.
+ * Connect this thread to the manager daemon. Attempt is counted as
+ * pending while it is in progress, so tmc_isol_start() waits for it.
+ */
+int isolation_connect_this_thread_remote(int cpu, int monitor)
+{
+	int rv;
+
+	__atomic_add_fetch(&_global_memipc_remote_attempts, 1,
+			   __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&_global_memipc_remote_pending, 1,
+			   __ATOMIC_SEQ_CST);
+	rv = memipc_connect_remote(cpu, monitor);
+	__atomic_sub_fetch(&_global_memipc_remote_pending, 1,
+			   __ATOMIC_SEQ_CST);
+	return rv;
+}
+
+/*
+ * Send request to the manager to run this thread isolated.
+ */
+int isolation_request_launch_this_thread(volatile int *c)
+{
+	if (memipc_thread_self == NULL)
+		return -1;
+
+	memipc_thread_launch_confirmed = 0;
+	memipc_thread_continue_flag = 1;
+	/* Ready for isolation */
+	while (memipc_add_req(memipc_thread_self->s_memipc_miso,
+			      MEMIPC_REQ_START_READY,
+			      c?sizeof(c):0, (unsigned char*)&c));
+
+	/* Talk to the manager until entered isolation */
+	do {
+		memipc_thread_pass(memipc_thread_self);
+	}
+	while ((memipc_thread_launch_confirmed == 0)
+	       && memipc_thread_continue_flag);
+	/* Entered isolation or got request to terminate */
+
+	if (!memipc_thread_continue_flag) {
+		/* This thread is supposed to exit now, perform shutdown */
+		prctl(PR_SET_TASK_ISOLATION, 0, 0, 0, 0);
+		char zero = 0;
+		if (memipc_thread_self->monitor == TMC_ISOL_MONITOR_SLAVE) {
+#ifdef DEBUG_LOG_ISOL_CHANGES
+			write(1, "\nLAUNCHT, isolated = 0\n", 23);
+#endif
+			__atomic_store(&memipc_thread_self->isolated,
+				       &zero,
+				       __ATOMIC_SEQ_CST);
+		}
+		while (memipc_add_req(memipc_thread_self->s_memipc_miso,
+				      MEMIPC_REQ_EXITING,
+				      0, NULL));
+		memipc_thread_disconnect();
+	}
+	return !memipc_thread_continue_flag;
+}
+
+/*
+ * SIGUSR1 handler for thread isolation.
+ */
+static void isolation_sigusr1_handler(int sig, siginfo_t *info, void *ctx)
+{
+	char zero = 0;
+	int i;
+	struct memipc_thread_params *threads, *thread;
+	int threads_count;
+	pthread_t thread_id;
+
+	threads = _global_isolated_threads;
+	threads_count = _global_isolated_thread_count;
+
+	thread_id = pthread_self();
+	/* Threads managed by the daemon only have their own descriptor */
+	thread = memipc_thread_self;
+	for (i = 0; (thread == NULL) && (i < threads_count); i++)
+		if (threads[i].thread_id == thread_id)
+			thread = &threads[i];
+	if (thread == NULL)
+		return;
+
+	/* Keep signal information for the break event */
+	thread->break_si_code = info->si_code;
+	thread->break_si_pid = info->si_pid;
+	clock_gettime(CLOCK_REALTIME, &thread->break_signal_time);
+	__atomic_add_fetch(&thread->break_signals, 1, __ATOMIC_SEQ_CST);
+#ifdef DEBUG_LOG_ISOL_CHANGES
+	write(1, "\nSIGUSR1, isolated = 0\n", 23);
+#endif
+	__atomic_store(&thread->isolated, &zero, __ATOMIC_SEQ_CST);
+	if (thread->monitor == TMC_ISOL_MONITOR_MASTER) {
+		/* Manager checks threads that received the signal */
+		if ((thread->index >= 0) && (thread->cpu < CPU_SETSIZE))
+			memipc_activity_set(_global_memipc_activity_breaks,
+					    thread->cpu);
+	} else
+		*thread->memipc_check_signal_ptr = 1;
+}
+
+/*
+ * Install SIGUSR1 handler for thread isolation.
+ */
+static void isolation_install_sigusr1_handler(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = isolation_sigusr1_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+/*
+ * Read the first line of a small file, such as a sysfs attribute.
+ */
+static int read_sysfs_line(const char *name, char *buf, size_t size)
+{
+	FILE *f;
+
+	f = fopen(name, "rt");
+	if (f == NULL)
+		return -1;
+	if (fgets(buf, size, f) == NULL) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Fill NUMA node, L3 cache domain and SMT siblings of a thread's CPU
+ * from sysfs. Unknown values are left at -1, and the CPU is its only
+ * sibling.
+ */
+static void isolation_read_cpu_topology(struct memipc_thread_params *thread)
+{
+	char name[128], line[256];
+	unsigned int *buf = NULL;
+	struct dirent *ent;
+	DIR *dir;
+	int n, i, node;
+
+	thread->node = -1;
+	thread->l3_domain = -1;
+	CPU_ZERO(&thread->siblings);
+	CPU_SET(thread->cpu, &thread->siblings);
+
+	snprintf(name, sizeof(name), "/sys/devices/system/cpu/cpu%d",
+		 thread->cpu);
+	dir = opendir(name);
+	if (dir != NULL) {
+		while ((ent = readdir(dir)) != NULL)
+			if (sscanf(ent->d_name, "node%d", &node) == 1) {
+				thread->node = node;
+				break;
+			}
+		closedir(dir);
+	}
+
+	snprintf(name, sizeof(name),
+		 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+		 thread->cpu);
+	if ((read_sysfs_line(name, line, sizeof(line)) == 0)
+	    && ((n = string_to_cpulist(line, &buf)) > 0)) {
+		for (i = 0; i < n; i++)
+			if (buf[i] < CPU_SETSIZE)
+				CPU_SET(buf[i], &thread->siblings);
+		free(buf);
+	}
+
+	for (i = 0; thread->l3_domain < 0; i++) {
+		snprintf(name, sizeof(name),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+			 thread->cpu, i);
+		if (read_sysfs_line(name, line, sizeof(line)))
+			break;
+		if (atoi(line) != 3)
+			continue;
+		snprintf(name, sizeof(name),
+		"/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+			 thread->cpu, i);
+		if ((read_sysfs_line(name, line, sizeof(line)) == 0)
+		    && ((n = string_to_cpulist(line, &buf)) > 0)) {
+			/* The list is sorted */
+			thread->l3_domain = buf[0];
+			free(buf);
+		}
+		break;
+	}
+}
+
+#define MEMIPC_CPU_CACHE_NAME "/isol_server_cpu_cache"
+#define MEMIPC_CPU_CACHE_MAGIC 0x69736f6c63707532ULL
+/* Same as the line buffer, so any id that can be read fits */
+#define MEMIPC_CPU_CACHE_ID_SIZE 1024
+#define MEMIPC_CPU_CACHE_MIN_SUBSETS 16
+
+/* Topology of a CPU */
+struct memipc_cpu_cache_topology {
+	int node;
+	int l3_domain;
+	cpu_set_t siblings;
+};
+
+/* Entry of the CPU subsets file */
+struct memipc_cpu_cache_subset {
+	char id[MEMIPC_CPU_CACHE_ID_SIZE];
+	cpu_set_t cpus; /* empty if the list is invalid */
+};
+
+/*
+ * Parsed CPU topology and CPU subsets. Shared copy is accessed only
+ * with its file locked, and grows with the subsets file.
+ */
+struct memipc_cpu_cache {
+	uint64_t magic;
+	size_t size; /* size of this structure without subsets */
+	cpu_set_t known; /* CPUs with valid topology */
+	struct memipc_cpu_cache_topology cpus[CPU_SETSIZE];
+
+	/* CPU subsets file when it was parsed */
+	int subsets_valid;
+	int subsets_present;
+	struct timespec subsets_mtime;
+	off_t subsets_size;
+	ino_t subsets_ino;
+	int subsets_count;
+	int subsets_alloc; /* entries in the segment */
+	struct memipc_cpu_cache_subset subsets[];
+};
+
+#define MEMIPC_CPU_CACHE_SIZE(n)					\
+	(sizeof(struct memipc_cpu_cache)				\
+	 + (n) * sizeof(struct memipc_cpu_cache_subset))
+
+static struct memipc_cpu_cache *_global_memipc_cpu_cache = NULL;
+/* Mapped or allocated size */
+static size_t _global_memipc_cpu_cache_len = 0;
+/* Shared copy file, or -1 for a copy private to this process */
+static int _global_memipc_cpu_cache_fd = -1;
+static pthread_mutex_t _global_memipc_cpu_cache_lock =
+	PTHREAD_MUTEX_INITIALIZER;
+static int _global_memipc_cpu_cache_atfork = 0;
+
+/*
+ * Map shared CPU cache, and lock it. Returns NULL if it can't be used.
+ */
+static struct memipc_cpu_cache *memipc_cpu_cache_map(int *fdp, size_t *lenp)
+{
+#if USE_CPU_CACHE
+	struct memipc_cpu_cache *cache;
+	struct stat st;
+	size_t len;
+	int fd;
+
+	fd = shm_open(MEMIPC_CPU_CACHE_NAME, O_RDWR | O_CREAT | O_CLOEXEC,
+		      0600);
+	if (fd < 0)
+		return NULL;
+	if ((flock(fd, LOCK_EX) != 0) || (fstat(fd, &st) != 0)) {
+		close(fd);
+		return NULL;
+	}
+	len = st.st_size;
+	if (len < MEMIPC_CPU_CACHE_SIZE(0)) {
+		len = MEMIPC_CPU_CACHE_SIZE(0);
+		if (ftruncate(fd, len) != 0) {
+			close(fd);
+			return NULL;
+		}
+	}
+	cache = (struct memipc_cpu_cache *)
+		mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (cache == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	*fdp = fd;
+	*lenp = len;
+	return cache;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Resize CPU cache to hold at least alloc subsets, or as many as the
+ * shared copy already holds. Returns 0 on success, -1 on failure.
+ */
+static int memipc_cpu_cache_resize(int alloc)
+{
+	struct memipc_cpu_cache *cache = _global_memipc_cpu_cache;
+	size_t len;
+
+	if (alloc < cache->subsets_alloc)
+		alloc = cache->subsets_alloc;
+	len = MEMIPC_CPU_CACHE_SIZE(alloc);
+	if (len == _global_memipc_cpu_cache_len)
+		return 0;
+	if (_global_memipc_cpu_cache_fd < 0) {
+		cache = (struct memipc_cpu_cache *)realloc(cache, len);
+		if (cache == NULL)
+			return -1;
+	} else {
+		if ((alloc > cache->subsets_alloc)
+		    && (ftruncate(_global_memipc_cpu_cache_fd, len) != 0))
+			return -1;
+		cache = (struct memipc_cpu_cache *)
+			mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			     _global_memipc_cpu_cache_fd, 0);
+		if (cache == MAP_FAILED)
+			return -1;
+		munmap(_global_memipc_cpu_cache, _global_memipc_cpu_cache_len);
+	}
+	cache->subsets_alloc = alloc;
+	_global_memipc_cpu_cache = cache;
+	_global_memipc_cpu_cache_len = len;
+	return 0;
+}
+
+/*
+ * Forget CPU cache in a child process. Lock of the shared copy belongs
+ * to the open file, so the child opens it again.
+ */
+static void memipc_cpu_cache_atfork_child(void)
+{
+	pthread_mutex_init(&_global_memipc_cpu_cache_lock, NULL);
+	if (_global_memipc_cpu_cache == NULL)
+		return;
+	if (_global_memipc_cpu_cache_fd >= 0) {
+		munmap(_global_memipc_cpu_cache, _global_memipc_cpu_cache_len);
+		close(_global_memipc_cpu_cache_fd);
+	} else
+		free(_global_memipc_cpu_cache);
+	_global_memipc_cpu_cache = NULL;
+	_global_memipc_cpu_cache_len = 0;
+	_global_memipc_cpu_cache_fd = -1;
+}
+
+/*
+ * Unlock CPU cache.
+ */
+static void memipc_cpu_cache_unlock(void)
+{
+	if (_global_memipc_cpu_cache_fd >= 0)
+		flock(_global_memipc_cpu_cache_fd, LOCK_UN);
+	pthread_mutex_unlock(&_global_memipc_cpu_cache_lock);
+}
+
+/*
+ * Lock CPU cache, creating it on the first use. Returns NULL if there
+ * is no memory for it.
+ */
+static struct memipc_cpu_cache *memipc_cpu_cache_lock(void)
+{
+	struct memipc_cpu_cache *cache;
+	size_t len = 0;
+	int fd = -1;
+
+	pthread_mutex_lock(&_global_memipc_cpu_cache_lock);
+	if (_global_memipc_cpu_cache != NULL) {
+		if (_global_memipc_cpu_cache_fd >= 0) {
+			flock(_global_memipc_cpu_cache_fd, LOCK_EX);
+			/* Another process could have added subsets */
+			if (memipc_cpu_cache_resize(0)) {
+				memipc_cpu_cache_unlock();
+				return NULL;
+			}
+		}
+		return _global_memipc_cpu_cache;
+	}
+
+	if (!_global_memipc_cpu_cache_atfork
+	    && (pthread_atfork(NULL, NULL,
+			       memipc_cpu_cache_atfork_child) == 0))
+		_global_memipc_cpu_cache_atfork = 1;
+	cache = memipc_cpu_cache_map(&fd, &len);
+	if (cache == NULL) {
+		len = MEMIPC_CPU_CACHE_SIZE(0);
+		cache = (struct memipc_cpu_cache *)malloc(len);
+		if (cache == NULL) {
+			pthread_mutex_unlock(&_global_memipc_cpu_cache_lock);
+			return NULL;
+		}
+		cache->magic = 0;
+	}
+	if ((cache->magic != MEMIPC_CPU_CACHE_MAGIC)
+	    || (cache->size != sizeof(struct memipc_cpu_cache))) {
+		memset(cache, 0, MEMIPC_CPU_CACHE_SIZE(0));
+		cache->magic = MEMIPC_CPU_CACHE_MAGIC;
+		cache->size = sizeof(struct memipc_cpu_cache);
+		if (fd >= 0)
+			cache->subsets_alloc = (len - MEMIPC_CPU_CACHE_SIZE(0))
+				/ sizeof(struct memipc_cpu_cache_subset);
+	}
+	_global_memipc_cpu_cache = cache;
+	_global_memipc_cpu_cache_len = len;
+	_global_memipc_cpu_cache_fd = fd;
+	if ((fd >= 0) && memipc_cpu_cache_resize(0)) {
+		munmap(cache, len);
+		close(fd);
+		_global_memipc_cpu_cache = NULL;
+		_global_memipc_cpu_cache_len = 0;
+		_global_memipc_cpu_cache_fd = -1;
+		pthread_mutex_unlock(&_global_memipc_cpu_cache_lock);
+		return NULL;
+	}
+	return _global_memipc_cpu_cache;
+}
+
+/*
+ * Fill NUMA node, L3 cache domain and SMT siblings of a thread's CPU
+ * from the CPU cache. sysfs is read only if the CPU is not in the
+ * cache yet.
+ */
+static void isolation_get_cpu_topology(struct memipc_thread_params *thread)
+{
+	struct memipc_cpu_cache *cache;
+	struct memipc_cpu_cache_topology *t;
+
+	if ((thread->cpu < 0) || (thread->cpu >= CPU_SETSIZE)
+	    || ((cache = memipc_cpu_cache_lock()) == NULL)) {
+		isolation_read_cpu_topology(thread);
+		return;
+	}
+	t = &cache->cpus[thread->cpu];
+	if (CPU_ISSET(thread->cpu, &cache->known)) {
+		thread->node = t->node;
+		thread->l3_domain = t->l3_domain;
+		thread->siblings = t->siblings;
+	} else {
+		isolation_read_cpu_topology(thread);
+		t->node = thread->node;
+		t->l3_domain = thread->l3_domain;
+		t->siblings = thread->siblings;
+		CPU_SET(thread->cpu, &cache->known);
+	}
+	memipc_cpu_cache_unlock();
+}
+
+#if USE_CPU_SUBSETS
+/*
+ * Parse CPU subsets file into the CPU cache, unless it is not changed
+ * since the last time. Returns 0 on success, -1 if not all entries
+ * could be stored.
+ */
+static int memipc_cpu_cache_read_subsets(void)
+{
+	struct memipc_cpu_cache *cache = _global_memipc_cpu_cache;
+	struct memipc_cpu_cache_subset *subset;
+	struct stat st;
+	unsigned int *buf;
+	int present, n, i, rv = 0;
+	char *p, *endp, *cpu_subset_str;
+	char stringbuf[MEMIPC_CPU_CACHE_ID_SIZE];
+	FILE *f;
+
+	present = (stat(CPU_SUBSETS_FILE, &st) == 0);
+	if (cache->subsets_valid
+	    && (present == cache->subsets_present)
+	    && (!present
+		|| ((st.st_mtim.tv_sec == cache->subsets_mtime.tv_sec)
+		    && (st.st_mtim.tv_nsec == cache->subsets_mtime.tv_nsec)
+		    && (st.st_size == cache->subsets_size)
+		    && (st.st_ino == cache->subsets_ino))))
+		return 0;
+
+	cache->subsets_valid = 0;
+	cache->subsets_count = 0;
+	cache->subsets_present = present;
+	if (present) {
+		cache->subsets_mtime = st.st_mtim;
+		cache->subsets_size = st.st_size;
+		cache->subsets_ino = st.st_ino;
+		f = fopen(CPU_SUBSETS_FILE, "rt");
+	} else
+		f = NULL;
+	while ((f != NULL) && (fgets(stringbuf, sizeof(stringbuf), f) != NULL)) {
+		p = strchr(stringbuf, '#');
+		if (p != NULL)
+			*p = '\0';
+		p = strchr(stringbuf, ':');
+		if (p == NULL)
+			continue;
+		*p = '\0';
+		p++;
+		skip_whitespace_nconst(&p);
+		cpu_subset_str = p;
+		p = stringbuf;
+		skip_whitespace_nconst(&p);
+		endp = find_endtoken_nconst(p);
+		*endp = '\0';
+		if ((cache->subsets_count == cache->subsets_alloc)
+		    && memipc_cpu_cache_resize(cache->subsets_alloc
+					       ? cache->subsets_alloc * 2
+					       : MEMIPC_CPU_CACHE_MIN_SUBSETS)) {
+			rv = -1;
+			break;
+		}
+		cache = _global_memipc_cpu_cache;
+		subset = &cache->subsets[cache->subsets_count++];
+		strcpy(subset->id, p);
+		CPU_ZERO(&subset->cpus);
+		n = string_to_cpulist(cpu_subset_str, &buf);
+		if (n > 0) {
+			for (i = 0; i < n; i++)
+				if (buf[i] < CPU_SETSIZE)
+					CPU_SET(buf[i], &subset->cpus);
+			free(buf);
+		}
+	}
+	if (f != NULL)
+		fclose(f);
+	/* Incomplete list is parsed again next time */
+	cache->subsets_valid = (rv == 0);
+	return rv;
+}
+
+/*
+ * Get CPUs of a subset from the CPU subsets file. Returns 0 if it is
+ * found, 1 if it is not in the file, -1 if the file can't be parsed.
  */
-int isolation_request_launch_this_thread(volatile int *c)
+static int memipc_cpu_subset_lookup(const char *id, cpu_set_t *cpus)
 {
-	if (memipc_thread_self == NULL)
+	struct memipc_cpu_cache *cache;
+	int i, rv;
+
+	cache = memipc_cpu_cache_lock();
+	if (cache == NULL)
 		return -1;
+	rv = memipc_cpu_cache_read_subsets() ? -1 : 1;
+	cache = _global_memipc_cpu_cache;
+	for (i = 0; (rv == 1) && (i < cache->subsets_count); i++)
+		if (!strcmp(cache->subsets[i].id, id)) {
+			*cpus = cache->subsets[i].cpus;
+			rv = 0;
+		}
+	memipc_cpu_cache_unlock();
+	return rv;
+}
+#endif
 
-	memipc_thread_launch_confirmed = 0;
-	memipc_thread_continue_flag = 1;
-	/* Ready for isolation */
-	while (memipc_add_req(memipc_thread_self->s_memipc_miso,
-			      MEMIPC_REQ_START_READY,
-			      c?sizeof(c):0, (unsigned char*)&c));
+/*
+ * Check if an SMT sibling of a thread's CPU is claimed.
+ */
+static int isolation_sibling_claimed(struct memipc_thread_params *thread)
+{
+	struct memipc_thread_params *threads;
+	int i, claim_counter;
 
-	/* Talk to the manager until entered isolation */
-	do {
-		memipc_thread_pass(memipc_thread_self);
+	threads = _global_isolated_threads;
+	for (i = 0; i < _global_isolated_thread_count; i++) {
+		if ((&threads[i] == thread)
+		    || !CPU_ISSET(threads[i].cpu, &thread->siblings))
+			continue;
+		__atomic_load(&threads[i].claim_counter, &claim_counter,
+			      __ATOMIC_SEQ_CST);
+		if (claim_counter != 0)
+			return 1;
 	}
-	while ((memipc_thread_launch_confirmed == 0)
-	       && memipc_thread_continue_flag);
-	/* Entered isolation or got request to terminate */
+	return 0;
+}
 
-	if (!memipc_thread_continue_flag) {
-		/* This thread is supposed to exit now, perform shutdown */
-		prctl(PR_SET_TASK_ISOLATION, 0, 0, 0, 0);
-#if ISOLATION_MONITOR_IN_SLAVE
-		char zero = 0;
-#ifdef DEBUG_LOG_ISOL_CHANGES
-		write(1, "\nLAUNCHT, isolated = 0\n", 23);
-#endif
-		__atomic_store(&memipc_thread_self->isolated,
-			       &zero,
-			       __ATOMIC_SEQ_CST);
-#endif
-		while (memipc_add_req(memipc_thread_self->s_memipc_miso,
-				      MEMIPC_REQ_EXITING,
-				      0, NULL));
-		if (memipc_thread_fd >= 0) {
-			close(memipc_thread_fd);
-			memipc_thread_fd = -1;
-		}
+/*
+ * Count claimed CPUs in the L3 cache domain of a thread's CPU.
+ */
+static int isolation_l3_claimed_count(struct memipc_thread_params *thread)
+{
+	struct memipc_thread_params *threads;
+	int i, claim_counter, count = 0;
+
+	if (thread->l3_domain < 0)
+		return 0;
+	threads = _global_isolated_threads;
+	for (i = 0; i < _global_isolated_thread_count; i++) {
+		if ((&threads[i] == thread)
+		    || (threads[i].l3_domain != thread->l3_domain))
+			continue;
+		__atomic_load(&threads[i].claim_counter, &claim_counter,
+			      __ATOMIC_SEQ_CST);
+		if (claim_counter != 0)
+			count++;
 	}
-	return !memipc_thread_continue_flag;
+	return count;
 }
 
 /*
- * SIGUSR1 handler for thread isolation.
+ * Select a CPU that is not claimed, according to ISOL_PLACE_* policy.
+ *
+ * Negative node means any node. Ties are resolved in the order of the
+ * CPU list. Returns CPU number or -1 if there is no suitable CPU.
  */
-static void isolation_sigusr1_handler(int sig)
+int isolation_select_cpu(int node, unsigned int policy)
 {
-	char zero = 0;
-	int i;
 	struct memipc_thread_params *threads;
-	int threads_count;
-	pthread_t thread_id;
+	int i, claim_counter, score, best = -1, best_score = 0;
 
 	threads = _global_isolated_threads;
-	threads_count = _global_isolated_thread_count;
-
-	thread_id = pthread_self();
-	for (i = 0; i < threads_count ; i++) {
-		if (threads[i].thread_id == thread_id) {
-#ifdef DEBUG_LOG_ISOL_CHANGES
-			write(1, "\nSIGUSR1, isolated = 0\n", 23);
-#endif
-			__atomic_store(&threads[i].isolated,
-				       &zero,
-				       __ATOMIC_SEQ_CST);
-#if ISOLATION_MONITOR_IN_SLAVE
-			*threads[i].memipc_check_signal_ptr = 1;
-#endif
-			return;
+	for (i = 0; i < _global_isolated_thread_count; i++) {
+		__atomic_load(&threads[i].claim_counter, &claim_counter,
+			      __ATOMIC_SEQ_CST);
+		if (claim_counter != 0)
+			continue;
+		if ((node >= 0) && (threads[i].node != node))
+			continue;
+		if ((policy & ISOL_PLACE_NO_SMT)
+		    && isolation_sibling_claimed(&threads[i]))
+			continue;
+		score = 0;
+		if (policy & ISOL_PLACE_L3_PACK)
+			score = isolation_l3_claimed_count(&threads[i]);
+		else if (policy & ISOL_PLACE_L3_SPREAD)
+			score = -isolation_l3_claimed_count(&threads[i]);
+		if ((best < 0) || (score > best_score)) {
+			best = i;
+			best_score = score;
 		}
 	}
-
-	return;
+	return (best < 0) ? -1 : threads[best].cpu;
 }
 
 /*
- * Compare unsigned integers for qsort().
+ * Get NUMA node of a device.
+ *
+ * Device is either a network interface name, or a sysfs device path
+ * such as /sys/bus/pci/devices/0000:03:00.0 . Returns node number or
+ * -1 if it is not known.
  */
-static int uintcmp(const void *v1, const void *v2)
+int isolation_device_node(const char *device)
 {
-	return (*((const unsigned int*)v1) >
-		*((const unsigned int*)v2)) * 2 - 1;
+	char name[256], line[32];
+	int node;
+
+	if (strchr(device, '/') != NULL)
+		snprintf(name, sizeof(name), "%s/numa_node", device);
+	else
+		snprintf(name, sizeof(name),
+			 "/sys/class/net/%s/device/numa_node", device);
+	if (read_sysfs_line(name, line, sizeof(line))
+	    || (sscanf(line, "%d", &node) != 1))
+		return -1;
+	return node;
 }
 
 /*
- * Allocate and fill a list of CPUs from a string.
+ * Get NUMA node of memory at a given address.
+ *
+ * The page should be already allocated. Returns node number or -1.
  */
-static int string_to_cpulist(const char *s, unsigned int **retbuf)
+int isolation_memory_node(const void *addr)
 {
-	const char *p;
-	char *nextp;
-	unsigned int *buf = NULL;
-	int cpunum, last_cpu, last_oper, n_cpus, pass, i;
-	for (pass = 0; pass < 2; pass++) {
-		p = s;
-		nextp = NULL;
-		cpunum = 0;
-		last_cpu = -1;
-		last_oper = 0;
-		n_cpus = 0;
-
-		while (*p) {
-			cpunum=strtol(p, (char ** restrict)&nextp, 0);
-			if (nextp != p) {
-				if (cpunum >= 0) {
-					if ((last_oper == 1)
-					    && (last_cpu >= 0)
-					    && (cpunum > last_cpu)) {
-						for (i = last_cpu + 1;
-						     i <= cpunum; i++) {
-							if (pass == 1)
-								buf[n_cpus] =
-								(unsigned int)i;
-							n_cpus++;
-						}
-					} else {
-						if (pass == 1)
-							buf[n_cpus] =
-							(unsigned int)cpunum;
-						n_cpus++;
-					}
-					last_cpu = cpunum;
-					last_oper = 0;
-				}
-			}
-			if (*nextp) {
-				if (*nextp == '-')
-					last_oper = 1;
-				nextp++;
-			}
-			p = nextp;
-		}
-		if (pass == 0) {
-			if (n_cpus == 0)
-				return -1;
-			buf = (unsigned int *)malloc(n_cpus
-						     * sizeof(unsigned int));
-			if (buf == NULL)
-				return -1;
-		}
-	}
+	int node;
 
-	qsort(buf, n_cpus, sizeof(unsigned int), uintcmp);
-
-	for (i = 0; i < n_cpus - 1; i++) {
-		if (buf[i] == buf[i+1]) {
-			if ((n_cpus - i) > 2)
-				memmove(&buf[i + 1],
-					&buf[i + 2],
-					(n_cpus - i - 2)
-					* sizeof(unsigned int));
-			i--;
-			n_cpus--;
-		}
-	}
-	*retbuf = buf;
-	return n_cpus;
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+		    MPOL_F_NODE | MPOL_F_ADDR))
+		return -1;
+	return node;
 }
 
 
+/*
+ * Create the activity bitmap, and make writers of all areas mark it.
+ * Called with the server socket created, so no other manager uses the
+ * same bitmap. Without the bitmap, manager visits all threads in every
+ * pass.
+ */
+static void memipc_activity_create(void)
+{
+	int i;
+
+	if (_global_memipc_activity == NULL)
+		_global_memipc_activity = memipc_activity_map(1);
+	for (i = 0; i < _global_isolated_thread_count; i++)
+		memipc_activity_attach(_global_isolated_threads[i].s_memipc_miso,
+				       _global_isolated_threads[i].cpu);
+}
+
 /*
  * Initialize environment for a given CPU list.
  */
@@ -4174,11 +9395,10 @@ int memipc_isolation_initialize_cpulist(const char *cpulist)
 	int n_cpus, i;
 	unsigned int *buf = NULL;
 #if USE_CPU_SUBSETS
-	int j, subset_found, n_subset_cpus;
+	int subset_found, n_subset_cpus, rv;
 	unsigned int *subset_buf = NULL;
-	FILE *f;
-	char *p, *endp;
-	char stringbuf[1024], *subset_id, *cpu_subset_str;
+	cpu_set_t subset_cpus;
+	char *subset_id, *cpu_subset_str;
 #endif
 	struct memipc_thread_params *threads;
 
@@ -4203,44 +9423,35 @@ int memipc_isolation_initialize_cpulist(const char *cpulist)
 	subset_found = 0;
 	subset_id = getenv("CPU_SUBSET_ID");
 	cpu_subset_str = getenv("CPU_SUBSET");
-	if ((subset_id != NULL) && (cpu_subset_str != NULL))
-		subset_found = 1;
-	if ((subset_found == 0) && (subset_id != NULL)) {
-		f = fopen(CPU_SUBSETS_FILE, "rt");
-		if (f != NULL) {
-			while ((subset_found == 0)
-			       && (fgets(stringbuf,
-					 sizeof(stringbuf), f) != NULL)) {
-				p = strchr(stringbuf, '#');
-				if (p != NULL)
-					*p = '\0';
-				p = strchr(stringbuf, ':');
-				if (p != NULL) {
-					*p = '\0';
-					p++;
-					skip_whitespace_nconst(&p);
-					cpu_subset_str = p;
-					p = stringbuf;
-					skip_whitespace_nconst(&p);
-					endp = find_endtoken_nconst(p);
-					*endp = '\0';
-					if (!strcmp(p, subset_id))
-						subset_found = 1;
-				}
-			}
-			fclose(f);
-		}
-	}
-	if (subset_found) {
+	CPU_ZERO(&subset_cpus);
+	if ((subset_id != NULL) && (cpu_subset_str != NULL)) {
 		n_subset_cpus = string_to_cpulist(cpu_subset_str, &subset_buf);
 		if (n_subset_cpus < 0) {
 			free(buf);
 			return -1;
 		}
-		for (i = 0, j = 0; i < n_cpus; i++) {
-			while ((j < n_subset_cpus) && (subset_buf[j] < buf[i]))
-				j++;
-			if ((j >= n_subset_cpus) || (subset_buf[j] != buf[i])) {
+		for (i = 0; i < n_subset_cpus; i++)
+			if (subset_buf[i] < CPU_SETSIZE)
+				CPU_SET(subset_buf[i], &subset_cpus);
+		free(subset_buf);
+		subset_found = 1;
+	} else if ((subset_id != NULL)
+		   && ((rv = memipc_cpu_subset_lookup(subset_id,
+						      &subset_cpus)) != 1)) {
+		/* Subset can't be found, or its list is invalid */
+		if ((rv < 0) || (CPU_COUNT(&subset_cpus) == 0)) {
+			fprintf(stderr, "Can't get CPU subset %s\n",
+				subset_id);
+			free(buf);
+			return -1;
+		}
+		subset_found = 1;
+		/* Claims follow later changes of the file */
+		_global_cpu_subset_id = strdup(subset_id);
+	}
+	if (subset_found) {
+		for (i = 0; i < n_cpus; i++) {
+			if (!CPU_ISSET(buf[i], &subset_cpus)) {
 				memmove(&buf[i],
 					&buf[i + 1],
 					(n_cpus - i - 1)
@@ -4249,7 +9460,6 @@ int memipc_isolation_initialize_cpulist(const char *cpulist)
 				n_cpus--;
 			}
 		}
-		free(subset_buf);
 	}
 #endif
 #if DEBUG_ISOL_VERBOSE
@@ -4260,9 +9470,9 @@ int memipc_isolation_initialize_cpulist(const char *cpulist)
 	}
 #endif
 
-	threads = (struct memipc_thread_params*)
-		malloc(n_cpus * sizeof(struct memipc_thread_params));
-	if (threads == NULL) {
+	/* Descriptors of different CPUs never share cache lines */
+	if (posix_memalign((void **)&threads, MEMIPC_CACHE_LINE_SIZE,
+			   n_cpus * sizeof(struct memipc_thread_params))) {
 		free(buf);
 		return -1;
 	}
@@ -4278,81 +9488,28 @@ int memipc_isolation_initialize_cpulist(const char *cpulist)
 		threads[i].cpu = buf[i];
 		CPU_SET(threads[i].cpu, &_global_isol_cpuset);
 		threads[i].memipc_name = memipc_area_name(threads[i].cpu);
-		if (threads[i].memipc_name != NULL) {
-			shm_unlink(threads[i].memipc_name);
-			threads[i].memipc_fd =
-				shm_open(threads[i].memipc_name,
-					 O_RDWR | O_CREAT | O_TRUNC, 0600);
-			if (threads[i].memipc_fd >= 0) {
-				if (ftruncate(threads[i].memipc_fd,
-					      AREA_SIZE * 2) < 0) {
-					close(threads[i].memipc_fd);
-					threads[i].memipc_fd = -1;
-				}
-			}
-			if (threads[i].memipc_fd >= 0) {
-				threads[i].m_memipc_mosi =
-					memipc_area_create(AREA_SIZE,
-							   AREA_SIZE * 2,
-							   0,
-							  threads[i].memipc_fd,
-							   NULL);
-				threads[i].m_memipc_miso =
-					memipc_area_create(AREA_SIZE,
-						0,
-						AREA_SIZE,
-						threads[i].memipc_fd,
-						(unsigned char*)threads[i].
-							   m_memipc_mosi->area);
-				threads[i].s_memipc_mosi =
-					memipc_area_dup(threads[i].
-							m_memipc_mosi);
-				threads[i].s_memipc_miso =
-					memipc_area_dup(threads[i].
-							m_memipc_miso);
-			} else {
-				threads[i].m_memipc_mosi = NULL;
-				threads[i].m_memipc_miso = NULL;
-				threads[i].s_memipc_mosi = NULL;
-				threads[i].s_memipc_miso = NULL;
-			}
-		} else {
-			threads[i].memipc_fd = -1;
-			threads[i].m_memipc_mosi = NULL;
-			threads[i].m_memipc_miso = NULL;
-			threads[i].s_memipc_mosi = NULL;
-			threads[i].s_memipc_miso = NULL;
-		}
+		isolation_get_cpu_topology(&threads[i]);
+		memipc_thread_areas_create(&threads[i],
+					   _global_memipc_area_size,
+					   _global_memipc_area_flags);
 		threads[i].start_routine = NULL;
 		threads[i].userdata = NULL;
 		threads[i].foreign_desc = NULL;
+		threads[i].timers = NULL;
+		threads[i].timers_count = 0;
+		threads[i].timers_alloc = 0;
 		threads[i].lasttimer = KTIME_MAX;
 		threads[i].updatetimer = KTIME_MAX;
 
 		if ((threads[i].memipc_name == NULL)
-		    || (threads[i].m_memipc_mosi == NULL)
-		    || (threads[i].m_memipc_miso == NULL)
-		    || (threads[i].s_memipc_mosi == NULL)
-		    || (threads[i].s_memipc_miso == NULL)) {
+		    || (threads[i].m_memipc_mosi == NULL)) {
 			int j;
 			for (j = 0; j <= i ; j++) {
-				if (threads[j].m_memipc_mosi != NULL)
-					memipc_area_delete(
-						threads[j].m_memipc_mosi);
-				if (threads[j].m_memipc_miso != NULL)
-					memipc_area_delete(
-						threads[j].m_memipc_miso);
-				if (threads[j].s_memipc_mosi != NULL)
-					memipc_area_delete_duplicate(
-						threads[j].s_memipc_mosi);
-				if (threads[j].s_memipc_miso != NULL)
-					memipc_area_delete_duplicate(
-						threads[j].s_memipc_miso);
-				if (threads[i].memipc_fd < 0)
-					close(threads[i].memipc_fd);
-				if (threads[i].memipc_name != NULL) {
-					shm_unlink(threads[i].memipc_name);
-					free(threads[i].memipc_name);
+				memipc_thread_areas_delete(&threads[j]);
+				if (threads[j].memipc_name != NULL) {
+					memipc_area_unlink(
+						threads[j].memipc_name);
+					free(threads[j].memipc_name);
 				}
 			}
 			free(threads);
@@ -4364,13 +9521,23 @@ int memipc_isolation_initialize_cpulist(const char *cpulist)
 
 	_global_isolated_threads = threads;
 	_global_isolated_thread_count = n_cpus;
+	for (i = 0; i < n_cpus; i++)
+		if (threads[i].cpu < CPU_SETSIZE) {
+			_global_cpu_threads[threads[i].cpu] = &threads[i];
+			_global_memipc_threads_mask[threads[i].cpu
+						    / MEMIPC_ACTIVITY_BITS] |=
+				1UL << (threads[i].cpu % MEMIPC_ACTIVITY_BITS);
+		}
 
 	struct timespec ts;
 	clock_gettime(CLOCK_MONOTONIC, &ts);
-	_global_isolated_threads_start_time = ts.tv_sec;
+	_global_isolated_threads_start_time =
+		ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	_global_loop_hist_start_cycles = tmc_isol_cycles();
+	_global_loop_hist_start_nsec = ts.tv_sec * 1000000000LL + ts.tv_nsec;
 	_global_isolated_threads_timeout_started = 1;
 
-	signal(SIGUSR1, isolation_sigusr1_handler);
+	isolation_install_sigusr1_handler();
 
 	return 0;
 }
@@ -4397,93 +9564,445 @@ static void cpu_remove_expired_timers(int64_t now)
 }
 
 /*
- * Return time before expiration of the last timer on threads
- * that are being managed.
+ * Return time before expiration of the last timer on the CPU of a
+ * thread that is being managed, or KTIME_MAX if there are no timers.
  */
-static int64_t remaining_nsec_before_expiration(int64_t now)
+static int64_t remaining_nsec_before_expiration(
+				const struct memipc_thread_params *thread,
+				int64_t now)
+{
+	if (((thread->state == MEMIPC_STATE_READY)
+	     || (thread->state == MEMIPC_STATE_TMP_EXITING_ISOLATION)
+	     || (thread->state == MEMIPC_STATE_EXITING_ISOLATION)
+	     || (thread->state == MEMIPC_STATE_LOST_ISOLATION)
+	     || (thread->state == MEMIPC_STATE_LAUNCHING)
+	     || (thread->state == MEMIPC_STATE_LAUNCHED)
+	     || (thread->state == MEMIPC_STATE_RUNNING))
+	    && (thread->lasttimer != KTIME_MAX))
+		return thread->lasttimer - now;
+	return KTIME_MAX;
+}
+
+/*
+ * This function is supposed to update a timer for CPUs where threads may
+ * run isolated. It returns 0 if given timer is not for CPUs in that set,
+ * so it may be ignored later, and 1 if CPU is in this set.
+ */
+static int cpu_update_timer(enum isol_timer_type timer_type,
+#if DEBUG_ISOL_NAMES
+			    const char *addr, const char *handler,
+#endif
+			    int cpu, int64_t expire, int64_t now)
+{
+	struct memipc_thread_params *thread;
+
+	thread = memipc_cpu_thread(cpu);
+	if (thread == NULL)
+		return 0;
+
+	if (thread->lasttimer == KTIME_MAX)
+		thread->lasttimer = expire;
+	else {
+		if ((thread->lasttimer - now) < 0)
+			thread->lasttimer = KTIME_MAX;
+		else
+			if ((thread->lasttimer - expire) < 0)
+				thread->lasttimer = expire;
+	}
+	thread->updatetimer = now;
+#if DEBUG_ISOL_ALWAYS_SHOW_ALL_TIMERS
+#if DEBUG_ISOL_NAMES
+	fprintf(stderr, "Timer on CPU %d, type %s, "
+		"at %s, handler %s, expires at %lu in %ld nsec\n",
+		cpu, isol_timer_type_name[timer_type],
+		addr, handler, (uint64_t)expire, expire - now);
+#else
+	fprintf(stderr, "Timer on CPU %d, type %s, "
+		"expires at %lu in %ld nsec\n",
+		cpu, isol_timer_type_name[timer_type],
+		(uint64_t)expire, expire - now);
+#endif
+#endif
+	return 1;
+}
+
+/*
+ * Find the gap in cycles that is not exceeded by a given fraction of
+ * recorded gaps, in parts per 10000. Gaps are only known up to their
+ * histogram bucket, so the upper limit of the bucket is used.
+ */
+static uint64_t loop_hist_percentile(const uint64_t *buckets, uint64_t count,
+				     uint64_t max, unsigned int parts)
+{
+	uint64_t rank, sum, limit;
+	int b;
+
+	rank = (count * parts + 9999) / 10000;
+	for (b = 0, sum = 0; b < TMC_ISOL_LOOP_HIST_BUCKETS; b++) {
+		sum += buckets[b];
+		if (sum >= rank) {
+			limit = (b == 63) ? UINT64_MAX : ((2ULL << b) - 1);
+			return (limit < max) ? limit : max;
+		}
+	}
+	return max;
+}
+
+/*
+ * Send loop period histograms of managed threads to the client.
+ *
+ * For every thread with recorded passes, a line with the number of
+ * passes, slow path passes, median, 99%, 99.99% and maximum gap in
+ * nanoseconds is sent. If cpu is not negative, only that CPU is shown,
+ * followed by non-empty buckets.
+ */
+static void client_send_loop_hist(int client_index, int cpu)
 {
-	int i;
 	struct memipc_thread_params *threads;
-	int threads_count;
-	int64_t remaining_last, remaining_current;
-	int found_remaining;
+	int threads_count, i, b;
+	struct tmc_isol_loop_hist *h;
+	uint64_t buckets[TMC_ISOL_LOOP_HIST_BUCKETS];
+	uint64_t count, slow, max;
+	struct timespec ts;
+	int64_t elapsed_nsec;
+	uint64_t elapsed_cycles;
+	double nsec_per_cycle = 1.0;
+	struct tx_text serv_resp;
+	char line[256];
 
 	threads = _global_isolated_threads;
 	threads_count = _global_isolated_thread_count;
-	for (i = 0, found_remaining = 0, remaining_last = KTIME_MAX;
-	     i < threads_count; i++) {
-		if (((threads[i].state == MEMIPC_STATE_READY)
-		     || (threads[i].state == MEMIPC_STATE_TMP_EXITING_ISOLATION)
-		     || (threads[i].state == MEMIPC_STATE_EXITING_ISOLATION)
-		     || (threads[i].state == MEMIPC_STATE_LOST_ISOLATION)
-		     || (threads[i].state == MEMIPC_STATE_LAUNCHING)
-		     || (threads[i].state == MEMIPC_STATE_LAUNCHED)
-		     || (threads[i].state == MEMIPC_STATE_RUNNING)
-		     )
-		    && (threads[i].lasttimer != KTIME_MAX)
-	    /*&& ((remaining_current = (threads[i].lasttimer - now)) >= 0)*/) {
-			remaining_current = (threads[i].lasttimer - now);
-			if (found_remaining) {
-				if (remaining_current > remaining_last)
-					remaining_last = remaining_current;
-			} else {
-				remaining_last = remaining_current;
-				found_remaining = 1;
-			}
+
+	/* Counter rate is measured over the whole time since startup */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	elapsed_cycles = tmc_isol_cycles() - _global_loop_hist_start_cycles;
+	elapsed_nsec = ts.tv_sec * 1000000000LL + ts.tv_nsec
+		- _global_loop_hist_start_nsec;
+	if ((elapsed_nsec > 0) && (elapsed_cycles != 0))
+		nsec_per_cycle = (double)elapsed_nsec / elapsed_cycles;
+
+	tx_init(&serv_resp);
+	for (i = 0; i < threads_count; i++) {
+		h = memipc_thread_loop_hist(&threads[i]);
+		if ((h == NULL) || ((cpu >= 0) && (threads[i].cpu != cpu)))
+			continue;
+		/* Snapshot, the thread keeps updating the histogram */
+		for (b = 0; b < TMC_ISOL_LOOP_HIST_BUCKETS; b++)
+			buckets[b] = __atomic_load_n(&h->buckets[b],
+						     __ATOMIC_RELAXED);
+		max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+		slow = __atomic_load_n(&h->slow, __ATOMIC_RELAXED);
+		for (b = 0, count = 0; b < TMC_ISOL_LOOP_HIST_BUCKETS; b++)
+			count += buckets[b];
+		if ((count == 0) && (slow == 0))
+			continue;
+		snprintf(line, sizeof(line),
+			 "200-CPU=%d PASSES=%" PRIu64 " SLOW=%" PRIu64
+			 " P50=%.0f P99=%.0f P9999=%.0f MAX=%.0f\n",
+			 threads[i].cpu, count, slow,
+			 loop_hist_percentile(buckets, count, max, 5000)
+			 * nsec_per_cycle,
+			 loop_hist_percentile(buckets, count, max, 9900)
+			 * nsec_per_cycle,
+			 loop_hist_percentile(buckets, count, max, 9999)
+			 * nsec_per_cycle,
+			 max * nsec_per_cycle);
+		tx_add_text(&serv_resp, line);
+		if (cpu < 0)
+			continue;
+		for (b = 0; b < TMC_ISOL_LOOP_HIST_BUCKETS; b++) {
+			if (buckets[b] == 0)
+				continue;
+			snprintf(line, sizeof(line),
+				 "200-BUCKET=%.0f COUNT=%" PRIu64 "\n",
+				 (double)(1ULL << b) * nsec_per_cycle,
+				 buckets[b]);
+			tx_add_text(&serv_resp, line);
 		}
 	}
-	if (found_remaining)
-		return remaining_last;
-	else
-		return KTIME_MAX;
+	tx_add_text(&serv_resp, "200 OK\n");
+	send_tx_persist(client_index, &serv_resp);
+}
+
+/*
+ * Add help and type lines of a metric.
+ */
+static void metrics_add_header(struct tx_text *tx, const char *name,
+			       const char *type, const char *help)
+{
+	char line[256];
+
+	snprintf(line, sizeof(line), "200-# HELP %s %s\n"
+		 "200-# TYPE %s %s\n", name, help, name, type);
+	tx_add_text(tx, line);
+}
+
+/*
+ * Add a per-CPU counter of all threads.
+ */
+static void metrics_add_cpu_counter(struct tx_text *tx, const char *name,
+				    const char *help,
+				    uint64_t (*get)(struct
+						    memipc_thread_params *))
+{
+	struct memipc_thread_params *threads;
+	char line[256];
+	int i;
+
+	threads = _global_isolated_threads;
+	metrics_add_header(tx, name, "counter", help);
+	for (i = 0; i < _global_isolated_thread_count; i++) {
+		snprintf(line, sizeof(line),
+			 "200-%s{cpu=\"%d\"} %" PRIu64 "\n",
+			 name, threads[i].cpu, get(&threads[i]));
+		tx_add_text(tx, line);
+	}
+}
+
+/*
+ * Add a summary and a maximum of scan durations.
+ */
+static void metrics_add_scan(struct tx_text *tx, const char *name,
+			     const char *help,
+			     const struct memipc_scan_stats *stats)
+{
+	char line[256], max_name[64];
+
+	metrics_add_header(tx, name, "summary", help);
+	snprintf(line, sizeof(line),
+		 "200-%s_sum %.9f\n200-%s_count %" PRIu64 "\n",
+		 name, stats->nsec / 1e9, name, stats->count);
+	tx_add_text(tx, line);
+	snprintf(max_name, sizeof(max_name), "%s_max", name);
+	metrics_add_header(tx, max_name, "gauge", "Longest scan, seconds.");
+	snprintf(line, sizeof(line), "200-%s %.9f\n",
+		 max_name, stats->max_nsec / 1e9);
+	tx_add_text(tx, line);
+}
+
+static uint64_t metrics_ring_full(struct memipc_thread_params *thread)
+{
+	struct memipc_thread_counters *counters;
+
+	counters = memipc_thread_counters(thread);
+	return (counters == NULL) ? 0
+		: __atomic_load_n(&counters->ring_full, __ATOMIC_RELAXED);
+}
+
+static uint64_t metrics_ring_drops(struct memipc_thread_params *thread)
+{
+	struct memipc_thread_counters *counters;
+
+	counters = memipc_thread_counters(thread);
+	return (counters == NULL) ? 0
+		: __atomic_load_n(&counters->ring_drops, __ATOMIC_RELAXED);
+}
+
+static uint64_t metrics_relaunches(struct memipc_thread_params *thread)
+{
+	return thread->relaunches;
+}
+
+static uint64_t metrics_breaks(struct memipc_thread_params *thread)
+{
+	return thread->break_count;
+}
+
+/*
+ * Send metrics in Prometheus text format. Every line of the metrics
+ * follows a "200-" prefix, and the response ends with "200 # EOF".
+ */
+static void client_send_metrics(int client_index)
+{
+	struct memipc_thread_params *threads;
+	struct tx_text serv_resp;
+	char line[256];
+	uint64_t count;
+	int i, t;
+
+	threads = _global_isolated_threads;
+	tx_init(&serv_resp);
+
+	metrics_add_header(&serv_resp, "tmc_isol_requests_total", "counter",
+			   "Requests received from threads.");
+	for (i = 0; i < _global_isolated_thread_count; i++)
+		for (t = 0; t < MEMIPC_REQ_TYPES; t++) {
+			count = __atomic_load_n(&threads[i].req_counts[t],
+						__ATOMIC_RELAXED);
+			if (count == 0)
+				continue;
+			snprintf(line, sizeof(line),
+				 "200-tmc_isol_requests_total"
+				 "{cpu=\"%d\",type=\"%s\"} %" PRIu64 "\n",
+				 threads[i].cpu, memipc_req_type_labels[t],
+				 count);
+			tx_add_text(&serv_resp, line);
+		}
+	metrics_add_cpu_counter(&serv_resp, "tmc_isol_ring_full_total",
+				"Requests that did not fit in the area.",
+				metrics_ring_full);
+	metrics_add_cpu_counter(&serv_resp, "tmc_isol_output_dropped_total",
+				"Output dropped because the area was full.",
+				metrics_ring_drops);
+	metrics_add_cpu_counter(&serv_resp, "tmc_isol_relaunches_total",
+				"Launches after a thread lost isolation.",
+				metrics_relaunches);
+	metrics_add_cpu_counter(&serv_resp, "tmc_isol_breaks_total",
+				"Recorded isolation breaks.",
+				metrics_breaks);
+
+	metrics_add_header(&serv_resp, "tmc_isol_state_seconds_total",
+			   "counter", "Time threads spent in each state.");
+	for (i = 0; i < _global_isolated_thread_count; i++)
+		for (t = 0; t < MEMIPC_THREAD_STATES; t++) {
+			snprintf(line, sizeof(line),
+				 "200-tmc_isol_state_seconds_total"
+				 "{cpu=\"%d\",state=\"%s\"} %.6f\n",
+				 threads[i].cpu,
+				 memipc_thread_state_labels[t],
+				 threads[i].state_nsec[t] / 1e9);
+			tx_add_text(&serv_resp, line);
+		}
+
+	metrics_add_scan(&serv_resp, "tmc_isol_timer_scan_seconds",
+			 "Duration of timer list scans.",
+			 &_global_timer_scan_stats);
+	metrics_add_scan(&serv_resp, "tmc_isol_proc_scan_seconds",
+			 "Duration of /proc scans.",
+			 &_global_proc_scan_stats);
+
+	tx_add_text(&serv_resp, "200 # EOF\n");
+	send_tx_persist(client_index, &serv_resp);
+}
+
+/*
+ * Send current states of threads, then push events to the client as
+ * they happen.
+ */
+static void client_subscribe(int client_index)
+{
+	struct memipc_thread_params *threads;
+	struct tx_text serv_resp;
+	char line[256];
+	int i;
+
+	threads = _global_isolated_threads;
+	tx_init(&serv_resp);
+	for (i = 0; i < _global_isolated_thread_count; i++) {
+		if (threads[i].state == MEMIPC_STATE_OFF)
+			continue;
+		snprintf(line, sizeof(line), "200-CPU %d state %s\n",
+			 threads[i].cpu,
+			 memipc_thread_state_name(&threads[i]));
+		tx_add_text(&serv_resp, line);
+	}
+	tx_add_text(&serv_resp, "220 Ok\n");
+	send_tx_persist(client_index, &serv_resp);
+	set_client_subscribed(client_index);
 }
 
 /*
- * This function is supposed to update a timer for CPUs where threads may
- * run isolated. It returns 0 if given timer is not for CPUs in that set,
- * so it may be ignored later, and 1 if CPU is in this set.
+ * Send isolation break events of managed threads to the client,
+ * oldest first. If cpu is not negative, only that CPU is shown.
  */
-static int cpu_update_timer(enum isol_timer_type timer_type,
-#if DEBUG_ISOL_NAMES
-			    const char *addr, const char *handler,
-#endif
-			    int cpu, int64_t expire, int64_t now)
+static void client_send_breaks(int client_index, int cpu)
 {
-	int i;
 	struct memipc_thread_params *threads;
-	int threads_count;
+	int threads_count, i, j;
+	unsigned int e, first;
+	struct isol_break_event *event;
+	struct isol_break_timer *timer;
+	struct tx_text serv_resp;
+	char line[256];
 
 	threads = _global_isolated_threads;
 	threads_count = _global_isolated_thread_count;
+
+	tx_init(&serv_resp);
 	for (i = 0; i < threads_count; i++) {
-		if (cpu == threads[i].cpu) {
-			if (threads[i].lasttimer == KTIME_MAX)
-				threads[i].lasttimer = expire;
-			else {
-				if ((threads[i].lasttimer - now) < 0)
-					threads[i].lasttimer = KTIME_MAX;
-				else
-					if ((threads[i].lasttimer - expire) < 0)
-						threads[i].lasttimer = expire;
+		if ((threads[i].break_count == 0)
+		    || ((cpu >= 0) && (threads[i].cpu != cpu)))
+			continue;
+		snprintf(line, sizeof(line),
+			 "200-CPU %d: %u isolation breaks\n",
+			 threads[i].cpu, threads[i].break_count);
+		tx_add_text(&serv_resp, line);
+		first = (threads[i].break_count > ISOL_BREAK_EVENTS) ?
+			(threads[i].break_count - ISOL_BREAK_EVENTS) : 0;
+		for (e = first; e < threads[i].break_count; e++) {
+			event = &threads[i].break_events[e
+							 % ISOL_BREAK_EVENTS];
+			snprintf(line, sizeof(line),
+				 "200- Break %u at %ld.%09ld, %s, "
+				 "%u signals\n",
+				 e + 1, (long)event->time.tv_sec,
+				 event->time.tv_nsec,
+				 isol_break_source_name[event->source],
+				 event->signals);
+			tx_add_text(&serv_resp, line);
+			if (event->signals != 0) {
+				snprintf(line, sizeof(line),
+					 "200-  signal at %ld.%09ld, "
+					 "code %d, from PID %d\n",
+					 (long)event->signal_time.tv_sec,
+					 event->signal_time.tv_nsec,
+					 event->signal_code,
+					 (int)event->signal_pid);
+				tx_add_text(&serv_resp, line);
 			}
-			threads[i].updatetimer = now;
-#if DEBUG_ISOL_ALWAYS_SHOW_ALL_TIMERS
+			for (j = 0; (j < event->timers_count)
+				     && (j < ISOL_BREAK_SUSPECTS); j++) {
+				timer = &event->timers[j];
+				snprintf(line, sizeof(line),
+					 "200-  timer: %s, expires in %ld ns"
 #if DEBUG_ISOL_NAMES
-			fprintf(stderr, "Timer on CPU %d, type %s, "
-			"at %s, handler %s, expires at %lu in %ld nsec\n",
-				cpu, isol_timer_type_name[timer_type],
-				addr, handler, (uint64_t)expire, expire - now);
-#else
-			fprintf(stderr, "Timer on CPU %d, type %s, "
-				"expires at %lu in %ld nsec\n",
-				cpu, isol_timer_type_name[timer_type],
-				(uint64_t)expire, expire - now);
+					 ", handler %s"
 #endif
+					 "\n",
+					 isol_timer_type_name[timer->timer_type],
+					 timer->remaining
+#if DEBUG_ISOL_NAMES
+					 , timer->handler
 #endif
-			return 1;
+					 );
+				tx_add_text(&serv_resp, line);
+			}
+			if (event->timers_count > ISOL_BREAK_SUSPECTS) {
+				snprintf(line, sizeof(line),
+					 "200-  %d more timers\n",
+					 event->timers_count
+					 - ISOL_BREAK_SUSPECTS);
+				tx_add_text(&serv_resp, line);
+			}
+			for (j = 0; (j < event->threads_count)
+				     && (j < ISOL_BREAK_SUSPECTS); j++) {
+				snprintf(line, sizeof(line),
+					 "200-  thread: PID %d, TID %d, "
+					 "%d involuntary context switches"
+#if DEBUG_ISOL_NAMES
+					 ", %s"
+#endif
+					 "\n",
+					 (int)event->threads[j].pid,
+					 (int)event->threads[j].tid,
+				 event->threads[j].nonvol_context_switches
+#if DEBUG_ISOL_NAMES
+					 , event->threads[j].name
+#endif
+					 );
+				tx_add_text(&serv_resp, line);
+			}
+			if (event->threads_count > ISOL_BREAK_SUSPECTS) {
+				snprintf(line, sizeof(line),
+					 "200-  %d more threads\n",
+					 event->threads_count
+					 - ISOL_BREAK_SUSPECTS);
+				tx_add_text(&serv_resp, line);
+			}
 		}
 	}
-	return 0;
+	tx_add_text(&serv_resp, "200 OK\n");
+	send_tx_persist(client_index, &serv_resp);
 }
 
 static int client_show_banner(int client_index)
@@ -4491,7 +10010,20 @@ static int client_show_banner(int client_index)
 	const char *banner =
 		"220-Task Manager.\n"
 		"220 Session started.\n";
-	send_data_persist(client_index, banner, strlen(banner));
+	struct tx_text tx;
+
+	if (memipc_manager_mode() == MEMIPC_MANAGER_LOCAL) {
+		send_data_persist(client_index, banner, strlen(banner));
+		return 0;
+	}
+	/* Daemon serves other processes, report its CPUs to them */
+	tx_init(&tx);
+	tx_add_text(&tx, "220-Task Manager.\n"
+		    "220-MANAGER=DAEMON\n"
+		    "220-CPUS=");
+	tx_add_text_num(&tx, _global_isolated_thread_count);
+	tx_add_text(&tx, "\n220 Session started.\n");
+	send_tx_persist(client_index, &tx);
 	return 0;
 }
 
@@ -4531,6 +10063,10 @@ static int client_text_handler(int client_index, const char *line)
 	      ISOL_SRV_CMD_NEWTASK,
 	      ISOL_SRV_CMD_TASKISOLFAIL,
 	      ISOL_SRV_CMD_TASKISOLFINISH,
+	      ISOL_SRV_CMD_LOOPHIST,
+	      ISOL_SRV_CMD_BREAKS,
+	      ISOL_SRV_CMD_SUBSCRIBE,
+	      ISOL_SRV_CMD_METRICS,
 	      ISOL_SRV_CMD_ARRAY_SIZE
 	};
 
@@ -4539,7 +10075,11 @@ static int client_text_handler(int client_index, const char *line)
 	      "terminate",
 	      "newtask",
 	      "taskisolfail",
-	      "taskisolfinish"
+	      "taskisolfinish",
+	      "loophist",
+	      "breaks",
+	      "subscribe",
+	      "metrics"
 	};
 
 	int command_len[ISOL_SRV_CMD_ARRAY_SIZE] = {
@@ -4547,7 +10087,11 @@ static int client_text_handler(int client_index, const char *line)
 	      9,
 	      7,
 	      12,
-	      14
+	      14,
+	      8,
+	      6,
+	      9,
+	      7
 	};
 
 	const char *p, *p1, *p2, *arg,
@@ -4567,7 +10111,7 @@ static int client_text_handler(int client_index, const char *line)
 		*ok_resp =
 		"220 Ok\n";
 
-	int i, command, client_cpu;
+	int i, command, client_cpu, client_monitor;
 	pid_t client_pid, client_tid;
 	struct tx_text serv_resp;
 	struct memipc_thread_params *thread;
@@ -4607,6 +10151,7 @@ static int client_text_handler(int client_index, const char *line)
 		client_pid = 0;
 		client_tid = 0;
 		client_cpu = -1;
+		client_monitor = TMC_ISOL_MONITOR_DEFAULT;
 		if (arg == NULL) {
 			send_data_persist(client_index, inv_response,
 					  strlen(inv_response));
@@ -4629,9 +10174,17 @@ static int client_text_handler(int client_index, const char *line)
 					p2++;
 					client_pid = get_uint(p1);
 					client_tid = get_uint(p2);
+					/* Monitoring mode is optional */
+					p2 = strchr(p2, ',');
+					if (p2 != NULL)
+						client_monitor =
+							get_int(p2 + 1);
 				}
 			}
 		}
+		if ((client_monitor != TMC_ISOL_MONITOR_MASTER)
+		    && (client_monitor != TMC_ISOL_MONITOR_SLAVE))
+			client_monitor = TMC_ISOL_MONITOR_DEFAULT;
 		if ((client_pid != 0) && (client_tid != 0)) {
 			/* Check if this client already has a task attached */
 			if (get_client_task(client_index) != NULL) {
@@ -4641,6 +10194,19 @@ static int client_text_handler(int client_index, const char *line)
 			} else {
 				/* Start a new task, mark client as this task */
 				thread = isolation_claim_cpu(client_cpu);
+				/*
+				  Another process maps areas by name,
+				  and should not see requests left from
+				  the previous thread.
+				*/
+				if ((thread != NULL)
+				    && (client_pid != getpid())
+				    && memipc_thread_areas_resize(thread,
+						thread->area_size,
+						thread->area_flags)) {
+					isolation_release_cpu(thread);
+					thread = NULL;
+				}
 				if (thread == NULL) {
 					send_data_persist(client_index,
 							  cant_alloc_resp,
@@ -4652,6 +10218,7 @@ static int client_text_handler(int client_index, const char *line)
 					*/
 					thread->memipc_check_signal_ptr = NULL;
 					thread->counter_ptr = NULL;
+					thread->monitor = client_monitor;
 					thread->thread_id = 0;
 					thread->pid = client_pid;
 					thread->tid = client_tid;
@@ -4680,7 +10247,14 @@ static int client_text_handler(int client_index, const char *line)
 								thread->index);
 					} else {
 						tx_add_text(&serv_resp,
-							"200-MODE=PROCESS\n");
+							    "200-MODE=PROCESS\n"
+							    "200-AREA=");
+						tx_add_text(&serv_resp,
+							    thread->memipc_name);
+						tx_add_text(&serv_resp,
+							    "\n200-AREA_SIZE=");
+						tx_add_text_num(&serv_resp,
+							thread->area_size);
 					}
 					tx_add_text(&serv_resp,
 						    "\n200-CPU=");
@@ -4724,42 +10298,13 @@ static int client_text_handler(int client_index, const char *line)
 				thread->cpu);
 #endif
 			/* Re-launch */
-#if ISOLATION_MONITOR_IN_MASTER
-		{
-			char isolated_state;
-			__atomic_load(&thread->isolated,
-				      &isolated_state,
-				      __ATOMIC_SEQ_CST);
-			if (isolated_state == 0) {
-				if ((thread->state !=
-				     MEMIPC_STATE_TMP_EXITING_ISOLATION)
-				    && (thread->state !=
-					MEMIPC_STATE_EXITING_ISOLATION)) {
-					thread->state =
-						MEMIPC_STATE_LOST_ISOLATION;
-					clock_gettime(CLOCK_MONOTONIC,
-						      &thread->isol_exit_time);
-					if (memipc_add_req(
-						   thread->m_memipc_mosi,
-						   MEMIPC_REQ_START_LAUNCH,
-						   0, NULL) == 0) {
-						if (thread->counter_ptr != NULL)
-						(*(thread->counter_ptr))++;
-						thread->state =
-							MEMIPC_STATE_LAUNCHING;
-#if DEBUG_ISOL_VERBOSE
-						fprintf(stderr,
-					     "Re-launching thread on CPU %d\n",
-							thread->cpu);
-#endif
-					}
-				}
-			}
-		}
-#else
-		if ((thread->state != MEMIPC_STATE_TMP_EXITING_ISOLATION)
+		if (((thread->monitor != TMC_ISOL_MONITOR_MASTER)
+		     || (__atomic_load_n(&thread->isolated,
+					 __ATOMIC_SEQ_CST) == 0))
+		    && (thread->state != MEMIPC_STATE_TMP_EXITING_ISOLATION)
 		    && (thread->state != MEMIPC_STATE_EXITING_ISOLATION)) {
 			thread->state = MEMIPC_STATE_LOST_ISOLATION;
+			memipc_record_isolation_break(thread, ISOL_BREAK_CLIENT);
 			clock_gettime(CLOCK_MONOTONIC, &thread->isol_exit_time);
 			if (memipc_add_req(thread->m_memipc_mosi,
 					   MEMIPC_REQ_START_LAUNCH,
@@ -4767,6 +10312,7 @@ static int client_text_handler(int client_index, const char *line)
 				if (thread->counter_ptr != NULL)
 					(*(thread->counter_ptr))++;
 				thread->state = MEMIPC_STATE_LAUNCHING;
+				memipc_event_relaunch(thread);
 #if DEBUG_ISOL_VERBOSE
 				fprintf(stderr,
 					"Re-launching thread on CPU %d\n",
@@ -4774,7 +10320,6 @@ static int client_text_handler(int client_index, const char *line)
 #endif
 			}
 		}
-#endif
 		send_data_persist(client_index,
 				  ok_resp,
 				  strlen(ok_resp));
@@ -4802,14 +10347,14 @@ static int client_text_handler(int client_index, const char *line)
 				/* Thread from the same process, join it. */
 				pthread_join(thread->thread_id, NULL);
 			}
-#if ISOLATION_MONITOR_IN_MASTER
+			if (thread->monitor == TMC_ISOL_MONITOR_MASTER) {
 #ifdef DEBUG_LOG_ISOL_CHANGES
-			write(1, "\nISOLFIN, isolated = 0\n", 23);
-#endif
-			__atomic_store_n(&thread->isolated,
-					 0,
-					 __ATOMIC_SEQ_CST);
+				write(1, "\nISOLFIN, isolated = 0\n", 23);
 #endif
+				__atomic_store_n(&thread->isolated,
+						 0,
+						 __ATOMIC_SEQ_CST);
+			}
 			thread->start_routine = NULL;
 			thread->userdata = NULL;
 			thread->lasttimer = KTIME_MAX;
@@ -4827,6 +10372,22 @@ static int client_text_handler(int client_index, const char *line)
 #endif
 		}
 		break;
+	case ISOL_SRV_CMD_LOOPHIST:
+		/* Optional argument is a CPU */
+		client_send_loop_hist(client_index,
+				      (arg == NULL) ? -1 : get_int(arg));
+		break;
+	case ISOL_SRV_CMD_BREAKS:
+		/* Optional argument is a CPU */
+		client_send_breaks(client_index,
+				   (arg == NULL) ? -1 : get_int(arg));
+		break;
+	case ISOL_SRV_CMD_SUBSCRIBE:
+		client_subscribe(client_index);
+		break;
+	case ISOL_SRV_CMD_METRICS:
+		client_send_metrics(client_index);
+		break;
 	default:
 		send_data_persist(client_index, inv_response,
 				  strlen(inv_response));
@@ -4853,14 +10414,14 @@ static int client_disconnect_handler(int client_index)
 			/* Thread from the same process, join it. */
 			pthread_join(thread->thread_id, NULL);
 		}
-#if ISOLATION_MONITOR_IN_MASTER
+		if (thread->monitor == TMC_ISOL_MONITOR_MASTER) {
 #ifdef DEBUG_LOG_ISOL_CHANGES
-		write(1, "\nDISCONN, isolated = 0\n", 23);
-#endif
-		__atomic_store_n(&thread->isolated,
-				 0,
-				 __ATOMIC_SEQ_CST);
+			write(1, "\nDISCONN, isolated = 0\n", 23);
 #endif
+			__atomic_store_n(&thread->isolated,
+					 0,
+					 __ATOMIC_SEQ_CST);
+		}
 		thread->start_routine = NULL;
 		thread->userdata = NULL;
 		thread->lasttimer = KTIME_MAX;
@@ -4877,8 +10438,66 @@ static int client_disconnect_handler(int client_index)
 	return 0;
 }
 
+/*
+ * Check if the manager daemon is running on a given socket.
+ *
+ * Returns 0 if threads of this process will be managed by the daemon.
+ */
+static int memipc_isolation_use_daemon(const char *name)
+{
+	struct rx_buffer rx;
+	int fd, rcode_value;
+
+	enum {
+	      MANAGER_BANNER_KV_MANAGER,
+	      MANAGER_BANNER_KV_CPUS
+	};
+	enum {
+	      MANAGER_TYPE_APPLICATION,
+	      MANAGER_TYPE_DAEMON
+	};
+	char *kv_type_managers[] = {"APPLICATION", "DAEMON", NULL};
+	struct kv_rx kv[] = {
+		{"MANAGER", KV_TYPE_ENUM, kv_type_managers, 0,
+		 .val.val_int = 0},
+		{"CPUS", KV_TYPE_INT, NULL, 0, .val.val_int = 0},
+		{NULL}
+	};
+
+	fd = isol_client_connect_to_server(name);
+	if (fd < 0)
+		return -1;
+	if (init_rx_buffer(&rx)) {
+		close(fd);
+		return -1;
+	}
+	rcode_value = read_rx_data(&rx, fd, kv);
+	free_rx_buffer(&rx);
+	close(fd);
+	if ((rcode_value != 220)
+	    || !kv[MANAGER_BANNER_KV_MANAGER].set
+	    || (kv[MANAGER_BANNER_KV_MANAGER].val.val_int
+		!= MANAGER_TYPE_DAEMON)
+	    || !kv[MANAGER_BANNER_KV_CPUS].set)
+		return -1;
+
+#if DEBUG_ISOL_VERBOSE
+	fprintf(stderr, "Using manager daemon with %ld CPUs\n",
+		kv[MANAGER_BANNER_KV_CPUS].val.val_int);
+#endif
+	_global_memipc_remote_cpus = kv[MANAGER_BANNER_KV_CPUS].val.val_int;
+	__atomic_store_n(&_global_memipc_manager_mode, MEMIPC_MANAGER_REMOTE,
+			 __ATOMIC_SEQ_CST);
+	signal(SIGPIPE, SIG_IGN);
+	isolation_install_sigusr1_handler();
+	return 0;
+}
+
 /*
  * Initialize environment for all CPUs available for task isolation.
+ *
+ * If the manager daemon is running, threads of this process will be
+ * managed by it, and no local environment is created.
  */
 int memipc_isolation_initialize(void)
 {
@@ -4934,6 +10553,23 @@ int memipc_isolation_initialize(void)
 		strcpy(server_socket_lock_name + sizeof(SERVER_SOCKET_NAME) - 1,
 		       ".LCK");
 	}
+	if (memipc_activity_set_name(subset_id)) {
+		rv = -1;
+		goto finish;
+	}
+	if (memipc_isolation_use_daemon(server_socket_name) == 0) {
+		rv = 0;
+		goto finish;
+	}
+#else
+	if (memipc_activity_set_name(NULL)) {
+		rv = -1;
+		goto finish;
+	}
+	if (memipc_isolation_use_daemon(SERVER_SOCKET_NAME) == 0) {
+		rv = 0;
+		goto finish;
+	}
 #endif
 	f = fopen("/sys/devices/system/cpu/task_isolation", "rt");
 	if (f == NULL)
@@ -5030,10 +10666,24 @@ int memipc_isolation_initialize(void)
 				close(fd);
 			}
 		}
+		/* This process is the manager now */
+		if (rv == 0)
+			memipc_activity_create();
 		/* Unlock and close. */
 		close(lockfd);
 	}
  finish:
+#if MANAGER_DOORBELL
+	if ((rv == 0) && (_global_memipc_doorbell_fd < 0)
+	    && !memipc_manager_is_remote()) {
+		_global_memipc_doorbell_fd = eventfd(0, EFD_NONBLOCK
+						     | EFD_CLOEXEC);
+		if (_global_memipc_doorbell_fd >= 0)
+			isol_server_set_doorbell(_global_memipc_doorbell_fd);
+		else
+			perror("Can't create doorbell, polling");
+	}
+#endif
 #if USE_CPU_SUBSETS
 	if (rv != 0) {
 		free(server_socket_name);
@@ -5060,21 +10710,60 @@ int tmc_isol_init(void)
  */
 int tmc_isol_start(void)
 {
-	return memipc_isolation_run_threads();
+	struct timespec ts, start, now;
+	int64_t elapsed;
+
+	if (!memipc_manager_is_remote())
+		return memipc_isolation_run_threads();
+
+	/*
+	 * Threads are managed by the daemon, wait until no connection
+	 * attempt is in progress and no connected thread is left. Threads
+	 * that did not try to connect yet are waited for no longer than
+	 * the start timeout.
+	 */
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		if (__atomic_load_n(&_global_memipc_remote_pending,
+				    __ATOMIC_SEQ_CST)
+		    || __atomic_load_n(&_global_memipc_remote_threads,
+				       __ATOMIC_SEQ_CST)) {
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		if (__atomic_load_n(&_global_memipc_remote_attempts,
+				    __ATOMIC_SEQ_CST))
+			break;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000000000LL
+			+ (now.tv_nsec - start.tv_nsec);
+		if (elapsed >= _global_isolated_threads_start_timeout)
+			break;
+		nanosleep(&ts, NULL);
+	}
+	return 0;
 }
 
 /*
- * Initialize thread's connection to the isolation mechanism
+ * Initialize thread's connection to the isolation mechanism, with
+ * TMC_ISOL_MONITOR_* monitoring mode.
  *
  * This version selects CPU automatically if it is not set already.
  */
-int tmc_isol_thr_init(void)
+int tmc_isol_thr_init_mode(int mode)
 {
 	int i, cpu;
 	cpu_set_t cpuset;
 	pthread_t thread_id;
 	thread_id = pthread_self();
 
+	if ((mode != TMC_ISOL_MONITOR_MASTER)
+	    && (mode != TMC_ISOL_MONITOR_SLAVE)) {
+		fprintf(stderr, "Invalid monitoring mode %d\n", mode);
+		return -1;
+	}
 	if (pthread_getaffinity_np(thread_id, sizeof(cpu_set_t),
 				   &cpuset) == 0) {
 		for (i = 0, cpu = -1; (cpu < 0) && (i < CPU_SETSIZE); i++) {
@@ -5088,12 +10777,21 @@ int tmc_isol_thr_init(void)
 	} else
 		cpu = -1;
 
-	if (isolation_connect_this_thread_remote(cpu))
-		return isolation_connect_this_thread_remote(-1);
+	if (isolation_connect_this_thread_remote(cpu, mode))
+		return isolation_connect_this_thread_remote(-1, mode);
 	else
 		return 0;
 }
 
+/*
+ * Same as above, with the default monitoring mode of the library. The
+ * header maps tmc_isol_thr_init() to the default of the application.
+ */
+int (tmc_isol_thr_init)(void)
+{
+	return tmc_isol_thr_init_mode(TMC_ISOL_MONITOR_DEFAULT);
+}
+
 /*
  * Enter isolation mode while connected to the manager.
  */
@@ -5112,36 +10810,307 @@ int tmc_isol_thr_exit(void)
 	memipc_isolation_request_leave_isolation();
 
 	prctl(PR_SET_TASK_ISOLATION, 0, 0, 0, 0);
-#if ISOLATION_MONITOR_IN_SLAVE
 	char zero = 0;
+	if (memipc_thread_self->monitor == TMC_ISOL_MONITOR_SLAVE) {
 #ifdef DEBUG_LOG_ISOL_CHANGES
-	write(1, "\nTHR_EXI, isolated = 0\n", 23);
-#endif
-	__atomic_store(&memipc_thread_self->isolated,
-		       &zero,
-		       __ATOMIC_SEQ_CST);
+		write(1, "\nTHR_EXI, isolated = 0\n", 23);
 #endif
+		__atomic_store(&memipc_thread_self->isolated,
+			       &zero,
+			       __ATOMIC_SEQ_CST);
+	}
 	memipc_isolation_announce_exit();
 
-	if (memipc_thread_fd >= 0) {
-		close(memipc_thread_fd);
-		memipc_thread_fd = -1;
+	memipc_arena_delete();
+	memipc_trace_delete();
+	memipc_thread_disconnect();
+	return 0;
+}
+
+/*
+ * Set sizes of the stack and heap reserves that threads prepare before
+ * entering isolation, and TMC_ISOL_RESERVE_* flags.
+ */
+int tmc_isol_set_reserve(size_t stack_size, size_t heap_size,
+			 unsigned int flags)
+{
+	if (flags & ~TMC_ISOL_RESERVE_HUGEPAGES) {
+		fprintf(stderr, "Invalid reserve flags 0x%x\n", flags);
+		return -1;
+	}
+	/* Nonzero reserve should fit at least the smallest block */
+	if ((heap_size != 0) && (heap_size < ARENA_HEADER_SIZE
+				 + ((size_t)1 << ARENA_MIN_CLASS))) {
+		fprintf(stderr, "Heap reserve of %lu bytes is too small\n",
+			(unsigned long)heap_size);
+		return -1;
+	}
+	_global_isolated_stack_reserve = stack_size;
+	_global_isolated_heap_reserve = heap_size;
+	_global_isolated_heap_flags = flags;
+	return 0;
+}
+
+/*
+ * Set the number of entries in trace rings of threads, a power of two,
+ * or 0 to disable them.
+ */
+int tmc_isol_set_trace(size_t entries)
+{
+	if ((entries & (entries - 1)) != 0)
+		return -1;
+	_global_isolated_trace_entries = entries;
+	return 0;
+}
+
+/*
+ * Allocate memory from the heap reserve of the calling thread.
+ */
+void *tmc_isol_alloc(size_t size)
+{
+	return memipc_arena_alloc(size);
+}
+
+/*
+ * Free memory allocated with tmc_isol_alloc() in the same thread.
+ */
+void tmc_isol_free(void *ptr)
+{
+	memipc_arena_free(ptr);
+}
+
+/*
+ * Shared configuration buffers, and the generation that will be
+ * published next.
+ */
+static struct tmc_isol_config_buf _global_memipc_config[2];
+static size_t _global_memipc_config_size = 0;
+
+/*
+ * Allocate shared configuration buffers.
+ */
+int tmc_isol_config_init(size_t size)
+{
+	void *p;
+	int i;
+
+	if ((size == 0) || (_global_memipc_config_size != 0)
+	    || memipc_manager_is_remote())
+		return -1;
+	for (i = 0; i < 2; i++) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			if (i != 0)
+				munmap(_global_memipc_config[0].data, size);
+			return -1;
+		}
+		_global_memipc_config[i].generation = 0;
+		_global_memipc_config[i].size = 0;
+		_global_memipc_config[i].data = p;
+	}
+	_global_memipc_config_size = size;
+	return 0;
+}
+
+/*
+ * Get the buffer that will be published next.
+ */
+static struct tmc_isol_config_buf *memipc_config_next(void)
+{
+	struct tmc_isol_config_buf *c;
+
+	c = __atomic_load_n(&memipc_config_published, __ATOMIC_ACQUIRE);
+	return (c == &_global_memipc_config[0]) ?
+		&_global_memipc_config[1] : &_global_memipc_config[0];
+}
+
+/*
+ * Get a buffer to fill with the next configuration generation.
+ *
+ * Returns NULL if threads still use the previous generation in it.
+ */
+void *tmc_isol_config_begin(void)
+{
+	struct tmc_isol_config_buf *c, *next;
+	struct memipc_thread_params *threads;
+	int i;
+
+	if (_global_memipc_config_size == 0)
+		return NULL;
+	c = __atomic_load_n(&memipc_config_published, __ATOMIC_ACQUIRE);
+	next = memipc_config_next();
+	if ((c != NULL) && (next->generation != 0)) {
+		/* All running threads should have switched to c */
+		threads = _global_isolated_threads;
+		for (i = 0; i < _global_isolated_thread_count; i++)
+			if ((__atomic_load_n(&threads[i].state,
+					     __ATOMIC_RELAXED)
+			     != MEMIPC_STATE_OFF)
+			    && (__atomic_load_n(&threads[i].config_generation,
+						__ATOMIC_ACQUIRE)
+				< c->generation))
+				return NULL;
 	}
+	return next->data;
+}
+
+/*
+ * Publish the buffer returned by tmc_isol_config_begin() as the next
+ * generation, with size bytes of data.
+ */
+int tmc_isol_config_publish(size_t size)
+{
+	struct tmc_isol_config_buf *c, *next;
+#if MANAGER_DOORBELL
+	uint64_t one = 1;
+#endif
+
+	if ((_global_memipc_config_size == 0)
+	    || (size > _global_memipc_config_size))
+		return -1;
+	c = __atomic_load_n(&memipc_config_published, __ATOMIC_ACQUIRE);
+	next = memipc_config_next();
+	next->generation = (c == NULL) ? 1 : (c->generation + 1);
+	next->size = size;
+	__atomic_store_n(&memipc_config_published, next, __ATOMIC_RELEASE);
+#if MANAGER_DOORBELL
+	/* Wake up the manager, so it notifies threads */
+	if (_global_memipc_doorbell_fd >= 0)
+		write(_global_memipc_doorbell_fd, &one, sizeof(one));
+#endif
 	return 0;
 }
 
+/*
+ * Switch the current thread to the last published configuration
+ * generation, and confirm it to the manager.
+ */
+void _tmc_isol_config_switch(void)
+{
+	struct tmc_isol_config_buf *c;
+	uint64_t generation;
+
+	c = __atomic_load_n(&memipc_config_published, __ATOMIC_ACQUIRE);
+	if ((c != NULL) && (c != memipc_config_current)
+	    && (memipc_thread_self != NULL)) {
+		generation = c->generation;
+		if (memipc_add_req(memipc_thread_self->s_memipc_miso,
+				   MEMIPC_REQ_CONFIG_ACK, sizeof(generation),
+				   (unsigned char *)&generation)) {
+			/*
+			  Area is full, the next pass takes the slow path
+			  and retries.
+			*/
+			memipc_config_pending = 1;
+			memipc_check_newdata_ptr = &newdata_one;
+			return;
+		}
+	}
+	if ((c != NULL) && (c != memipc_config_current))
+		memipc_config_current = c;
+	if (memipc_config_pending && (memipc_thread_self != NULL)) {
+		/* Check the thread's input again */
+		memipc_config_pending = 0;
+		memipc_check_newdata_ptr =
+			get_s_memipc_mosi(memipc_thread_self)->rptr;
+	}
+}
+
+/*
+ * Submit a system call to be made by an offload worker.
+ *
+ * Returns 0 on success, -1 if the thread is not managed by a manager
+ * in the same process, or if the area is full, then it can be retried.
+ */
+int tmc_isol_syscall_submit(struct tmc_isol_syscall *op)
+{
+	if ((memipc_thread_self == NULL) || memipc_manager_is_remote())
+		return -1;
+	__atomic_store_n(&op->done, 0, __ATOMIC_RELAXED);
+	return memipc_add_req(memipc_thread_self->s_memipc_miso,
+			      MEMIPC_REQ_OFFLOAD, sizeof(op),
+			      (unsigned char *)&op) ? -1 : 0;
+}
+
 
 /*
  * Thread pass function, returns nonzero if exit is requested.
  */
 int _tmc_isol_thr_pass(void)
 {
+	if (memipc_loop_hist != NULL)
+		__atomic_store_n(&memipc_loop_hist->slow,
+				 memipc_loop_hist->slow + 1, __ATOMIC_RELAXED);
 	return memipc_thread_pass_default();
 }
 
 int tmc_printf(const char *fmt, ...)
 {
-	return memipc_isolation_printf(fmt);
+	va_list va;
+	int l;
+
+	va_start(va, fmt);
+	l = memipc_isolation_vprintf(fmt, va);
+	va_end(va);
+	return l;
+}
+
+int tmc_log_register(const char *fmt)
+{
+	return memipc_isolation_log_register(fmt);
+}
+
+int tmc_log(const char *fmt, ...)
+{
+	va_list va;
+	int rv;
+
+	va_start(va, fmt);
+	rv = memipc_isolation_vlog(fmt, va);
+	va_end(va);
+	return rv;
+}
+
+/*
+ * Create a channel between threads on two CPUs
+ */
+struct memipc_channel *tmc_isol_chan_create(const char *name,
+					    int writer_cpu, int reader_cpu,
+					    size_t size)
+{
+	return memipc_channel_create(name, writer_cpu, reader_cpu, size, 0);
+}
+
+/*
+ * Find a channel, and attach current thread to it
+ */
+struct memipc_channel *tmc_isol_chan_open(const char *name)
+{
+	struct memipc_channel *channel;
+
+	channel = memipc_channel_find(name);
+	if (memipc_channel_attach(channel))
+		return NULL;
+	return channel;
+}
+
+int tmc_isol_chan_send(struct memipc_channel *channel,
+		       const void *data, size_t size)
+{
+	return memipc_channel_send(channel, data, size);
+}
+
+ssize_t tmc_isol_chan_recv(struct memipc_channel *channel,
+			   void *data, size_t size)
+{
+	return memipc_channel_recv(channel, data, size);
+}
+
+volatile unsigned char * const *
+tmc_isol_chan_poll_ptr(struct memipc_channel *channel)
+{
+	return memipc_channel_poll_ptr(channel);
 }
 
 /*